@@ -0,0 +1,583 @@
+/**
+ * @filename   bench.c
+ *  Benchmark of kafkatools producer and consumer against the mock cluster
+ *   of librdkafka, so it runs anywhere without a kafka broker.
+ *
+ *  Every combination of message size, batch size, compression codec, acks,
+ *   threads and partitions is run on a new topic: messages are produced by
+ *   threads, then all of them are consumed by kafkatools_consumer_run().
+ *   One row of throughput and latency percentiles is output per run.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <librdkafka/rdkafka_mock.h>
+
+#include <common/misc.h>
+#include <common/uatomic.h>
+
+#include <getopt.h>
+
+#define APPNAME    "kafkatools_bench"
+
+#define BENCH_VALUES_MAX        16
+
+#define BENCH_MOCK_BROKERS      3
+
+/* topic with one partition on each broker to warm up connections */
+#define BENCH_WARMUP_TOPIC      "bench-warmup"
+
+/* consume stops when no message arrives within this time */
+#define BENCH_CONSUME_IDLE_MS   2000
+
+
+typedef struct
+{
+    int count;
+    char *values[BENCH_VALUES_MAX];
+} bench_list_t;
+
+
+typedef struct
+{
+    /* swept parameters */
+    int msgsize;
+    int batch;
+    const char *codec;
+    const char *acks;
+    int threads;
+    int partitions;
+
+    /* results */
+    int64_t messages;
+    double produce_secs;
+    kt_metrics_snapshot_t produce;
+
+    int64_t consumed;
+    double consume_secs;
+    kt_metrics_snapshot_t consume;
+} bench_run_t;
+
+
+typedef struct
+{
+    kt_producer producer;
+    kafkatools_msg_site_t site;
+
+    const bench_run_t *run;
+    int64_t messages;
+
+    char *payload;
+} bench_thread_t;
+
+
+typedef struct
+{
+    uatomic_int64 consumed;
+    uatomic_int64 lastms;
+} bench_consume_t;
+
+
+static int bench_list_parse (char *arg, bench_list_t *list)
+{
+    char *saveptr = NULL;
+    char *value = strtok_r(arg, ",", &saveptr);
+
+    list->count = 0;
+
+    while (value) {
+        if (list->count == BENCH_VALUES_MAX) {
+            return (-1);
+        }
+        list->values[list->count++] = value;
+
+        value = strtok_r(NULL, ",", &saveptr);
+    }
+
+    return list->count;
+}
+
+
+/* print first delivery error of each run */
+static void bench_delivery_report (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque)
+{
+    uatomic_int *failed = (uatomic_int *) opaque;
+
+    if (rkmessage->err && uatomic_int_add(failed, 1) == 1) {
+        fprintf(stderr, "(bench.c:%d) delivery failed: %s\n", __LINE__, rd_kafka_err2str(rkmessage->err));
+    }
+}
+
+
+static void * bench_produce_thread (void *arg)
+{
+    bench_thread_t *bt = (bench_thread_t *) arg;
+
+    int64_t sent = 0;
+
+    kafkatools_msg_data_t *ktmsgs = (kafkatools_msg_data_t *) calloc(bt->run->batch, sizeof(kafkatools_msg_data_t));
+
+    while (sent < bt->messages) {
+        int i, n = (int) ((bt->messages - sent < bt->run->batch)? bt->messages - sent : bt->run->batch);
+
+        for (i = 0; i < n; i++) {
+            ktmsgs[i].msgbuf = bt->payload;
+            ktmsgs[i].msglen = bt->run->msgsize;
+        }
+
+        if (n == 1) {
+            if (kafkatools_produce_timedwait(bt->producer, &bt->site, ktmsgs, 100, -1) != KAFKATOOLS_SUCCESS) {
+                fprintf(stderr, "(bench.c:%d) %s\n", __LINE__, kafkatools_producer_get_errstr(bt->producer, NULL));
+                break;
+            }
+        } else {
+            if (kafkatools_produce_batch(bt->producer, &bt->site, ktmsgs, n, KAFKATOOLS_MSGF_COPY, NULL, NULL, 100, -1) != n) {
+                fprintf(stderr, "(bench.c:%d) %s\n", __LINE__, kafkatools_producer_get_errstr(bt->producer, NULL));
+                break;
+            }
+        }
+
+        sent += n;
+    }
+
+    free(ktmsgs);
+    return NULL;
+}
+
+
+static int bench_consume_batch (kt_consumer consumer, int worker, rd_kafka_message_t **rkmessages, int count, void *arg)
+{
+    bench_consume_t *bc = (bench_consume_t *) arg;
+
+    uatomic_int64_add(&bc->consumed, count);
+    uatomic_int64_set(&bc->lastms, difftime_msec(NULL, NULL));
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static void * bench_consume_watch (void *arg)
+{
+    kt_consumer consumer = (kt_consumer) arg;
+
+    bench_consume_t *bc = (bench_consume_t *) kafkatools_consumer_get_opaque(consumer);
+
+    while (difftime_msec(NULL, NULL) - uatomic_int64_get(&bc->lastms) < BENCH_CONSUME_IDLE_MS) {
+        sleep_msec(100);
+    }
+
+    kafkatools_consumer_stop(consumer);
+    return NULL;
+}
+
+
+static int bench_produce (const char *bootstraps, const char *topic, int64_t messages, bench_run_t *run)
+{
+    int i, ret;
+    sb8 startus;
+
+    uatomic_int failed = 0;
+    const struct rd_kafka_metadata *metadata = NULL;
+
+    char *names[] = {"bootstrap.servers", "compression.codec", "acks", "kafkatools.metrics", NULL};
+    char *values[] = {(char *) bootstraps, (char *) run->codec, (char *) run->acks, "true", NULL};
+
+    kt_producer producer;
+    kafkatools_msg_site_t site = {0};
+
+    pthread_t *threads;
+    bench_thread_t *bts;
+    char *payload;
+
+    ret = kafkatools_producer_create(names, values, bench_delivery_report, (void *) &failed, &producer);
+    if (ret != KAFKATOOLS_SUCCESS) {
+        fprintf(stderr, "(bench.c:%d) kafkatools_producer_create failed(%d)\n", __LINE__, ret);
+        return ret;
+    }
+
+    site.topic = kafkatools_producer_get_topic(producer, topic);
+    site.partition = RD_KAFKA_PARTITION_UA;
+
+    /* connect to all brokers and learn leaders before timing */
+    if (rd_kafka_metadata(kafkatools_producer_get_rdkafka(producer), 0, (rd_kafka_topic_t *) site.topic, &metadata, 10000) == RD_KAFKA_RESP_ERR_NO_ERROR) {
+        rd_kafka_metadata_destroy(metadata);
+    }
+
+    for (i = 0; i < BENCH_MOCK_BROKERS; i++) {
+        kafkatools_msg_data_t ktmsg = {0};
+        kafkatools_msg_site_t warmup = {0};
+
+        warmup.topic = kafkatools_producer_get_topic(producer, BENCH_WARMUP_TOPIC);
+        warmup.partition = i;
+        ktmsg.msgbuf = (char *) topic;
+        ktmsg.msglen = (ssize_t) strlen(topic);
+
+        kafkatools_produce_timedwait(producer, &warmup, &ktmsg, 100, -1);
+    }
+    rd_kafka_flush(kafkatools_producer_get_rdkafka(producer), 10000);
+
+    kafkatools_metrics_snapshot(kafkatools_producer_get_metrics(producer), &run->produce, 1);
+
+    /* printable and a bit compressible like most of real payloads */
+    payload = (char *) malloc(run->msgsize);
+    for (i = 0; i < run->msgsize; i++) {
+        payload[i] = (char) ('a' + (i * 7 + i / 13) % 26);
+    }
+
+    threads = (pthread_t *) calloc(run->threads, sizeof(pthread_t));
+    bts = (bench_thread_t *) calloc(run->threads, sizeof(bench_thread_t));
+
+    startus = monotonic_usec();
+
+    for (i = 0; i < run->threads; i++) {
+        bts[i].producer = producer;
+        bts[i].site = site;
+        bts[i].run = run;
+        bts[i].messages = messages / run->threads + (i < messages % run->threads? 1 : 0);
+        bts[i].payload = payload;
+
+        pthread_create(&threads[i], NULL, bench_produce_thread, (void *) &bts[i]);
+    }
+
+    for (i = 0; i < run->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* until all delivery reports arrived */
+    rd_kafka_flush(kafkatools_producer_get_rdkafka(producer), -1);
+
+    run->produce_secs = (double) (monotonic_usec() - startus) / 1000000.0;
+    run->messages = messages;
+
+    kafkatools_metrics_snapshot(kafkatools_producer_get_metrics(producer), &run->produce, 0);
+
+    kafkatools_producer_destroy(producer, 0);
+
+    free(bts);
+    free(threads);
+    free(payload);
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static int bench_consume (const char *bootstraps, const char *topic, int runid, bench_run_t *run)
+{
+    int ret;
+    sb8 startus;
+
+    char groupid[64];
+    char topicpartitions[128];
+
+    const char *names[] = {"topic.auto.offset.reset", "enable.auto.commit", NULL};
+    const char *values[] = {"earliest", "false", NULL};
+    const char *topics[] = {topicpartitions, NULL};
+
+    kt_consumer consumer;
+    pthread_t watcher;
+    bench_consume_t bc;
+
+    snprintf(groupid, sizeof(groupid), "bench-group-%d", runid);
+    snprintf(topicpartitions, sizeof(topicpartitions), "%s:0-%d", topic, run->partitions - 1);
+
+    bc.consumed = 0;
+    bc.lastms = difftime_msec(NULL, NULL);
+
+    ret = kafkatools_consumer_create(groupid, bootstraps, run->partitions, names, values, topics, (void *) &bc, &consumer);
+    if (ret != KAFKATOOLS_SUCCESS) {
+        fprintf(stderr, "(bench.c:%d) kafkatools_consumer_create failed(%d)\n", __LINE__, ret);
+        return ret;
+    }
+
+    kafkatools_consumer_enable_metrics(consumer);
+
+    pthread_create(&watcher, NULL, bench_consume_watch, (void *) consumer);
+
+    startus = monotonic_usec();
+
+    ret = kafkatools_consumer_run(consumer, run->threads, 0, 0, bench_consume_batch, (void *) &bc);
+
+    pthread_join(watcher, NULL);
+
+    /* idle time before stop is not consuming */
+    run->consume_secs = (double) (monotonic_usec() - startus) / 1000000.0 - BENCH_CONSUME_IDLE_MS / 1000.0;
+    run->consumed = bc.consumed;
+
+    kafkatools_metrics_snapshot(kafkatools_consumer_get_metrics(consumer), &run->consume, 0);
+
+    kafkatools_consumer_destroy(consumer);
+
+    return ret;
+}
+
+
+static double bench_rate (double n, double secs)
+{
+    return (secs > 0? n / secs : 0);
+}
+
+
+static void bench_output_csv (FILE *fp, const bench_run_t *run, int header)
+{
+    const kt_histogram_snapshot_t *enq = &run->produce.histograms[KT_HISTOGRAM_ENQUEUE_US];
+    const kt_histogram_snapshot_t *dr = &run->produce.histograms[KT_HISTOGRAM_DELIVERY_US];
+    const kt_histogram_snapshot_t *lag = &run->consume.histograms[KT_HISTOGRAM_CONSUME_LAG_MS];
+
+    if (header) {
+        fprintf(fp, "msgsize,batch,codec,acks,threads,partitions,messages,"
+            "produce_msgs_per_sec,produce_mb_per_sec,enqueue_p50_us,enqueue_p99_us,enqueue_p999_us,"
+            "delivery_p50_us,delivery_p99_us,delivery_p999_us,delivered,failed,retries,queue_full,"
+            "consumed,consume_msgs_per_sec,consume_lag_p50_ms,consume_lag_p99_ms\n");
+    }
+
+    fprintf(fp, "%d,%d,%s,%s,%d,%d,%" PRId64 ",%.0f,%.2f,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64
+        ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 ",%.0f,%" PRId64 ",%" PRId64 "\n",
+        run->msgsize, run->batch, run->codec, run->acks, run->threads, run->partitions, run->messages,
+        bench_rate((double) run->messages, run->produce_secs),
+        bench_rate((double) run->messages * run->msgsize / (1024 * 1024), run->produce_secs),
+        enq->p50, enq->p99, enq->p999, dr->p50, dr->p99, dr->p999,
+        run->produce.counters[KT_COUNTER_DELIVERED], run->produce.counters[KT_COUNTER_FAILED],
+        run->produce.counters[KT_COUNTER_RETRIES], run->produce.counters[KT_COUNTER_QUEUE_FULL],
+        run->consumed, bench_rate((double) run->consumed, run->consume_secs), lag->p50, lag->p99);
+
+    fflush(fp);
+}
+
+
+static void bench_output_histogram_json (FILE *fp, const char *name, const kt_histogram_snapshot_t *hs)
+{
+    fprintf(fp, "\"%s\": {\"count\": %" PRId64 ", \"min\": %" PRId64 ", \"mean\": %.1f, \"p50\": %" PRId64
+        ", \"p90\": %" PRId64 ", \"p99\": %" PRId64 ", \"p999\": %" PRId64 ", \"max\": %" PRId64 "}",
+        name, hs->count, hs->min, hs->mean, hs->p50, hs->p90, hs->p99, hs->p999, hs->max);
+}
+
+
+static void bench_output_json (FILE *fp, const bench_run_t *run, int first)
+{
+    int i;
+
+    fprintf(fp, "%s  {\"msgsize\": %d, \"batch\": %d, \"codec\": \"%s\", \"acks\": \"%s\", \"threads\": %d, \"partitions\": %d,\n",
+        first? "" : ",\n", run->msgsize, run->batch, run->codec, run->acks, run->threads, run->partitions);
+
+    fprintf(fp, "   \"produce\": {\"messages\": %" PRId64 ", \"secs\": %.3f, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.2f",
+        run->messages, run->produce_secs, bench_rate((double) run->messages, run->produce_secs),
+        bench_rate((double) run->messages * run->msgsize / (1024 * 1024), run->produce_secs));
+
+    for (i = 0; i < KT_COUNTER_MAX; i++) {
+        if (i != KT_COUNTER_CONSUMED) {
+            fprintf(fp, ", \"%s\": %" PRId64, kafkatools_metrics_counter_name(i), run->produce.counters[i]);
+        }
+    }
+
+    fprintf(fp, ",\n    ");
+    bench_output_histogram_json(fp, kafkatools_metrics_histogram_name(KT_HISTOGRAM_ENQUEUE_US), &run->produce.histograms[KT_HISTOGRAM_ENQUEUE_US]);
+    fprintf(fp, ",\n    ");
+    bench_output_histogram_json(fp, kafkatools_metrics_histogram_name(KT_HISTOGRAM_DELIVERY_US), &run->produce.histograms[KT_HISTOGRAM_DELIVERY_US]);
+
+    fprintf(fp, "},\n   \"consume\": {\"messages\": %" PRId64 ", \"secs\": %.3f, \"msgs_per_sec\": %.0f,\n    ",
+        run->consumed, run->consume_secs, bench_rate((double) run->consumed, run->consume_secs));
+    bench_output_histogram_json(fp, kafkatools_metrics_histogram_name(KT_HISTOGRAM_CONSUME_LAG_MS), &run->consume.histograms[KT_HISTOGRAM_CONSUME_LAG_MS]);
+
+    fprintf(fp, "}}");
+
+    fflush(fp);
+}
+
+
+static void print_usage (void)
+{
+    printf("Usage: %s [OPTION...]\n"
+        "  -s, --msgsize=LIST      message sizes in bytes (default: 100,1000)\n"
+        "  -b, --batch=LIST        messages per produce call (default: 1,1000)\n"
+        "  -z, --codec=LIST        compression codecs (default: none)\n"
+        "  -a, --acks=LIST         acks (default: 1,all)\n"
+        "  -t, --threads=LIST      produce threads and consume workers (default: 1,4)\n"
+        "  -p, --partitions=LIST   partitions of topic (default: 4)\n"
+        "  -n, --messages=NUM      messages of each run (default: 50000)\n"
+        "  -o, --output=FORMAT     csv or json (default: csv)\n"
+        "  -f, --file=PATH         write results to file (default: stdout)\n"
+        "  -h, --help              display this help\n"
+        "\n"
+        "LIST is comma separated values. Every combination of them is a run.\n"
+        "NOTE: mock broker keeps only last 5 MB of each partition, so fewer\n"
+        "  messages than produced may be consumed in large runs. mock broker\n"
+        "  of librdkafka 1.4 rejects compressed batches as invalid size.\n",
+        APPNAME);
+}
+
+
+int main (int argc, char *argv[])
+{
+    int ret, runid = 0;
+    int s, b, z, a, t, p;
+
+    char msgsizes[] = "100,1000";
+    char batches[] = "1,1000";
+    char codecs[] = "none";
+    char acks[] = "1,all";
+    char threads[] = "1,4";
+    char partitions[] = "4";
+
+    bench_list_t lsize, lbatch, lcodec, lacks, lthreads, lparts;
+
+    int64_t messages = 50000;
+    int json = 0;
+    FILE *fp = stdout;
+
+    const char *bootstraps;
+    rd_kafka_t *mockrk;
+    rd_kafka_mock_cluster_t *mcluster;
+    rd_kafka_conf_t *conf;
+    char errstr[KAFKATOOLS_ERRSTR_SIZE];
+
+    const struct option lopts[] = {
+        {"msgsize", required_argument, 0, 's'},
+        {"batch", required_argument, 0, 'b'},
+        {"codec", required_argument, 0, 'z'},
+        {"acks", required_argument, 0, 'a'},
+        {"threads", required_argument, 0, 't'},
+        {"partitions", required_argument, 0, 'p'},
+        {"messages", required_argument, 0, 'n'},
+        {"output", required_argument, 0, 'o'},
+        {"file", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    bench_list_parse(msgsizes, &lsize);
+    bench_list_parse(batches, &lbatch);
+    bench_list_parse(codecs, &lcodec);
+    bench_list_parse(acks, &lacks);
+    bench_list_parse(threads, &lthreads);
+    bench_list_parse(partitions, &lparts);
+
+    while ((ret = getopt_long(argc, argv, "s:b:z:a:t:p:n:o:f:h", lopts, NULL)) != -1) {
+        switch (ret) {
+        case 's':
+            ret = bench_list_parse(optarg, &lsize);
+            break;
+        case 'b':
+            ret = bench_list_parse(optarg, &lbatch);
+            break;
+        case 'z':
+            ret = bench_list_parse(optarg, &lcodec);
+            break;
+        case 'a':
+            ret = bench_list_parse(optarg, &lacks);
+            break;
+        case 't':
+            ret = bench_list_parse(optarg, &lthreads);
+            break;
+        case 'p':
+            ret = bench_list_parse(optarg, &lparts);
+            break;
+        case 'n':
+            messages = atoll(optarg);
+            ret = (messages > 0? 1 : -1);
+            break;
+        case 'o':
+            json = ! strcmp(optarg, "json");
+            ret = (json || ! strcmp(optarg, "csv"))? 1 : -1;
+            break;
+        case 'f':
+            fp = fopen(optarg, "w");
+            if (! fp) {
+                fprintf(stderr, "(bench.c:%d) open file failed: %s\n", __LINE__, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            print_usage();
+            exit(EXIT_SUCCESS);
+        default:
+            ret = -1;
+            break;
+        }
+
+        if (ret <= 0) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* handle owns the mock cluster which all producers and consumers connect to */
+    conf = rd_kafka_conf_new();
+    mockrk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (! mockrk) {
+        fprintf(stderr, "(bench.c:%d) rd_kafka_new failed: %s\n", __LINE__, errstr);
+        exit(EXIT_FAILURE);
+    }
+
+    mcluster = rd_kafka_mock_cluster_new(mockrk, BENCH_MOCK_BROKERS);
+    if (! mcluster) {
+        fprintf(stderr, "(bench.c:%d) rd_kafka_mock_cluster_new failed\n", __LINE__);
+        exit(EXIT_FAILURE);
+    }
+
+    bootstraps = rd_kafka_mock_cluster_bootstraps(mcluster);
+
+    rd_kafka_mock_topic_create(mcluster, BENCH_WARMUP_TOPIC, BENCH_MOCK_BROKERS, BENCH_MOCK_BROKERS);
+
+    if (json) {
+        fprintf(fp, "[\n");
+    }
+
+    for (s = 0; s < lsize.count; s++)
+    for (b = 0; b < lbatch.count; b++)
+    for (z = 0; z < lcodec.count; z++)
+    for (a = 0; a < lacks.count; a++)
+    for (t = 0; t < lthreads.count; t++)
+    for (p = 0; p < lparts.count; p++) {
+        char topic[64];
+        bench_run_t run;
+
+        bzero(&run, sizeof(run));
+
+        run.msgsize = atoi(lsize.values[s]);
+        run.batch = atoi(lbatch.values[b]);
+        run.codec = lcodec.values[z];
+        run.acks = lacks.values[a];
+        run.threads = atoi(lthreads.values[t]);
+        run.partitions = atoi(lparts.values[p]);
+
+        if (run.msgsize < 1 || run.batch < 1 || run.threads < 1 || run.partitions < 1) {
+            fprintf(stderr, "(bench.c:%d) invalid run parameters\n", __LINE__);
+            exit(EXIT_FAILURE);
+        }
+
+        snprintf(topic, sizeof(topic), "bench-%d", ++runid);
+
+        rd_kafka_mock_topic_create(mcluster, topic, run.partitions, BENCH_MOCK_BROKERS);
+
+        fprintf(stderr, "run %d: msgsize=%d batch=%d codec=%s acks=%s threads=%d partitions=%d\n",
+            runid, run.msgsize, run.batch, run.codec, run.acks, run.threads, run.partitions);
+
+        if (bench_produce(bootstraps, topic, messages, &run) != KAFKATOOLS_SUCCESS ||
+            bench_consume(bootstraps, topic, runid, &run) != KAFKATOOLS_SUCCESS) {
+            exit(EXIT_FAILURE);
+        }
+
+        if (json) {
+            bench_output_json(fp, &run, runid == 1);
+        } else {
+            bench_output_csv(fp, &run, runid == 1);
+        }
+    }
+
+    if (json) {
+        fprintf(fp, "\n]\n");
+    }
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    rd_kafka_mock_cluster_destroy(mcluster);
+    rd_kafka_destroy(mockrk);
+
+    return 0;
+}
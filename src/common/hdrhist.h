@@ -0,0 +1,307 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   hdrhist.h
+ *  High Dynamic Range histogram with lock-free recording.
+ *
+ *  A port of the design of rdhdrhistogram.c (librdkafka) which is based on
+ *   Coda Hale's Golang implementation: https://github.com/codahale/hdr_histogram
+ *  Counts are updated by atomic add, so many threads may record into one
+ *   histogram, and integer math is used only. Values out of range are
+ *   clamped to [lowest, highest].
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#ifndef HDRHIST_H_INCLUDED
+#define HDRHIST_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include "unitypes.h"
+#include "memapi.h"
+#include "uatomic.h"
+
+
+typedef struct hdrhist_t
+{
+    int64_t lowest;
+    int64_t highest;
+
+    int32_t unitMagnitude;
+    int32_t subBucketHalfCountMagnitude;
+    int32_t subBucketHalfCount;
+    int32_t subBucketCount;
+    int32_t bucketCount;
+    int32_t countsLen;
+    int64_t subBucketMask;
+
+    uatomic_int64 totalCount;
+    uatomic_int64 totalSum;
+    uatomic_int64 minValue;
+    uatomic_int64 maxValue;
+
+    uatomic_int64 counts[0];
+} hdrhist_t;
+
+
+NOWARNING_UNUSED(static)
+int32_t hdrhist_bitlen (int64_t x)
+{
+    int32_t n = 0;
+
+    for (; x >= 0x8000; x >>= 16) {
+        n += 16;
+    }
+    if (x >= 0x80) {
+        x >>= 8;
+        n += 8;
+    }
+    if (x >= 0x8) {
+        x >>= 4;
+        n += 4;
+    }
+    if (x >= 0x2) {
+        x >>= 2;
+        n += 2;
+    }
+    if (x >= 0x1) {
+        n++;
+    }
+    return n;
+}
+
+
+/**
+ * create histogram tracks values in [lowest, highest] with precision of
+ *  sigfigs (1-5) significant decimal digits.
+ */
+NOWARNING_UNUSED(static)
+hdrhist_t * hdrhist_new (int64_t lowest, int64_t highest, int sigfigs)
+{
+    hdrhist_t *h;
+
+    int64_t largestSingleUnit = 2;
+    int32_t subBucketCountMagnitude = 0;
+    int32_t bucketsNeeded = 1;
+    int32_t subBucketCount, countsLen;
+    int64_t smallestUntrackable;
+
+    if (sigfigs < 1 || sigfigs > 5 || lowest < 1 || highest < 2 * lowest) {
+        return NULL;
+    }
+
+    while (sigfigs-- > 0) {
+        largestSingleUnit *= 10;
+    }
+
+    /* ceil(log2(largestSingleUnit)) */
+    while (((int64_t) 1 << subBucketCountMagnitude) < largestSingleUnit) {
+        subBucketCountMagnitude++;
+    }
+
+    subBucketCount = (int32_t) 1 << subBucketCountMagnitude;
+
+    smallestUntrackable = (int64_t) subBucketCount << (hdrhist_bitlen(lowest) - 1);
+    while (smallestUntrackable < highest) {
+        smallestUntrackable <<= 1;
+        bucketsNeeded++;
+    }
+
+    countsLen = (bucketsNeeded + 1) * (subBucketCount / 2);
+
+    h = (hdrhist_t *) mem_alloc_zero(1, sizeof(*h) + sizeof(h->counts[0]) * countsLen);
+
+    h->lowest = lowest;
+    h->highest = highest;
+    h->unitMagnitude = hdrhist_bitlen(lowest) - 1;
+    h->subBucketHalfCountMagnitude = subBucketCountMagnitude - 1;
+    h->subBucketHalfCount = subBucketCount / 2;
+    h->subBucketCount = subBucketCount;
+    h->subBucketMask = (int64_t) (subBucketCount - 1) << h->unitMagnitude;
+    h->bucketCount = bucketsNeeded;
+    h->countsLen = countsLen;
+    h->minValue = INT64_MAX;
+
+    return h;
+}
+
+
+NOWARNING_UNUSED(static)
+void hdrhist_free (hdrhist_t *h)
+{
+    mem_free(h);
+}
+
+
+NOWARNING_UNUSED(static)
+int32_t hdrhist_counts_index (const hdrhist_t *h, int32_t bucketIdx, int32_t subBucketIdx)
+{
+    return ((bucketIdx + 1) << h->subBucketHalfCountMagnitude) + (subBucketIdx - h->subBucketHalfCount);
+}
+
+
+NOWARNING_UNUSED(static)
+int32_t hdrhist_bucket_index (const hdrhist_t *h, int64_t v)
+{
+    return hdrhist_bitlen(v | h->subBucketMask) - h->unitMagnitude - (h->subBucketHalfCountMagnitude + 1);
+}
+
+
+NOWARNING_UNUSED(static)
+int64_t hdrhist_highest_equivalent (const hdrhist_t *h, int32_t bucketIdx, int32_t subBucketIdx)
+{
+    int64_t lowestEquivalent = (int64_t) subBucketIdx << (bucketIdx + h->unitMagnitude);
+
+    if (subBucketIdx >= h->subBucketCount) {
+        bucketIdx++;
+    }
+
+    return lowestEquivalent + ((int64_t) 1 << (h->unitMagnitude + bucketIdx)) - 1;
+}
+
+
+/* thread-safe */
+NOWARNING_UNUSED(static)
+void hdrhist_record (hdrhist_t *h, int64_t v)
+{
+    int32_t bucketIdx, subBucketIdx;
+    int64_t old;
+
+    if (v < h->lowest) {
+        v = h->lowest;
+    } else if (v > h->highest) {
+        v = h->highest;
+    }
+
+    bucketIdx = hdrhist_bucket_index(h, v);
+    subBucketIdx = (int32_t) (v >> (bucketIdx + h->unitMagnitude));
+
+    uatomic_int64_add(&h->counts[hdrhist_counts_index(h, bucketIdx, subBucketIdx)], 1);
+    uatomic_int64_add(&h->totalCount, 1);
+    uatomic_int64_add(&h->totalSum, v);
+
+    while (v < (old = h->minValue) && ! uatomic_int64_cas(&h->minValue, old, v)) {
+        /* retry */
+    }
+    while (v > (old = h->maxValue) && ! uatomic_int64_cas(&h->maxValue, old, v)) {
+        /* retry */
+    }
+}
+
+
+/* values recorded while reset may be lost */
+NOWARNING_UNUSED(static)
+void hdrhist_reset (hdrhist_t *h)
+{
+    int32_t i;
+
+    for (i = 0; i < h->countsLen; i++) {
+        uatomic_int64_set(&h->counts[i], 0);
+    }
+
+    uatomic_int64_set(&h->totalCount, 0);
+    uatomic_int64_set(&h->totalSum, 0);
+    uatomic_int64_set(&h->minValue, INT64_MAX);
+    uatomic_int64_set(&h->maxValue, 0);
+}
+
+
+/* add counts of src to dst which must be created with the same arguments */
+NOWARNING_UNUSED(static)
+void hdrhist_merge (hdrhist_t *dst, const hdrhist_t *src)
+{
+    int32_t i;
+
+    for (i = 0; i < dst->countsLen; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+
+    dst->totalCount += src->totalCount;
+    dst->totalSum += src->totalSum;
+
+    if (src->minValue < dst->minValue) {
+        dst->minValue = src->minValue;
+    }
+    if (src->maxValue > dst->maxValue) {
+        dst->maxValue = src->maxValue;
+    }
+}
+
+
+/* returns the recorded value at the given percentile (0..100) */
+NOWARNING_UNUSED(static)
+int64_t hdrhist_percentile (const hdrhist_t *h, double q)
+{
+    int32_t bucketIdx, subBucketIdx;
+    int64_t total = 0, countAtPercentile;
+
+    if (! h->totalCount) {
+        return 0;
+    }
+
+    if (q > 100.0) {
+        q = 100.0;
+    }
+
+    countAtPercentile = (int64_t) (q / 100.0 * (double) h->totalCount + 0.5);
+    if (countAtPercentile < 1) {
+        countAtPercentile = 1;
+    }
+
+    for (bucketIdx = 0; bucketIdx < h->bucketCount; bucketIdx++) {
+        for (subBucketIdx = (bucketIdx? h->subBucketHalfCount : 0); subBucketIdx < h->subBucketCount; subBucketIdx++) {
+            total += h->counts[hdrhist_counts_index(h, bucketIdx, subBucketIdx)];
+
+            if (total >= countAtPercentile) {
+                int64_t v = hdrhist_highest_equivalent(h, bucketIdx, subBucketIdx);
+
+                /* never beyond what was recorded */
+                return (v > h->maxValue? h->maxValue : v);
+            }
+        }
+    }
+
+    return h->maxValue;
+}
+
+
+NOWARNING_UNUSED(static)
+double hdrhist_mean (const hdrhist_t *h)
+{
+    return (h->totalCount? (double) h->totalSum / (double) h->totalCount : 0.0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HDRHIST_H_INCLUDED */
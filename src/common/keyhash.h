@@ -0,0 +1,304 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   keyhash.h
+ *  32 bits hash functions of message keys for partitioning:
+ *
+ *   murmur2  - same as java client (DefaultPartitioner) and librdkafka
+ *   fnv1a    - same as librdkafka fnv1a partitioner
+ *   xxhash32 - xxHash 32 bits with seed 0
+ *
+ *  keyhash_murmur2_x4 hashes 4 keys at once: the blocks which all 4 keys
+ *   have are mixed in 4 lanes of vector (gcc vector extensions compiled for
+ *   sse4.1 on x86 or neon on arm64) and the rest of each key continues on
+ *   scalar. fnv1a is byte serial and xxhash32 has 4 accumulators itself,
+ *   both run faster on scalar.
+ *
+ * @refer
+ *    https://github.com/apache/kafka/blob/trunk/clients/src/main/java/org/apache/kafka/common/utils/Utils.java
+ *    https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#ifndef KEYHASH_H_INCLUDED
+#define KEYHASH_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef NOWARNING_UNUSED
+# if defined(__GNUC__) || defined(__CYGWIN__)
+#   define NOWARNING_UNUSED(x) __attribute__((unused)) x
+# else
+#   define NOWARNING_UNUSED(x) x
+# endif
+#endif
+
+/**
+ * lanes of x4 need 32 bits vector multiply, which is sse4.1 on x86 and
+ *  baseline on arm64. keyhash_x4_supported() tells whether the cpu has it.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+# define KEYHASH_VECTOR_X4  1
+# define KEYHASH_X4_TARGET  __attribute__ ((target("sse4.1")))
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+# define KEYHASH_VECTOR_X4  1
+# define KEYHASH_X4_TARGET
+#endif
+
+#ifdef KEYHASH_VECTOR_X4
+typedef uint32_t keyhash_u32x4 __attribute__ ((vector_size(16)));
+#else
+# define KEYHASH_X4_TARGET
+#endif
+
+#define KEYHASH_MURMUR2_SEED    0x9747b28cU
+#define KEYHASH_MURMUR2_M       0x5bd1e995U
+#define KEYHASH_MURMUR2_R       24
+
+#define KEYHASH_FNV1A_BASIS     0x811c9dc5U
+#define KEYHASH_FNV1A_PRIME     0x01000193U
+
+#define KEYHASH_XXH32_P1        2654435761U
+#define KEYHASH_XXH32_P2        2246822519U
+#define KEYHASH_XXH32_P3        3266489917U
+#define KEYHASH_XXH32_P4         668265263U
+#define KEYHASH_XXH32_P5         374761393U
+
+#define keyhash_rotl32(x, r)    (((x) << (r)) | ((x) >> (32 - (r))))
+
+
+/* little endian 32 bits load on any cpu */
+NOWARNING_UNUSED(static)
+uint32_t keyhash_le32 (const unsigned char *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+/**
+ * murmur2: mix 4 bytes blocks from offset of key into h and finalize
+ */
+NOWARNING_UNUSED(static)
+uint32_t keyhash_murmur2_finish (uint32_t h, const unsigned char *key, size_t offset, size_t len)
+{
+    const uint32_t m = KEYHASH_MURMUR2_M;
+
+    for (; offset + 4 <= len; offset += 4) {
+        uint32_t k = keyhash_le32(key + offset);
+
+        k *= m;
+        k ^= k >> KEYHASH_MURMUR2_R;
+        k *= m;
+
+        h *= m;
+        h ^= k;
+    }
+
+    switch (len - offset) {
+    case 3:
+        h ^= (uint32_t) key[offset + 2] << 16;
+        /* fall through */
+    case 2:
+        h ^= (uint32_t) key[offset + 1] << 8;
+        /* fall through */
+    case 1:
+        h ^= (uint32_t) key[offset];
+        h *= m;
+    }
+
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+
+    return h;
+}
+
+
+NOWARNING_UNUSED(static)
+uint32_t keyhash_murmur2 (const void *key, size_t len)
+{
+    return keyhash_murmur2_finish(KEYHASH_MURMUR2_SEED ^ (uint32_t) len, (const unsigned char *) key, 0, len);
+}
+
+
+NOWARNING_UNUSED(static)
+uint32_t keyhash_fnv1a_finish (uint32_t h, const unsigned char *key, size_t offset, size_t len)
+{
+    for (; offset < len; offset++) {
+        h ^= key[offset];
+        h *= KEYHASH_FNV1A_PRIME;
+    }
+
+    return h;
+}
+
+
+NOWARNING_UNUSED(static)
+uint32_t keyhash_fnv1a (const void *key, size_t len)
+{
+    return keyhash_fnv1a_finish(KEYHASH_FNV1A_BASIS, (const unsigned char *) key, 0, len);
+}
+
+
+NOWARNING_UNUSED(static)
+uint32_t keyhash_xxh32 (const void *key, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) key;
+    const unsigned char *end = p + len;
+
+    uint32_t h;
+
+    if (len >= 16) {
+        /* 4 independent accumulators */
+        uint32_t v1 = KEYHASH_XXH32_P1 + KEYHASH_XXH32_P2;
+        uint32_t v2 = KEYHASH_XXH32_P2;
+        uint32_t v3 = 0;
+        uint32_t v4 = 0 - KEYHASH_XXH32_P1;
+
+        do {
+            v1 += keyhash_le32(p) * KEYHASH_XXH32_P2;
+            v1 = keyhash_rotl32(v1, 13) * KEYHASH_XXH32_P1;
+            v2 += keyhash_le32(p + 4) * KEYHASH_XXH32_P2;
+            v2 = keyhash_rotl32(v2, 13) * KEYHASH_XXH32_P1;
+            v3 += keyhash_le32(p + 8) * KEYHASH_XXH32_P2;
+            v3 = keyhash_rotl32(v3, 13) * KEYHASH_XXH32_P1;
+            v4 += keyhash_le32(p + 12) * KEYHASH_XXH32_P2;
+            v4 = keyhash_rotl32(v4, 13) * KEYHASH_XXH32_P1;
+            p += 16;
+        } while (p + 16 <= end);
+
+        h = keyhash_rotl32(v1, 1) + keyhash_rotl32(v2, 7) + keyhash_rotl32(v3, 12) + keyhash_rotl32(v4, 18);
+    } else {
+        h = KEYHASH_XXH32_P5;
+    }
+
+    h += (uint32_t) len;
+
+    for (; p + 4 <= end; p += 4) {
+        h += keyhash_le32(p) * KEYHASH_XXH32_P3;
+        h = keyhash_rotl32(h, 17) * KEYHASH_XXH32_P4;
+    }
+
+    for (; p < end; p++) {
+        h += (*p) * KEYHASH_XXH32_P5;
+        h = keyhash_rotl32(h, 11) * KEYHASH_XXH32_P1;
+    }
+
+    h ^= h >> 15;
+    h *= KEYHASH_XXH32_P2;
+    h ^= h >> 13;
+    h *= KEYHASH_XXH32_P3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+
+/**
+ * returns 1 if keyhash_murmur2_x4() can run on this cpu.
+ */
+NOWARNING_UNUSED(static)
+int keyhash_x4_supported (void)
+{
+#if defined(KEYHASH_VECTOR_X4) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("sse4.1")? 1 : 0;
+#elif defined(KEYHASH_VECTOR_X4)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+NOWARNING_UNUSED(static)
+size_t keyhash_minlen_x4 (const size_t lens[4])
+{
+    size_t n = lens[0];
+
+    if (lens[1] < n) n = lens[1];
+    if (lens[2] < n) n = lens[2];
+    if (lens[3] < n) n = lens[3];
+
+    return n;
+}
+
+
+/**
+ * murmur2 of 4 keys into hashes[4]. call only if keyhash_x4_supported().
+ */
+NOWARNING_UNUSED(static) KEYHASH_X4_TARGET
+void keyhash_murmur2_x4 (const unsigned char *keys[4], const size_t lens[4], uint32_t hashes[4])
+{
+    int i;
+    size_t off = 0;
+
+#ifdef KEYHASH_VECTOR_X4
+    size_t common = keyhash_minlen_x4(lens) & ~((size_t) 3);
+
+    keyhash_u32x4 h = {
+        KEYHASH_MURMUR2_SEED ^ (uint32_t) lens[0], KEYHASH_MURMUR2_SEED ^ (uint32_t) lens[1],
+        KEYHASH_MURMUR2_SEED ^ (uint32_t) lens[2], KEYHASH_MURMUR2_SEED ^ (uint32_t) lens[3]
+    };
+
+    for (; off < common; off += 4) {
+        keyhash_u32x4 k = {
+            keyhash_le32(keys[0] + off), keyhash_le32(keys[1] + off),
+            keyhash_le32(keys[2] + off), keyhash_le32(keys[3] + off)
+        };
+
+        k *= KEYHASH_MURMUR2_M;
+        k ^= k >> KEYHASH_MURMUR2_R;
+        k *= KEYHASH_MURMUR2_M;
+
+        h *= KEYHASH_MURMUR2_M;
+        h ^= k;
+    }
+
+    for (i = 0; i < 4; i++) {
+        hashes[i] = keyhash_murmur2_finish(h[i], keys[i], off, lens[i]);
+    }
+#else
+    for (i = 0; i < 4; i++) {
+        hashes[i] = keyhash_murmur2_finish(KEYHASH_MURMUR2_SEED ^ (uint32_t) lens[i], keys[i], off, lens[i]);
+    }
+#endif
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KEYHASH_H_INCLUDED */
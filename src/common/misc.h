@@ -28,9 +28,9 @@
  *    miscellaneous tools for application.
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.10
+ * @version    0.0.11
  * @create     2017-08-28 11:12:10
- * @update     2020-12-12 22:55:37
+ * @update     2026-10-18 10:12:33
  */
 #ifndef _MISC_H_
 #define _MISC_H_
@@ -212,6 +212,48 @@ void getnowtimeofday(struct timespec *now)
 }
 
 
+/**
+ * get absolute time after msec milliseconds from now,
+ *   for pthread_cond_timedwait.
+ */
+NOWARNING_UNUSED(static)
+void getfuturetimeofday(struct timespec *abstime, int msec)
+{
+    getnowtimeofday(abstime);
+
+    abstime->tv_sec += msec / 1000;
+    abstime->tv_nsec += (long) (msec % 1000) * 1000000L;
+
+    if (abstime->tv_nsec >= 1000000000L) {
+        abstime->tv_sec++;
+        abstime->tv_nsec -= 1000000000L;
+    }
+}
+
+
+/**
+ * monotonic clock in microseconds, for measuring elapsed time.
+ */
+NOWARNING_UNUSED(static)
+sb8 monotonic_usec(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, counter;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+
+    return (sb8) (counter.QuadPart / freq.QuadPart * 1000000 + counter.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (sb8) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+
 /**
  * taken from: redis/src/localtime.c
  *   although localtime_s on windows is a bit faster than getlocaltime_safe,
@@ -28,9 +28,9 @@
  *  read ini file api for Linux and Windows.
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.9
+ * @version    0.0.10
  * @create     2012-05-21 10:14:00
- * @update     2020-05-19 18:34:50
+ * @update     2026-10-18 10:12:33
  */
 #include "readconf.h"
 #include <math.h>
@@ -90,10 +90,11 @@ NOWARNING_UNUSED(static) char * dtrim (char *s, char c)
 NOWARNING_UNUSED(static) int readln (FILE *fp, char *strbuf, int bufsize)
 {
     int  i, j;
-    char ch;
+    int  ch;
 
     for (i=0, j=0; i<bufsize; j++) {
-        if (fread(&ch, sizeof(char), 1, fp) != 1) {
+        ch = getc(fp);
+        if (ch == EOF) {
             /* read error */
             if (feof(fp) != 0) {
                 if (j==0) {
@@ -112,12 +113,12 @@ NOWARNING_UNUSED(static) int readln (FILE *fp, char *strbuf, int bufsize)
             }
 
             if (ch==12 || ch==0x1A) { /* 12='\f' */
-                strbuf[i++]=ch;
+                strbuf[i++]=(char)ch;
                 break;
             }
 
             if (ch != 13) { /* '\r' */
-                strbuf[i++]=ch;
+                strbuf[i++]=(char)ch;
             }
         }
 
@@ -226,6 +227,9 @@ CONF_position ConfOpenFile (const char *conf)
     if (! fp) {
         return 0;
     }
+    /* lines are read by getc() from a full buffered stream */
+    setvbuf(fp, NULL, _IOFBF, READCONF_READ_BUFSIZE);
+
     cpos = (CONF_position) ConfMemAlloc(1, sizeof(conf_position_t));
     cpos->_fp = fp;
     return cpos;
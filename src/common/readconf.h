@@ -28,9 +28,9 @@
  *  read ini file api for Linux and Windows.
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.9
+ * @version    0.0.10
  * @create     2012-05-21
- * @update     2020-01-08 12:32:50
+ * @update     2026-10-18 10:12:33
  */
 #ifndef _READCONF_H__
 #define _READCONF_H__
@@ -76,6 +76,10 @@ typedef int READCONF_RESULT;
     # define READCONF_MAX_SECNAME      256
 #endif
 
+#ifndef READCONF_READ_BUFSIZE
+    # define READCONF_READ_BUFSIZE     65536
+#endif
+
 
 typedef struct _conf_position_t * CONF_position;
 
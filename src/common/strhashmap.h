@@ -0,0 +1,205 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   strhashmap.h
+ *  open addressing hash map with string keys and linear probing.
+ *
+ *  keys are not copied and must live as long as their entries. there is no
+ *   removal of entries. NOT thread safe: readers and writer must be guarded
+ *   by caller, for example with ThreadRWLock_t.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#ifndef STRHASHMAP_H_INCLUDED
+#define STRHASHMAP_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include "unitypes.h"
+#include "memapi.h"
+
+#define STRHASHMAP_CAPACITY_MIN   16
+
+
+typedef struct
+{
+    /* key is NULL for empty entry */
+    const char *key;
+    uint32_t hash;
+    void *value;
+} strhashmap_entry_t;
+
+
+typedef struct
+{
+    /* power of 2 */
+    uint32_t capacity;
+    uint32_t count;
+
+    strhashmap_entry_t *entries;
+} strhashmap_t;
+
+
+typedef void (*strhashmap_value_cb) (void *value, void *arg);
+
+
+/**
+ * FNV-1a 32 bits hash of key. caller keeps it to save rehashing.
+ */
+NOWARNING_UNUSED(static)
+uint32_t strhashmap_hash (const char *key)
+{
+    uint32_t h = 2166136261U;
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+
+NOWARNING_UNUSED(static)
+void strhashmap_init (strhashmap_t *map, uint32_t capacity)
+{
+    uint32_t cap = STRHASHMAP_CAPACITY_MIN;
+
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    map->capacity = cap;
+    map->count = 0;
+    map->entries = (strhashmap_entry_t *) mem_alloc_zero(cap, sizeof(strhashmap_entry_t));
+}
+
+
+/**
+ * free map and call valuecb(value, arg) for each entry if valuecb not NULL
+ */
+NOWARNING_UNUSED(static)
+void strhashmap_uninit (strhashmap_t *map, strhashmap_value_cb valuecb, void *arg)
+{
+    if (map->entries) {
+        if (valuecb) {
+            uint32_t i;
+
+            for (i = 0; i < map->capacity; i++) {
+                if (map->entries[i].key) {
+                    valuecb(map->entries[i].value, arg);
+                }
+            }
+        }
+
+        mem_free(map->entries);
+        map->entries = NULL;
+    }
+
+    map->capacity = 0;
+    map->count = 0;
+}
+
+
+/**
+ * returns value of key or NULL if not found
+ */
+NOWARNING_UNUSED(static)
+void * strhashmap_find (const strhashmap_t *map, const char *key, uint32_t hash)
+{
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = hash & mask;
+
+    for (;;) {
+        const strhashmap_entry_t *entry = &map->entries[i];
+
+        if (! entry->key) {
+            return NULL;
+        }
+
+        if (entry->hash == hash && ! strcmp(entry->key, key)) {
+            return entry->value;
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+
+/**
+ * insert key with value. map grows if load factor exceeds 3/4.
+ *   returns 1 if inserted, 0 if key exists already (value not changed).
+ */
+NOWARNING_UNUSED(static)
+int strhashmap_insert (strhashmap_t *map, const char *key, uint32_t hash, void *value)
+{
+    uint32_t i, mask;
+
+    if ((map->count + 1) * 4 > map->capacity * 3) {
+        strhashmap_t newmap;
+
+        strhashmap_init(&newmap, map->capacity * 2);
+
+        for (i = 0; i < map->capacity; i++) {
+            if (map->entries[i].key) {
+                strhashmap_insert(&newmap, map->entries[i].key, map->entries[i].hash, map->entries[i].value);
+            }
+        }
+
+        mem_free(map->entries);
+        *map = newmap;
+    }
+
+    mask = map->capacity - 1;
+    i = hash & mask;
+
+    while (map->entries[i].key) {
+        if (map->entries[i].hash == hash && ! strcmp(map->entries[i].key, key)) {
+            return 0;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    map->entries[i].key = key;
+    map->entries[i].hash = hash;
+    map->entries[i].value = value;
+    map->count++;
+
+    return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STRHASHMAP_H_INCLUDED */
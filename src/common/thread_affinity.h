@@ -0,0 +1,166 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   thread_affinity.h
+ *  bind calling thread to cpus given by a cpu list string like: "0,2-5".
+ *  only Linux is supported, others do nothing.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#ifndef THREAD_AFFINITY_H_INCLUDED
+#define THREAD_AFFINITY_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stdlib.h>
+#include <ctype.h>
+
+#if defined(__linux__)
+# ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+# endif
+# include <sched.h>
+# include <pthread.h>
+#endif
+
+
+#ifndef NOWARNING_UNUSED
+# if defined(__GNUC__) || defined(__CYGWIN__)
+#   define NOWARNING_UNUSED(x) __attribute__((unused)) x
+# else
+#   define NOWARNING_UNUSED(x) x
+# endif
+#endif
+
+#define THREAD_AFFINITY_CPUS_MAX   1024
+
+
+/**
+ * parse cpu list into array of cpu ids.
+ *   returns count of cpus or -1 if bad cpu list.
+ */
+NOWARNING_UNUSED(static)
+int cpulist_parse (const char *cpulist, int *cpus, int maxcpus)
+{
+    int num = 0;
+    const char *p = cpulist;
+
+    while (p && *p) {
+        char *end;
+        long first, last;
+
+        while (isspace((unsigned char) *p) || *p == ',') {
+            p++;
+        }
+        if (! *p) {
+            break;
+        }
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= THREAD_AFFINITY_CPUS_MAX) {
+            return (-1);
+        }
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p || last < first || last >= THREAD_AFFINITY_CPUS_MAX) {
+                return (-1);
+            }
+            p = end;
+        }
+
+        while (isspace((unsigned char) *p)) {
+            p++;
+        }
+        if (*p && *p != ',') {
+            return (-1);
+        }
+
+        for (; first <= last; first++) {
+            if (num == maxcpus) {
+                return (-1);
+            }
+            cpus[num++] = (int) first;
+        }
+    }
+
+    return num;
+}
+
+
+/**
+ * bind calling thread to cpus.
+ *   returns 0 on success.
+ */
+NOWARNING_UNUSED(static)
+int thread_set_affinity (const int *cpus, int numcpus)
+{
+#if defined(__linux__)
+    int i;
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    for (i = 0; i < numcpus; i++) {
+        if (cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &cpuset);
+        }
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+#else
+    (void) cpus;
+    (void) numcpus;
+    return 0;
+#endif
+}
+
+
+/**
+ * returns cpu which calling thread is running on or -1 if unknown.
+ */
+NOWARNING_UNUSED(static)
+int thread_get_cpu (void)
+{
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return (-1);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREAD_AFFINITY_H_INCLUDED */
@@ -0,0 +1,108 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   uatomic.h
+ *  atomic operations for integers and pointers both for Windows and Linux.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#ifndef UATOMIC_H_INCLUDED
+#define UATOMIC_H_INCLUDED
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include "unitypes.h"
+
+
+#if defined(_MSC_VER)
+# include <intrin.h>
+
+typedef volatile LONG      uatomic_int;
+typedef volatile LONGLONG  uatomic_int64;
+typedef void * volatile    uatomic_ptr;
+
+# define uatomic_int_add(a, v)         (InterlockedExchangeAdd((a), (LONG)(v)) + (LONG)(v))
+# define uatomic_int_sub(a, v)         (InterlockedExchangeAdd((a), -(LONG)(v)) - (LONG)(v))
+# define uatomic_int_get(a)            InterlockedCompareExchange((a), 0, 0)
+# define uatomic_int_set(a, v)         InterlockedExchange((a), (LONG)(v))
+# define uatomic_int_cas(a, o, n)      (InterlockedCompareExchange((a), (LONG)(n), (LONG)(o)) == (LONG)(o))
+
+# define uatomic_int64_add(a, v)       (InterlockedExchangeAdd64((a), (LONGLONG)(v)) + (LONGLONG)(v))
+# define uatomic_int64_sub(a, v)       (InterlockedExchangeAdd64((a), -(LONGLONG)(v)) - (LONGLONG)(v))
+# define uatomic_int64_get(a)          InterlockedCompareExchange64((a), 0, 0)
+# define uatomic_int64_set(a, v)       InterlockedExchange64((a), (LONGLONG)(v))
+# define uatomic_int64_cas(a, o, n)    (InterlockedCompareExchange64((a), (LONGLONG)(n), (LONGLONG)(o)) == (LONGLONG)(o))
+
+# define uatomic_ptr_get(a)            InterlockedCompareExchangePointer((a), 0, 0)
+# define uatomic_ptr_set(a, p)         InterlockedExchangePointer((a), (p))
+# define uatomic_ptr_cas(a, o, n)      (InterlockedCompareExchangePointer((a), (n), (o)) == (o))
+
+# define uatomic_barrier()             MemoryBarrier()
+# define uatomic_cpu_relax()           YieldProcessor()
+
+#else /* GCC, Clang */
+
+typedef volatile int      uatomic_int;
+typedef volatile int64_t  uatomic_int64;
+typedef void * volatile   uatomic_ptr;
+
+# define uatomic_int_add(a, v)         __sync_add_and_fetch((a), (int)(v))
+# define uatomic_int_sub(a, v)         __sync_sub_and_fetch((a), (int)(v))
+# define uatomic_int_get(a)            __sync_fetch_and_add((a), 0)
+# define uatomic_int_set(a, v)         __sync_lock_test_and_set((a), (int)(v))
+# define uatomic_int_cas(a, o, n)      __sync_bool_compare_and_swap((a), (int)(o), (int)(n))
+
+# define uatomic_int64_add(a, v)       __sync_add_and_fetch((a), (int64_t)(v))
+# define uatomic_int64_sub(a, v)       __sync_sub_and_fetch((a), (int64_t)(v))
+# define uatomic_int64_get(a)          __sync_fetch_and_add((a), 0)
+# define uatomic_int64_set(a, v)       __sync_lock_test_and_set((a), (int64_t)(v))
+# define uatomic_int64_cas(a, o, n)    __sync_bool_compare_and_swap((a), (int64_t)(o), (int64_t)(n))
+
+# define uatomic_ptr_get(a)            __sync_fetch_and_add((a), 0)
+# define uatomic_ptr_set(a, p)         __sync_lock_test_and_set((a), (p))
+# define uatomic_ptr_cas(a, o, n)      __sync_bool_compare_and_swap((a), (o), (n))
+
+# define uatomic_barrier()             __sync_synchronize()
+
+# if defined(__x86_64__) || defined(__i386__)
+#   define uatomic_cpu_relax()         __asm__ __volatile__("pause" ::: "memory")
+# else
+#   define uatomic_cpu_relax()         __sync_synchronize()
+# endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UATOMIC_H_INCLUDED */
@@ -3,31 +3,20 @@
  *  A sample shows how to consume messages from kafka with kafkatools api.
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.9
+ * @version    0.0.12
  * @create     2017-12-20
- * @update     2020-05-22 12:32:50
+ * @update     2026-10-18 10:12:33
  */
 #include "kafkatools.h"
 
+#include <common/uatomic.h>
+
 
 static int tplist_cb(rd_kafka_topic_partition_t *tp, void *cbarg)
 {
-    int64_t offlow, offhigh;
-    int timeout_ms = 1000;
-
-    rd_kafka_resp_err_t err;
-
-    rd_kafka_t * rk = (rd_kafka_t *) cbarg;
-
     printf("topic=%s, partition=%d, offset=%ju\n", tp->topic, tp->partition, tp->offset);
 
-    err = rd_kafka_query_watermark_offsets(rk, tp->topic, tp->partition, &offlow, &offhigh, timeout_ms);
-    if (err == 0) {
-        printf("offlow=%ju, offhigh=%ju\n", offlow, offhigh);
-    } else {
-        printf("rd_kafka_query_watermark_offsets failed: %s\n", rd_kafka_err2str(err));
-    }
-
+    /* watermarks and lag of all partitions are reported by lag monitor */
     return 1;
 }
 
@@ -83,6 +72,34 @@ static void consume_message (rd_kafka_message_t *rkmessage, void *opaque)
 }
 
 
+static int consume_batch (kt_consumer consumer, int worker, rd_kafka_message_t **rkmessages, int count, void *arg)
+{
+    int i;
+
+    int64_t totallag;
+    sb8 updated_ms, reported;
+
+    /* workers share the last reported snapshot time */
+    static uatomic_int64 reported_ms = 0;
+
+    for (i = 0; i < count; i++) {
+        consume_message(rkmessages[i], NULL);
+    }
+
+    /* snapshot of lag monitor never blocks consuming */
+    if (kafkatools_lagmon_snapshot((kt_lagmon) arg, NULL, 0, &totallag, &updated_ms) >= 0) {
+        reported = uatomic_int64_get(&reported_ms);
+
+        /* only the worker which wins the swap reports a snapshot */
+        if (updated_ms != reported && uatomic_int64_cas(&reported_ms, reported, updated_ms)) {
+            printf("Consumer lag: %jd\n", (intmax_t) totallag);
+        }
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
 /**
  * Enter the $projectroot/test dir and open 5 terminals as below:
  *
@@ -118,6 +135,7 @@ int main (int argc, char *argv[])
     int ret, err;
 
     kt_consumer consumer;
+    kt_lagmon lagmon;
 
     const char * names[] = {
         "offset.store.method",
@@ -184,49 +202,19 @@ int main (int argc, char *argv[])
             printf("rd_kafka_committed failed: %s\n", rd_kafka_err2str(err));
         }
 
-        int partitionid = 0;    //  = 1 no msg
-        int64_t offsetln = RD_KAFKA_OFFSET_BEGINNING;
-
-        err = rd_kafka_consume_start(rktopic, partitionid, offsetln);
-        if (err) {
-            printf("rd_kafka_consume_start failed: %s\n", rd_kafka_err2str(err));
-            exit(0);
+        ret = kafkatools_lagmon_create(consumer, 1000, &lagmon);
+        if (ret != KAFKATOOLS_SUCCESS) {
+            printf("kafkatools_lagmon_create failed.\n");
+            exit(-1);
         }
 
-        /* 订阅模式: 只能从最新的位置订阅
-        err = rd_kafka_subscribe(rk, tplist);
-        if (err) {
-            printf("rd_kafka_subscribe failed: %s\n", rd_kafka_err2str(err));
+        /* consume all partitions in topics with 4 worker threads */
+        ret = kafkatools_consumer_run(consumer, 4, 0, 0, consume_batch, (void *) lagmon);
+        if (ret != KAFKATOOLS_SUCCESS) {
+            printf("kafkatools_consumer_run failed: %s\n", kafkatools_consumer_get_errstr(consumer, 0));
         }
-        */
-
-        while(1) {
-            rd_kafka_message_t *rkmessage;
-
-            /* 订阅模式
-             * 轮询消费者的消息或事件, 最多阻塞 timeout_ms.
-             * 即使没有预期的消息, 为服务所有排队等待的回调函数, 应用程序
-             * 应该定期调用 consumer_poll(), 尤其当注册过 rebalance_cb,
-             * 它需要被正确地调用和处理以同步内部消费者状态
-            rkmessage = rd_kafka_consumer_poll(rk, 100);
-             */
-
-            /* 拉取模式 */
-            rd_kafka_poll(rk, 0);
 
-            rkmessage = rd_kafka_consume(rktopic, partitionid, 1 /* wait timeout ms */);
-            if (! rkmessage) {
-                /* timeout */
-                continue;
-            }
-
-            consume_message(rkmessage, NULL);
-
-            /**
-             * 释放rkmessage的资源, 并把所有权还给 rdkafka
-             */
-            rd_kafka_message_destroy(rkmessage);
-        }
+        kafkatools_lagmon_destroy(lagmon);
 
         kafkatools_consumer_destroy(consumer);
     } else {
@@ -42,9 +42,9 @@
  *     client from multiple threads.
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.9
+ * @version    0.0.35
  * @create     2018-10-08 16:17:00
- * @update     2020-05-20 11:32:50
+ * @update     2026-10-18 10:12:33
  */
 #ifndef KAFKATOOLS_H_INCLUDED
 #define KAFKATOOLS_H_INCLUDED
@@ -69,6 +69,8 @@ extern "C" {
 #include <sched.h>
 #include <pthread.h>
 
+#include <common/thread_rwlock.h>
+
 
 #define KAFKATOOLS_SUCCESS    0
 #define KAFKATOOLS_ERROR    (-1)
@@ -79,6 +81,7 @@ extern "C" {
 #define KAFKATOOLS_EFILE    (-5)
 #define KAFKATOOLS_EBREAK   (-6)
 #define KAFKATOOLS_EPROPS   (-7)
+#define KAFKATOOLS_EAGAIN   (-8)
 #define KAFKATOOLS_EFATAL   (-10)
 
 #define KAFKATOOLS_WAIT_INFINITE      (-1)
@@ -91,6 +94,24 @@ extern "C" {
 
 #define KAFKATOOLS_MSG_CB_DEFAULT  ((kafkatools_msg_cb)((void*) (uintptr_t) (int) (-1)))
 
+/* message flags for kafkatools_produce_batch() */
+#define KAFKATOOLS_MSGF_COPY       0x0
+#define KAFKATOOLS_MSGF_NOCOPY     0x1
+
+/* partitioner methods for kafkatools_partitioner_create() */
+#define KAFKATOOLS_PARTITIONER_MURMUR2     1    /* java compatible */
+#define KAFKATOOLS_PARTITIONER_FNV1A       2
+#define KAFKATOOLS_PARTITIONER_XXHASH      3
+#define KAFKATOOLS_PARTITIONER_ROUNDROBIN  4    /* keys are ignored, rotate every message */
+#define KAFKATOOLS_PARTITIONER_STICKY      5    /* keys are ignored, rotate every batch */
+
+/* sticky partition is rotated when bytes, messages or linger of batch is
+ *  reached. defaults are batch.size, batch.num.messages and linger.ms of
+ *  librdkafka */
+#define KAFKATOOLS_PARTITIONER_STICKY_BYTES      1000000
+#define KAFKATOOLS_PARTITIONER_STICKY_MSGS       10000
+#define KAFKATOOLS_PARTITIONER_STICKY_LINGER_MS  0.5
+
 #define KAFKA_PRODUCER_PROPERTIES_FILE    "kafka-producer.properties"
 #define KAFKA_CONSUMER_PROPERTIES_FILE    "kafka-consumer.properties"
 
@@ -103,6 +124,32 @@ typedef struct kafkatools_consumer_t * kt_consumer;
 
 typedef rd_kafka_topic_t * kt_topic;
 
+typedef struct kafkatools_ingest_t * kt_ingest;
+
+typedef struct kafkatools_producer_pool_t * kt_producer_pool;
+
+typedef struct kafkatools_spool_t * kt_spool;
+
+typedef struct kafkatools_metrics_t * kt_metrics;
+
+typedef struct kafkatools_props_cache_t * kt_props_cache;
+
+typedef struct kafkatools_state_watch_t * kt_state_watch;
+
+typedef struct kafkatools_state_sites_t * kt_state_sites;
+
+typedef struct kafkatools_partitioner_t * kt_partitioner;
+
+typedef struct kafkatools_lagmon_t * kt_lagmon;
+
+typedef struct kafkatools_reactor_t * kt_reactor;
+
+typedef struct kafkatools_affinity_t * kt_affinity;
+
+typedef struct kafkatools_envelope_t * kt_envelope;
+
+typedef struct kafkatools_coalesce_t * kt_coalesce;
+
 
 typedef struct kafkatools_msg_site_t
 {
@@ -133,6 +180,32 @@ typedef struct kafkatools_msg_data_t
 } kafkatools_msg_data_t;
 
 
+/**
+ * free payload of message produced with KAFKATOOLS_MSGF_NOCOPY.
+ *   called from delivery report after kafkatools_msg_cb returns.
+ */
+typedef void (*kt_msgfree_cb) (void *msgbuf, ssize_t msglen, void *_private);
+
+
+/**
+ * delivery result reaped from completion queue: kafkatools_producer_reap()
+ */
+typedef struct kafkatools_completion_t
+{
+    /* returned by kafkatools_produce_nowait, 0 for messages produced by other calls */
+    uint64_t ticket;
+
+    rd_kafka_resp_err_t err;
+
+    kt_topic topic;
+    int32_t partition;
+    int64_t offset;
+
+    /* _private of kafkatools_msg_data_t */
+    void * _private;
+} kt_completion_t;
+
+
 typedef struct kafkatools_producer_api_t
 {
     void *handle;
@@ -157,6 +230,17 @@ typedef struct
     kt_producer producer;
     kafkatools_msg_site_t site;
     void *statearg;
+
+    /* held for read between kafkatools_producer_state_acquire and _release,
+     *  for write by properties watcher to replace producer and sites
+     */
+    ThreadRWLock_t lock;
+
+    /* properties watcher: kafkatools_producer_state_watch() */
+    kt_state_watch watch;
+
+    /* all sites of state, site above is the first one (siteid = 0) */
+    kt_state_sites sites;
 } ktproducer_state_t;
 
 
@@ -169,8 +253,47 @@ typedef struct
  */
 extern int kafkatools_producer_state_init (const char *propertiesfile, const char *topicpartitions, kafkatools_msg_cb statecb, void *argp, ktproducer_state_t *state);
 
+/**
+ * create kafka producer state for many topics sharing one producer
+ *   `section` - section of properties, NULL for the topic of first site
+ *   `topicpartitions` - NULL terminated array of "$topic:$min-$max". siteid
+ *        of each topic is its index in array
+ */
+extern int kafkatools_producer_state_init_sites (const char *propertiesfile, const char *section, const char *topicpartitions[], kafkatools_msg_cb statecb, void *argp, ktproducer_state_t *state);
+
+extern int kafkatools_producer_state_sites (ktproducer_state_t *state);
+
+/* siteid of topic or -1 if not found */
+extern int kafkatools_producer_state_site_id (ktproducer_state_t *state, const char *topic);
+
+/* site of siteid or NULL if out of range */
+extern kafkatools_msg_site_t * kafkatools_producer_state_get_site (ktproducer_state_t *state, int siteid);
+
 extern void kafkatools_producer_state_uninit (ktproducer_state_t *state, int wait_ms);
 
+/**
+ * watch properties file of state (inotify on Linux, polling on others) and
+ *  rebuild producer from the section of state's topic when it changes.
+ *  new messages are switched to the new producer atomically, while the old
+ *  one is flushed for up to drain_ms and destroyed in the background. its
+ *  delivery reports still go to statecb.
+ *
+ *   `propertiesfile` - same as given to kafkatools_producer_state_init()
+ *
+ * NOTE: once watched, producer and site of state must be accessed between
+ *   kafkatools_producer_state_acquire() and _release(). producers with
+ *   kafkatools.spool.dir or kafkatools.completion can not be reloaded.
+ */
+extern int kafkatools_producer_state_watch (ktproducer_state_t *state, const char *propertiesfile, int drain_ms);
+
+/**
+ * get current producer and a copy of site of siteid (if site not NULL).
+ *  the producer is kept alive until kafkatools_producer_state_release().
+ */
+extern kt_producer kafkatools_producer_state_acquire (ktproducer_state_t *state, int siteid, kafkatools_msg_site_t *site);
+
+extern void kafkatools_producer_state_release (ktproducer_state_t *state);
+
 
 /**
  * helper api
@@ -182,6 +305,27 @@ extern int kafkatools_props_retrieve (const char *propsbuf, size_t bufsz, char *
 
 extern void kafkatools_propsbuf_free (char *propsbuf);
 
+
+/**
+ * properties cache api
+ *   parse properties file once and index props by section name. props of
+ *   a section are packed as "key\0value\0..." in the same way as
+ *   kafkatools_props_readconf() does, so kafkatools_props_retrieve() can be
+ *   applied to the buffer returned by kafkatools_props_cache_section().
+ *
+ * kafkatools_props_readconf() uses a process wide cache which is reloaded
+ *   only when the properties file is changed.
+ */
+extern int kafkatools_props_cache_load (const char *conf_file, kt_props_cache *outcache);
+
+extern void kafkatools_props_cache_free (kt_props_cache cache);
+
+/**
+ * get props of section (NULL for all sections). propsbuf is owned by cache.
+ *   returns count of props, 0 if section not found.
+ */
+extern int kafkatools_props_cache_section (kt_props_cache cache, const char *section, const char **propsbuf, size_t *bufsz);
+
 extern const char * kafkatools_get_rdkafka_version (void);
 
 extern int kafkatools_mutex_lock (pthread_mutex_t * mutex, int is_try);
@@ -202,22 +346,482 @@ extern rd_kafka_t * kafkatools_producer_get_rdkafka (kt_producer producer);
 
 extern pthread_mutex_t * kafkatools_producer_get_mutex (kt_producer producer);
 
+/* opaque given to create. rd_kafka_opaque() of its rd_kafka_t is the producer itself */
 extern void * kafkatools_producer_get_opaque (kt_producer producer);
 
+/**
+ * serve delivery reports, or wait for next batch of them up to timeout_ms
+ *  if producer is created with poller thread (kafkatools.poller.interval.ms)
+ */
+extern void kafkatools_producer_poll (kt_producer producer, int timeout_ms);
+
 extern kt_topic kafkatools_producer_get_topic (kt_producer producer, const char *topic_name);
 
 extern const char * kafkatools_topic_name (const kt_topic topic);
 
+/**
+ * produce one message to site. while queue is full, serve delivery reports
+ *  for up to timout_ms and try again, retry_count times at most (-1 for no
+ *  limit, 0 is same as 1).
+ */
 extern int kafkatools_produce_timedwait (kt_producer producer, kafkatools_msg_site_t *ktsite, kafkatools_msg_data_t *ktmsg, int timout_ms, int retry_count);
 
+/**
+ * produce count of messages to site in one call.
+ *   `msgflags` - KAFKATOOLS_MSGF_COPY or KAFKATOOLS_MSGF_NOCOPY. with NOCOPY
+ *        msgbuf must be kept until delivery report, when `freecb` (if given)
+ *        is called for it.
+ *   `errs` - optional, per-message error (RD_KAFKA_RESP_ERR_NO_ERROR on success).
+ *        caller still owns payload of failed messages, freecb is not called.
+ *   `retry_count` - attempts while queue is full, each after serving delivery
+ *        reports for up to timout_ms. -1 for no limit, 0 is same as 1.
+ * returns count of messages enqueued.
+ */
+extern int kafkatools_produce_batch (kt_producer producer, kafkatools_msg_site_t *ktsite, kafkatools_msg_data_t *ktmsgs, int count, int msgflags, kt_msgfree_cb freecb, rd_kafka_resp_err_t *errs, int timout_ms, int retry_count);
+
+/**
+ * completion queue api: producer created with "kafkatools.completion" = true
+ *   never calls msg_cb. delivery results are queued and the eventfd returned
+ *   by kafkatools_producer_completion_fd() becomes readable, so it can be
+ *   added to application's epoll set:
+ *
+ *     epoll_ctl(epfd, EPOLL_CTL_ADD, kafkatools_producer_completion_fd(producer), &ev);
+ *     ...
+ *     n = kafkatools_producer_reap(producer, completions, 256);
+ *
+ * kafkatools_produce_nowait() copies message and returns at once with a
+ *   ticket which comes back in its completion, or KAFKATOOLS_EAGAIN if
+ *   queue is full (reap and try again). tickets are increasing but a failed
+ *   call skips one.
+ *
+ * only reaping frees the queue, so calls which would wait for it do not:
+ *   kafkatools_produce_timedwait() returns KAFKATOOLS_EAGAIN and
+ *   kafkatools_produce_batch() fails the rest with QUEUE_FULL at once,
+ *   whatever the retry_count. kafkatools_produce_file(), kt_envelope and
+ *   kt_coalesce are not supported, nor kafkatools_producer_state_watch():
+ *   a reload would replace the eventfd and drop queued completions.
+ *
+ * kafkatools_producer_reap() returns count (up to maxcount) of completions
+ *   drained without blocking, KAFKATOOLS_EARG if not a completion producer.
+ *   eventfd is left readable if more completions remain. only one thread
+ *   may reap at a time.
+ */
+extern int kafkatools_produce_nowait (kt_producer producer, kafkatools_msg_site_t *ktsite, kafkatools_msg_data_t *ktmsg, uint64_t *ticket);
+
+extern int kafkatools_producer_completion_fd (kt_producer producer);
+
+extern int kafkatools_producer_reap (kt_producer producer, kt_completion_t *completions, int maxcount);
+
+/**
+ * callback for each message (record) read from file:
+ *   kt_msgfile_cb(id, msg, msglen, arg)
+ * returns KAFKATOOLS_SUCCESS if msg is consumed, others to stop at msg.
+ */
 typedef int(* kt_msgfile_cb)(size_t, void *, size_t, void *);
 
+/* records of file are prefixed by 4 bytes length in big endian */
+#define KAFKATOOLS_FILE_LENPREFIX  (-1)
+
+/**
+ * produce records of file to site without copy. file is mapped region by
+ *  region, a region is unmapped when delivery reports of all its records
+ *  have arrived, so files of any size are produced with bounded memory.
+ *   `delim` - records are separated by this char (empty ones are skipped),
+ *        or KAFKATOOLS_FILE_LENPREFIX.
+ *   `recordcb` - optional, called with file offset of each record before it
+ *        is produced. return others than KAFKATOOLS_SUCCESS to stop.
+ *   `stopoffset` - optional, file offset to resume from if not all produced.
+ *  delivery reports of records have _private of NULL. records are not spilled
+ *  to spool.
+ * returns KAFKATOOLS_SUCCESS if all records are enqueued, KAFKATOOLS_ERROR on
+ *  error, or value returned by recordcb.
+ */
+extern int kafkatools_produce_file (kt_producer producer, kafkatools_msg_site_t *ktsite, const char *pathfile, int delim, kt_msgfile_cb recordcb, void *arg, int timout_ms, int retry_count, sb8 *stopoffset);
+
+
+/**
+ * kafka partitioner api
+ *   select partition within [partitionid_min, partitionid_max] of site.
+ *   keyless messages stick to one partition until the batch of it is full
+ *   or lingered, then move to next partition. one sticky partition is kept
+ *   per partitioner and mapped into scope of each site.
+ *
+ * a producer created with "kafkatools.partitioner" = murmur2 | fnv1a |
+ *   xxhash | roundrobin | sticky uses it for messages produced to a site
+ *   with partition of RD_KAFKA_PARTITION_UA.
+ */
+extern int kafkatools_partitioner_create (int method, kt_partitioner *outpart);
+
+extern void kafkatools_partitioner_destroy (kt_partitioner part);
+
+/* method of partitioner name or -1 if unknown */
+extern int kafkatools_partitioner_method (const char *name);
+
+/* thresholds of sticky batch, 0 for default */
+extern void kafkatools_partitioner_set_sticky (kt_partitioner part, size_t batch_bytes, int batch_msgs, double linger_ms);
+
+extern int32_t kafkatools_partitioner_partition (kt_partitioner part, const kafkatools_msg_site_t *site, const kafkatools_msg_data_t *ktmsg);
+
+/**
+ * partitions of count messages into partitions[count].
+ *  murmur2 keys are hashed 4 at once with SIMD where supported.
+ */
+extern void kafkatools_partitioner_partition_batch (kt_partitioner part, const kafkatools_msg_site_t *site, const kafkatools_msg_data_t *ktmsgs, int count, int32_t *partitions);
+
+
+/**
+ * kafka slab allocator api
+ *   process wide allocator of size classes (64 bytes .. 64 KB) with per
+ *   thread magazine caches, so blocks allocated on producing threads and
+ *   freed on the delivery report thread do not contend on malloc. larger
+ *   sizes fall back to malloc. used by producer for message envelopes,
+ *   and for payload copies if created with "kafkatools.slab" = true.
+ */
+extern void * kafkatools_slab_alloc (size_t size);
+
+extern void kafkatools_slab_free (void *ptr);
+
+
+/**
+ * librdkafka thread affinity api
+ *   properties of both producer and consumer bind internal threads of
+ *   librdkafka to cpus as they start:
+ *
+ *     kafkatools.affinity.main.cpus       - main thread
+ *     kafkatools.affinity.broker.cpus     - per broker threads
+ *     kafkatools.affinity.background.cpus - background thread
+ *
+ *   value is a cpu list like "0,2-5", or cpus of NUMA nodes like "node:1"
+ *   or "node:0-1". see kafkatools_producer_get_threads() and
+ *   kafkatools_consumer_get_threads() for threads and cpus they run on.
+ */
+typedef struct kafkatools_thread_cpu_t
+{
+    /* rd_kafka_thread_type_t */
+    int type;
+
+    /* name by librdkafka, like "rdk:broker1" */
+    char name[32];
+
+    int tid;
+
+    /* 1 if bound to cpus of type */
+    int pinned;
+
+    /* cpu thread ran on last, -1 if unknown */
+    int cpu;
+} kt_thread_cpu_t;
+
+extern int kafkatools_affinity_create (kt_affinity *outaff);
+
+/* destroy after rd_kafka_destroy() of client */
+extern void kafkatools_affinity_destroy (kt_affinity aff);
+
+/* set "kafkatools.affinity.*" property, KAFKATOOLS_ECONF if bad name or value */
+extern int kafkatools_affinity_set (kt_affinity aff, const char *name, const char *value);
+
+/* add interceptors to conf before rd_kafka_new() */
+extern int kafkatools_affinity_conf (kt_affinity aff, rd_kafka_conf_t *conf);
+
+/* returns count of threads running */
+extern int kafkatools_affinity_threads (kt_affinity aff, kt_thread_cpu_t *threads, int maxthreads);
+
+
+/**
+ * kafka producer ingest ring api
+ *   application threads enqueue into a bounded lock-free ring without
+ *   blocking, a drain thread hands messages to the producer in bulk.
+ *
+ *   `slots` - ring capacity (rounded up to power of 2)
+ *   `slotsize` - max bytes of key and payload for one message
+ *   `highwater` - hwmcb(ingest, 1, used, arg) is called when used slots reach
+ *        highwater and hwmcb(ingest, 0, used, arg) when drop to highwater/2.
+ */
+typedef void (*kt_ingest_hwm_cb) (kt_ingest ingest, int is_high, int used, void *arg);
+
+extern int kafkatools_ingest_create (kt_producer producer, const kafkatools_msg_site_t *ktsite, int slots, int slotsize, int highwater, kt_ingest_hwm_cb hwmcb, void *hwmarg, kt_ingest *outingest);
+
+/* pending messages are handed to producer before destroy returns */
+extern void kafkatools_ingest_destroy (kt_ingest ingest);
+
+/**
+ * copy message into ring. `partition` is RD_KAFKA_PARTITION_UA or in site's
+ *  partitionid scope. returns KAFKATOOLS_EAGAIN at once if ring is full.
+ */
+extern int kafkatools_ingest_try_enqueue (kt_ingest ingest, int32_t partition, const kafkatools_msg_data_t *ktmsg);
+
+extern int kafkatools_ingest_pending (kt_ingest ingest);
+
+extern void kafkatools_ingest_stats (kt_ingest ingest, int64_t *produced, int64_t *failed);
+
+
+/**
+ * kafka envelope api
+ *   small records are packed into one kafka message (envelope) which is
+ *   produced when the next record does not fit in `maxbytes` or the oldest
+ *   record has waited `linger_ms`. one envelope is built per partition of
+ *   site's partitionid scope and one for RD_KAFKA_PARTITION_UA.
+ *
+ *   `maxbytes` - max size of envelope, 0 for 64 KB
+ *   `linger_ms` - max time a record waits in envelope, 0 for 5 ms
+ *
+ * delivery reports are per envelope: msg_cb of producer gets the envelope
+ *   with _private of NULL, _private of records is not kept. producer with
+ *   "kafkatools.completion" is not supported (KAFKATOOLS_EARG).
+ */
+extern int kafkatools_envelope_create (kt_producer producer, const kafkatools_msg_site_t *ktsite, size_t maxbytes, int linger_ms, kt_envelope *outenv);
+
+/* pending records are produced before destroy returns */
+extern void kafkatools_envelope_destroy (kt_envelope env);
+
+/**
+ * copy record (key is optional) into envelope of partition. `partition` is
+ *  RD_KAFKA_PARTITION_UA or in site's partitionid scope. thread safe.
+ *  returns KAFKATOOLS_EARG if record can not fit in an envelope.
+ */
+extern int kafkatools_envelope_add (kt_envelope env, int32_t partition, const kafkatools_msg_data_t *ktmsg);
+
+/* produce all pending envelopes now. returns count of envelopes produced */
+extern int kafkatools_envelope_flush (kt_envelope env);
+
+extern void kafkatools_envelope_stats (kt_envelope env, int64_t *records, int64_t *envelopes, int64_t *failed);
+
+/**
+ * consumer side iterator over records of an envelope without copy:
+ *
+ *   kt_envelope_iter_t iter;
+ *   kafkatools_msg_data_t record;
+ *
+ *   if (kafkatools_envelope_iter_init(&iter, rkmessage->payload, rkmessage->len) >= 0) {
+ *       while (kafkatools_envelope_iter_next(&iter, &record) == 1) {
+ *           ... record.key, record.keylen, record.msgbuf, record.msglen
+ *       }
+ *   }
+ *
+ * records point into payload and are valid as long as the message is.
+ */
+typedef struct kafkatools_envelope_iter_t
+{
+    const char *next;
+    const char *end;
+
+    int count;
+    int index;
+} kt_envelope_iter_t;
+
+/* returns count of records, KAFKATOOLS_EARG if payload is not an envelope */
+extern int kafkatools_envelope_iter_init (kt_envelope_iter_t *iter, const void *payload, size_t len);
+
+/* returns 1 for next record, 0 at end, KAFKATOOLS_EARG if envelope is malformed */
+extern int kafkatools_envelope_iter_next (kt_envelope_iter_t *iter, kafkatools_msg_data_t *record);
+
+
+/**
+ * kafka coalesce api
+ *   last-write-wins for keyed state updates: within `window_ms` only the
+ *   newest message of each (partition, key) is kept, then survivors are
+ *   produced in a batch. earlier window is flushed at once if `maxkeys`
+ *   distinct keys are pending.
+ *
+ *   `window_ms` - 0 for 100 ms
+ *   `maxkeys` - 0 for 65536
+ *
+ * superseded messages are dropped without delivery report. survivors keep
+ *   the position of the first message of their key in the window. producer
+ *   with "kafkatools.completion" is not supported (KAFKATOOLS_EARG).
+ */
+extern int kafkatools_coalesce_create (kt_producer producer, const kafkatools_msg_site_t *ktsite, int window_ms, int maxkeys, kt_coalesce *outcoalesce);
+
+/* survivors are produced before destroy returns */
+extern void kafkatools_coalesce_destroy (kt_coalesce coalesce);
+
+/**
+ * copy keyed message into window. `partition` is RD_KAFKA_PARTITION_UA or
+ *  in site's partitionid scope. msgbuf of NULL is kept as tombstone.
+ *  returns KAFKATOOLS_EARG for message without key. thread safe.
+ */
+extern int kafkatools_coalesce_put (kt_coalesce coalesce, int32_t partition, const kafkatools_msg_data_t *ktmsg);
+
+/* produce survivors now. returns count of messages flushed */
+extern int kafkatools_coalesce_flush (kt_coalesce coalesce);
+
+/* `puts` - messages put, `produced` + `failed` - survivors */
+extern void kafkatools_coalesce_stats (kt_coalesce coalesce, int64_t *puts, int64_t *produced, int64_t *failed);
+
+
+/**
+ * disk spool api
+ *   messages are appended to CRC framed records in memory-mapped segment
+ *   files under spooldir and replayed in order. segments left by previous
+ *   process are recovered on open.
+ *
+ * producer spills to spool when created with property "kafkatools.spool.dir"
+ *   (see kafkatools_producer_create). delivery reports of replayed messages
+ *   have _private of NULL. replayed messages failed with retriable errors
+ *   are replayed again from their position, others are dropped.
+ */
+typedef struct kafkatools_spool_record_t
+{
+    const char *topic;
+    int32_t partition;
+
+    /* position of record in its segment: kafkatools_spool_rewind() */
+    size_t offset;
+
+    /* key and msgbuf point into segment */
+    kafkatools_msg_data_t msg;
+} kt_spool_record_t;
+
+/**
+ * segment_bytes: size of segment file (0 for default: 64 MB). spooldir is
+ *  locked until close: KAFKATOOLS_EFILE if it is opened by another spool.
+ */
+extern int kafkatools_spool_open (const char *spooldir, size_t segment_bytes, kt_spool *outspool);
+
+/* segments with unreleased records are kept and replayed as whole by next open
+ *  (at-least-once: records of a partly released segment are duplicated) */
+extern void kafkatools_spool_close (kt_spool spool);
+
+extern int kafkatools_spool_append (kt_spool spool, const char *topic, int32_t partition, const kafkatools_msg_data_t *ktmsg);
+
+/**
+ * replay up to maxrecords in order: recordcb(segid, kt_spool_record_t *, reclen, arg).
+ *  record consumed by recordcb stays valid until kafkatools_spool_release(segid).
+ * returns count of records consumed.
+ */
+extern int kafkatools_spool_replay (kt_spool spool, int maxrecords, kt_msgfile_cb recordcb, void *arg);
+
+extern void kafkatools_spool_release (kt_spool spool, size_t segid);
+
+/**
+ * replay again from record at offset of segment segid, for example after
+ *  its delivery failed. records behind it which were replayed already are
+ *  replayed again (at-least-once, order kept). rewind to a record after
+ *  the next one to replay does nothing. segment must not be released yet.
+ */
+extern int kafkatools_spool_rewind (kt_spool spool, size_t segid, size_t offset);
+
+/* count of records appended but not yet replayed */
+extern int64_t kafkatools_spool_unread (kt_spool spool);
+
+/* count of records appended but not yet released: unread and in flight */
+extern int64_t kafkatools_spool_pending (kt_spool spool);
+
+
+/**
+ * sharded producer pool api
+ *
+ * create `shards` producers from the same properties file and topicpartitions
+ *  as kafkatools_producer_state_init(). each shard owns a disjoint slice of
+ *  the partitionid scope, so that no two librdkafka instances contend for
+ *  the same partition queue. shards is limited to count of partitions.
+ *
+ * delivery reports are served with statecb on the shard's own thread and
+ *  opaque is its ktproducer_state_t whose statearg is argp.
+ *
+ * more than one shard can not share "kafkatools.spool.dir" (KAFKATOOLS_EARG).
+ */
+extern int kafkatools_producer_pool_create (const char *propertiesfile, const char *topicpartitions, int shards, kafkatools_msg_cb statecb, void *argp, kt_producer_pool *outpool);
+
+extern void kafkatools_producer_pool_destroy (kt_producer_pool pool, int wait_ms);
+
+extern int kafkatools_producer_pool_shards (kt_producer_pool pool);
+
+/* state of shard: producer and site with partitionid scope of shard */
+extern ktproducer_state_t * kafkatools_producer_pool_get_shard (kt_producer_pool pool, int shard);
+
+/**
+ * partition in pool's partitionid scope for key (murmur2 as java client),
+ *  or next partition in round-robin if key is null.
+ */
+extern int32_t kafkatools_producer_pool_partition (kt_producer_pool pool, const char *key, ssize_t keylen);
+
+/* shard which owns partition, or -1 if partition is out of scope */
+extern int kafkatools_producer_pool_shard_of (kt_producer_pool pool, int32_t partition);
+
+/**
+ * produce message on the shard owns partition. if partition is
+ *  RD_KAFKA_PARTITION_UA, it is taken by kafkatools_producer_pool_partition().
+ */
+extern int kafkatools_producer_pool_produce (kt_producer_pool pool, int32_t partition, kafkatools_msg_data_t *ktmsg, int timout_ms, int retry_count);
+
+
+/**
+ * metrics api
+ *   counters and HDR histograms recorded lock-free into per-thread stripes,
+ *   which are merged on snapshot.
+ */
+#define KT_COUNTER_ENQUEUED          0    /* messages enqueued to librdkafka */
+#define KT_COUNTER_DELIVERED         1    /* messages delivered */
+#define KT_COUNTER_FAILED            2    /* messages failed to enqueue or deliver */
+#define KT_COUNTER_RETRIES           3    /* produce retries */
+#define KT_COUNTER_QUEUE_FULL        4    /* QUEUE_FULL events */
+#define KT_COUNTER_CONSUMED          5    /* messages consumed */
+#define KT_COUNTER_PAUSED            6    /* partitions paused by flow control */
+#define KT_COUNTER_MAX               7
+
+#define KT_HISTOGRAM_ENQUEUE_US      0    /* time in produce call until enqueued */
+#define KT_HISTOGRAM_DELIVERY_US     1    /* produce to delivery report */
+#define KT_HISTOGRAM_CONSUME_LAG_MS  2    /* message timestamp to consume */
+#define KT_HISTOGRAM_MAX             3
+
+typedef struct kafkatools_histogram_snapshot_t
+{
+    int64_t count;
+    int64_t min;
+    int64_t max;
+    double mean;
+
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t p999;
+} kt_histogram_snapshot_t;
+
+typedef struct kafkatools_metrics_snapshot_t
+{
+    int64_t counters[KT_COUNTER_MAX];
+    kt_histogram_snapshot_t histograms[KT_HISTOGRAM_MAX];
+} kt_metrics_snapshot_t;
+
+extern int kafkatools_metrics_create (kt_metrics *outmetrics);
+
+extern void kafkatools_metrics_destroy (kt_metrics metrics);
+
+/* both do nothing if metrics is NULL */
+extern void kafkatools_metrics_count (kt_metrics metrics, int counter, int64_t n);
+
+extern void kafkatools_metrics_record (kt_metrics metrics, int histogram, int64_t value);
+
+/* reset after snapshot if `reset` is not 0, values recorded meanwhile may be lost */
+extern void kafkatools_metrics_snapshot (kt_metrics metrics, kt_metrics_snapshot_t *snapshot, int reset);
+
+extern const char * kafkatools_metrics_counter_name (int counter);
+
+extern const char * kafkatools_metrics_histogram_name (int histogram);
+
+/* metrics of producer created with property "kafkatools.metrics = true", or NULL */
+extern kt_metrics kafkatools_producer_get_metrics (kt_producer producer);
+
+/* spool of producer created with property "kafkatools.spool.dir", or NULL */
+extern kt_spool kafkatools_producer_get_spool (kt_producer producer);
+
+/* internal threads of producer, 0 if no kafkatools.affinity.* property */
+extern int kafkatools_producer_get_threads (kt_producer producer, kt_thread_cpu_t *threads, int maxthreads);
+
 
 /**
  * kafka consumer api
  */
 typedef int(* kt_tplist_cb)(rd_kafka_topic_partition_t *, void *);
 
+/**
+ * called with messages of one partition in offset order. messages are
+ *  destroyed after it returns. returns KAFKATOOLS_SUCCESS to continue,
+ *  other to stop kafkatools_consumer_run().
+ */
+typedef int (* kt_consume_batch_cb) (kt_consumer consumer, int worker, rd_kafka_message_t **rkmessages, int count, void *arg);
+
 extern int kafkatools_consumer_create (const char *groupid, const char *brokers, int tplist_size, const char * names[], const char * values[], const char * topics[], void * opaque, kt_consumer *outConsumer);
 
 extern void kafkatools_consumer_destroy (kt_consumer consumer);
@@ -236,10 +840,161 @@ extern kt_topic kafkatools_consumer_get_topic (kt_consumer consumer, const char
 
 extern rd_kafka_topic_partition_list_t * kafkatools_consumer_get_topics (kt_consumer consumer);
 
+/**
+ * called by builtin rebalance handler of subscribed consumer.
+ *   assign - partitions with their committed offsets (RD_KAFKA_OFFSET_INVALID
+ *            if none) before fetching starts, so state of partitions may be
+ *            warmed up. offsets may be changed to start elsewhere.
+ *   revoke - after all batches in flight are processed and done offsets are
+ *            committed synchronously, so state may be handed over.
+ */
+typedef void (* kt_rebalance_cb) (kt_consumer consumer, int assign, rd_kafka_topic_partition_list_t *partitions, void *arg);
+
+/**
+ * subscribe to topics of consumer as member of group. partitions of topics
+ *  are assigned by group and kafkatools_consumer_run() consumes them from
+ *  the group queue, serving rebalances between batches.
+ */
 extern int kafkatools_consumer_start_subscribe (kt_consumer consumer);
 
+extern void kafkatools_consumer_set_rebalance_cb (kt_consumer consumer, kt_rebalance_cb rebalancecb, void *arg);
+
+/**
+ * consume all partitions in topics of consumer with rd_kafka_consume_batch_queue()
+ *  until kafkatools_consumer_stop() is called or batchcb returns not success.
+ *
+ *   `workers`    - threads batches dispatched to by partition. 0 for calling thread.
+ *   `batch_size` - max messages consumed at once (0 for default: 1000)
+ *   `timeout_ms` - max wait for messages (0 for default: 100)
+ *
+ * offset of entry in kafkatools_consumer_get_topics() is start offset of
+ *  partition, RD_KAFKA_OFFSET_STORED if not set.
+ *
+ * kafkatools_consumer_stop() called before run makes it return at once.
+ *  stop is cleared when run returns, so consumer can be run again.
+ */
+extern int kafkatools_consumer_run (kt_consumer consumer, int workers, int batch_size, int timeout_ms, kt_consume_batch_cb batchcb, void *arg);
+
+extern void kafkatools_consumer_stop (kt_consumer consumer);
+
+/**
+ * consumer reactor api (Linux only)
+ *   one thread serves many consumers without spinning: it sleeps in
+ *   epoll_wait() until queue of any consumer has events, then drains ready
+ *   queues in batches and calls batchcb of consumer on the reactor thread
+ *   (worker is 0). commits and flow control are served as in run.
+ *
+ *   `batch_size` - max messages consumed from one queue at once (0 for default: 1000)
+ */
+extern int kafkatools_reactor_create (int batch_size, kt_reactor *outreactor);
+
+/* consumers still in reactor are removed */
+extern void kafkatools_reactor_destroy (kt_reactor reactor);
+
+/**
+ * start consuming partitions in topics of consumer, or group queue if it is
+ *  subscribed. consumer must not be in kafkatools_consumer_run(). reactor
+ *  removes consumer if batchcb returns not success, consume fails or
+ *  kafkatools_consumer_stop() is called on it, also before add. stop is
+ *  cleared when consumer is removed.
+ *
+ * add and remove may be called from any thread but not from batchcb.
+ */
+extern int kafkatools_reactor_add (kt_reactor reactor, kt_consumer consumer, kt_consume_batch_cb batchcb, void *arg);
+
+/* stop consuming and final commit, KAFKATOOLS_EARG if consumer not in reactor */
+extern int kafkatools_reactor_remove (kt_reactor reactor, kt_consumer consumer);
+
+/**
+ * serve consumers until kafkatools_reactor_stop() is called, which may be
+ *  before run too. stop is cleared when run returns.
+ */
+extern int kafkatools_reactor_run (kt_reactor reactor);
+
+extern void kafkatools_reactor_stop (kt_reactor reactor);
+
+/**
+ * attach offset commit manager to consumer. kafkatools_consumer_run() tracks
+ *  offsets of all messages dispatched and commits the contiguous done offsets
+ *  of every partition asynchronously every interval_ms (0 for default: 5000)
+ *  or max_pending done messages (0 for default: 10000), and synchronously
+ *  when run ends. offsets of a failed commit are committed again later.
+ *
+ * if manual_done is 0, messages of a batch are done when kt_consume_batch_cb
+ *  returns success, otherwise application calls kafkatools_consumer_offset_done()
+ *  for each message in any order from any thread.
+ *
+ * set "enable.auto.commit" and "enable.auto.offset.store" to "false" for
+ *  at-least-once delivery.
+ */
+extern int kafkatools_consumer_enable_commit (kt_consumer consumer, int interval_ms, int max_pending, int manual_done);
+
+extern int kafkatools_consumer_offset_done (kt_consumer consumer, const char *topic, int32_t partition, int64_t offset);
+
+/* commit done offsets now */
+extern int kafkatools_consumer_commit (kt_consumer consumer, int async);
+
+/**
+ * attach flow control to consumer. kafkatools_consumer_run() pauses a
+ *  partition when bytes of its messages dispatched and not yet processed
+ *  exceed partition_bytes (0 for fair share: budget_bytes / partitions),
+ *  and all partitions when total exceeds budget_bytes. they are resumed
+ *  after draining below half. prefetched messages of a paused partition
+ *  are dropped by librdkafka, so memory is bounded by budget and fetches
+ *  of running partitions. budget may be exceeded by consume batches read
+ *  before a pause takes effect.
+ */
+extern int kafkatools_consumer_enable_flowctl (kt_consumer consumer, size_t budget_bytes, size_t partition_bytes);
+
+/* current outstanding bytes and paused partitions */
+extern int kafkatools_consumer_get_flowctl (kt_consumer consumer, size_t *outstanding, int *paused);
+
+/* record consumed messages and their lag in kafkatools_consumer_run() */
+extern int kafkatools_consumer_enable_metrics (kt_consumer consumer);
+
+/* returns NULL unless metrics enabled */
+extern kt_metrics kafkatools_consumer_get_metrics (kt_consumer consumer);
+
+/* internal threads of consumer, 0 if no kafkatools.affinity.* property */
+extern int kafkatools_consumer_get_threads (kt_consumer consumer, kt_thread_cpu_t *threads, int maxthreads);
+
 extern void kafkatools_list_topic_partitions (rd_kafka_topic_partition_list_t *partitions, kt_tplist_cb tpcb, void *cbarg);
 
+
+/**
+ * kafka consumer lag monitor api
+ *   a monitor thread refreshes lag of partitions of consumer every
+ *   interval_ms (0 for default: 1000) from cached high watermarks and one
+ *   batched ListOffsets for partitions not cached. snapshot never blocks.
+ *
+ * monitor must be destroyed before its consumer.
+ */
+typedef struct kafkatools_partition_lag_t
+{
+    /* name lives as long as consumer */
+    const char *topic;
+    int32_t partition;
+
+    /* next offset to consume, -1 if unknown */
+    int64_t position;
+
+    /* high watermark, -1 if unknown */
+    int64_t highwater;
+
+    /* highwater - position, -1 if unknown */
+    int64_t lag;
+} kt_partition_lag_t;
+
+extern int kafkatools_lagmon_create (kt_consumer consumer, int interval_ms, kt_lagmon *outmon);
+
+extern void kafkatools_lagmon_destroy (kt_lagmon mon);
+
+/**
+ * copy lags of at most maxlags partitions from last refresh. lags may be
+ *  NULL for totallag only. returns count of partitions, -1 if not ready.
+ */
+extern int kafkatools_lagmon_snapshot (kt_lagmon mon, kt_partition_lag_t *lags, int maxlags, int64_t *totallag, sb8 *updated_ms);
+
 #if defined(__cplusplus)
 }
 #endif
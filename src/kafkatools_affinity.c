@@ -0,0 +1,344 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_affinity.c
+ *  cpu affinity of librdkafka internal threads.
+ *
+ *  An on_new interceptor adds on_thread_start/on_thread_exit interceptors
+ *   to each client instance, so main, broker and background threads bind
+ *   themselves to the configured cpus as they start, and are recorded for
+ *   kafkatools_affinity_threads() until they exit.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/thread_affinity.h>
+
+static const char THIS_FILE[] = "kafkatools_affinity.c";
+
+#define KT_AFFINITY_TYPES        3
+#define KT_AFFINITY_PREFIX       "kafkatools.affinity."
+#define KT_AFFINITY_THREADS_INIT 8
+
+
+typedef struct
+{
+    int numcpus;
+    int *cpus;
+} kt_affinity_cpus_t;
+
+
+typedef struct kafkatools_affinity_t
+{
+    /* by rd_kafka_thread_type_t */
+    kt_affinity_cpus_t bind[KT_AFFINITY_TYPES];
+
+    /* threads started and not exited */
+    pthread_mutex_t lock;
+    int numthreads;
+    int capacity;
+    kt_thread_cpu_t *threads;
+} kafkatools_affinity_t;
+
+
+static const char * kt_affinity_types[KT_AFFINITY_TYPES] = {
+    "main",          /* RD_KAFKA_THREAD_MAIN */
+    "background",    /* RD_KAFKA_THREAD_BACKGROUND */
+    "broker"         /* RD_KAFKA_THREAD_BROKER */
+};
+
+
+/**
+ * cpus of NUMA nodes in node list: "0" or "0-1".
+ *  returns count of cpus or -1 if bad node list.
+ */
+static int kt_affinity_numa_cpus (const char *nodelist, int *cpus, int maxcpus)
+{
+    int i, num = 0;
+    int nodes[64];
+
+    int numnodes = cpulist_parse(nodelist, nodes, 64);
+    if (numnodes <= 0) {
+        return (-1);
+    }
+
+    for (i = 0; i < numnodes; i++) {
+        int n;
+        FILE *fp;
+        char path[64];
+        char cpulist[1024];
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+
+        fp = fopen(path, "r");
+        if (! fp) {
+            printf("(%s:%d) ERROR - no NUMA node: %d\n", THIS_FILE, __LINE__, nodes[i]);
+            return (-1);
+        }
+
+        if (! fgets(cpulist, sizeof(cpulist), fp)) {
+            cpulist[0] = 0;
+        }
+        fclose(fp);
+
+        n = cpulist_parse(cpulist, cpus + num, maxcpus - num);
+        if (n < 0) {
+            return (-1);
+        }
+        num += n;
+    }
+
+    return num;
+}
+
+
+static rd_kafka_resp_err_t kt_affinity_on_thread_start (rd_kafka_t *rk, rd_kafka_thread_type_t thread_type, const char *thread_name, void *ic_opaque)
+{
+    kt_affinity aff = (kt_affinity) ic_opaque;
+
+    kt_thread_cpu_t *thr;
+
+    int pinned = 0;
+
+    if ((int) thread_type < KT_AFFINITY_TYPES && aff->bind[thread_type].numcpus > 0) {
+        pinned = (thread_set_affinity(aff->bind[thread_type].cpus, aff->bind[thread_type].numcpus) == 0);
+    }
+
+    pthread_mutex_lock(&aff->lock);
+
+    if (aff->numthreads == aff->capacity) {
+        aff->capacity = aff->capacity? aff->capacity * 2 : KT_AFFINITY_THREADS_INIT;
+        aff->threads = (kt_thread_cpu_t *) mem_realloc(aff->threads, sizeof(kt_thread_cpu_t) * aff->capacity);
+    }
+
+    thr = &aff->threads[aff->numthreads++];
+
+    thr->type = (int) thread_type;
+    thr->tid = (int) getthreadid();
+    thr->pinned = pinned;
+    thr->cpu = thread_get_cpu();
+
+    snprintf(thr->name, sizeof(thr->name), "%s", thread_name);
+
+    pthread_mutex_unlock(&aff->lock);
+
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+static rd_kafka_resp_err_t kt_affinity_on_thread_exit (rd_kafka_t *rk, rd_kafka_thread_type_t thread_type, const char *thread_name, void *ic_opaque)
+{
+    kt_affinity aff = (kt_affinity) ic_opaque;
+
+    int i, tid = (int) getthreadid();
+
+    pthread_mutex_lock(&aff->lock);
+
+    for (i = 0; i < aff->numthreads; i++) {
+        if (aff->threads[i].tid == tid) {
+            aff->threads[i] = aff->threads[--aff->numthreads];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&aff->lock);
+
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+static rd_kafka_resp_err_t kt_affinity_on_new (rd_kafka_t *rk, const rd_kafka_conf_t *conf, void *ic_opaque, char *errstr, size_t errstr_size)
+{
+    rd_kafka_interceptor_add_on_thread_start(rk, "kafkatools.affinity", kt_affinity_on_thread_start, ic_opaque);
+    rd_kafka_interceptor_add_on_thread_exit(rk, "kafkatools.affinity", kt_affinity_on_thread_exit, ic_opaque);
+
+    return RD_KAFKA_RESP_ERR_NO_ERROR;
+}
+
+
+int kafkatools_affinity_create (kt_affinity *outaff)
+{
+    kt_affinity aff = (kt_affinity) mem_alloc_zero(1, sizeof(*aff));
+
+    pthread_mutex_init(&aff->lock, NULL);
+
+    *outaff = aff;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_affinity_destroy (kt_affinity aff)
+{
+    if (aff) {
+        int i;
+
+        for (i = 0; i < KT_AFFINITY_TYPES; i++) {
+            mem_free(aff->bind[i].cpus);
+        }
+
+        pthread_mutex_destroy(&aff->lock);
+
+        mem_free(aff->threads);
+        mem_free(aff);
+    }
+}
+
+
+int kafkatools_affinity_set (kt_affinity aff, const char *name, const char *value)
+{
+    int i, numcpus;
+    int cpus[THREAD_AFFINITY_CPUS_MAX];
+
+    const char *type;
+    size_t typelen;
+
+    if (strncmp(name, KT_AFFINITY_PREFIX, sizeof(KT_AFFINITY_PREFIX) - 1)) {
+        return KAFKATOOLS_ECONF;
+    }
+
+    /* "$type.cpus" */
+    type = name + sizeof(KT_AFFINITY_PREFIX) - 1;
+    typelen = strlen(type);
+
+    if (typelen <= 5 || strcmp(type + typelen - 5, ".cpus")) {
+        return KAFKATOOLS_ECONF;
+    }
+    typelen -= 5;
+
+    for (i = 0; i < KT_AFFINITY_TYPES; i++) {
+        if (strlen(kt_affinity_types[i]) == typelen && ! strncmp(type, kt_affinity_types[i], typelen)) {
+            break;
+        }
+    }
+
+    if (i == KT_AFFINITY_TYPES) {
+        return KAFKATOOLS_ECONF;
+    }
+
+    if (! strncmp(value, "node:", 5)) {
+        numcpus = kt_affinity_numa_cpus(value + 5, cpus, THREAD_AFFINITY_CPUS_MAX);
+    } else {
+        numcpus = cpulist_parse(value, cpus, THREAD_AFFINITY_CPUS_MAX);
+    }
+
+    if (numcpus < 0) {
+        return KAFKATOOLS_ECONF;
+    }
+
+    mem_free_s((void **) &aff->bind[i].cpus);
+    aff->bind[i].numcpus = numcpus;
+
+    if (numcpus) {
+        aff->bind[i].cpus = (int *) mem_alloc_unset(sizeof(int) * numcpus);
+        memcpy(aff->bind[i].cpus, cpus, sizeof(int) * numcpus);
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_affinity_conf (kt_affinity aff, rd_kafka_conf_t *conf)
+{
+    if (rd_kafka_conf_interceptor_add_on_new(conf, "kafkatools.affinity", kt_affinity_on_new, (void *) aff) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf("(%s:%d) ERROR - rd_kafka_conf_interceptor_add_on_new failed.\n", THIS_FILE, __LINE__);
+        return KAFKATOOLS_ERROR;
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+/**
+ * cpu a thread ran on last: field 39 of /proc/self/task/$tid/stat.
+ *  returns -1 if unknown.
+ */
+static int kt_affinity_last_cpu (int tid)
+{
+    int cpu = -1;
+
+#if defined(__linux__)
+    FILE *fp;
+    char path[64];
+    char stat[1024];
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+
+    fp = fopen(path, "r");
+    if (fp) {
+        if (fgets(stat, sizeof(stat), fp)) {
+            /* comm in field 2 may contain spaces: count from its ')' */
+            char *p = strrchr(stat, ')');
+            int field = 2;
+
+            while (p && *p && field < 39) {
+                if (*p++ == ' ') {
+                    field++;
+                }
+            }
+
+            if (p && field == 39) {
+                cpu = atoi(p);
+            }
+        }
+
+        fclose(fp);
+    }
+#endif
+
+    return cpu;
+}
+
+
+int kafkatools_affinity_threads (kt_affinity aff, kt_thread_cpu_t *threads, int maxthreads)
+{
+    int i, num;
+
+    pthread_mutex_lock(&aff->lock);
+
+    num = (aff->numthreads < maxthreads? aff->numthreads : maxthreads);
+
+    for (i = 0; i < num; i++) {
+        threads[i] = aff->threads[i];
+    }
+
+    pthread_mutex_unlock(&aff->lock);
+
+    for (i = 0; i < num; i++) {
+        int cpu = kt_affinity_last_cpu(threads[i].tid);
+
+        if (cpu != -1) {
+            threads[i].cpu = cpu;
+        }
+    }
+
+    return num;
+}
@@ -0,0 +1,481 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_coalesce.c
+ *  last-write-wins coalescing of keyed messages in front of producer.
+ *
+ *  Within a window only the newest message of each (partition, key) is
+ *   kept. When the window elapses or maxkeys distinct keys are pending,
+ *   survivors are handed to librdkafka with kafkatools_produce_batch(),
+ *   one batch per partition, in order of first appearance of their keys.
+ *
+ *  Two generations of the key map are kept: kafkatools_coalesce_put()
+ *   writes to the active one while a flush produces the other, so puts
+ *   only wait for the swap and not for kafka.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.2
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/uatomic.h>
+#include <common/keyhash.h>
+
+static const char THIS_FILE[] = "kafkatools_coalesce.c";
+
+
+#define KT_COALESCE_KEYS_DEFAULT    65536
+#define KT_COALESCE_WINDOW_DEFAULT  100
+
+
+typedef struct
+{
+    uint32_t hash;
+    int32_t partition;
+
+    int keylen;
+    int msglen;
+
+    /* NULL payload, tombstone of compacted topic */
+    int nullmsg;
+
+    void * _private;
+
+    /* slab block: key followed by payload */
+    char *buf;
+} kt_coalesce_entry_t;
+
+
+typedef struct
+{
+    /* entries in order of first put */
+    int count;
+    kt_coalesce_entry_t *entries;
+
+    /* open addressing with linear probing: index + 1 of entry, 0 if empty */
+    uint32_t mask;
+    int *slots;
+} kt_coalesce_gen_t;
+
+
+typedef struct kafkatools_coalesce_t
+{
+    kt_producer producer;
+    kafkatools_msg_site_t site;
+
+    int window_ms;
+    int maxkeys;
+
+    /* guards active generation */
+    pthread_mutex_t lock;
+    kt_coalesce_gen_t *active;
+    sb8 firstus;
+
+    /* one flush at a time: owns the other generation */
+    pthread_mutex_t flushlock;
+
+    uatomic_int stopping;
+
+    pthread_mutex_t waitlock;
+    pthread_cond_t cond;
+    pthread_t window_thread;
+
+    /* flush work area */
+    kafkatools_msg_data_t *msgs;
+    kafkatools_msg_data_t *sorted;
+    int *counts;
+
+    uatomic_int64 puts;
+    uatomic_int64 produced;
+    uatomic_int64 failed;
+
+    kt_coalesce_gen_t gens[2];
+} kafkatools_coalesce_t;
+
+
+static void kt_coalesce_gen_init (kt_coalesce_gen_t *gen, int maxkeys)
+{
+    uint32_t cap = 16;
+
+    /* load factor no more than 1/2 */
+    while (cap < (uint32_t) maxkeys * 2) {
+        cap <<= 1;
+    }
+
+    gen->count = 0;
+    gen->entries = (kt_coalesce_entry_t *) mem_alloc_zero(maxkeys, sizeof(kt_coalesce_entry_t));
+
+    gen->mask = cap - 1;
+    gen->slots = (int *) mem_alloc_zero(cap, sizeof(int));
+}
+
+
+static void kt_coalesce_gen_clear (kt_coalesce_gen_t *gen)
+{
+    int i;
+
+    for (i = 0; i < gen->count; i++) {
+        kafkatools_slab_free(gen->entries[i].buf);
+        gen->entries[i].buf = NULL;
+    }
+
+    if (gen->count) {
+        bzero(gen->slots, sizeof(int) * (gen->mask + 1));
+        gen->count = 0;
+    }
+}
+
+
+static void kt_coalesce_gen_uninit (kt_coalesce_gen_t *gen)
+{
+    kt_coalesce_gen_clear(gen);
+
+    mem_free(gen->slots);
+    mem_free(gen->entries);
+}
+
+
+/**
+ * produces survivors of gen grouped by partition (counting sort over
+ *  site's partitionid scope, bucket 0 for RD_KAFKA_PARTITION_UA).
+ */
+static void kt_coalesce_produce (kt_coalesce coalesce, kt_coalesce_gen_t *gen)
+{
+    int i, k, start, ret;
+    int nbuckets = coalesce->site.partitionid_max - coalesce->site.partitionid_min + 2;
+
+    kafkatools_msg_site_t site = coalesce->site;
+
+    bzero(coalesce->counts, sizeof(int) * (nbuckets + 1));
+
+    for (i = 0; i < gen->count; i++) {
+        kt_coalesce_entry_t *entry = &gen->entries[i];
+        kafkatools_msg_data_t *msg = &coalesce->msgs[i];
+
+        msg->key = entry->buf;
+        msg->keylen = entry->keylen;
+        msg->msgbuf = entry->nullmsg? NULL : entry->buf + entry->keylen;
+        msg->msglen = entry->msglen;
+        msg->_private = entry->_private;
+
+        k = (entry->partition == RD_KAFKA_PARTITION_UA)? 0 : (entry->partition - coalesce->site.partitionid_min + 1);
+        coalesce->counts[k + 1]++;
+    }
+
+    for (k = 1; k <= nbuckets; k++) {
+        coalesce->counts[k] += coalesce->counts[k - 1];
+    }
+
+    for (i = 0; i < gen->count; i++) {
+        int32_t partition = gen->entries[i].partition;
+
+        k = (partition == RD_KAFKA_PARTITION_UA)? 0 : (partition - coalesce->site.partitionid_min + 1);
+        coalesce->sorted[coalesce->counts[k]++] = coalesce->msgs[i];
+    }
+
+    start = 0;
+    for (k = 0; k < nbuckets; k++) {
+        if (coalesce->counts[k] > start) {
+            site.partition = (k == 0)? RD_KAFKA_PARTITION_UA : (coalesce->site.partitionid_min + k - 1);
+
+            /* payloads are copied, entries are freed after */
+            ret = kafkatools_produce_batch(coalesce->producer, &site, coalesce->sorted + start, coalesce->counts[k] - start,
+                    KAFKATOOLS_MSGF_COPY, NULL, NULL, 100, KAFKATOOLS_WAIT_INFINITE);
+
+            uatomic_int64_add(&coalesce->produced, ret);
+            uatomic_int64_add(&coalesce->failed, coalesce->counts[k] - start - ret);
+
+            start = coalesce->counts[k];
+        }
+    }
+}
+
+
+static int kt_coalesce_flush (kt_coalesce coalesce, int due_only)
+{
+    int count;
+    kt_coalesce_gen_t *gen;
+
+    pthread_mutex_lock(&coalesce->flushlock);
+
+    pthread_mutex_lock(&coalesce->lock);
+
+    gen = coalesce->active;
+    count = gen->count;
+
+    if (! count || (due_only && monotonic_usec() - coalesce->firstus < (sb8) coalesce->window_ms * 1000)) {
+        pthread_mutex_unlock(&coalesce->lock);
+        pthread_mutex_unlock(&coalesce->flushlock);
+        return 0;
+    }
+
+    /* other generation was cleared by last flush */
+    coalesce->active = (gen == &coalesce->gens[0])? &coalesce->gens[1] : &coalesce->gens[0];
+
+    pthread_mutex_unlock(&coalesce->lock);
+
+    kt_coalesce_produce(coalesce, gen);
+    kt_coalesce_gen_clear(gen);
+
+    pthread_mutex_unlock(&coalesce->flushlock);
+
+    return count;
+}
+
+
+static void * kt_coalesce_window_thread (void *arg)
+{
+    kt_coalesce coalesce = (kt_coalesce) arg;
+
+    int wait_ms = (coalesce->window_ms > 1? coalesce->window_ms / 2 : 1);
+
+    while (! coalesce->stopping) {
+        struct timespec abstime;
+
+        pthread_mutex_lock(&coalesce->waitlock);
+        if (! coalesce->stopping) {
+            getfuturetimeofday(&abstime, wait_ms);
+            pthread_cond_timedwait(&coalesce->cond, &coalesce->waitlock, &abstime);
+        }
+        pthread_mutex_unlock(&coalesce->waitlock);
+
+        kt_coalesce_flush(coalesce, 1);
+
+        kafkatools_producer_poll(coalesce->producer, 0);
+    }
+
+    return NULL;
+}
+
+
+int kafkatools_coalesce_create (kt_producer producer, const kafkatools_msg_site_t *ktsite, int window_ms, int maxkeys, kt_coalesce *outcoalesce)
+{
+    int nbuckets;
+
+    kafkatools_coalesce_t *coalesce;
+
+    if (! producer || ! ktsite || ! ktsite->topic ||
+        ktsite->partitionid_min < 0 || ktsite->partitionid_max < ktsite->partitionid_min) {
+        return KAFKATOOLS_EARG;
+    }
+
+    if (kafkatools_producer_completion_fd(producer) != -1) {
+        /* window thread can not wait for queue space freed by reaping */
+        printf("(%s:%d) ERROR - coalesce not supported with kafkatools.completion\n", THIS_FILE, __LINE__);
+        return KAFKATOOLS_EARG;
+    }
+
+    if (window_ms == 0) {
+        window_ms = KT_COALESCE_WINDOW_DEFAULT;
+    }
+    if (maxkeys == 0) {
+        maxkeys = KT_COALESCE_KEYS_DEFAULT;
+    }
+
+    if (window_ms < 0 || maxkeys < 0 || maxkeys > (INT_MAX >> 2)) {
+        printf("(%s:%d) ERROR - invalid coalesce window_ms: %d or maxkeys: %d\n", THIS_FILE, __LINE__, window_ms, maxkeys);
+        return KAFKATOOLS_EARG;
+    }
+
+    nbuckets = ktsite->partitionid_max - ktsite->partitionid_min + 2;
+
+    coalesce = (kafkatools_coalesce_t *) mem_alloc_zero(1, sizeof(*coalesce));
+
+    coalesce->producer = producer;
+    coalesce->site = *ktsite;
+    coalesce->window_ms = window_ms;
+    coalesce->maxkeys = maxkeys;
+
+    kt_coalesce_gen_init(&coalesce->gens[0], maxkeys);
+    kt_coalesce_gen_init(&coalesce->gens[1], maxkeys);
+    coalesce->active = &coalesce->gens[0];
+
+    coalesce->msgs = (kafkatools_msg_data_t *) mem_alloc_zero(maxkeys, sizeof(kafkatools_msg_data_t));
+    coalesce->sorted = (kafkatools_msg_data_t *) mem_alloc_zero(maxkeys, sizeof(kafkatools_msg_data_t));
+    coalesce->counts = (int *) mem_alloc_zero(nbuckets + 1, sizeof(int));
+
+    pthread_mutex_init(&coalesce->lock, NULL);
+    pthread_mutex_init(&coalesce->flushlock, NULL);
+    pthread_mutex_init(&coalesce->waitlock, NULL);
+
+    if (pthread_cond_init(&coalesce->cond, NULL) != 0) {
+        goto on_error_result;
+    }
+
+    if (pthread_create(&coalesce->window_thread, NULL, kt_coalesce_window_thread, (void *) coalesce) != 0) {
+        pthread_cond_destroy(&coalesce->cond);
+        goto on_error_result;
+    }
+
+    *outcoalesce = coalesce;
+    return KAFKATOOLS_SUCCESS;
+
+on_error_result:
+    pthread_mutex_destroy(&coalesce->waitlock);
+    pthread_mutex_destroy(&coalesce->flushlock);
+    pthread_mutex_destroy(&coalesce->lock);
+
+    mem_free(coalesce->counts);
+    mem_free(coalesce->sorted);
+    mem_free(coalesce->msgs);
+    kt_coalesce_gen_uninit(&coalesce->gens[1]);
+    kt_coalesce_gen_uninit(&coalesce->gens[0]);
+    mem_free(coalesce);
+
+    return KAFKATOOLS_EFATAL;
+}
+
+
+void kafkatools_coalesce_destroy (kt_coalesce coalesce)
+{
+    if (coalesce) {
+        uatomic_int_set(&coalesce->stopping, 1);
+
+        pthread_mutex_lock(&coalesce->waitlock);
+        pthread_cond_signal(&coalesce->cond);
+        pthread_mutex_unlock(&coalesce->waitlock);
+
+        pthread_join(coalesce->window_thread, NULL);
+
+        /* survivors are produced before destroy returns */
+        kt_coalesce_flush(coalesce, 0);
+
+        pthread_cond_destroy(&coalesce->cond);
+        pthread_mutex_destroy(&coalesce->waitlock);
+        pthread_mutex_destroy(&coalesce->flushlock);
+        pthread_mutex_destroy(&coalesce->lock);
+
+        mem_free(coalesce->counts);
+        mem_free(coalesce->sorted);
+        mem_free(coalesce->msgs);
+        kt_coalesce_gen_uninit(&coalesce->gens[1]);
+        kt_coalesce_gen_uninit(&coalesce->gens[0]);
+        mem_free(coalesce);
+    }
+}
+
+
+int kafkatools_coalesce_put (kt_coalesce coalesce, int32_t partition, const kafkatools_msg_data_t *ktmsg)
+{
+    uint32_t hash, i;
+    char *buf;
+
+    kt_coalesce_gen_t *gen;
+    kt_coalesce_entry_t *entry;
+
+    if (! ktmsg->key || ktmsg->keylen < 0 || ktmsg->keylen > INT_MAX ||
+        ktmsg->msglen < 0 || ktmsg->msglen > INT_MAX || (ktmsg->msglen && ! ktmsg->msgbuf)) {
+        return KAFKATOOLS_EARG;
+    }
+
+    if (partition != RD_KAFKA_PARTITION_UA &&
+        (partition < coalesce->site.partitionid_min || partition > coalesce->site.partitionid_max)) {
+        return KAFKATOOLS_EARG;
+    }
+
+    hash = keyhash_xxh32(ktmsg->key, (size_t) ktmsg->keylen) ^ ((uint32_t) partition * 0x9E3779B1U);
+
+    /* copy outside of lock */
+    buf = (char *) kafkatools_slab_alloc((size_t) (ktmsg->keylen + ktmsg->msglen) + 1);
+
+    memcpy(buf, ktmsg->key, ktmsg->keylen);
+    if (ktmsg->msglen) {
+        memcpy(buf + ktmsg->keylen, ktmsg->msgbuf, ktmsg->msglen);
+    }
+
+    uatomic_int64_add(&coalesce->puts, 1);
+
+    pthread_mutex_lock(&coalesce->lock);
+
+    for (;;) {
+        gen = coalesce->active;
+
+        for (i = hash & gen->mask; gen->slots[i]; i = (i + 1) & gen->mask) {
+            entry = &gen->entries[gen->slots[i] - 1];
+
+            if (entry->hash == hash && entry->partition == partition && entry->keylen == (int) ktmsg->keylen &&
+                ! memcmp(entry->buf, ktmsg->key, ktmsg->keylen)) {
+                /* newer message replaces older one in place */
+                kafkatools_slab_free(entry->buf);
+                goto set_entry;
+            }
+        }
+
+        if (gen->count < coalesce->maxkeys) {
+            break;
+        }
+
+        /* map is full: flush it before the window elapses */
+        pthread_mutex_unlock(&coalesce->lock);
+        kt_coalesce_flush(coalesce, 0);
+        pthread_mutex_lock(&coalesce->lock);
+    }
+
+    if (! gen->count) {
+        coalesce->firstus = monotonic_usec();
+    }
+
+    entry = &gen->entries[gen->count++];
+    gen->slots[i] = gen->count;
+
+    entry->hash = hash;
+    entry->partition = partition;
+    entry->keylen = (int) ktmsg->keylen;
+
+set_entry:
+    entry->msglen = (int) ktmsg->msglen;
+    entry->nullmsg = (ktmsg->msgbuf == NULL);
+    entry->_private = ktmsg->_private;
+    entry->buf = buf;
+
+    pthread_mutex_unlock(&coalesce->lock);
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_coalesce_flush (kt_coalesce coalesce)
+{
+    return kt_coalesce_flush(coalesce, 0);
+}
+
+
+void kafkatools_coalesce_stats (kt_coalesce coalesce, int64_t *puts, int64_t *produced, int64_t *failed)
+{
+    if (puts) {
+        *puts = uatomic_int64_get(&coalesce->puts);
+    }
+    if (produced) {
+        *produced = uatomic_int64_get(&coalesce->produced);
+    }
+    if (failed) {
+        *failed = uatomic_int64_get(&coalesce->failed);
+    }
+}
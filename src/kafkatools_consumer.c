@@ -28,27 +28,162 @@
  *  kafka consumer api both for Windows and Linux.
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.11
+ * @version    0.0.21
  * @create     2017-12-20
- * @update     2020-05-20 11:32:50
+ * @update     2026-10-18 10:12:33
  */
 #include "kafkatools.h"
 
-#include <common/red_black_tree.h>
 #include <common/readconf.h>
 #include <common/memapi.h>
 #include <common/misc.h>
 #include <common/cstrbuf.h>
+#include <common/thread_rwlock.h>
+#include <common/strhashmap.h>
+#include <common/uatomic.h>
+
+#if defined(__linux__)
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
 
 
 static const char THIS_FILE[] = "kafkatools_consumer.c";
 
+#define KT_CONSUME_BATCH_SIZE      1000
+#define KT_CONSUME_TIMEOUT_MS      100
+#define KT_CONSUME_WORKER_QUEUE    64
+
+#define KT_COMMIT_INTERVAL_MS      5000
+#define KT_COMMIT_MAX_PENDING      10000
+#define KT_COMMIT_TRACK_INITSIZE   256
+
+#define KT_REBALANCE_TIMEOUT_MS    10000
+
+#define KT_REACTOR_EVENTS          64
+#define KT_REACTOR_DRAIN_BATCHES   4
+#define KT_REACTOR_TICK_MS         1000
+
 /**
  * API doc:
  *   https://docs.confluent.io/2.0.0/clients/librdkafka/rdkafka_8h.html
  *   https://github.com/edenhill/librdkafka/blob/master/src/rdkafka.h
  */
 
+/**
+ * Commit manager
+ *
+ * Offsets of messages handed to the application are tracked per partition
+ *  in order. Messages may be done in any order, and the commit position of
+ *  a partition is the offset after the last message in the contiguous done
+ *  prefix (low-water mark), so that no message is committed before all
+ *  messages ahead of it are done. Commits of all partitions are coalesced
+ *  into one async commit on interval_ms or every max_pending done messages.
+ *  Its result is served from commitq when polled: committed offsets advance
+ *  only on success, a failed commit is retried on next interval.
+ */
+typedef struct
+{
+    int64_t offset;
+    int done;
+} kt_offset_entry_t;
+
+
+typedef struct
+{
+    /* offset after last done message in order, -1 if none */
+    int64_t doneupto;
+    int64_t committed;
+
+    /* ring of tracked offsets, ascending */
+    int head;
+    int count;
+    int capacity;
+    kt_offset_entry_t *entries;
+} kt_offset_track_t;
+
+
+typedef struct
+{
+    const char *topic;
+
+    /* index by partition */
+    int numparts;
+    kt_offset_track_t **parts;
+} kt_offset_topic_t;
+
+
+typedef struct
+{
+    pthread_mutex_t lock;
+
+    int interval_ms;
+    int max_pending;
+    int manual_done;
+
+    /* done messages since last commit */
+    int pending;
+    sb8 lastcommit_ms;
+
+    /* results of async commits: kt_commit_manager_commit_cb */
+    rd_kafka_queue_t *commitq;
+
+    strhashmap_t topics;
+} kt_commit_manager_t;
+
+
+/**
+ * Flow control
+ *
+ * Bytes of messages dispatched by kafkatools_consumer_run() and not yet
+ *  processed are accounted per partition. A partition is paused when its
+ *  outstanding bytes exceed its share (partition_bytes, or budget divided
+ *  fairly among partitions), and every partition is paused when the total
+ *  exceeds the budget. Paused partitions are resumed once both have drained
+ *  below half, so one hot partition can not hold the budget of others.
+ *
+ * Pausing drops messages prefetched for the partition by librdkafka, which
+ *  are fetched again on resume from the offset after the last dispatched.
+ *  Only the run thread pauses and resumes, so that they are issued in order,
+ *  and a drained partition is resumed on its next poll within timeout_ms.
+ */
+typedef struct
+{
+    const char *topic;
+    int32_t partition;
+
+    int paused;
+    sb8 outstanding;
+} kt_flowctl_part_t;
+
+
+typedef struct
+{
+    /* index by partition */
+    int numparts;
+    kt_flowctl_part_t **parts;
+} kt_flowctl_topic_t;
+
+
+typedef struct
+{
+    pthread_mutex_t lock;
+
+    sb8 budget;
+    sb8 partition_bytes;
+
+    sb8 outstanding;
+    int numpaused;
+
+    strhashmap_t topics;
+
+    /* all partitions in order of registered */
+    int numparts;
+    int capacity;
+    kt_flowctl_part_t **parts;
+} kt_flowctl_t;
+
+
 typedef struct kafkatools_consumer_t
 {
     pthread_mutex_t  lock;
@@ -58,20 +193,104 @@ typedef struct kafkatools_consumer_t
 
     void * opaque;
 
-    red_black_tree_t  rktopic_tree;
+    /* read-mostly cache of topic handles by name */
+    ThreadRWLock_t rktopic_lock;
+    strhashmap_t rktopic_map;
 
     int errcode;
     char errstr[KAFKATOOLS_ERRSTR_SIZE];
 
     /* Topic+Partition container */
     rd_kafka_topic_partition_list_t * tp_list;
+
+    /* set by kafkatools_consumer_stop() to stop kafkatools_consumer_run() */
+    uatomic_int run_stopping;
+
+    /* optional offset commit manager */
+    kt_commit_manager_t *commitmgr;
+
+    /* optional flow control */
+    kt_flowctl_t *flowctl;
+
+    /* set by kafkatools_consumer_start_subscribe(): run consumes group queue */
+    int subscribed;
+
+    /* bumped by rebalance handler on each revoke */
+    int revokes;
+
+    /* hook of builtin rebalance handler */
+    kt_rebalance_cb rebalancecb;
+    void *rebalancearg;
+
+    /* engine of kafkatools_consumer_run(), NULL if not running */
+    struct kt_consume_runner_t *runner;
+
+    /* optional metrics */
+    kt_metrics metrics;
+
+    /* kafkatools.affinity.*: cpus of librdkafka threads */
+    kt_affinity affinity;
 } kafkatools_consumer_t;
 
 
-static int rktopic_name_cmp(void *newObject, void *nodeObject)
+/**
+ * Batch consume engine
+ *
+ * kafkatools_consumer_run() starts all partitions in tp_list on one queue and
+ *  reads it with rd_kafka_consume_batch_queue(). Messages of each batch are
+ *  grouped by partition, keeping their order, and every group is handed to
+ *  the worker which owns the partition: (hash(topic) + partition) % workers.
+ *  So messages of one partition are always processed in order by the same
+ *  worker thread.
+ */
+typedef struct
+{
+    /* accounted by flow control */
+    kt_flowctl_part_t *flowpart;
+    sb8 flowbytes;
+
+    int count;
+    rd_kafka_message_t *rkmessages[0];
+} kt_consume_batch_t;
+
+
+typedef struct kt_consume_runner_t  kt_consume_runner_t;
+
+typedef struct
 {
-    return strcmp(rd_kafka_topic_name((rd_kafka_topic_t *) newObject), rd_kafka_topic_name((rd_kafka_topic_t *) nodeObject));
-}
+    kt_consume_runner_t *runner;
+    int index;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+
+    int stopping;
+
+    /* ring of batches */
+    int head;
+    int count;
+    int capacity;
+    kt_consume_batch_t **batches;
+} kt_consume_worker_t;
+
+
+struct kt_consume_runner_t
+{
+    kt_consumer consumer;
+
+    kt_consume_batch_cb batchcb;
+    void *arg;
+
+    int numworkers;
+    kt_consume_worker_t *workers;
+
+    /* batches dispatched and not yet processed, waited on by rebalance */
+    pthread_mutex_t flushlock;
+    pthread_cond_t flushcond;
+    int inflight;
+};
 
 
 /*! Callback function prototype for traverse objects */
@@ -81,418 +300,2226 @@ static void rktopic_object_release(void *object, void *param)
 }
 
 
-int kafkatools_consumer_create (const char *groupid, const char *brokers, int tplist_size, const char * names[], const char * values[], const char * topics[], void * opaque, kt_consumer *outConsumer)
+static void kt_offset_topic_release (void *value, void *arg)
 {
-    int result;
+    int i;
 
-    char errstr[KAFKATOOLS_ERRSTR_SIZE];
+    kt_offset_topic_t *ot = (kt_offset_topic_t *) value;
 
-    rd_kafka_conf_res_t res;
+    for (i = 0; i < ot->numparts; i++) {
+        if (ot->parts[i]) {
+            mem_free(ot->parts[i]->entries);
+            mem_free(ot->parts[i]);
+        }
+    }
 
-    rd_kafka_conf_t * conf = 0;
-    rd_kafka_topic_conf_t * topic_conf = 0;
+    mem_free(ot->parts);
+    mem_free(ot);
+}
 
-    rd_kafka_t * rkConsumer = 0;
-    rd_kafka_topic_partition_list_t * tp_list = 0;
 
-    kafkatools_consumer_t * consumer = 0;
+static void kt_commit_manager_free (kt_commit_manager_t *mgr)
+{
+    if (mgr) {
+        rd_kafka_queue_destroy(mgr->commitq);
+        strhashmap_uninit(&mgr->topics, kt_offset_topic_release, NULL);
+        pthread_mutex_destroy(&mgr->lock);
+        mem_free(mgr);
+    }
+}
 
-    result = KAFKATOOLS_ENOMEM;
 
-    consumer = (kafkatools_consumer_t *) mem_alloc_zero(1, sizeof(*consumer));
-    if (! consumer) {
-        goto on_error_result;
+/* get track of partition, created if not exists. called with lock held */
+static kt_offset_track_t * kt_commit_manager_track_of (kt_commit_manager_t *mgr, const char *topic, int32_t partition, int create)
+{
+    kt_offset_track_t *track;
+
+    uint32_t hash = strhashmap_hash(topic);
+
+    kt_offset_topic_t *ot = (kt_offset_topic_t *) strhashmap_find(&mgr->topics, topic, hash);
+
+    if (! ot) {
+        if (! create) {
+            return NULL;
+        }
+
+        ot = (kt_offset_topic_t *) mem_alloc_zero(1, sizeof(*ot));
+
+        /* name of cached topic handle lives as long as consumer */
+        ot->topic = topic;
+        strhashmap_insert(&mgr->topics, ot->topic, hash, (void *) ot);
     }
 
-    /* success returns consumer object */
-    rbtree_init(&consumer->rktopic_tree, (rbtreenode_cmp_func *) rktopic_name_cmp);
+    if (partition >= ot->numparts) {
+        int numparts;
 
-    /* Use rd_kafka_topic_partition_list_destroy()
-     *  to free all resources in use by a list and the list itself.
-     *    tplist_size - Initial allocated size.
-     */
-    tp_list = rd_kafka_topic_partition_list_new(tplist_size);
-    if (! tp_list) {
-        goto on_error_result;
+        if (! create) {
+            return NULL;
+        }
+
+        numparts = partition + 1;
+        ot->parts = (kt_offset_track_t **) mem_realloc(ot->parts, sizeof(kt_offset_track_t *) * numparts);
+        bzero(ot->parts + ot->numparts, sizeof(kt_offset_track_t *) * (numparts - ot->numparts));
+        ot->numparts = numparts;
     }
 
-    if (topics) {
-        const char *tp;
+    track = ot->parts[partition];
 
-        int i = 0;
+    if (! track && create) {
+        track = (kt_offset_track_t *) mem_alloc_zero(1, sizeof(*track));
 
-        while ((i < KAFKATOOLS_TOPICS_MAX) && ((tp = topics[i]) != 0)) {
-            /**
-             * topicName:startPartitionid-endPartitionid
-             *
-             * topicA:1-2
-             * topicB:1
-             */
-            const char * id = strchr(tp, ':');
+        track->doneupto = -1;
+        track->committed = -1;
+        track->capacity = KT_COMMIT_TRACK_INITSIZE;
+        track->entries = (kt_offset_entry_t *) mem_alloc_unset(sizeof(kt_offset_entry_t) * track->capacity);
 
-            if (! id) {
-                rd_kafka_topic_partition_list_add(tp_list, tp, -1);
-            } else {
-                char topic[KAFKATOOLS_TOPIC_NAMELEN + 1];
-                const char * q = strchr(id, '-');
+        ot->parts[partition] = track;
+    }
 
-                if (id - tp > KAFKATOOLS_TOPIC_NAMELEN) {
-                    result = KAFKATOOLS_EARG;
-                    goto on_error_result;
-                }
+    return track;
+}
 
-                bcopy(tp, topic, id - tp);
-                topic[id - tp] = 0;
 
-                if (! q) {
-                    rd_kafka_topic_partition_list_add(tp_list, topic, atoi(id));
-                } else {
-                    int startid, stopid;
+/* track offsets of messages of one partition in order */
+static void kt_commit_manager_track (kt_commit_manager_t *mgr, const char *topic, rd_kafka_message_t **rkmessages, int count)
+{
+    int i;
 
-                    char p[11];
+    kt_offset_track_t *track;
 
-                    if (q - id >= sizeof(p)) {
-                        result = KAFKATOOLS_EARG;
-                        goto on_error_result;
-                    }
+    pthread_mutex_lock(&mgr->lock);
 
-                    bcopy(id, p, q - id);
-                    p[q++ - id] = 0;
+    track = kt_commit_manager_track_of(mgr, topic, rkmessages[0]->partition, 1);
 
-                    startid = atoi(p);
-                    stopid = atoi(q);
+    if (track->count + count > track->capacity) {
+        int n, capacity = track->capacity;
 
-                    if (startid < stopid) {
-                        rd_kafka_topic_partition_list_add_range(tp_list, topic, startid, stopid);
-                    } else {
-                        rd_kafka_topic_partition_list_add_range(tp_list, topic, stopid, startid);
-                    }
-                }
+        kt_offset_entry_t *entries;
+
+        while (capacity < track->count + count) {
+            capacity *= 2;
+        }
+
+        entries = (kt_offset_entry_t *) mem_alloc_unset(sizeof(kt_offset_entry_t) * capacity);
+
+        for (n = 0; n < track->count; n++) {
+            entries[n] = track->entries[(track->head + n) % track->capacity];
+        }
+
+        mem_free(track->entries);
+
+        track->entries = entries;
+        track->capacity = capacity;
+        track->head = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        kt_offset_entry_t *entry = &track->entries[(track->head + track->count++) % track->capacity];
+
+        entry->offset = rkmessages[i]->offset;
+        entry->done = 0;
+    }
+
+    pthread_mutex_unlock(&mgr->lock);
+}
+
+
+/* mark offset done and advance low-water mark. called with lock held */
+static int kt_commit_manager_done (kt_commit_manager_t *mgr, kt_offset_track_t *track, int64_t offset)
+{
+    int lo = 0, hi = track->count - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        kt_offset_entry_t *entry = &track->entries[(track->head + mid) % track->capacity];
+
+        if (entry->offset < offset) {
+            lo = mid + 1;
+        } else if (entry->offset > offset) {
+            hi = mid - 1;
+        } else {
+            if (! entry->done) {
+                entry->done = 1;
+                mgr->pending++;
+            }
+
+            while (track->count && track->entries[track->head].done) {
+                track->doneupto = track->entries[track->head].offset + 1;
+                track->head = (track->head + 1) % track->capacity;
+                track->count--;
+            }
+
+            return KAFKATOOLS_SUCCESS;
+        }
+    }
+
+    return KAFKATOOLS_EARG;
+}
+
+
+/* failed commit is retried by kt_commit_manager_poll on next interval. called with lock held */
+static void kt_commit_manager_retry (kt_commit_manager_t *mgr, int pending)
+{
+    mgr->pending += (pending > 0? pending : 1);
+}
+
+
+/* advance committed offsets of partitions in offsets which succeeded */
+static void kt_commit_manager_committed (kt_commit_manager_t *mgr, const rd_kafka_topic_partition_list_t *offsets)
+{
+    int i, failed = 0;
+
+    pthread_mutex_lock(&mgr->lock);
+
+    for (i = 0; i < offsets->cnt; i++) {
+        const rd_kafka_topic_partition_t *tp = &offsets->elems[i];
+
+        if (tp->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+            kt_offset_track_t *track = kt_commit_manager_track_of(mgr, tp->topic, tp->partition, 0);
+
+            if (track && tp->offset > track->committed) {
+                track->committed = tp->offset;
+            }
+        } else {
+            failed++;
+        }
+    }
+
+    if (failed) {
+        kt_commit_manager_retry(mgr, 0);
+    }
+
+    pthread_mutex_unlock(&mgr->lock);
+}
+
+
+/* result of async commit, served by rd_kafka_queue_poll_callback(commitq) */
+static void kt_commit_manager_commit_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *offsets, void *opaque)
+{
+    kt_commit_manager_t *mgr = ((kt_consumer) opaque)->commitmgr;
+
+    if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+        if (offsets) {
+            kt_commit_manager_committed(mgr, offsets);
+        }
+    } else if (err != RD_KAFKA_RESP_ERR__NO_OFFSET) {
+        printf("(%s:%d) WARN - async commit failed: %s\n", THIS_FILE, __LINE__, rd_kafka_err2str(err));
+
+        pthread_mutex_lock(&mgr->lock);
+        kt_commit_manager_retry(mgr, 0);
+        pthread_mutex_unlock(&mgr->lock);
+    }
+}
+
+
+/**
+ * commit low-water marks of all partitions which have progress.
+ *  returns KAFKATOOLS_SUCCESS if nothing to commit.
+ */
+static int kt_commit_manager_commit (kt_consumer consumer, int async)
+{
+    uint32_t i;
+    int k, pending;
+
+    rd_kafka_resp_err_t err;
+    rd_kafka_topic_partition_list_t *offsets;
+
+    kt_commit_manager_t *mgr = consumer->commitmgr;
+
+    pthread_mutex_lock(&mgr->lock);
+
+    offsets = rd_kafka_topic_partition_list_new(16);
+
+    for (i = 0; i < mgr->topics.capacity; i++) {
+        kt_offset_topic_t *ot = (kt_offset_topic_t *) mgr->topics.entries[i].value;
+
+        if (! mgr->topics.entries[i].key) {
+            continue;
+        }
+
+        for (k = 0; k < ot->numparts; k++) {
+            kt_offset_track_t *track = ot->parts[k];
+
+            if (track && track->doneupto > track->committed) {
+                /* committed is advanced when commit succeeds */
+                rd_kafka_topic_partition_list_add(offsets, ot->topic, k)->offset = track->doneupto;
             }
+        }
+    }
+
+    pending = mgr->pending;
+
+    mgr->pending = 0;
+    mgr->lastcommit_ms = difftime_msec(NULL, NULL);
+
+    pthread_mutex_unlock(&mgr->lock);
+
+    err = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+    if (offsets->cnt) {
+        if (async) {
+            err = rd_kafka_commit_queue(consumer->rkConsumer, offsets, mgr->commitq, kt_commit_manager_commit_cb, (void *) consumer);
+        } else {
+            err = rd_kafka_commit(consumer->rkConsumer, offsets, 0);
+
+            if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                kt_commit_manager_committed(mgr, offsets);
+            }
+        }
+    }
+
+    rd_kafka_topic_partition_list_destroy(offsets);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        pthread_mutex_lock(&mgr->lock);
+        kt_commit_manager_retry(mgr, pending);
+        pthread_mutex_unlock(&mgr->lock);
+
+        consumer->errcode = err;
+        snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_commit failed: %s", rd_kafka_err2str(err));
+        return KAFKATOOLS_ERROR;
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+/* commit if max_pending or interval_ms reached */
+static void kt_commit_manager_poll (kt_consumer consumer)
+{
+    int due;
+
+    kt_commit_manager_t *mgr = consumer->commitmgr;
+
+    /* results of async commits */
+    rd_kafka_queue_poll_callback(mgr->commitq, 0);
+
+    pthread_mutex_lock(&mgr->lock);
+    due = mgr->pending && (mgr->pending >= mgr->max_pending || difftime_msec(NULL, NULL) - mgr->lastcommit_ms >= mgr->interval_ms);
+    pthread_mutex_unlock(&mgr->lock);
+
+    if (due) {
+        kt_commit_manager_commit(consumer, 1);
+    }
+}
+
+
+/* drop tracked offsets of revoked partitions, they restart from committed */
+static void kt_commit_manager_forget (kt_commit_manager_t *mgr, const rd_kafka_topic_partition_list_t *partitions)
+{
+    int i;
+
+    pthread_mutex_lock(&mgr->lock);
+
+    for (i = 0; i < partitions->cnt; i++) {
+        kt_offset_track_t *track = kt_commit_manager_track_of(mgr, partitions->elems[i].topic, partitions->elems[i].partition, 0);
+
+        if (track) {
+            track->doneupto = -1;
+            track->committed = -1;
+            track->head = 0;
+            track->count = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&mgr->lock);
+}
+
+
+int kafkatools_consumer_enable_commit (kt_consumer consumer, int interval_ms, int max_pending, int manual_done)
+{
+    kt_commit_manager_t *mgr;
+
+    if (consumer->commitmgr) {
+        return KAFKATOOLS_EARG;
+    }
+
+    mgr = (kt_commit_manager_t *) mem_alloc_zero(1, sizeof(*mgr));
+
+    if (pthread_mutex_init(&mgr->lock, NULL) != 0) {
+        mem_free(mgr);
+        return KAFKATOOLS_EFATAL;
+    }
+
+    mgr->interval_ms = (interval_ms > 0)? interval_ms : KT_COMMIT_INTERVAL_MS;
+    mgr->max_pending = (max_pending > 0)? max_pending : KT_COMMIT_MAX_PENDING;
+    mgr->manual_done = manual_done;
+    mgr->lastcommit_ms = difftime_msec(NULL, NULL);
+
+    mgr->commitq = rd_kafka_queue_new(consumer->rkConsumer);
+
+    strhashmap_init(&mgr->topics, 0);
+
+    consumer->commitmgr = mgr;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_consumer_offset_done (kt_consumer consumer, const char *topic, int32_t partition, int64_t offset)
+{
+    int ret, due;
+
+    kt_offset_track_t *track;
+
+    kt_commit_manager_t *mgr = consumer->commitmgr;
+
+    if (! mgr) {
+        return KAFKATOOLS_EARG;
+    }
+
+    pthread_mutex_lock(&mgr->lock);
+
+    track = kt_commit_manager_track_of(mgr, topic, partition, 0);
+
+    ret = track? kt_commit_manager_done(mgr, track, offset) : KAFKATOOLS_EARG;
+
+    due = (mgr->pending >= mgr->max_pending);
+
+    pthread_mutex_unlock(&mgr->lock);
+
+    if (due) {
+        kt_commit_manager_commit(consumer, 1);
+    }
+
+    return ret;
+}
+
+
+int kafkatools_consumer_commit (kt_consumer consumer, int async)
+{
+    if (! consumer->commitmgr) {
+        return KAFKATOOLS_EARG;
+    }
+
+    return kt_commit_manager_commit(consumer, async);
+}
+
+
+static void kt_flowctl_topic_release (void *value, void *arg)
+{
+    kt_flowctl_topic_t *ft = (kt_flowctl_topic_t *) value;
+
+    mem_free(ft->parts);
+    mem_free(ft);
+}
+
+
+static void kt_flowctl_free (kt_flowctl_t *fc)
+{
+    if (fc) {
+        int i;
+
+        for (i = 0; i < fc->numparts; i++) {
+            mem_free(fc->parts[i]);
+        }
+
+        mem_free(fc->parts);
+
+        strhashmap_uninit(&fc->topics, kt_flowctl_topic_release, NULL);
+        pthread_mutex_destroy(&fc->lock);
+        mem_free(fc);
+    }
+}
+
+
+/* get partition, registered if not exists. called with lock held */
+static kt_flowctl_part_t * kt_flowctl_part_of (kt_flowctl_t *fc, const char *topic, int32_t partition)
+{
+    kt_flowctl_part_t *part;
+
+    uint32_t hash = strhashmap_hash(topic);
+
+    kt_flowctl_topic_t *ft = (kt_flowctl_topic_t *) strhashmap_find(&fc->topics, topic, hash);
+
+    if (! ft) {
+        ft = (kt_flowctl_topic_t *) mem_alloc_zero(1, sizeof(*ft));
+
+        /* name of cached topic handle lives as long as consumer */
+        strhashmap_insert(&fc->topics, topic, hash, (void *) ft);
+    }
+
+    if (partition >= ft->numparts) {
+        int numparts = partition + 1;
+
+        ft->parts = (kt_flowctl_part_t **) mem_realloc(ft->parts, sizeof(kt_flowctl_part_t *) * numparts);
+        bzero(ft->parts + ft->numparts, sizeof(kt_flowctl_part_t *) * (numparts - ft->numparts));
+        ft->numparts = numparts;
+    }
+
+    part = ft->parts[partition];
+
+    if (! part) {
+        part = (kt_flowctl_part_t *) mem_alloc_zero(1, sizeof(*part));
+
+        part->topic = topic;
+        part->partition = partition;
+
+        if (fc->numparts == fc->capacity) {
+            fc->capacity = fc->capacity? fc->capacity * 2 : 64;
+            fc->parts = (kt_flowctl_part_t **) mem_realloc(fc->parts, sizeof(kt_flowctl_part_t *) * fc->capacity);
+        }
+
+        fc->parts[fc->numparts++] = part;
+        ft->parts[partition] = part;
+    }
+
+    return part;
+}
+
+
+/* max outstanding bytes of one partition. called with lock held */
+static sb8 kt_flowctl_share (const kt_flowctl_t *fc)
+{
+    if (fc->partition_bytes) {
+        return fc->partition_bytes;
+    }
+
+    return fc->budget / (fc->numparts? fc->numparts : 1);
+}
+
+
+/* account batch of one partition before it is dispatched */
+static void kt_flowctl_acquire (kt_flowctl_t *fc, const char *topic, kt_consume_batch_t *batch)
+{
+    int i;
+
+    sb8 bytes = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        bytes += (sb8) (batch->rkmessages[i]->len + batch->rkmessages[i]->key_len);
+    }
+
+    pthread_mutex_lock(&fc->lock);
+
+    batch->flowpart = kt_flowctl_part_of(fc, topic, batch->rkmessages[0]->partition);
+    batch->flowbytes = bytes;
+
+    batch->flowpart->outstanding += bytes;
+    fc->outstanding += bytes;
+
+    pthread_mutex_unlock(&fc->lock);
+}
+
+
+/* batch processed by worker */
+static void kt_flowctl_release (kt_flowctl_t *fc, kt_consume_batch_t *batch)
+{
+    pthread_mutex_lock(&fc->lock);
+
+    batch->flowpart->outstanding -= batch->flowbytes;
+    fc->outstanding -= batch->flowbytes;
+
+    pthread_mutex_unlock(&fc->lock);
+}
+
+
+/**
+ * pause partitions beyond share or budget and resume drained ones.
+ *  called by run thread only so that pauses and resumes are in order.
+ *  `resumeall` resumes all paused partitions when run ends.
+ */
+static void kt_flowctl_poll (kt_consumer consumer, int resumeall)
+{
+    int i, overall, drained;
+    sb8 share;
+
+    rd_kafka_topic_partition_list_t *pauses = NULL;
+    rd_kafka_topic_partition_list_t *resumes = NULL;
+
+    kt_flowctl_t *fc = consumer->flowctl;
+
+    pthread_mutex_lock(&fc->lock);
+
+    share = kt_flowctl_share(fc);
+
+    overall = (fc->outstanding > fc->budget);
+    drained = (fc->outstanding <= fc->budget / 2);
+
+    for (i = 0; i < fc->numparts; i++) {
+        kt_flowctl_part_t *part = fc->parts[i];
+
+        if (part->paused) {
+            if (resumeall || (drained && part->outstanding <= share / 2)) {
+                if (! resumes) {
+                    resumes = rd_kafka_topic_partition_list_new(fc->numpaused);
+                }
+
+                rd_kafka_topic_partition_list_add(resumes, part->topic, part->partition);
+                part->paused = 0;
+                fc->numpaused--;
+            }
+        } else if (! resumeall && (overall || part->outstanding > share)) {
+            if (! pauses) {
+                pauses = rd_kafka_topic_partition_list_new(16);
+            }
+
+            rd_kafka_topic_partition_list_add(pauses, part->topic, part->partition);
+            part->paused = 1;
+            fc->numpaused++;
+        }
+    }
+
+    pthread_mutex_unlock(&fc->lock);
+
+    if (pauses) {
+        rd_kafka_pause_partitions(consumer->rkConsumer, pauses);
+        kafkatools_metrics_count(consumer->metrics, KT_COUNTER_PAUSED, pauses->cnt);
+        rd_kafka_topic_partition_list_destroy(pauses);
+    }
+
+    if (resumes) {
+        rd_kafka_resume_partitions(consumer->rkConsumer, resumes);
+        rd_kafka_topic_partition_list_destroy(resumes);
+    }
+}
+
+
+/* resume revoked partitions paused, so they are not paused if assigned again */
+static void kt_flowctl_forget (kt_consumer consumer, const rd_kafka_topic_partition_list_t *partitions)
+{
+    int i;
+
+    rd_kafka_topic_partition_list_t *resumes = NULL;
+
+    kt_flowctl_t *fc = consumer->flowctl;
+
+    pthread_mutex_lock(&fc->lock);
+
+    for (i = 0; i < partitions->cnt; i++) {
+        const rd_kafka_topic_partition_t *tp = &partitions->elems[i];
+
+        kt_flowctl_topic_t *ft = (kt_flowctl_topic_t *) strhashmap_find(&fc->topics, tp->topic, strhashmap_hash(tp->topic));
+
+        if (ft && tp->partition < ft->numparts && ft->parts[tp->partition] && ft->parts[tp->partition]->paused) {
+            if (! resumes) {
+                resumes = rd_kafka_topic_partition_list_new(partitions->cnt);
+            }
+
+            rd_kafka_topic_partition_list_add(resumes, tp->topic, tp->partition);
+            ft->parts[tp->partition]->paused = 0;
+            fc->numpaused--;
+        }
+    }
+
+    pthread_mutex_unlock(&fc->lock);
+
+    if (resumes) {
+        rd_kafka_resume_partitions(consumer->rkConsumer, resumes);
+        rd_kafka_topic_partition_list_destroy(resumes);
+    }
+}
+
+
+int kafkatools_consumer_enable_flowctl (kt_consumer consumer, size_t budget_bytes, size_t partition_bytes)
+{
+    kt_flowctl_t *fc;
+
+    if (consumer->flowctl || ! budget_bytes) {
+        return KAFKATOOLS_EARG;
+    }
+
+    fc = (kt_flowctl_t *) mem_alloc_zero(1, sizeof(*fc));
+
+    if (pthread_mutex_init(&fc->lock, NULL) != 0) {
+        mem_free(fc);
+        return KAFKATOOLS_EFATAL;
+    }
+
+    fc->budget = (sb8) budget_bytes;
+    fc->partition_bytes = (sb8) partition_bytes;
+
+    strhashmap_init(&fc->topics, 0);
+
+    consumer->flowctl = fc;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_consumer_get_flowctl (kt_consumer consumer, size_t *outstanding, int *paused)
+{
+    kt_flowctl_t *fc = consumer->flowctl;
+
+    if (! fc) {
+        return KAFKATOOLS_EARG;
+    }
+
+    pthread_mutex_lock(&fc->lock);
+
+    if (outstanding) {
+        *outstanding = (size_t) fc->outstanding;
+    }
+    if (paused) {
+        *paused = fc->numpaused;
+    }
+
+    pthread_mutex_unlock(&fc->lock);
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_consumer_enable_metrics (kt_consumer consumer)
+{
+    if (consumer->metrics) {
+        return KAFKATOOLS_EARG;
+    }
+
+    return kafkatools_metrics_create(&consumer->metrics);
+}
+
+
+kt_metrics kafkatools_consumer_get_metrics (kt_consumer consumer)
+{
+    return consumer->metrics;
+}
+
+
+int kafkatools_consumer_get_threads (kt_consumer consumer, kt_thread_cpu_t *threads, int maxthreads)
+{
+    return (consumer->affinity? kafkatools_affinity_threads(consumer->affinity, threads, maxthreads) : 0);
+}
+
+
+static void kt_consumer_rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque);
+
+
+int kafkatools_consumer_create (const char *groupid, const char *brokers, int tplist_size, const char * names[], const char * values[], const char * topics[], void * opaque, kt_consumer *outConsumer)
+{
+    int result;
+
+    char errstr[KAFKATOOLS_ERRSTR_SIZE];
+
+    rd_kafka_conf_res_t res;
+
+    rd_kafka_conf_t * conf = 0;
+    rd_kafka_topic_conf_t * topic_conf = 0;
+
+    rd_kafka_t * rkConsumer = 0;
+    rd_kafka_topic_partition_list_t * tp_list = 0;
+
+    kafkatools_consumer_t * consumer = 0;
+
+    result = KAFKATOOLS_ENOMEM;
+
+    consumer = (kafkatools_consumer_t *) mem_alloc_zero(1, sizeof(*consumer));
+    if (! consumer) {
+        goto on_error_result;
+    }
+
+    /* success returns consumer object */
+    RWLockInit(&consumer->rktopic_lock);
+    strhashmap_init(&consumer->rktopic_map, 0);
+
+    /* Use rd_kafka_topic_partition_list_destroy()
+     *  to free all resources in use by a list and the list itself.
+     *    tplist_size - Initial allocated size.
+     */
+    tp_list = rd_kafka_topic_partition_list_new(tplist_size);
+    if (! tp_list) {
+        goto on_error_result;
+    }
+
+    if (topics) {
+        const char *tp;
+
+        int i = 0;
+
+        while ((i < KAFKATOOLS_TOPICS_MAX) && ((tp = topics[i]) != 0)) {
+            /**
+             * topicName:startPartitionid-endPartitionid
+             *
+             * topicA:1-2
+             * topicB:1
+             */
+            const char * id = strchr(tp, ':');
+
+            if (! id) {
+                rd_kafka_topic_partition_list_add(tp_list, tp, -1);
+            } else {
+                char topic[KAFKATOOLS_TOPIC_NAMELEN + 1];
+                const char * q = strchr(id, '-');
+
+                if (id - tp > KAFKATOOLS_TOPIC_NAMELEN) {
+                    result = KAFKATOOLS_EARG;
+                    goto on_error_result;
+                }
+
+                bcopy(tp, topic, id - tp);
+                topic[id - tp] = 0;
+
+                if (! q) {
+                    rd_kafka_topic_partition_list_add(tp_list, topic, atoi(id));
+                } else {
+                    int startid, stopid;
+
+                    char p[11];
+
+                    if (q - id >= sizeof(p)) {
+                        result = KAFKATOOLS_EARG;
+                        goto on_error_result;
+                    }
+
+                    bcopy(id, p, q - id);
+                    p[q++ - id] = 0;
+
+                    startid = atoi(p);
+                    stopid = atoi(q);
+
+                    if (startid < stopid) {
+                        rd_kafka_topic_partition_list_add_range(tp_list, topic, startid, stopid);
+                    } else {
+                        rd_kafka_topic_partition_list_add_range(tp_list, topic, stopid, startid);
+                    }
+                }
+            }
+
+            ++i;
+        }
+    }
+
+    conf = rd_kafka_conf_new();
+    if (! conf) {
+        goto on_error_result;
+    }
+
+    topic_conf = rd_kafka_topic_conf_new();
+    if (! topic_conf) {
+        goto on_error_result;
+    }
+
+    /* Sets the application's opaque pointer that will be passed to all topic
+     * callbacks as the rkt_opaque argument.
+     */
+    rd_kafka_topic_conf_set_opaque(topic_conf, opaque);
+
+    /* Emit RD_KAFKA_RESP_ERR__PARTITION_EOF event whenever the consumer reaches
+     * the end of a partition.
+     */
+    rd_kafka_conf_set(conf, "enable.partition.eof", "true", NULL, 0);
+
+    if (names) {
+        int i = 0;
+
+        while (i < KAFKATOOLS_CONF_PROPS_MAX && names[i]) {
+            res = RD_KAFKA_CONF_UNKNOWN;
+
+            /* Try "topic." prefixed properties on topic conf first, and then fall through
+             * to global if it didnt match a topic configuration property.
+             */
+            if (! strncmp(names[i], "topic.", 6)) {
+                res = rd_kafka_topic_conf_set(topic_conf, names[i] + 6, values[i], errstr, sizeof(errstr));
+            } else if (! strncmp(names[i], "kafkatools.affinity.", 20)) {
+                if (! consumer->affinity) {
+                    kafkatools_affinity_create(&consumer->affinity);
+                }
+                res = (kafkatools_affinity_set(consumer->affinity, names[i], values[i]) == KAFKATOOLS_SUCCESS)? RD_KAFKA_CONF_OK : RD_KAFKA_CONF_INVALID;
+            }
+
+            if (res == RD_KAFKA_CONF_UNKNOWN) {
+                res = rd_kafka_conf_set(conf, names[i], values[i], errstr, sizeof(errstr));
+            }
+
+            if (res != RD_KAFKA_CONF_OK) {
+                result = KAFKATOOLS_ECONF;
+                goto on_error_result;
+            }
+
+            ++i;
+        }
+    }
+
+    /* Callback called on partition assignment changes of subscribed consumer */
+    rd_kafka_conf_set_rebalance_cb(conf, kt_consumer_rebalance_cb);
+    rd_kafka_conf_set_opaque(conf, (void *) consumer);
+
+    /* Consumer groups require a group id */
+    if (groupid) {
+        if (rd_kafka_conf_set(conf, "group.id", groupid, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            result = KAFKATOOLS_ECONF;
+            goto on_error_result;
+        }
+    }
+
+    /* Set default topic config for pattern-matched topics. */
+    rd_kafka_conf_set_default_topic_conf(conf, topic_conf);
+
+    /* The topic config object is not usable after this call. */
+    topic_conf = 0;
+
+    if (consumer->affinity) {
+        result = kafkatools_affinity_conf(consumer->affinity, conf);
+        if (result != KAFKATOOLS_SUCCESS) {
+            goto on_error_result;
+        }
+    }
+
+    /* Create Kafka handle */
+    rkConsumer = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+
+    if (! rkConsumer) {
+        result = KAFKATOOLS_ENOMEM;
+        goto on_error_result;
+    }
+
+    /* conf object is freed by this function on success and must not be used
+     * or destroyed by the application sub-sequently. */
+    conf = 0;
+
+    result = KAFKATOOLS_ERROR;
+
+    /* Add brokers if needed */
+    if (brokers) {
+        if (rd_kafka_brokers_add(rkConsumer, brokers) == 0) {
+            goto on_error_result;
+        }
+    }
+
+    /* Redirect the main (rd_kafka_poll()) queue to the KafkaConsumer's
+     *   queue (rd_kafka_consumer_poll()).
+     * It is not permitted to call rd_kafka_poll() after directing the
+     *   main queue with rd_kafka_poll_set_consumer().
+     */
+    res = rd_kafka_poll_set_consumer(rkConsumer);
+    if (res != RD_KAFKA_CONF_OK) {
+        goto on_error_result;
+    }
+
+    /* hand over kafka objects */
+    consumer->rkConsumer = rkConsumer;
+    rkConsumer = 0;
+
+    consumer->tp_list = tp_list;
+    tp_list = 0;
+
+    /*
+     * https://linux.die.net/man/3/pthread_mutex_init
+     */
+    if (pthread_mutex_init(&consumer->lock, NULL) != 0) {
+        result = KAFKATOOLS_EFATAL;
+        goto on_error_result;
+    }
+
+    consumer->opaque = opaque;
+    *outConsumer = consumer;
+    return KAFKATOOLS_SUCCESS;
+
+on_error_result:
+
+    if (rkConsumer) {
+        /* threads of librdkafka refer to affinity of consumer */
+        rd_kafka_destroy(rkConsumer);
+    }
+
+    kafkatools_consumer_destroy(consumer);
+
+    if (tp_list) {
+        rd_kafka_topic_partition_list_destroy(tp_list);
+    }
+    if (topic_conf) {
+        rd_kafka_topic_conf_destroy(topic_conf);
+    }
+    if (conf) {
+        rd_kafka_conf_destroy(conf);
+    }
+
+    return result;
+}
+
+
+void kafkatools_consumer_destroy (kt_consumer consumer)
+{
+    if (consumer) {
+        rd_kafka_t *rkConsumer = NULL;
+
+        pthread_mutex_lock(&consumer->lock);
+
+        if (consumer->rkConsumer) {
+            rkConsumer = consumer->rkConsumer;
+
+            if (consumer->subscribed) {
+                /* revoke by rebalance handler while commit manager still alive */
+                rd_kafka_consumer_close(rkConsumer);
+            }
+
+            consumer->rkConsumer = NULL;
+        }
+
+        if (consumer->tp_list) {
+            rd_kafka_topic_partition_list_destroy(consumer->tp_list);
+        }
+
+        kt_commit_manager_free(consumer->commitmgr);
+
+        kt_flowctl_free(consumer->flowctl);
+
+        kafkatools_metrics_destroy(consumer->metrics);
+
+        strhashmap_uninit(&consumer->rktopic_map, rktopic_object_release, 0);
+        RWLockUninit(&consumer->rktopic_lock);
+
+        if (rkConsumer) {
+            /* Destroy Kafka handle. This is a blocking operation.
+             *   rd_kafka_consumer_close() will be called from this function.
+             */
+            rd_kafka_destroy(rkConsumer);
+        }
+
+        /* all threads of librdkafka have exited */
+        kafkatools_affinity_destroy(consumer->affinity);
+
+        pthread_mutex_destroy(&consumer->lock);
+        mem_free(consumer);
+    }
+}
+
+
+const char * kafkatools_consumer_get_errstr (kt_consumer consumer, int *perrcode)
+{
+    if (perrcode) {
+        *perrcode = consumer->errcode;
+    }
+
+    return consumer->errstr;
+}
+
+
+rd_kafka_topic_conf_t * kafkatools_consumer_new_topic_conf (kt_consumer consumer, const char * names[], const char * values[])
+{
+    rd_kafka_topic_conf_t * topic_conf = rd_kafka_topic_conf_new();
+
+    if (! topic_conf) {
+        consumer->errcode = KAFKATOOLS_ENOMEM;
+        snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_topic_conf_new error(%d): Out memory", KAFKATOOLS_ENOMEM);
+        return NULL;
+    }
+
+    if (names) {
+        rd_kafka_conf_res_t res;
+
+        int i = 0;
+
+        while (i < KAFKATOOLS_CONF_PROPS_MAX && names[i]) {
+            res = rd_kafka_topic_conf_set(topic_conf, names[i], values[i], consumer->errstr, sizeof(consumer->errstr));
+
+            if (res != RD_KAFKA_CONF_OK) {
+                consumer->errcode = KAFKATOOLS_ECONF;
+
+                rd_kafka_topic_conf_destroy(topic_conf);
+
+                return NULL;
+            }
+
+            ++i;
+        }
+    }
+
+    consumer->errcode = KAFKATOOLS_SUCCESS;
+    *consumer->errstr = 0;
+
+    return topic_conf;
+}
+
+
+kt_topic kafkatools_consumer_get_topic (kt_consumer consumer, const char *topic_name, rd_kafka_topic_conf_t *topic_conf)
+{
+    rd_kafka_topic_t *rktopic;
+
+    uint32_t hash = strhashmap_hash(topic_name);
+
+    /* lookup first: cached topic handle costs one hash probe */
+    RWLockAcquire(&consumer->rktopic_lock, RWLOCK_STATE_READ, 0);
+    rktopic = (rd_kafka_topic_t *) strhashmap_find(&consumer->rktopic_map, topic_name, hash);
+    RWLockRelease(&consumer->rktopic_lock, RWLOCK_STATE_READ);
+
+    if (! rktopic) {
+        RWLockAcquire(&consumer->rktopic_lock, RWLOCK_STATE_WRITE, 0);
+
+        /* another thread may have inserted it */
+        rktopic = (rd_kafka_topic_t *) strhashmap_find(&consumer->rktopic_map, topic_name, hash);
+
+        if (! rktopic) {
+            /* Topic handles are refcounted internally and calling rd_kafka_topic_new()
+             *  again with the same topic name will return the previous topic handle
+             *  without updating the original handle's configuration.
+             *
+             * Applications must eventually call rd_kafka_topic_destroy() for each
+             *  succesfull call to rd_kafka_topic_new() to clear up resources.
+             *
+             * returns the new topic handle or NULL on error.
+             */
+            rktopic = rd_kafka_topic_new(consumer->rkConsumer, topic_name, topic_conf);
+
+            if (! rktopic) {
+                RWLockRelease(&consumer->rktopic_lock, RWLOCK_STATE_WRITE);
+
+                consumer->errcode = KAFKATOOLS_ENOMEM;
+                snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_topic_new error(%d): Out memory", KAFKATOOLS_ENOMEM);
+
+                return NULL;
+            }
+
+            /* topic_conf is owned by rktopic now */
+            topic_conf = NULL;
+
+            /* name of topic handle lives as long as the handle in cache */
+            strhashmap_insert(&consumer->rktopic_map, rd_kafka_topic_name(rktopic), hash, (void *) rktopic);
+        }
+
+        RWLockRelease(&consumer->rktopic_lock, RWLOCK_STATE_WRITE);
+    }
+
+    if (topic_conf) {
+        /* topic exists already: topic_conf is not used, as rd_kafka_topic_new() does */
+        rd_kafka_topic_conf_destroy(topic_conf);
+    }
+
+    /* do not call rd_kafka_topic_destroy() for below object! */
+    return (kt_topic) rktopic;
+}
+
+
+rd_kafka_topic_partition_list_t * kafkatools_consumer_get_topics (kt_consumer consumer)
+{
+    return consumer->tp_list;
+}
+
+
+rd_kafka_t * kafkatools_consumer_get_rdkafka (kt_consumer consumer)
+{
+    return consumer->rkConsumer;
+}
+
+
+void * kafkatools_consumer_get_opaque (kt_consumer consumer)
+{
+    return consumer->opaque;
+}
+
+
+pthread_mutex_t * kafkatools_consumer_get_mutex (kt_consumer consumer)
+{
+    return &(consumer->lock);
+}
+
+
+int kafkatools_consumer_start_subscribe (kt_consumer consumer)
+{
+    int i;
+
+    rd_kafka_resp_err_t err;
+    rd_kafka_topic_partition_list_t *topics;
+
+    if (consumer->subscribed) {
+        return KAFKATOOLS_SUCCESS;
+    }
+
+    /* subscribe to topic names of tp_list, partitions are assigned by group */
+    topics = rd_kafka_topic_partition_list_new(consumer->tp_list->cnt);
+
+    for (i = 0; i < consumer->tp_list->cnt; i++) {
+        const char *topic = consumer->tp_list->elems[i].topic;
+
+        if (! rd_kafka_topic_partition_list_find(topics, topic, RD_KAFKA_PARTITION_UA)) {
+            rd_kafka_topic_partition_list_add(topics, topic, RD_KAFKA_PARTITION_UA);
+        }
+    }
+
+    /* rd_kafka_subscribe() is an asynchronous method which returns immediately.
+     *   background threads will (re)join the group, wait for group rebalance,
+     *   issue any registered rebalance_cb, assign() the assigned partitions,
+     *   and then start fetching messages.
+     * This cycle may take up to
+     *   session.timeout.ms * 2 or more to complete.
+     */
+    err = rd_kafka_subscribe(consumer->rkConsumer, topics);
+
+    rd_kafka_topic_partition_list_destroy(topics);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        consumer->errcode = err;
+        snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_subscribe failed: %s", rd_kafka_err2str(err));
+        return KAFKATOOLS_ERROR;
+    }
+
+    consumer->subscribed = 1;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_consumer_set_rebalance_cb (kt_consumer consumer, kt_rebalance_cb rebalancecb, void *arg)
+{
+    consumer->rebalancecb = rebalancecb;
+    consumer->rebalancearg = arg;
+}
+
+
+/* wait until all batches dispatched by run are processed */
+static void kt_consume_runner_flush (kt_consume_runner_t *runner)
+{
+    pthread_mutex_lock(&runner->flushlock);
+
+    while (runner->inflight) {
+        pthread_cond_wait(&runner->flushcond, &runner->flushlock);
+    }
+
+    pthread_mutex_unlock(&runner->flushlock);
+}
+
+
+/**
+ * Builtin rebalance handler
+ *
+ * Called on the thread serving the consumer queue: the run thread, or the
+ *  caller of rd_kafka_consumer_close().
+ *
+ * On assign, partitions start from their committed offsets which are
+ *  fetched at once, so the hook may warm state of partitions from them.
+ * On revoke, all batches in flight are processed and done offsets are
+ *  committed synchronously before the hook hands over state, so the next
+ *  owner of partitions does not process them again.
+ */
+static void kt_consumer_rebalance_cb (rd_kafka_t *rk, rd_kafka_resp_err_t err, rd_kafka_topic_partition_list_t *partitions, void *opaque)
+{
+    kt_consumer consumer = (kt_consumer) opaque;
+
+    if (err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS) {
+        rd_kafka_resp_err_t cerr = rd_kafka_committed(rk, partitions, KT_REBALANCE_TIMEOUT_MS);
+
+        if (cerr != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            int i;
+
+            /* fall back to offsets fetched by librdkafka itself */
+            printf("(%s:%d) WARN - rd_kafka_committed failed: %s\n", THIS_FILE, __LINE__, rd_kafka_err2str(cerr));
+
+            for (i = 0; i < partitions->cnt; i++) {
+                partitions->elems[i].offset = RD_KAFKA_OFFSET_INVALID;
+            }
+        }
+
+        if (consumer->rebalancecb) {
+            consumer->rebalancecb(consumer, 1, partitions, consumer->rebalancearg);
+        }
+
+        rd_kafka_assign(rk, partitions);
+    } else if (err == RD_KAFKA_RESP_ERR__REVOKE_PARTITIONS) {
+        consumer->revokes++;
+
+        if (consumer->runner) {
+            kt_consume_runner_flush(consumer->runner);
+        }
+
+        if (consumer->commitmgr) {
+            kt_commit_manager_commit(consumer, 0);
+            kt_commit_manager_forget(consumer->commitmgr, partitions);
+        }
+
+        if (consumer->flowctl) {
+            kt_flowctl_forget(consumer, partitions);
+        }
+
+        if (consumer->rebalancecb) {
+            consumer->rebalancecb(consumer, 0, partitions, consumer->rebalancearg);
+        }
+
+        rd_kafka_assign(rk, NULL);
+    } else {
+        consumer->errcode = err;
+        snprintf(consumer->errstr, sizeof(consumer->errstr), "rebalance failed: %s", rd_kafka_err2str(err));
+
+        rd_kafka_assign(rk, NULL);
+    }
+}
+
+
+static void kt_consume_batch_process (kt_consume_runner_t *runner, int worker, kt_consume_batch_t *batch)
+{
+    int i;
+
+    kt_consumer consumer = runner->consumer;
+
+    if (runner->batchcb(consumer, worker, batch->rkmessages, batch->count, runner->arg) != KAFKATOOLS_SUCCESS) {
+        /* messages of failed batch are not done */
+        kafkatools_consumer_stop(consumer);
+    } else if (consumer->commitmgr && ! consumer->commitmgr->manual_done) {
+        kt_offset_track_t *track;
+
+        int due;
+
+        kt_commit_manager_t *mgr = consumer->commitmgr;
+
+        pthread_mutex_lock(&mgr->lock);
+
+        track = kt_commit_manager_track_of(mgr, rd_kafka_topic_name(batch->rkmessages[0]->rkt), batch->rkmessages[0]->partition, 0);
+
+        for (i = 0; i < batch->count; i++) {
+            kt_commit_manager_done(mgr, track, batch->rkmessages[i]->offset);
+        }
+
+        due = (mgr->pending >= mgr->max_pending);
+
+        pthread_mutex_unlock(&mgr->lock);
+
+        if (due) {
+            kt_commit_manager_commit(consumer, 1);
+        }
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        rd_kafka_message_destroy(batch->rkmessages[i]);
+    }
+
+    if (batch->flowpart) {
+        kt_flowctl_release(consumer->flowctl, batch);
+    }
+
+    mem_free(batch);
+
+    pthread_mutex_lock(&runner->flushlock);
+    if (--runner->inflight == 0) {
+        pthread_cond_broadcast(&runner->flushcond);
+    }
+    pthread_mutex_unlock(&runner->flushlock);
+}
+
+
+static void * kt_consume_worker_thread (void *arg)
+{
+    kt_consume_worker_t *worker = (kt_consume_worker_t *) arg;
+
+    for (;;) {
+        kt_consume_batch_t *batch;
+
+        pthread_mutex_lock(&worker->lock);
+
+        while (! worker->count && ! worker->stopping) {
+            pthread_cond_wait(&worker->notempty, &worker->lock);
+        }
+
+        if (! worker->count) {
+            /* stopping and drained */
+            pthread_mutex_unlock(&worker->lock);
+            break;
+        }
+
+        batch = worker->batches[worker->head];
+        worker->head = (worker->head + 1) % worker->capacity;
+        worker->count--;
+
+        pthread_cond_signal(&worker->notfull);
+        pthread_mutex_unlock(&worker->lock);
+
+        kt_consume_batch_process(worker->runner, worker->index, batch);
+    }
+
+    return NULL;
+}
+
+
+/* blocks while queue of worker is full */
+static void kt_consume_worker_push (kt_consume_worker_t *worker, kt_consume_batch_t *batch)
+{
+    pthread_mutex_lock(&worker->lock);
+
+    while (worker->count == worker->capacity) {
+        pthread_cond_wait(&worker->notfull, &worker->lock);
+    }
+
+    worker->batches[(worker->head + worker->count) % worker->capacity] = batch;
+    worker->count++;
+
+    pthread_cond_signal(&worker->notempty);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+
+static void kt_consume_workers_stop (kt_consume_runner_t *runner, int numworkers)
+{
+    int i;
+
+    for (i = 0; i < numworkers; i++) {
+        kt_consume_worker_t *worker = &runner->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        worker->stopping = 1;
+        pthread_cond_signal(&worker->notempty);
+        pthread_mutex_unlock(&worker->lock);
+
+        pthread_join(worker->thread, NULL);
+
+        pthread_cond_destroy(&worker->notfull);
+        pthread_cond_destroy(&worker->notempty);
+        pthread_mutex_destroy(&worker->lock);
+        mem_free(worker->batches);
+    }
+}
+
+
+static int kt_consume_workers_start (kt_consume_runner_t *runner, int numworkers, int capacity)
+{
+    int i;
+
+    for (i = 0; i < numworkers; i++) {
+        kt_consume_worker_t *worker = &runner->workers[i];
+
+        worker->runner = runner;
+        worker->index = i;
+        worker->capacity = capacity;
+        worker->batches = (kt_consume_batch_t **) mem_alloc_zero(capacity, sizeof(kt_consume_batch_t *));
+
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->notempty, NULL);
+        pthread_cond_init(&worker->notfull, NULL);
+
+        if (pthread_create(&worker->thread, NULL, kt_consume_worker_thread, (void *) worker) != 0) {
+            pthread_cond_destroy(&worker->notfull);
+            pthread_cond_destroy(&worker->notempty);
+            pthread_mutex_destroy(&worker->lock);
+            mem_free(worker->batches);
+
+            kt_consume_workers_stop(runner, i);
+            return KAFKATOOLS_EFATAL;
+        }
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+/* count consumed messages and record lag from their timestamps */
+static void kt_consume_record_metrics (kt_consumer consumer, rd_kafka_message_t **rkmessages, int count)
+{
+    int i, consumed = 0;
+
+    sb8 nowms = difftime_msec(NULL, NULL);
+
+    for (i = 0; i < count; i++) {
+        if (! rkmessages[i]->err) {
+            int64_t ts = rd_kafka_message_timestamp(rkmessages[i], NULL);
+
+            if (ts > 0) {
+                kafkatools_metrics_record(consumer->metrics, KT_HISTOGRAM_CONSUME_LAG_MS, nowms - ts);
+            }
+
+            consumed++;
+        }
+    }
+
+    kafkatools_metrics_count(consumer->metrics, KT_COUNTER_CONSUMED, consumed);
+}
+
+
+/**
+ * name of topic kept by trackers. messages of subscribed consumer refer to
+ *  topics not in cache, whose names live as long as cached handles of them.
+ */
+static const char * kt_consume_topic_name (kt_consumer consumer, rd_kafka_topic_t *rkt)
+{
+    if (consumer->subscribed) {
+        kt_topic topic = kafkatools_consumer_get_topic(consumer, rd_kafka_topic_name(rkt), NULL);
+
+        if (topic) {
+            return rd_kafka_topic_name((rd_kafka_topic_t *) topic);
+        }
+    }
+
+    return rd_kafka_topic_name(rkt);
+}
+
+
+/**
+ * drop messages of partitions revoked while they were consumed in the same
+ *  batch, which are fetched by new owner from committed offsets.
+ *  returns count of messages kept.
+ */
+static int kt_consume_filter_revoked (kt_consumer consumer, rd_kafka_message_t **rkmessages, int count)
+{
+    int i, kept = 0;
+
+    rd_kafka_topic_partition_list_t *assignment = NULL;
+
+    if (rd_kafka_assignment(consumer->rkConsumer, &assignment) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        rd_kafka_message_t *rkmessage = rkmessages[i];
+
+        if (rkmessage->rkt && ! rd_kafka_topic_partition_list_find(assignment, rd_kafka_topic_name(rkmessage->rkt), rkmessage->partition)) {
+            rd_kafka_message_destroy(rkmessage);
+            continue;
+        }
+
+        rkmessages[kept++] = rkmessage;
+    }
+
+    rd_kafka_topic_partition_list_destroy(assignment);
+
+    return kept;
+}
+
+
+/**
+ * split rkmessages into groups by partition in order and dispatch them.
+ *  `groups` is scratch space for 2 * count entries: index of first message
+ *  of each group followed by group of each message. messages of dispatched
+ *  groups may be destroyed at once by workers so they are never touched
+ *  again while dispatching the others.
+ */
+static void kt_consume_dispatch (kt_consume_runner_t *runner, rd_kafka_message_t **rkmessages, int count, int *groups)
+{
+    int i, j, numgroups = 0;
+
+    int *groupof = groups + count;
+
+    for (i = 0; i < count; i++) {
+        rd_kafka_message_t *rkmessage = rkmessages[i];
+
+        if (rkmessage->err) {
+            kt_consumer consumer = runner->consumer;
+
+            if (rkmessage->err != RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                consumer->errcode = rkmessage->err;
+                snprintf(consumer->errstr, sizeof(consumer->errstr), "consume error (topic=%s partition=%d): %s",
+                    rkmessage->rkt? rd_kafka_topic_name(rkmessage->rkt) : "", rkmessage->partition,
+                    rd_kafka_message_errstr(rkmessage));
+
+                printf("(%s:%d) %s\n", THIS_FILE, __LINE__, consumer->errstr);
+            }
+
+            rd_kafka_message_destroy(rkmessage);
+            groupof[i] = -1;
+            continue;
+        }
+
+        /* index of first message of the same partition */
+        for (j = 0; j < numgroups; j++) {
+            rd_kafka_message_t *first = rkmessages[groups[j]];
+
+            if (first->rkt == rkmessage->rkt && first->partition == rkmessage->partition) {
+                break;
+            }
+        }
+
+        if (j == numgroups) {
+            groups[numgroups++] = i;
+        }
+
+        groupof[i] = j;
+    }
+
+    for (j = 0; j < numgroups; j++) {
+        rd_kafka_message_t *first = rkmessages[groups[j]];
+
+        kt_consume_batch_t *batch = (kt_consume_batch_t *) mem_alloc_unset(sizeof(*batch) + sizeof(rd_kafka_message_t *) * (count - groups[j]));
+
+        batch->flowpart = NULL;
+        batch->count = 0;
+
+        for (i = groups[j]; i < count; i++) {
+            if (groupof[i] == j) {
+                batch->rkmessages[batch->count++] = rkmessages[i];
+            }
+        }
+
+        if (runner->consumer->commitmgr) {
+            kt_commit_manager_track(runner->consumer->commitmgr, kt_consume_topic_name(runner->consumer, first->rkt), batch->rkmessages, batch->count);
+        }
+
+        if (runner->consumer->flowctl) {
+            kt_flowctl_acquire(runner->consumer->flowctl, kt_consume_topic_name(runner->consumer, first->rkt), batch);
+        }
+
+        pthread_mutex_lock(&runner->flushlock);
+        runner->inflight++;
+        pthread_mutex_unlock(&runner->flushlock);
+
+        if (runner->numworkers) {
+            uint32_t hash = strhashmap_hash(rd_kafka_topic_name(first->rkt)) + (uint32_t) first->partition;
+
+            kt_consume_worker_push(&runner->workers[hash % runner->numworkers], batch);
+        } else {
+            kt_consume_batch_process(runner, 0, batch);
+        }
+    }
+}
+
+
+/**
+ * start or stop consuming all partitions in tp_list on rkqu.
+ *  topic entry without partition (-1) means all partitions of topic.
+ */
+static int kt_consume_partitions (kt_consumer consumer, rd_kafka_queue_t *rkqu, int start)
+{
+    int i, k, partitions;
+
+    rd_kafka_topic_partition_list_t *tp_list = consumer->tp_list;
+
+    for (i = 0; i < tp_list->cnt; i++) {
+        rd_kafka_topic_partition_t *tp = &tp_list->elems[i];
+
+        kt_topic rkt = kafkatools_consumer_get_topic(consumer, tp->topic, NULL);
+        if (! rkt) {
+            return KAFKATOOLS_ERROR;
+        }
+
+        partitions = 1;
+
+        if (tp->partition == RD_KAFKA_PARTITION_UA) {
+            const struct rd_kafka_metadata *metadata;
+
+            rd_kafka_resp_err_t err = rd_kafka_metadata(consumer->rkConsumer, 0, rkt, &metadata, 5000);
+            if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                consumer->errcode = err;
+                snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_metadata(topic=%s) failed: %s", tp->topic, rd_kafka_err2str(err));
+                return KAFKATOOLS_ERROR;
+            }
+
+            partitions = (metadata->topic_cnt == 1)? metadata->topics[0].partition_cnt : 0;
+            rd_kafka_metadata_destroy(metadata);
+        }
+
+        for (k = 0; k < partitions; k++) {
+            int32_t partition = (tp->partition == RD_KAFKA_PARTITION_UA)? k : tp->partition;
+
+            if (start) {
+                int64_t offset;
+
+                if (consumer->flowctl) {
+                    /* known partitions share budget from the beginning */
+                    pthread_mutex_lock(&consumer->flowctl->lock);
+                    kt_flowctl_part_of(consumer->flowctl, rd_kafka_topic_name((rd_kafka_topic_t *) rkt), partition);
+                    pthread_mutex_unlock(&consumer->flowctl->lock);
+                }
+
+                offset = (tp->offset == RD_KAFKA_OFFSET_INVALID)? RD_KAFKA_OFFSET_STORED : tp->offset;
+
+                if (rd_kafka_consume_start_queue(rkt, partition, offset, rkqu) == -1) {
+                    consumer->errcode = rd_kafka_last_error();
+                    snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_consume_start_queue(topic=%s partition=%d) failed: %s",
+                        tp->topic, partition, rd_kafka_err2str(consumer->errcode));
+                    return KAFKATOOLS_ERROR;
+                }
+            } else {
+                rd_kafka_consume_stop(rkt, partition);
+            }
+        }
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+/**
+ * open queue of consumer for runner: group queue of subscribed consumer, or
+ *  a new queue on which all partitions in tp_list are started.
+ */
+static int kt_consume_attach (kt_consume_runner_t *runner, rd_kafka_queue_t **outrkqu)
+{
+    int ret = KAFKATOOLS_SUCCESS;
+
+    kt_consumer consumer = runner->consumer;
+
+    rd_kafka_queue_t *rkqu;
+
+    if (consumer->subscribed) {
+        /* group assigns partitions: rebalance handler is served on this thread */
+        rkqu = rd_kafka_queue_get_consumer(consumer->rkConsumer);
+    } else {
+        rkqu = rd_kafka_queue_new(consumer->rkConsumer);
+    }
+
+    consumer->runner = runner;
+
+    if (! consumer->subscribed) {
+        ret = kt_consume_partitions(consumer, rkqu, 1);
+    }
+
+    *outrkqu = rkqu;
+    return ret;
+}
+
+
+/**
+ * consume one batch from rkqu waiting up to timeout_ms and dispatch it.
+ *  returns count of messages consumed or -1 on error.
+ */
+static ssize_t kt_consume_once (kt_consume_runner_t *runner, rd_kafka_queue_t *rkqu, int timeout_ms, rd_kafka_message_t **rkmessages, int batch_size, int *groups)
+{
+    kt_consumer consumer = runner->consumer;
+
+    int revokes = consumer->revokes;
+
+    ssize_t count = rd_kafka_consume_batch_queue(rkqu, timeout_ms, rkmessages, (size_t) batch_size);
+
+    if (count > 0 && revokes != consumer->revokes) {
+        count = kt_consume_filter_revoked(consumer, rkmessages, (int) count);
+    }
+
+    if (count > 0) {
+        if (consumer->metrics) {
+            kt_consume_record_metrics(consumer, rkmessages, (int) count);
+        }
+
+        kt_consume_dispatch(runner, rkmessages, (int) count, groups);
+    }
+
+    if (consumer->commitmgr) {
+        kt_commit_manager_poll(consumer);
+    }
+
+    if (consumer->flowctl) {
+        kt_flowctl_poll(consumer, 0);
+    }
+
+    if (count == -1) {
+        consumer->errcode = rd_kafka_last_error();
+        snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_consume_batch_queue failed: %s", rd_kafka_err2str(consumer->errcode));
+    }
+
+    return count;
+}
+
+
+static void kt_consume_detach (kt_consume_runner_t *runner, rd_kafka_queue_t *rkqu)
+{
+    kt_consumer consumer = runner->consumer;
+
+    /* workers finish queued batches, so all messages are destroyed before stop */
+    kt_consume_workers_stop(runner, runner->numworkers);
+
+    consumer->runner = NULL;
+
+    if (consumer->commitmgr) {
+        /* final commit of all done messages */
+        kt_commit_manager_commit(consumer, 0);
+    }
+
+    if (consumer->flowctl) {
+        /* paused partitions would stay paused in next run */
+        kt_flowctl_poll(consumer, 1);
+    }
+
+    if (! consumer->subscribed) {
+        kt_consume_partitions(consumer, rkqu, 0);
+    }
+
+    rd_kafka_queue_destroy(rkqu);
+
+    /* stop is consumed here, not at attach: a stop before run is kept */
+    uatomic_int_set(&consumer->run_stopping, 0);
+}
+
+
+int kafkatools_consumer_run (kt_consumer consumer, int workers, int batch_size, int timeout_ms, kt_consume_batch_cb batchcb, void *arg)
+{
+    int ret;
+
+    kt_consume_runner_t runner;
+
+    rd_kafka_queue_t *rkqu;
+    rd_kafka_message_t **rkmessages;
+    int *groups;
+
+    if (! batchcb || workers < 0) {
+        return KAFKATOOLS_EARG;
+    }
+
+    if (batch_size <= 0) {
+        batch_size = KT_CONSUME_BATCH_SIZE;
+    }
+    if (timeout_ms <= 0) {
+        timeout_ms = KT_CONSUME_TIMEOUT_MS;
+    }
+
+    bzero(&runner, sizeof(runner));
+
+    runner.consumer = consumer;
+    runner.batchcb = batchcb;
+    runner.arg = arg;
+
+    pthread_mutex_init(&runner.flushlock, NULL);
+    pthread_cond_init(&runner.flushcond, NULL);
+
+    if (workers) {
+        runner.workers = (kt_consume_worker_t *) mem_alloc_zero(workers, sizeof(kt_consume_worker_t));
+
+        ret = kt_consume_workers_start(&runner, workers, KT_CONSUME_WORKER_QUEUE);
+        if (ret != KAFKATOOLS_SUCCESS) {
+            pthread_cond_destroy(&runner.flushcond);
+            pthread_mutex_destroy(&runner.flushlock);
+            mem_free(runner.workers);
+            return ret;
+        }
+
+        runner.numworkers = workers;
+    }
+
+    rkmessages = (rd_kafka_message_t **) mem_alloc_unset(sizeof(rd_kafka_message_t *) * batch_size);
+    groups = (int *) mem_alloc_unset(sizeof(int) * batch_size * 2);
+
+    ret = kt_consume_attach(&runner, &rkqu);
+
+    while (ret == KAFKATOOLS_SUCCESS && ! uatomic_int_get(&consumer->run_stopping)) {
+        if (kt_consume_once(&runner, rkqu, timeout_ms, rkmessages, batch_size, groups) == -1) {
+            ret = KAFKATOOLS_ERROR;
+        }
+    }
+
+    kt_consume_detach(&runner, rkqu);
+
+    pthread_cond_destroy(&runner.flushcond);
+    pthread_mutex_destroy(&runner.flushlock);
+
+    mem_free(groups);
+    mem_free(rkmessages);
+    mem_free(runner.workers);
+
+    return ret;
+}
+
+
+void kafkatools_consumer_stop (kt_consumer consumer)
+{
+    uatomic_int_set(&consumer->run_stopping, 1);
+}
+
+
+void kafkatools_list_topic_partitions (rd_kafka_topic_partition_list_t *partitions, kt_tplist_cb tpcb, void *cbarg)
+{
+    int i;
+
+    for (i = 0 ; i < partitions->cnt ; i++) {
+        rd_kafka_topic_partition_t * tp = &partitions->elems[i];
+
+        if (! tpcb(tp, cbarg)) {
+            break;
+        }
+    }
+}
+
+
+/**
+ * Consumer reactor
+ *
+ * One thread serves many consumers. Queue of each consumer signals its own
+ *  eventfd through rd_kafka_queue_io_event_enable(), all of which are in
+ *  the epoll set of reactor. So the thread sleeps in epoll_wait() until any
+ *  queue has events, and then drains ready queues in batches which are
+ *  processed on the reactor thread.
+ */
+#if defined(__linux__)
+
+typedef struct kt_reactor_entry_t  kt_reactor_entry_t;
+
+struct kt_reactor_entry_t
+{
+    kt_reactor_entry_t *next;
+
+    /* epoll data of entry, never reused so stale events are dropped */
+    uint64_t id;
+
+    int efd;
+    rd_kafka_queue_t *rkqu;
+
+    kt_consume_runner_t runner;
+};
+
+
+typedef struct kafkatools_reactor_t
+{
+    /* held while entries are served, added or removed */
+    pthread_mutex_t lock;
 
-            ++i;
-        }
-    }
+    int epfd;
 
-    conf = rd_kafka_conf_new();
-    if (! conf) {
-        goto on_error_result;
-    }
+    /* written by kafkatools_reactor_stop() to wake up epoll_wait */
+    int wakefd;
+    uatomic_int stopping;
 
-    topic_conf = rd_kafka_topic_conf_new();
-    if (! topic_conf) {
-        goto on_error_result;
-    }
+    uint64_t lastid;
+    kt_reactor_entry_t *entries;
 
-    /* Sets the application's opaque pointer that will be passed to all topic
-     * callbacks as the rkt_opaque argument.
-     */
-    rd_kafka_topic_conf_set_opaque(topic_conf, opaque);
+    int batch_size;
+    rd_kafka_message_t **rkmessages;
+    int *groups;
+} kafkatools_reactor_t;
 
-    /* Emit RD_KAFKA_RESP_ERR__PARTITION_EOF event whenever the consumer reaches
-     * the end of a partition.
-     */
-    rd_kafka_conf_set(conf, "enable.partition.eof", "true", NULL, 0);
 
-    if (names) {
-        int i = 0;
+static void kt_reactor_entry_free (kafkatools_reactor_t *reactor, kt_reactor_entry_t *entry)
+{
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, entry->efd, NULL);
 
-        while (i < KAFKATOOLS_CONF_PROPS_MAX && names[i]) {
-            res = RD_KAFKA_CONF_UNKNOWN;
+    rd_kafka_queue_io_event_enable(entry->rkqu, -1, NULL, 0);
 
-            /* Try "topic." prefixed properties on topic conf first, and then fall through
-             * to global if it didnt match a topic configuration property.
-             */
-            if (! strncmp(names[i], "topic.", 6)) {
-                res = rd_kafka_topic_conf_set(topic_conf, names[i] + 6, values[i], errstr, sizeof(errstr));
-            }
+    kt_consume_detach(&entry->runner, entry->rkqu);
 
-            if (res == RD_KAFKA_CONF_UNKNOWN) {
-                res = rd_kafka_conf_set(conf, names[i], values[i], errstr, sizeof(errstr));
-            }
+    close(entry->efd);
 
-            if (res != RD_KAFKA_CONF_OK) {
-                result = KAFKATOOLS_ECONF;
-                goto on_error_result;
-            }
+    pthread_cond_destroy(&entry->runner.flushcond);
+    pthread_mutex_destroy(&entry->runner.flushlock);
 
-            ++i;
-        }
-    }
+    mem_free(entry);
+}
 
-    /* Callback called on partition assignment changes */
-    //rd_kafka_conf_set_rebalance_cb(conf, rebalance_cb);
 
-    /* Consumer groups require a group id */
-    if (groupid) {
-        if (rd_kafka_conf_set(conf, "group.id", groupid, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
-            result = KAFKATOOLS_ECONF;
-            goto on_error_result;
+/* unlink entry of consumer and free it, returns 0 if not found */
+static int kt_reactor_entry_remove (kafkatools_reactor_t *reactor, kt_consumer consumer)
+{
+    kt_reactor_entry_t **link = &reactor->entries;
+
+    while (*link) {
+        kt_reactor_entry_t *entry = *link;
+
+        if (entry->runner.consumer == consumer) {
+            *link = entry->next;
+            kt_reactor_entry_free(reactor, entry);
+            return 1;
         }
+
+        link = &entry->next;
     }
 
-    /* Set default topic config for pattern-matched topics. */
-    rd_kafka_conf_set_default_topic_conf(conf, topic_conf);
+    return 0;
+}
 
-    /* The topic config object is not usable after this call. */
-    topic_conf = 0;
 
-    /* Create Kafka handle */
-    rkConsumer = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+/**
+ * drain queue of entry by at most KT_REACTOR_DRAIN_BATCHES batches, so that
+ *  a busy consumer does not starve others. returns KAFKATOOLS_ERROR if the
+ *  consumer should be removed.
+ */
+static int kt_reactor_entry_drain (kafkatools_reactor_t *reactor, kt_reactor_entry_t *entry)
+{
+    int i;
+    uint64_t cnt = 1;
+    ssize_t count = 0;
 
-    if (! rkConsumer) {
-        result = KAFKATOOLS_ENOMEM;
-        goto on_error_result;
+    /* clear eventfd before draining, so later events signal it again */
+    if (read(entry->efd, &cnt, sizeof(cnt)) == -1) {
+        ;
     }
 
-    /* conf object is freed by this function on success and must not be used
-     * or destroyed by the application sub-sequently. */
-    conf = 0;
+    for (i = 0; i < KT_REACTOR_DRAIN_BATCHES; i++) {
+        count = kt_consume_once(&entry->runner, entry->rkqu, 0, reactor->rkmessages, reactor->batch_size, reactor->groups);
 
-    result = KAFKATOOLS_ERROR;
+        if (count < reactor->batch_size) {
+            break;
+        }
+    }
 
-    /* Add brokers if needed */
-    if (brokers) {
-        if (rd_kafka_brokers_add(rkConsumer, brokers) == 0) {
-            goto on_error_result;
+    if (i == KT_REACTOR_DRAIN_BATCHES) {
+        /* queue may have more: keep eventfd readable */
+        cnt = 1;
+        if (write(entry->efd, &cnt, sizeof(cnt)) == -1) {
+            ;
         }
     }
 
-    /* Redirect the main (rd_kafka_poll()) queue to the KafkaConsumer's
-     *   queue (rd_kafka_consumer_poll()).
-     * It is not permitted to call rd_kafka_poll() after directing the
-     *   main queue with rd_kafka_poll_set_consumer().
-     */
-    res = rd_kafka_poll_set_consumer(rkConsumer);
-    if (res != RD_KAFKA_CONF_OK) {
-        goto on_error_result;
+    if (count == -1 || uatomic_int_get(&entry->runner.consumer->run_stopping)) {
+        return KAFKATOOLS_ERROR;
     }
 
-    /* hand over kafka objects */
-    consumer->rkConsumer = rkConsumer;
-    rkConsumer = 0;
+    return KAFKATOOLS_SUCCESS;
+}
 
-    consumer->tp_list = tp_list;
-    tp_list = 0;
 
-    /*
-     * https://linux.die.net/man/3/pthread_mutex_init
-     */
-    if (pthread_mutex_init(&consumer->lock, NULL) != 0) {
-        result = KAFKATOOLS_EFATAL;
-        goto on_error_result;
-    }
+/* commits and flow control of idle consumers are served on ticks */
+static int kt_reactor_tick (kafkatools_reactor_t *reactor)
+{
+    int timeout_ms = -1;
 
-    consumer->opaque = opaque;
-    *outConsumer = consumer;
-    return KAFKATOOLS_SUCCESS;
+    kt_reactor_entry_t **link = &reactor->entries;
 
-on_error_result:
+    while (*link) {
+        kt_reactor_entry_t *entry = *link;
+        kt_consumer consumer = entry->runner.consumer;
 
-    kafkatools_consumer_destroy(consumer);
+        if (uatomic_int_get(&consumer->run_stopping)) {
+            *link = entry->next;
+            kt_reactor_entry_free(reactor, entry);
+            continue;
+        }
 
-    if (tp_list) {
-        rd_kafka_topic_partition_list_destroy(tp_list);
+        if (consumer->commitmgr) {
+            kt_commit_manager_poll(consumer);
+            timeout_ms = KT_REACTOR_TICK_MS;
+        }
+
+        if (consumer->flowctl) {
+            kt_flowctl_poll(consumer, 0);
+            timeout_ms = KT_REACTOR_TICK_MS;
+        }
+
+        link = &entry->next;
     }
-    if (topic_conf) {
-        rd_kafka_topic_conf_destroy(topic_conf);
+
+    return timeout_ms;
+}
+
+
+int kafkatools_reactor_create (int batch_size, kt_reactor *outreactor)
+{
+    struct epoll_event ev;
+
+    kt_reactor reactor;
+
+    if (batch_size <= 0) {
+        batch_size = KT_CONSUME_BATCH_SIZE;
     }
-    if (conf) {
-        rd_kafka_conf_destroy(conf);
+
+    reactor = (kt_reactor) mem_alloc_zero(1, sizeof(*reactor));
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd == -1) {
+        printf("(%s:%d) ERROR - epoll_create1 failed(%d).\n", THIS_FILE, __LINE__, errno);
+        mem_free(reactor);
+        return KAFKATOOLS_EFATAL;
     }
-    if (rkConsumer) {
-        rd_kafka_destroy(rkConsumer);
+
+    reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wakefd == -1) {
+        printf("(%s:%d) ERROR - eventfd failed(%d).\n", THIS_FILE, __LINE__, errno);
+        close(reactor->epfd);
+        mem_free(reactor);
+        return KAFKATOOLS_EFATAL;
     }
 
-    return result;
+    /* id 0 is wakefd */
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev);
+
+    pthread_mutex_init(&reactor->lock, NULL);
+
+    reactor->batch_size = batch_size;
+    reactor->rkmessages = (rd_kafka_message_t **) mem_alloc_unset(sizeof(rd_kafka_message_t *) * batch_size);
+    reactor->groups = (int *) mem_alloc_unset(sizeof(int) * batch_size * 2);
+
+    *outreactor = reactor;
+    return KAFKATOOLS_SUCCESS;
 }
 
 
-void kafkatools_consumer_destroy (kt_consumer consumer)
+void kafkatools_reactor_destroy (kt_reactor reactor)
 {
-    if (consumer) {
-        rd_kafka_t *rkConsumer = NULL;
+    if (reactor) {
+        pthread_mutex_lock(&reactor->lock);
 
-        pthread_mutex_lock(&consumer->lock);
+        while (reactor->entries) {
+            kt_reactor_entry_t *entry = reactor->entries;
 
-        if (consumer->rkConsumer) {
-            rkConsumer = consumer->rkConsumer;
-            consumer->rkConsumer = NULL;
+            reactor->entries = entry->next;
+            kt_reactor_entry_free(reactor, entry);
         }
 
-        if (consumer->tp_list) {
-            rd_kafka_topic_partition_list_destroy(consumer->tp_list);
-        }
+        pthread_mutex_unlock(&reactor->lock);
 
-        rbtree_traverse(&consumer->rktopic_tree, rktopic_object_release, 0);
-        rbtree_clean(&consumer->rktopic_tree);
+        close(reactor->wakefd);
+        close(reactor->epfd);
 
-        if (rkConsumer) {
-            /* Destroy Kafka handle. This is a blocking operation.
-             *   rd_kafka_consumer_close() will be called from this function.
-             */
-            rd_kafka_destroy(rkConsumer);
-        }
+        pthread_mutex_destroy(&reactor->lock);
 
-        pthread_mutex_destroy(&consumer->lock);
-        mem_free(consumer);
+        mem_free(reactor->groups);
+        mem_free(reactor->rkmessages);
+        mem_free(reactor);
     }
 }
 
 
-const char * kafkatools_consumer_get_errstr (kt_consumer consumer, int *perrcode)
+int kafkatools_reactor_add (kt_reactor reactor, kt_consumer consumer, kt_consume_batch_cb batchcb, void *arg)
 {
-    if (perrcode) {
-        *perrcode = consumer->errcode;
+    int ret;
+    uint64_t one = 1;
+
+    struct epoll_event ev;
+    kt_reactor_entry_t *entry;
+
+    if (! batchcb || consumer->runner) {
+        return KAFKATOOLS_EARG;
     }
 
-    return consumer->errstr;
-}
+    entry = (kt_reactor_entry_t *) mem_alloc_zero(1, sizeof(*entry));
 
+    entry->runner.consumer = consumer;
+    entry->runner.batchcb = batchcb;
+    entry->runner.arg = arg;
 
-rd_kafka_topic_conf_t * kafkatools_consumer_new_topic_conf (kt_consumer consumer, const char * names[], const char * values[])
-{
-    rd_kafka_topic_conf_t * topic_conf = rd_kafka_topic_conf_new();
+    pthread_mutex_init(&entry->runner.flushlock, NULL);
+    pthread_cond_init(&entry->runner.flushcond, NULL);
 
-    if (! topic_conf) {
-        consumer->errcode = KAFKATOOLS_ENOMEM;
-        snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_topic_conf_new error(%d): Out memory", KAFKATOOLS_ENOMEM);
-        return NULL;
+    entry->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (entry->efd == -1) {
+        printf("(%s:%d) ERROR - eventfd failed(%d).\n", THIS_FILE, __LINE__, errno);
+        pthread_cond_destroy(&entry->runner.flushcond);
+        pthread_mutex_destroy(&entry->runner.flushlock);
+        mem_free(entry);
+        return KAFKATOOLS_EFATAL;
     }
 
-    if (names) {
-        rd_kafka_conf_res_t res;
-
-        int i = 0;
+    pthread_mutex_lock(&reactor->lock);
 
-        while (i < KAFKATOOLS_CONF_PROPS_MAX && names[i]) {
-            res = rd_kafka_topic_conf_set(topic_conf, names[i], values[i], consumer->errstr, sizeof(consumer->errstr));
+    ret = kt_consume_attach(&entry->runner, &entry->rkqu);
 
-            if (res != RD_KAFKA_CONF_OK) {
-                consumer->errcode = KAFKATOOLS_ECONF;
+    if (ret == KAFKATOOLS_SUCCESS) {
+        /* eventfd only accepts writes of 8 bytes counter */
+        rd_kafka_queue_io_event_enable(entry->rkqu, entry->efd, &one, sizeof(one));
 
-                rd_kafka_topic_conf_destroy(topic_conf);
+        entry->id = ++reactor->lastid;
 
-                return NULL;
-            }
+        ev.events = EPOLLIN;
+        ev.data.u64 = entry->id;
 
-            ++i;
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, entry->efd, &ev) == -1) {
+            printf("(%s:%d) ERROR - epoll_ctl failed(%d).\n", THIS_FILE, __LINE__, errno);
+            ret = KAFKATOOLS_EFATAL;
         }
     }
 
-    consumer->errcode = KAFKATOOLS_SUCCESS;
-    *consumer->errstr = 0;
+    if (ret != KAFKATOOLS_SUCCESS) {
+        kt_reactor_entry_free(reactor, entry);
+        pthread_mutex_unlock(&reactor->lock);
+        return ret;
+    }
 
-    return topic_conf;
+    entry->next = reactor->entries;
+    reactor->entries = entry;
+
+    /* events queued before attached are not signaled */
+    if (write(entry->efd, &one, sizeof(one)) == -1) {
+        ;
+    }
+
+    pthread_mutex_unlock(&reactor->lock);
+
+    /* wake up reactor to tick for new consumer */
+    if (write(reactor->wakefd, &one, sizeof(one)) == -1) {
+        ;
+    }
+
+    return KAFKATOOLS_SUCCESS;
 }
 
 
-kt_topic kafkatools_consumer_get_topic (kt_consumer consumer, const char *topic_name, rd_kafka_topic_conf_t *topic_conf)
+int kafkatools_reactor_remove (kt_reactor reactor, kt_consumer consumer)
 {
-    red_black_node_t *node;
+    int found;
 
-    /* Topic handles are refcounted internally and calling rd_kafka_topic_new()
-     *  again with the same topic name will return the previous topic handle
-     *  without updating the original handle's configuration.
-     *
-     * Applications must eventually call rd_kafka_topic_destroy() for each
-     *  succesfull call to rd_kafka_topic_new() to clear up resources.
-     *
-     * returns the new topic handle or NULL on error.
-     */
-    rd_kafka_topic_t *rktopic;
+    pthread_mutex_lock(&reactor->lock);
+    found = kt_reactor_entry_remove(reactor, consumer);
+    pthread_mutex_unlock(&reactor->lock);
 
-    rktopic = rd_kafka_topic_new(consumer->rkConsumer, topic_name, topic_conf);
+    return (found? KAFKATOOLS_SUCCESS : KAFKATOOLS_EARG);
+}
 
-    if (! rktopic) {
-        consumer->errcode = KAFKATOOLS_ENOMEM;
-        snprintf(consumer->errstr, sizeof(consumer->errstr), "rd_kafka_topic_new error(%d): Out memory", KAFKATOOLS_ENOMEM);
 
-        return NULL;
-    }
+int kafkatools_reactor_run (kt_reactor reactor)
+{
+    int i, n, timeout_ms;
 
-    node = rbtree_find(&consumer->rktopic_tree, (void*) rktopic);
-    if (! node) {
-        /* 如果 tree 没有 topic, 插入新 topic */
-        int is_new_node;
+    struct epoll_event events[KT_REACTOR_EVENTS];
 
-        node = rbtree_insert_unique(&consumer->rktopic_tree, (void *) rktopic, &is_new_node);
-        if (! node || ! is_new_node) {
-            rd_kafka_topic_destroy(rktopic);
+    pthread_mutex_lock(&reactor->lock);
+    timeout_ms = kt_reactor_tick(reactor);
+    pthread_mutex_unlock(&reactor->lock);
 
-            consumer->errcode = KAFKATOOLS_ERROR;
-            snprintf(consumer->errstr, sizeof(consumer->errstr), "rbtree_insert_unique error(%d): Unexpect", KAFKATOOLS_ERROR);
+    while (! uatomic_int_get(&reactor->stopping)) {
+        n = epoll_wait(reactor->epfd, events, KT_REACTOR_EVENTS, timeout_ms);
 
-            return NULL;
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            printf("(%s:%d) ERROR - epoll_wait failed(%d).\n", THIS_FILE, __LINE__, errno);
+            uatomic_int_set(&reactor->stopping, 0);
+            return KAFKATOOLS_ERROR;
         }
-    } else {
-        /* 如果 tree 中已经存在 topic, 释放 topic 引用计数 */
-        rd_kafka_topic_destroy(rktopic);
+
+        pthread_mutex_lock(&reactor->lock);
+
+        for (i = 0; i < n; i++) {
+            kt_reactor_entry_t *entry;
+
+            if (events[i].data.u64 == 0) {
+                uint64_t cnt;
+
+                if (read(reactor->wakefd, &cnt, sizeof(cnt)) == -1) {
+                    ;
+                }
+                continue;
+            }
+
+            /* entry may be removed since epoll_wait returned */
+            for (entry = reactor->entries; entry; entry = entry->next) {
+                if (entry->id == events[i].data.u64) {
+                    break;
+                }
+            }
+
+            if (entry && kt_reactor_entry_drain(reactor, entry) != KAFKATOOLS_SUCCESS) {
+                printf("(%s:%d) WARN - consumer removed from reactor: %s\n", THIS_FILE, __LINE__, entry->runner.consumer->errstr);
+                kt_reactor_entry_remove(reactor, entry->runner.consumer);
+            }
+        }
+
+        timeout_ms = kt_reactor_tick(reactor);
+
+        pthread_mutex_unlock(&reactor->lock);
     }
 
-    /* do not call rd_kafka_topic_destroy() for below object! */
-    return (kt_topic) rktopic;
+    /* stop is consumed here, not at start: a stop before run is kept */
+    uatomic_int_set(&reactor->stopping, 0);
+
+    return KAFKATOOLS_SUCCESS;
 }
 
 
-rd_kafka_topic_partition_list_t * kafkatools_consumer_get_topics (kt_consumer consumer)
+void kafkatools_reactor_stop (kt_reactor reactor)
 {
-    return consumer->tp_list;
-}
+    uint64_t one = 1;
 
+    uatomic_int_set(&reactor->stopping, 1);
 
-rd_kafka_t * kafkatools_consumer_get_rdkafka (kt_consumer consumer)
-{
-    return consumer->rkConsumer;
+    if (write(reactor->wakefd, &one, sizeof(one)) == -1) {
+        ;
+    }
 }
 
+#else /* ! __linux__ */
 
-void * kafkatools_consumer_get_opaque (kt_consumer consumer)
+int kafkatools_reactor_create (int batch_size, kt_reactor *outreactor)
 {
-    return consumer->opaque;
+    printf("(%s:%d) ERROR - reactor not supported.\n", THIS_FILE, __LINE__);
+    return KAFKATOOLS_ERROR;
 }
 
 
-pthread_mutex_t * kafkatools_consumer_get_mutex (kt_consumer consumer)
+void kafkatools_reactor_destroy (kt_reactor reactor)
 {
-    return &(consumer->lock);
 }
 
 
-int kafkatools_consumer_start_subscribe (kt_consumer consumer)
+int kafkatools_reactor_add (kt_reactor reactor, kt_consumer consumer, kt_consume_batch_cb batchcb, void *arg)
 {
-    /* rd_kafka_subscribe() is an asynchronous method which returns immediately.
-     *   background threads will (re)join the group, wait for group rebalance,
-     *   issue any registered rebalance_cb, assign() the assigned partitions,
-     *   and then start fetching messages.
-     * This cycle may take up to
-     *   session.timeout.ms * 2 or more to complete.
-     */
-    if (consumer->errcode == RD_KAFKA_RESP_ERR_NO_ERROR) {
-        return KAFKATOOLS_SUCCESS;
-    } else {
-        const char *str = rd_kafka_err2str(consumer->errcode);
+    return KAFKATOOLS_EARG;
+}
 
-        if (str) {
-            snprintf(consumer->errstr, sizeof(consumer->errstr), "%s", str);
-        } else {
-            snprintf(consumer->errstr, sizeof(consumer->errstr), "unknown rdkafka error");
-        }
 
-        return KAFKATOOLS_ERROR;
-    }
+int kafkatools_reactor_remove (kt_reactor reactor, kt_consumer consumer)
+{
+    return KAFKATOOLS_EARG;
 }
 
 
-void kafkatools_list_topic_partitions (rd_kafka_topic_partition_list_t *partitions, kt_tplist_cb tpcb, void *cbarg)
+int kafkatools_reactor_run (kt_reactor reactor)
 {
-    int i;
+    return KAFKATOOLS_EARG;
+}
 
-    for (i = 0 ; i < partitions->cnt ; i++) {
-        rd_kafka_topic_partition_t * tp = &partitions->elems[i];
 
-        if (! tpcb(tp, cbarg)) {
-            break;
-        }
-    }
+void kafkatools_reactor_stop (kt_reactor reactor)
+{
 }
+
+#endif
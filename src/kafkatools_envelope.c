@@ -0,0 +1,498 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_envelope.c
+ *  client side envelope batching of small records.
+ *
+ *  Many small application records are packed into one kafka message, so
+ *   the per-message overhead of librdkafka and of the MessageSet is paid
+ *   once per envelope. Envelopes are produced when full (maxbytes) or when
+ *   the oldest record has waited linger_ms.
+ *
+ *  Envelope frame (integers in network byte order):
+ *
+ *    "KTE" | version(1) | count(4) | record ... record
+ *
+ *    record := varint(keylen + 1, 0 if no key) | varint(valuelen) | key | value
+ *
+ *  Varints are unsigned LEB128, so a record of 50-200 bytes costs 2 or 3
+ *   bytes of framing. kafkatools_envelope_iter_next() unpacks records of
+ *   a consumed envelope without copying.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.2
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/uatomic.h>
+
+static const char THIS_FILE[] = "kafkatools_envelope.c";
+
+
+#define KT_ENVELOPE_MAGIC          "KTE"
+#define KT_ENVELOPE_VERSION        1
+#define KT_ENVELOPE_HEADSIZE       8
+
+/* max bytes of 2 varints of a record */
+#define KT_ENVELOPE_FRAME_MAX      10
+
+#define KT_ENVELOPE_BYTES_MIN      64
+#define KT_ENVELOPE_BYTES_DEFAULT  65536
+#define KT_ENVELOPE_LINGER_DEFAULT 5
+
+
+typedef struct
+{
+    pthread_mutex_t lock;
+
+    /* RD_KAFKA_PARTITION_UA or partition in site's scope */
+    int32_t partition;
+
+    /* records packed in buf since firstus */
+    int count;
+    size_t len;
+    sb8 firstus;
+
+    char *buf;
+} kt_envelope_bucket_t;
+
+
+typedef struct kafkatools_envelope_t
+{
+    kt_producer producer;
+    kafkatools_msg_site_t site;
+
+    size_t maxbytes;
+    int linger_ms;
+
+    uatomic_int stopping;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t linger_thread;
+
+    uatomic_int64 records;
+    uatomic_int64 envelopes;
+    uatomic_int64 failed;
+
+    /* bucket 0 is for RD_KAFKA_PARTITION_UA */
+    int numbuckets;
+    kt_envelope_bucket_t buckets[0];
+} kafkatools_envelope_t;
+
+
+static int kt_varint_put (char *p, uint32_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (char) ((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char) v;
+
+    return n;
+}
+
+
+static const char * kt_varint_get (const char *p, const char *end, uint32_t *v)
+{
+    int shift = 0;
+    uint32_t u = 0;
+
+    while (p < end && shift < 35) {
+        unsigned char c = (unsigned char) *p++;
+
+        u |= (uint32_t) (c & 0x7F) << shift;
+
+        if (! (c & 0x80)) {
+            *v = u;
+            return p;
+        }
+
+        shift += 7;
+    }
+
+    /* truncated or overlong */
+    return NULL;
+}
+
+
+static void kt_envelope_freebuf (void *msgbuf, ssize_t msglen, void *_private)
+{
+    kafkatools_slab_free(msgbuf);
+}
+
+
+/**
+ * produces envelope of bucket. the buffer is handed to librdkafka without
+ *  copy and freed on its delivery report. caller holds bucket lock.
+ */
+static void kt_envelope_produce (kt_envelope env, kt_envelope_bucket_t *bucket)
+{
+    int ret;
+    uint32_t count = (uint32_t) bucket->count;
+
+    kafkatools_msg_site_t site = env->site;
+    kafkatools_msg_data_t ktmsg = {0};
+
+    bucket->buf[4] = (char) (count >> 24);
+    bucket->buf[5] = (char) (count >> 16);
+    bucket->buf[6] = (char) (count >> 8);
+    bucket->buf[7] = (char) count;
+
+    ktmsg.msgbuf = bucket->buf;
+    ktmsg.msglen = (ssize_t) bucket->len;
+
+    site.partition = bucket->partition;
+
+    ret = kafkatools_produce_batch(env->producer, &site, &ktmsg, 1, KAFKATOOLS_MSGF_NOCOPY,
+            kt_envelope_freebuf, NULL, 100, KAFKATOOLS_WAIT_INFINITE);
+
+    if (ret == 1) {
+        uatomic_int64_add(&env->envelopes, 1);
+        uatomic_int64_add(&env->records, bucket->count);
+    } else {
+        printf("(%s:%d) ERROR - produce envelope of %d records failed\n", THIS_FILE, __LINE__, bucket->count);
+
+        kafkatools_slab_free(bucket->buf);
+        uatomic_int64_add(&env->failed, bucket->count);
+    }
+
+    bucket->buf = NULL;
+    bucket->count = 0;
+    bucket->len = 0;
+}
+
+
+static void * kt_envelope_linger_thread (void *arg)
+{
+    int i;
+    kt_envelope env = (kt_envelope) arg;
+
+    int wait_ms = (env->linger_ms > 1? env->linger_ms / 2 : 1);
+
+    while (! env->stopping) {
+        struct timespec abstime;
+        sb8 dueus;
+
+        pthread_mutex_lock(&env->lock);
+        if (! env->stopping) {
+            getfuturetimeofday(&abstime, wait_ms);
+            pthread_cond_timedwait(&env->cond, &env->lock, &abstime);
+        }
+        pthread_mutex_unlock(&env->lock);
+
+        dueus = monotonic_usec() - (sb8) env->linger_ms * 1000;
+
+        for (i = 0; i < env->numbuckets; i++) {
+            kt_envelope_bucket_t *bucket = &env->buckets[i];
+
+            /* racy peek, checked again under lock */
+            if (bucket->count && bucket->firstus <= dueus) {
+                pthread_mutex_lock(&bucket->lock);
+                if (bucket->count && bucket->firstus <= dueus) {
+                    kt_envelope_produce(env, bucket);
+                }
+                pthread_mutex_unlock(&bucket->lock);
+            }
+        }
+
+        /* serve delivery reports which free envelopes */
+        kafkatools_producer_poll(env->producer, 0);
+    }
+
+    return NULL;
+}
+
+
+int kafkatools_envelope_create (kt_producer producer, const kafkatools_msg_site_t *ktsite, size_t maxbytes, int linger_ms, kt_envelope *outenv)
+{
+    int i, numbuckets;
+
+    kafkatools_envelope_t *env;
+
+    if (! producer || ! ktsite || ! ktsite->topic ||
+        ktsite->partitionid_min < 0 || ktsite->partitionid_max < ktsite->partitionid_min) {
+        return KAFKATOOLS_EARG;
+    }
+
+    if (kafkatools_producer_completion_fd(producer) != -1) {
+        /* linger thread can not wait for queue space freed by reaping */
+        printf("(%s:%d) ERROR - envelope not supported with kafkatools.completion\n", THIS_FILE, __LINE__);
+        return KAFKATOOLS_EARG;
+    }
+
+    if (maxbytes == 0) {
+        maxbytes = KT_ENVELOPE_BYTES_DEFAULT;
+    } else if (maxbytes < KT_ENVELOPE_BYTES_MIN || maxbytes > INT_MAX) {
+        printf("(%s:%d) ERROR - invalid envelope maxbytes: %" PRIu64 "\n", THIS_FILE, __LINE__, (uint64_t) maxbytes);
+        return KAFKATOOLS_EARG;
+    }
+
+    if (linger_ms == 0) {
+        linger_ms = KT_ENVELOPE_LINGER_DEFAULT;
+    } else if (linger_ms < 0) {
+        printf("(%s:%d) ERROR - invalid envelope linger_ms: %d\n", THIS_FILE, __LINE__, linger_ms);
+        return KAFKATOOLS_EARG;
+    }
+
+    numbuckets = ktsite->partitionid_max - ktsite->partitionid_min + 2;
+
+    env = (kafkatools_envelope_t *) mem_alloc_zero(1, sizeof(*env) + sizeof(kt_envelope_bucket_t) * numbuckets);
+
+    env->producer = producer;
+    env->site = *ktsite;
+    env->maxbytes = maxbytes;
+    env->linger_ms = linger_ms;
+    env->numbuckets = numbuckets;
+
+    for (i = 0; i < numbuckets; i++) {
+        env->buckets[i].partition = (i == 0)? RD_KAFKA_PARTITION_UA : (ktsite->partitionid_min + i - 1);
+        pthread_mutex_init(&env->buckets[i].lock, NULL);
+    }
+
+    if (pthread_mutex_init(&env->lock, NULL) != 0) {
+        goto on_error_result;
+    }
+
+    if (pthread_cond_init(&env->cond, NULL) != 0) {
+        pthread_mutex_destroy(&env->lock);
+        goto on_error_result;
+    }
+
+    if (pthread_create(&env->linger_thread, NULL, kt_envelope_linger_thread, (void *) env) != 0) {
+        pthread_cond_destroy(&env->cond);
+        pthread_mutex_destroy(&env->lock);
+        goto on_error_result;
+    }
+
+    *outenv = env;
+    return KAFKATOOLS_SUCCESS;
+
+on_error_result:
+    for (i = 0; i < numbuckets; i++) {
+        pthread_mutex_destroy(&env->buckets[i].lock);
+    }
+    mem_free(env);
+
+    return KAFKATOOLS_EFATAL;
+}
+
+
+void kafkatools_envelope_destroy (kt_envelope env)
+{
+    if (env) {
+        int i;
+
+        uatomic_int_set(&env->stopping, 1);
+
+        pthread_mutex_lock(&env->lock);
+        pthread_cond_signal(&env->cond);
+        pthread_mutex_unlock(&env->lock);
+
+        pthread_join(env->linger_thread, NULL);
+
+        /* pending records are produced before destroy returns */
+        kafkatools_envelope_flush(env);
+
+        for (i = 0; i < env->numbuckets; i++) {
+            pthread_mutex_destroy(&env->buckets[i].lock);
+        }
+
+        pthread_cond_destroy(&env->cond);
+        pthread_mutex_destroy(&env->lock);
+
+        mem_free(env);
+    }
+}
+
+
+int kafkatools_envelope_add (kt_envelope env, int32_t partition, const kafkatools_msg_data_t *ktmsg)
+{
+    size_t need;
+    char *p;
+
+    kt_envelope_bucket_t *bucket;
+
+    if (ktmsg->keylen < 0 || ktmsg->msglen < 0 || (ktmsg->keylen && ! ktmsg->key)) {
+        return KAFKATOOLS_EARG;
+    }
+
+    need = KT_ENVELOPE_FRAME_MAX + (size_t) ktmsg->keylen + (size_t) ktmsg->msglen;
+
+    if (need > env->maxbytes - KT_ENVELOPE_HEADSIZE) {
+        /* never fits in an envelope */
+        return KAFKATOOLS_EARG;
+    }
+
+    if (partition == RD_KAFKA_PARTITION_UA) {
+        bucket = &env->buckets[0];
+    } else if (partition >= env->site.partitionid_min && partition <= env->site.partitionid_max) {
+        bucket = &env->buckets[partition - env->site.partitionid_min + 1];
+    } else {
+        return KAFKATOOLS_EARG;
+    }
+
+    pthread_mutex_lock(&bucket->lock);
+
+    if (bucket->count && bucket->len + need > env->maxbytes) {
+        kt_envelope_produce(env, bucket);
+    }
+
+    if (! bucket->buf) {
+        bucket->buf = (char *) kafkatools_slab_alloc(env->maxbytes);
+
+        memcpy(bucket->buf, KT_ENVELOPE_MAGIC, 3);
+        bucket->buf[3] = (char) KT_ENVELOPE_VERSION;
+
+        bucket->len = KT_ENVELOPE_HEADSIZE;
+    }
+
+    if (! bucket->count) {
+        bucket->firstus = monotonic_usec();
+    }
+
+    p = bucket->buf + bucket->len;
+
+    p += kt_varint_put(p, ktmsg->key? (uint32_t) ktmsg->keylen + 1 : 0);
+    p += kt_varint_put(p, (uint32_t) ktmsg->msglen);
+
+    if (ktmsg->keylen) {
+        memcpy(p, ktmsg->key, ktmsg->keylen);
+        p += ktmsg->keylen;
+    }
+    if (ktmsg->msglen) {
+        memcpy(p, ktmsg->msgbuf, ktmsg->msglen);
+        p += ktmsg->msglen;
+    }
+
+    bucket->len = (size_t) (p - bucket->buf);
+    bucket->count++;
+
+    pthread_mutex_unlock(&bucket->lock);
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_envelope_flush (kt_envelope env)
+{
+    int i, flushed = 0;
+
+    for (i = 0; i < env->numbuckets; i++) {
+        kt_envelope_bucket_t *bucket = &env->buckets[i];
+
+        pthread_mutex_lock(&bucket->lock);
+        if (bucket->count) {
+            kt_envelope_produce(env, bucket);
+            flushed++;
+        }
+        pthread_mutex_unlock(&bucket->lock);
+    }
+
+    return flushed;
+}
+
+
+void kafkatools_envelope_stats (kt_envelope env, int64_t *records, int64_t *envelopes, int64_t *failed)
+{
+    if (records) {
+        *records = uatomic_int64_get(&env->records);
+    }
+    if (envelopes) {
+        *envelopes = uatomic_int64_get(&env->envelopes);
+    }
+    if (failed) {
+        *failed = uatomic_int64_get(&env->failed);
+    }
+}
+
+
+int kafkatools_envelope_iter_init (kt_envelope_iter_t *iter, const void *payload, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) payload;
+
+    if (! p || len < KT_ENVELOPE_HEADSIZE || memcmp(p, KT_ENVELOPE_MAGIC, 3) || p[3] != KT_ENVELOPE_VERSION) {
+        return KAFKATOOLS_EARG;
+    }
+
+    iter->count = (int) (((uint32_t) p[4] << 24) | ((uint32_t) p[5] << 16) | ((uint32_t) p[6] << 8) | (uint32_t) p[7]);
+    iter->index = 0;
+
+    iter->next = (const char *) p + KT_ENVELOPE_HEADSIZE;
+    iter->end = (const char *) p + len;
+
+    if (iter->count < 0) {
+        return KAFKATOOLS_EARG;
+    }
+
+    return iter->count;
+}
+
+
+int kafkatools_envelope_iter_next (kt_envelope_iter_t *iter, kafkatools_msg_data_t *record)
+{
+    uint32_t keyhint, msglen;
+    const char *p;
+
+    if (iter->index >= iter->count) {
+        return 0;
+    }
+
+    p = kt_varint_get(iter->next, iter->end, &keyhint);
+    if (p) {
+        p = kt_varint_get(p, iter->end, &msglen);
+    }
+
+    if (! p || (size_t) (iter->end - p) < (size_t) (keyhint? keyhint - 1 : 0) + msglen) {
+        /* malformed envelope: stop iteration */
+        iter->index = iter->count;
+        return KAFKATOOLS_EARG;
+    }
+
+    if (keyhint) {
+        record->key = (char *) p;
+        record->keylen = (ssize_t) keyhint - 1;
+        p += keyhint - 1;
+    } else {
+        record->key = NULL;
+        record->keylen = 0;
+    }
+
+    record->msgbuf = (char *) p;
+    record->msglen = (ssize_t) msglen;
+    record->_private = NULL;
+
+    iter->next = p + msglen;
+    iter->index++;
+
+    return 1;
+}
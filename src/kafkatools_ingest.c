@@ -0,0 +1,433 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_ingest.c
+ *  bounded lock-free multi-producer/single-consumer ingest ring in front
+ *  of kafka producer.
+ *
+ *  Application threads copy messages into pre-allocated slots with
+ *   kafkatools_ingest_try_enqueue() which never blocks. A drain thread
+ *   pops slots in bulk and hands them to librdkafka with
+ *   kafkatools_produce_batch(), one batch per partition.
+ *
+ * @refer
+ *    http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/uatomic.h>
+
+
+#define KT_INGEST_DRAIN_BATCH     1024
+#define KT_INGEST_IDLE_WAIT_MS    1
+#define KT_CACHELINE_SIZE         64
+
+
+typedef struct
+{
+    /* Vyukov sequence: == pos when free, == pos + 1 when filled */
+    uatomic_int64 seq;
+
+    int32_t partition;
+    int keylen;
+    int msglen;
+
+    void * _private;
+
+    /* slot memory in arena: key followed by payload */
+    char *buf;
+} kt_ingest_slot_t;
+
+
+typedef struct kafkatools_ingest_t
+{
+    /* enqueue position shared by producer threads */
+    uatomic_int64 tail;
+    char _pad1[KT_CACHELINE_SIZE - sizeof(uatomic_int64)];
+
+    /* dequeue position owned by drain thread */
+    uatomic_int64 head;
+    char _pad2[KT_CACHELINE_SIZE - sizeof(uatomic_int64)];
+
+    int64_t mask;
+    int slots;
+    int slotsize;
+
+    int highwater;
+    int lowwater;
+    uatomic_int above_highwater;
+
+    kt_ingest_hwm_cb hwmcb;
+    void * hwmarg;
+
+    kt_producer producer;
+    kafkatools_msg_site_t site;
+
+    uatomic_int stopping;
+    uatomic_int sleeping;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t drain_thread;
+
+    /* drain thread work area */
+    kafkatools_msg_data_t *msgs;
+    kafkatools_msg_data_t *sorted;
+    int32_t *partitions;
+    int *counts;
+
+    uatomic_int64 produced;
+    uatomic_int64 failed;
+
+    kt_ingest_slot_t *ring;
+    char *arena;
+} kafkatools_ingest_t;
+
+
+static void kt_ingest_check_lowwater (kt_ingest ingest)
+{
+    if (ingest->above_highwater) {
+        int used = (int) (uatomic_int64_get(&ingest->tail) - ingest->head);
+
+        if (used <= ingest->lowwater && uatomic_int_cas(&ingest->above_highwater, 1, 0)) {
+            ingest->hwmcb(ingest, 0, used, ingest->hwmarg);
+        }
+    }
+}
+
+
+/**
+ * hands count of popped messages to producer. messages are grouped by
+ *  partition (counting sort over site's partitionid scope) so that each
+ *  kafkatools_produce_batch() call goes to one toppar.
+ */
+static void kt_ingest_produce (kt_ingest ingest, int count)
+{
+    int i, k, start, ret;
+    int nbuckets = ingest->site.partitionid_max - ingest->site.partitionid_min + 2;
+
+    kafkatools_msg_site_t site = ingest->site;
+
+    bzero(ingest->counts, sizeof(int) * (nbuckets + 1));
+
+    /* bucket 0 is for RD_KAFKA_PARTITION_UA */
+    for (i = 0; i < count; i++) {
+        k = (ingest->partitions[i] == RD_KAFKA_PARTITION_UA)? 0 : (ingest->partitions[i] - ingest->site.partitionid_min + 1);
+        ingest->counts[k + 1]++;
+    }
+
+    for (k = 1; k <= nbuckets; k++) {
+        ingest->counts[k] += ingest->counts[k - 1];
+    }
+
+    for (i = 0; i < count; i++) {
+        k = (ingest->partitions[i] == RD_KAFKA_PARTITION_UA)? 0 : (ingest->partitions[i] - ingest->site.partitionid_min + 1);
+        ingest->sorted[ingest->counts[k]++] = ingest->msgs[i];
+    }
+
+    /* counts[k] is now the end of bucket k */
+    start = 0;
+    for (k = 0; k < nbuckets; k++) {
+        if (ingest->counts[k] > start) {
+            site.partition = (k == 0)? RD_KAFKA_PARTITION_UA : (ingest->site.partitionid_min + k - 1);
+
+            ret = kafkatools_produce_batch(ingest->producer, &site, ingest->sorted + start, ingest->counts[k] - start,
+                    KAFKATOOLS_MSGF_COPY, NULL, NULL, 100, KAFKATOOLS_WAIT_INFINITE);
+
+            uatomic_int64_add(&ingest->produced, ret);
+            uatomic_int64_add(&ingest->failed, ingest->counts[k] - start - ret);
+
+            start = ingest->counts[k];
+        }
+    }
+}
+
+
+static void * kt_ingest_drain_thread (void *arg)
+{
+    kt_ingest ingest = (kt_ingest) arg;
+
+    for (;;) {
+        int count = 0;
+        int64_t pos = ingest->head;
+
+        while (count < KT_INGEST_DRAIN_BATCH) {
+            kt_ingest_slot_t *slot = &ingest->ring[pos & ingest->mask];
+
+            if (uatomic_int64_get(&slot->seq) != pos + 1) {
+                break;
+            }
+
+            ingest->msgs[count].key = slot->keylen? slot->buf : NULL;
+            ingest->msgs[count].keylen = slot->keylen;
+            ingest->msgs[count].msgbuf = slot->buf + slot->keylen;
+            ingest->msgs[count].msglen = slot->msglen;
+            ingest->msgs[count]._private = slot->_private;
+            ingest->partitions[count] = slot->partition;
+
+            count++;
+            pos++;
+        }
+
+        if (count) {
+            int64_t i;
+
+            /* payloads are copied by librdkafka, slots can be reused after */
+            kt_ingest_produce(ingest, count);
+
+            uatomic_barrier();
+
+            for (i = ingest->head; i < pos; i++) {
+                uatomic_int64_set(&ingest->ring[i & ingest->mask].seq, i + ingest->mask + 1);
+            }
+            uatomic_int64_set(&ingest->head, pos);
+
+            if (ingest->hwmcb) {
+                kt_ingest_check_lowwater(ingest);
+            }
+            continue;
+        }
+
+        if (ingest->stopping) {
+            break;
+        }
+
+        /* ring is empty: serve delivery reports and wait for producers */
+        kafkatools_producer_poll(ingest->producer, 0);
+
+        pthread_mutex_lock(&ingest->lock);
+        uatomic_int_set(&ingest->sleeping, 1);
+
+        if (uatomic_int64_get(&ingest->tail) == ingest->head && ! ingest->stopping) {
+            struct timespec abstime;
+
+            getfuturetimeofday(&abstime, KT_INGEST_IDLE_WAIT_MS);
+
+            pthread_cond_timedwait(&ingest->cond, &ingest->lock, &abstime);
+        }
+
+        uatomic_int_set(&ingest->sleeping, 0);
+        pthread_mutex_unlock(&ingest->lock);
+    }
+
+    return NULL;
+}
+
+
+int kafkatools_ingest_create (kt_producer producer, const kafkatools_msg_site_t *ktsite, int slots, int slotsize, int highwater, kt_ingest_hwm_cb hwmcb, void *hwmarg, kt_ingest *outingest)
+{
+    int i, capacity, nbuckets;
+
+    kafkatools_ingest_t *ingest;
+
+    if (! producer || ! ktsite || ! ktsite->topic || slots < 2 || slotsize < 1 ||
+        ktsite->partitionid_min < 0 || ktsite->partitionid_max < ktsite->partitionid_min) {
+        return KAFKATOOLS_EARG;
+    }
+
+    /* round up to power of 2 */
+    capacity = 2;
+    while (capacity < slots) {
+        if (capacity > (INT_MAX >> 1)) {
+            return KAFKATOOLS_EARG;
+        }
+        capacity <<= 1;
+    }
+
+    slotsize = (int) memapi_align_psize(slotsize);
+    nbuckets = ktsite->partitionid_max - ktsite->partitionid_min + 2;
+
+    ingest = (kafkatools_ingest_t *) mem_alloc_zero(1, sizeof(*ingest));
+
+    ingest->ring = (kt_ingest_slot_t *) mem_alloc_zero(capacity, sizeof(kt_ingest_slot_t));
+    ingest->arena = (char *) mem_alloc_unset((size_t) capacity * slotsize);
+
+    ingest->msgs = (kafkatools_msg_data_t *) mem_alloc_zero(KT_INGEST_DRAIN_BATCH, sizeof(kafkatools_msg_data_t));
+    ingest->sorted = (kafkatools_msg_data_t *) mem_alloc_zero(KT_INGEST_DRAIN_BATCH, sizeof(kafkatools_msg_data_t));
+    ingest->partitions = (int32_t *) mem_alloc_zero(KT_INGEST_DRAIN_BATCH, sizeof(int32_t));
+    ingest->counts = (int *) mem_alloc_zero(nbuckets + 1, sizeof(int));
+
+    for (i = 0; i < capacity; i++) {
+        ingest->ring[i].seq = i;
+        ingest->ring[i].buf = ingest->arena + (size_t) i * slotsize;
+    }
+
+    ingest->mask = capacity - 1;
+    ingest->slots = capacity;
+    ingest->slotsize = slotsize;
+
+    ingest->highwater = (highwater > 0 && highwater <= capacity)? highwater : capacity;
+    ingest->lowwater = ingest->highwater / 2;
+    ingest->hwmcb = hwmcb;
+    ingest->hwmarg = hwmarg;
+
+    ingest->producer = producer;
+    ingest->site = *ktsite;
+
+    if (pthread_mutex_init(&ingest->lock, NULL) != 0) {
+        goto on_error_result;
+    }
+
+    if (pthread_cond_init(&ingest->cond, NULL) != 0) {
+        pthread_mutex_destroy(&ingest->lock);
+        goto on_error_result;
+    }
+
+    if (pthread_create(&ingest->drain_thread, NULL, kt_ingest_drain_thread, (void *) ingest) != 0) {
+        pthread_cond_destroy(&ingest->cond);
+        pthread_mutex_destroy(&ingest->lock);
+        goto on_error_result;
+    }
+
+    *outingest = ingest;
+    return KAFKATOOLS_SUCCESS;
+
+on_error_result:
+    mem_free(ingest->counts);
+    mem_free(ingest->partitions);
+    mem_free(ingest->sorted);
+    mem_free(ingest->msgs);
+    mem_free(ingest->arena);
+    mem_free(ingest->ring);
+    mem_free(ingest);
+
+    return KAFKATOOLS_EFATAL;
+}
+
+
+void kafkatools_ingest_destroy (kt_ingest ingest)
+{
+    if (ingest) {
+        /* drain thread hands all pending messages to producer before exit */
+        uatomic_int_set(&ingest->stopping, 1);
+
+        pthread_mutex_lock(&ingest->lock);
+        pthread_cond_signal(&ingest->cond);
+        pthread_mutex_unlock(&ingest->lock);
+
+        pthread_join(ingest->drain_thread, NULL);
+
+        pthread_cond_destroy(&ingest->cond);
+        pthread_mutex_destroy(&ingest->lock);
+
+        mem_free(ingest->counts);
+        mem_free(ingest->partitions);
+        mem_free(ingest->sorted);
+        mem_free(ingest->msgs);
+        mem_free(ingest->arena);
+        mem_free(ingest->ring);
+        mem_free(ingest);
+    }
+}
+
+
+int kafkatools_ingest_try_enqueue (kt_ingest ingest, int32_t partition, const kafkatools_msg_data_t *ktmsg)
+{
+    int64_t pos, diff;
+    kt_ingest_slot_t *slot;
+
+    if (ktmsg->keylen < 0 || ktmsg->msglen < 0 || ktmsg->keylen + ktmsg->msglen > ingest->slotsize) {
+        return KAFKATOOLS_EARG;
+    }
+
+    if (partition != RD_KAFKA_PARTITION_UA &&
+        (partition < ingest->site.partitionid_min || partition > ingest->site.partitionid_max)) {
+        return KAFKATOOLS_EARG;
+    }
+
+    pos = uatomic_int64_get(&ingest->tail);
+
+    for (;;) {
+        slot = &ingest->ring[pos & ingest->mask];
+        diff = uatomic_int64_get(&slot->seq) - pos;
+
+        if (diff == 0) {
+            if (uatomic_int64_cas(&ingest->tail, pos, pos + 1)) {
+                break;
+            }
+            pos = uatomic_int64_get(&ingest->tail);
+        } else if (diff < 0) {
+            /* ring is full: never wait for kafka */
+            return KAFKATOOLS_EAGAIN;
+        } else {
+            pos = uatomic_int64_get(&ingest->tail);
+        }
+    }
+
+    if (ktmsg->keylen) {
+        memcpy(slot->buf, ktmsg->key, ktmsg->keylen);
+    }
+    if (ktmsg->msglen) {
+        memcpy(slot->buf + ktmsg->keylen, ktmsg->msgbuf, ktmsg->msglen);
+    }
+
+    slot->keylen = (int) ktmsg->keylen;
+    slot->msglen = (int) ktmsg->msglen;
+    slot->partition = partition;
+    slot->_private = ktmsg->_private;
+
+    /* publish slot to drain thread */
+    uatomic_barrier();
+    uatomic_int64_set(&slot->seq, pos + 1);
+
+    if (ingest->hwmcb && ! ingest->above_highwater) {
+        int used = (int) (pos + 1 - uatomic_int64_get(&ingest->head));
+
+        if (used >= ingest->highwater && uatomic_int_cas(&ingest->above_highwater, 0, 1)) {
+            ingest->hwmcb(ingest, 1, used, ingest->hwmarg);
+        }
+    }
+
+    if (ingest->sleeping) {
+        pthread_cond_signal(&ingest->cond);
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_ingest_pending (kt_ingest ingest)
+{
+    return (int) (uatomic_int64_get(&ingest->tail) - uatomic_int64_get(&ingest->head));
+}
+
+
+void kafkatools_ingest_stats (kt_ingest ingest, int64_t *produced, int64_t *failed)
+{
+    if (produced) {
+        *produced = uatomic_int64_get(&ingest->produced);
+    }
+    if (failed) {
+        *failed = uatomic_int64_get(&ingest->failed);
+    }
+}
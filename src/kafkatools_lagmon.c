@@ -0,0 +1,393 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_lagmon.c
+ *  lag and watermark monitor of kafka consumer.
+ *
+ *  A monitor thread refreshes lag of all partitions of consumer on every
+ *   interval: assigned partitions of a subscribed consumer, otherwise the
+ *   partitions in its topics. High watermarks are read from the cache of
+ *   librdkafka which is updated by fetch responses, and partitions not
+ *   fetched yet (or all partitions every KT_LAGMON_REFRESH_MS, since paused
+ *   partitions are not fetched) are queried by one batched ListOffsets.
+ *   Lag is the high watermark minus the consumed position.
+ *
+ *  Readers copy the last result under a sequence lock, so they never block
+ *   the monitor and are never blocked by it. Arrays of results outgrown are
+ *   retired, not freed, until the monitor is destroyed, so a reader racing
+ *   with growth never touches freed memory.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.1
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/uatomic.h>
+
+static const char THIS_FILE[] = "kafkatools_lagmon.c";
+
+#define KT_LAGMON_INTERVAL_MS      1000
+#define KT_LAGMON_REFRESH_MS       10000
+#define KT_LAGMON_TICK_MS          100
+#define KT_LAGMON_METADATA_MS      5000
+
+
+typedef struct kafkatools_lagmon_t
+{
+    kt_consumer consumer;
+
+    int interval_ms;
+
+    /* partitions of topics of consumer not subscribed, expanded on refresh */
+    rd_kafka_topic_partition_list_t *topics;
+
+    sb8 lastrefresh_ms;
+
+    /* result under construction by monitor thread */
+    int numwork;
+    int workcap;
+    kt_partition_lag_t *work;
+
+    /* published result: odd seq while being written */
+    uatomic_int seq;
+
+    kt_partition_lag_t * volatile lags;
+    volatile int numlags;
+    int lagscap;
+    volatile int64_t totallag;
+    volatile sb8 updated_ms;
+
+    /* outgrown arrays of published result */
+    int numretired;
+    kt_partition_lag_t **retired;
+
+    uatomic_int stopping;
+    pthread_t thread;
+} kafkatools_lagmon_t;
+
+
+/* name of topic which lives as long as consumer */
+static const char * kt_lagmon_topic_name (kt_lagmon mon, const char *name)
+{
+    kt_topic topic = kafkatools_consumer_get_topic(mon->consumer, name, NULL);
+
+    return topic? kafkatools_topic_name(topic) : NULL;
+}
+
+
+/* expand topic entries without partition by metadata */
+static rd_kafka_topic_partition_list_t * kt_lagmon_expand_topics (kt_lagmon mon)
+{
+    int i, k;
+
+    rd_kafka_t *rk = kafkatools_consumer_get_rdkafka(mon->consumer);
+    rd_kafka_topic_partition_list_t *tp_list = kafkatools_consumer_get_topics(mon->consumer);
+    rd_kafka_topic_partition_list_t *partitions = rd_kafka_topic_partition_list_new(tp_list->cnt);
+
+    for (i = 0; i < tp_list->cnt; i++) {
+        const rd_kafka_topic_partition_t *tp = &tp_list->elems[i];
+
+        if (tp->partition == RD_KAFKA_PARTITION_UA) {
+            const struct rd_kafka_metadata *metadata;
+
+            kt_topic rkt = kafkatools_consumer_get_topic(mon->consumer, tp->topic, NULL);
+
+            if (rkt && rd_kafka_metadata(rk, 0, (rd_kafka_topic_t *) rkt, &metadata, KT_LAGMON_METADATA_MS) == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                if (metadata->topic_cnt == 1) {
+                    for (k = 0; k < metadata->topics[0].partition_cnt; k++) {
+                        rd_kafka_topic_partition_list_add(partitions, tp->topic, k);
+                    }
+                }
+
+                rd_kafka_metadata_destroy(metadata);
+            }
+        } else {
+            rd_kafka_topic_partition_list_add(partitions, tp->topic, tp->partition);
+        }
+    }
+
+    return partitions;
+}
+
+
+static void kt_lagmon_publish (kt_lagmon mon, int64_t totallag)
+{
+    if (mon->numwork > mon->lagscap) {
+        /* readers may still copy from the outgrown array */
+        kt_partition_lag_t *lags = (kt_partition_lag_t *) mem_alloc_unset(sizeof(kt_partition_lag_t) * mon->workcap);
+
+        if (mon->lags) {
+            mon->retired = (kt_partition_lag_t **) mem_realloc(mon->retired, sizeof(kt_partition_lag_t *) * (mon->numretired + 1));
+            mon->retired[mon->numretired++] = mon->lags;
+        }
+
+        mon->lagscap = mon->workcap;
+
+        uatomic_int_add(&mon->seq, 1);
+        mon->lags = lags;
+    } else {
+        uatomic_int_add(&mon->seq, 1);
+    }
+
+    if (mon->numwork) {
+        memcpy(mon->lags, mon->work, sizeof(kt_partition_lag_t) * mon->numwork);
+    }
+
+    mon->numlags = mon->numwork;
+    mon->totallag = totallag;
+    mon->updated_ms = difftime_msec(NULL, NULL);
+
+    uatomic_int_add(&mon->seq, 1);
+}
+
+
+static void kt_lagmon_update (kt_lagmon mon)
+{
+    int i;
+    int64_t totallag = 0;
+
+    rd_kafka_resp_err_t err;
+    rd_kafka_topic_partition_list_t *partitions = NULL;
+    rd_kafka_topic_partition_list_t *queries = NULL;
+
+    rd_kafka_t *rk = kafkatools_consumer_get_rdkafka(mon->consumer);
+
+    sb8 now = difftime_msec(NULL, NULL);
+    int refresh = (now - mon->lastrefresh_ms >= KT_LAGMON_REFRESH_MS);
+
+    if (refresh) {
+        mon->lastrefresh_ms = now;
+    }
+
+    err = rd_kafka_assignment(rk, &partitions);
+
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR || ! partitions->cnt) {
+        /* not subscribed: partitions in topics of consumer */
+        if (partitions) {
+            rd_kafka_topic_partition_list_destroy(partitions);
+        }
+
+        if (! mon->topics || refresh) {
+            if (mon->topics) {
+                rd_kafka_topic_partition_list_destroy(mon->topics);
+            }
+            mon->topics = kt_lagmon_expand_topics(mon);
+        }
+
+        partitions = rd_kafka_topic_partition_list_copy(mon->topics);
+    }
+
+    /* consumed position: offset after last message handed to application */
+    rd_kafka_position(rk, partitions);
+
+    if (partitions->cnt > mon->workcap) {
+        mon->workcap = partitions->cnt * 2;
+        mon->work = (kt_partition_lag_t *) mem_realloc(mon->work, sizeof(kt_partition_lag_t) * mon->workcap);
+    }
+
+    mon->numwork = 0;
+
+    for (i = 0; i < partitions->cnt; i++) {
+        int64_t low, high = RD_KAFKA_OFFSET_INVALID;
+
+        const rd_kafka_topic_partition_t *tp = &partitions->elems[i];
+
+        kt_partition_lag_t *lag = &mon->work[mon->numwork];
+
+        lag->topic = kt_lagmon_topic_name(mon, tp->topic);
+        if (! lag->topic) {
+            continue;
+        }
+
+        lag->partition = tp->partition;
+        lag->position = (tp->err == RD_KAFKA_RESP_ERR_NO_ERROR && tp->offset >= 0)? tp->offset : -1;
+
+        if (rd_kafka_get_watermark_offsets(rk, tp->topic, tp->partition, &low, &high) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            high = RD_KAFKA_OFFSET_INVALID;
+        }
+
+        lag->highwater = (high >= 0)? high : -1;
+
+        if (refresh || high < 0) {
+            if (! queries) {
+                queries = rd_kafka_topic_partition_list_new(partitions->cnt);
+            }
+
+            /* ListOffsets with timestamp of RD_KAFKA_OFFSET_END is high watermark */
+            rd_kafka_topic_partition_list_add(queries, tp->topic, tp->partition)->offset = RD_KAFKA_OFFSET_END;
+        }
+
+        mon->numwork++;
+    }
+
+    if (queries) {
+        /* one request per leader broker for all partitions */
+        err = rd_kafka_offsets_for_times(rk, queries, mon->interval_ms);
+
+        if (err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+            int k = 0;
+
+            /* results are in order of queries, a subsequence of work */
+            for (i = 0; i < mon->numwork && k < queries->cnt; i++) {
+                const rd_kafka_topic_partition_t *tp = &queries->elems[k];
+
+                if (mon->work[i].partition == tp->partition && ! strcmp(mon->work[i].topic, tp->topic)) {
+                    if (tp->err == RD_KAFKA_RESP_ERR_NO_ERROR && tp->offset >= 0) {
+                        mon->work[i].highwater = tp->offset;
+                    }
+                    k++;
+                }
+            }
+        } else {
+            printf("(%s:%d) WARN - rd_kafka_offsets_for_times failed: %s\n", THIS_FILE, __LINE__, rd_kafka_err2str(err));
+        }
+
+        rd_kafka_topic_partition_list_destroy(queries);
+    }
+
+    for (i = 0; i < mon->numwork; i++) {
+        kt_partition_lag_t *lag = &mon->work[i];
+
+        if (lag->highwater >= 0 && lag->position >= 0) {
+            lag->lag = (lag->highwater > lag->position)? lag->highwater - lag->position : 0;
+            totallag += lag->lag;
+        } else {
+            lag->lag = -1;
+        }
+    }
+
+    rd_kafka_topic_partition_list_destroy(partitions);
+
+    kt_lagmon_publish(mon, totallag);
+}
+
+
+static void * kt_lagmon_thread (void *arg)
+{
+    kt_lagmon mon = (kt_lagmon) arg;
+
+    while (! uatomic_int_get(&mon->stopping)) {
+        int waited;
+
+        kt_lagmon_update(mon);
+
+        for (waited = 0; waited < mon->interval_ms && ! uatomic_int_get(&mon->stopping); waited += KT_LAGMON_TICK_MS) {
+            sleep_msec(KT_LAGMON_TICK_MS);
+        }
+    }
+
+    return NULL;
+}
+
+
+int kafkatools_lagmon_create (kt_consumer consumer, int interval_ms, kt_lagmon *outmon)
+{
+    kt_lagmon mon = (kt_lagmon) mem_alloc_zero(1, sizeof(*mon));
+
+    mon->consumer = consumer;
+    mon->interval_ms = (interval_ms > 0)? interval_ms : KT_LAGMON_INTERVAL_MS;
+
+    /* first update queries all partitions */
+    mon->lastrefresh_ms = difftime_msec(NULL, NULL) - KT_LAGMON_REFRESH_MS;
+
+    if (pthread_create(&mon->thread, NULL, kt_lagmon_thread, (void *) mon) != 0) {
+        printf("(%s:%d) ERROR - pthread_create failed\n", THIS_FILE, __LINE__);
+        mem_free(mon);
+        return KAFKATOOLS_EFATAL;
+    }
+
+    *outmon = mon;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_lagmon_destroy (kt_lagmon mon)
+{
+    if (mon) {
+        int i;
+
+        uatomic_int_set(&mon->stopping, 1);
+        pthread_join(mon->thread, NULL);
+
+        for (i = 0; i < mon->numretired; i++) {
+            mem_free(mon->retired[i]);
+        }
+
+        if (mon->topics) {
+            rd_kafka_topic_partition_list_destroy(mon->topics);
+        }
+
+        mem_free(mon->retired);
+        mem_free(mon->lags);
+        mem_free(mon->work);
+        mem_free(mon);
+    }
+}
+
+
+int kafkatools_lagmon_snapshot (kt_lagmon mon, kt_partition_lag_t *lags, int maxlags, int64_t *totallag, sb8 *updated_ms)
+{
+    int seq, numlags;
+    sb8 updated;
+
+    for (;;) {
+        seq = uatomic_int_get(&mon->seq);
+
+        if (seq & 1) {
+            uatomic_cpu_relax();
+            continue;
+        }
+
+        numlags = mon->numlags;
+
+        if (lags && maxlags > 0 && numlags > 0) {
+            memcpy(lags, mon->lags, sizeof(kt_partition_lag_t) * (numlags < maxlags? numlags : maxlags));
+        }
+
+        if (totallag) {
+            *totallag = mon->totallag;
+        }
+
+        updated = mon->updated_ms;
+
+        uatomic_barrier();
+
+        if (uatomic_int_get(&mon->seq) == seq) {
+            break;
+        }
+    }
+
+    if (updated_ms) {
+        *updated_ms = updated;
+    }
+
+    /* not refreshed yet */
+    return (updated? numlags : -1);
+}
@@ -0,0 +1,217 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_metrics.c
+ *  latency and throughput instrumentation of kafka producer and consumer.
+ *
+ *  Each thread records into one of KT_METRICS_STRIPES stripes of counters
+ *   and histograms picked on its first record, so threads rarely share a
+ *   cache line. A snapshot merges all stripes.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.2
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/uatomic.h>
+#include <common/hdrhist.h>
+
+#define KT_METRICS_STRIPES      8
+
+/* 2 significant figures: error of percentiles below 1% */
+#define KT_METRICS_SIGFIGS      2
+
+#if defined(_MSC_VER)
+# define KT_THREAD_LOCAL  __declspec(thread)
+#else
+# define KT_THREAD_LOCAL  __thread
+#endif
+
+
+typedef struct
+{
+    uatomic_int64 counters[KT_COUNTER_MAX];
+
+    hdrhist_t *histograms[KT_HISTOGRAM_MAX];
+
+    /* no false sharing with next stripe */
+    char _pad[64];
+} kt_metrics_stripe_t;
+
+
+typedef struct kafkatools_metrics_t
+{
+    kt_metrics_stripe_t stripes[KT_METRICS_STRIPES];
+} kafkatools_metrics_t;
+
+
+/* highest trackable value of histograms */
+static const int64_t kt_histogram_highest[KT_HISTOGRAM_MAX] = {
+    60LL * 1000000,             /* enqueue: 60 seconds in us */
+    600LL * 1000000,            /* delivery: 10 minutes in us */
+    7LL * 24 * 3600 * 1000      /* consume lag: 7 days in ms */
+};
+
+static const char * kt_counter_names[KT_COUNTER_MAX] = {
+    "enqueued",
+    "delivered",
+    "failed",
+    "retries",
+    "queue_full",
+    "consumed",
+    "paused"
+};
+
+static const char * kt_histogram_names[KT_HISTOGRAM_MAX] = {
+    "enqueue_us",
+    "delivery_us",
+    "consume_lag_ms"
+};
+
+static uatomic_int kt_metrics_nextstripe = 0;
+
+static KT_THREAD_LOCAL int kt_metrics_stripe = -1;
+
+
+static kt_metrics_stripe_t * kt_metrics_get_stripe (kt_metrics metrics)
+{
+    if (kt_metrics_stripe == -1) {
+        kt_metrics_stripe = (int) ((unsigned int) uatomic_int_add(&kt_metrics_nextstripe, 1) % KT_METRICS_STRIPES);
+    }
+
+    return &metrics->stripes[kt_metrics_stripe];
+}
+
+
+int kafkatools_metrics_create (kt_metrics *outmetrics)
+{
+    int i, h;
+
+    kt_metrics metrics = (kt_metrics) mem_alloc_zero(1, sizeof(*metrics));
+
+    for (i = 0; i < KT_METRICS_STRIPES; i++) {
+        for (h = 0; h < KT_HISTOGRAM_MAX; h++) {
+            metrics->stripes[i].histograms[h] = hdrhist_new(1, kt_histogram_highest[h], KT_METRICS_SIGFIGS);
+        }
+    }
+
+    *outmetrics = metrics;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_metrics_destroy (kt_metrics metrics)
+{
+    if (metrics) {
+        int i, h;
+
+        for (i = 0; i < KT_METRICS_STRIPES; i++) {
+            for (h = 0; h < KT_HISTOGRAM_MAX; h++) {
+                hdrhist_free(metrics->stripes[i].histograms[h]);
+            }
+        }
+
+        mem_free(metrics);
+    }
+}
+
+
+void kafkatools_metrics_count (kt_metrics metrics, int counter, int64_t n)
+{
+    if (metrics && counter >= 0 && counter < KT_COUNTER_MAX) {
+        uatomic_int64_add(&kt_metrics_get_stripe(metrics)->counters[counter], n);
+    }
+}
+
+
+void kafkatools_metrics_record (kt_metrics metrics, int histogram, int64_t value)
+{
+    if (metrics && histogram >= 0 && histogram < KT_HISTOGRAM_MAX) {
+        hdrhist_record(kt_metrics_get_stripe(metrics)->histograms[histogram], value);
+    }
+}
+
+
+void kafkatools_metrics_snapshot (kt_metrics metrics, kt_metrics_snapshot_t *snapshot, int reset)
+{
+    int i, h;
+
+    bzero(snapshot, sizeof(*snapshot));
+
+    if (! metrics) {
+        return;
+    }
+
+    for (i = 0; i < KT_METRICS_STRIPES; i++) {
+        for (h = 0; h < KT_COUNTER_MAX; h++) {
+            snapshot->counters[h] += (reset? uatomic_int64_set(&metrics->stripes[i].counters[h], 0) :
+                uatomic_int64_get(&metrics->stripes[i].counters[h]));
+        }
+    }
+
+    for (h = 0; h < KT_HISTOGRAM_MAX; h++) {
+        kt_histogram_snapshot_t *hs = &snapshot->histograms[h];
+
+        hdrhist_t *merged = hdrhist_new(1, kt_histogram_highest[h], KT_METRICS_SIGFIGS);
+
+        for (i = 0; i < KT_METRICS_STRIPES; i++) {
+            hdrhist_merge(merged, metrics->stripes[i].histograms[h]);
+
+            if (reset) {
+                hdrhist_reset(metrics->stripes[i].histograms[h]);
+            }
+        }
+
+        hs->count = merged->totalCount;
+
+        if (hs->count) {
+            hs->min = merged->minValue;
+            hs->max = merged->maxValue;
+            hs->mean = hdrhist_mean(merged);
+            hs->p50 = hdrhist_percentile(merged, 50.0);
+            hs->p90 = hdrhist_percentile(merged, 90.0);
+            hs->p99 = hdrhist_percentile(merged, 99.0);
+            hs->p999 = hdrhist_percentile(merged, 99.9);
+        }
+
+        hdrhist_free(merged);
+    }
+}
+
+
+const char * kafkatools_metrics_counter_name (int counter)
+{
+    return (counter >= 0 && counter < KT_COUNTER_MAX)? kt_counter_names[counter] : NULL;
+}
+
+
+const char * kafkatools_metrics_histogram_name (int histogram)
+{
+    return (histogram >= 0 && histogram < KT_HISTOGRAM_MAX)? kt_histogram_names[histogram] : NULL;
+}
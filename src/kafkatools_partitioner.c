@@ -0,0 +1,338 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_partitioner.c
+ *  partitioner of kafkatools restricted to partitionid scope of site.
+ *
+ *  Keyed messages are hashed by murmur2 (java compatible), fnv1a or
+ *   xxhash32. Keyless messages and all messages of sticky partitioner stick
+ *   to one partition until a batch is filled or lingered (like java's
+ *   sticky partitioner, KIP-480), then move to the next one of the scope.
+ *   roundrobin rotates on every message. Batches of murmur2 are hashed 4 keys
+ *   at once (see common/keyhash.h) and the modulo by partitions of scope is done
+ *   by multiplying with a divisor prepared once per batch.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.2
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/uatomic.h>
+#include <common/keyhash.h>
+
+static const char THIS_FILE[] = "kafkatools_partitioner.c";
+
+
+typedef struct kafkatools_partitioner_t
+{
+    int method;
+
+    /* hash keys on vector lanes: keyhash_x4_supported() */
+    int x4;
+
+    /* rotating counter of messages for roundrobin */
+    uatomic_int counter;
+
+    /* sticky: keyless messages go to one slot until a threshold is crossed */
+    pthread_mutex_t sticky_lock;
+
+    size_t sticky_max_bytes;
+    int sticky_max_msgs;
+    sb8 sticky_linger_us;
+
+    uint32_t sticky_slot;
+    size_t sticky_bytes;
+    int sticky_msgs;
+    sb8 sticky_since_us;
+} kafkatools_partitioner_t;
+
+
+static const char * kt_partitioner_names[] = {
+    NULL,
+    "murmur2",
+    "fnv1a",
+    "xxhash",
+    "roundrobin",
+    "sticky"
+};
+
+
+/**
+ * exact hash % n by multiplying, divisor is prepared once per batch.
+ * @refer
+ *    https://arxiv.org/abs/1902.01961 (Lemire: Faster Remainder by Direct Computation)
+ */
+typedef struct
+{
+    uint32_t n;
+#if defined(__SIZEOF_INT128__)
+    uint64_t m;
+#endif
+} kt_partition_divisor_t;
+
+
+static void kt_partition_divisor_init (kt_partition_divisor_t *div, const kafkatools_msg_site_t *site)
+{
+    div->n = (uint32_t) (site->partitionid_max - site->partitionid_min + 1);
+#if defined(__SIZEOF_INT128__)
+    div->m = UINT64_C(0xFFFFFFFFFFFFFFFF) / div->n + 1;
+#endif
+}
+
+
+static uint32_t kt_partition_divisor_mod (const kt_partition_divisor_t *div, uint32_t hash)
+{
+#if defined(__SIZEOF_INT128__)
+    return (uint32_t) (((unsigned __int128) (div->m * hash) * div->n) >> 64);
+#else
+    return hash % div->n;
+#endif
+}
+
+
+/* partition of hash within scope of site */
+static int32_t kt_partition_of_hash (kt_partitioner part, uint32_t hash, const kafkatools_msg_site_t *site, const kt_partition_divisor_t *div)
+{
+    if (part->method == KAFKATOOLS_PARTITIONER_MURMUR2) {
+        /* java: toPositive(murmur2(key)) */
+        hash &= 0x7fffffff;
+    } else if (part->method == KAFKATOOLS_PARTITIONER_FNV1A && (hash & 0x80000000)) {
+        /* librdkafka takes absolute value of signed hash as sarama */
+        hash = 0U - hash;
+    }
+
+    if (div) {
+        return site->partitionid_min + (int32_t) kt_partition_divisor_mod(div, hash);
+    }
+
+    return site->partitionid_min + (int32_t) (hash % (uint32_t) (site->partitionid_max - site->partitionid_min + 1));
+}
+
+
+static int32_t kt_partition_rotate (kt_partitioner part, const kafkatools_msg_site_t *site)
+{
+    unsigned int n = (unsigned int) uatomic_int_add(&part->counter, 1);
+
+    return site->partitionid_min + (int32_t) (n % (unsigned int) (site->partitionid_max - site->partitionid_min + 1));
+}
+
+
+/**
+ * sticky slot for a keyless message of msglen bytes. the slot moves to next
+ *  partition of scope once batch bytes, messages or linger of current slot
+ *  is reached, so that each MessageSet is filled by one partition.
+ */
+static int32_t kt_partition_sticky (kt_partitioner part, const kafkatools_msg_site_t *site, size_t msglen, sb8 nowus)
+{
+    uint32_t slot;
+
+    pthread_mutex_lock(&part->sticky_lock);
+
+    if (part->sticky_bytes >= part->sticky_max_bytes ||
+        part->sticky_msgs >= part->sticky_max_msgs ||
+        nowus - part->sticky_since_us >= part->sticky_linger_us) {
+        if (part->sticky_msgs) {
+            part->sticky_slot++;
+        }
+
+        part->sticky_bytes = 0;
+        part->sticky_msgs = 0;
+        part->sticky_since_us = nowus;
+    }
+
+    part->sticky_bytes += msglen;
+    part->sticky_msgs++;
+
+    slot = part->sticky_slot;
+
+    pthread_mutex_unlock(&part->sticky_lock);
+
+    return site->partitionid_min + (int32_t) (slot % (uint32_t) (site->partitionid_max - site->partitionid_min + 1));
+}
+
+
+static uint32_t kt_partition_hash (int method, const void *key, size_t keylen)
+{
+    switch (method) {
+    case KAFKATOOLS_PARTITIONER_FNV1A:
+        return keyhash_fnv1a(key, keylen);
+
+    case KAFKATOOLS_PARTITIONER_XXHASH:
+        return keyhash_xxh32(key, keylen);
+
+    default:
+        return keyhash_murmur2(key, keylen);
+    }
+}
+
+
+int kafkatools_partitioner_method (const char *name)
+{
+    int method;
+
+    for (method = KAFKATOOLS_PARTITIONER_MURMUR2; method <= KAFKATOOLS_PARTITIONER_STICKY; method++) {
+        if (! strcmp(name, kt_partitioner_names[method])) {
+            return method;
+        }
+    }
+
+    return (-1);
+}
+
+
+int kafkatools_partitioner_create (int method, kt_partitioner *outpart)
+{
+    kt_partitioner part;
+
+    if (method < KAFKATOOLS_PARTITIONER_MURMUR2 || method > KAFKATOOLS_PARTITIONER_STICKY) {
+        printf("(%s:%d) ERROR - invalid partitioner: %d\n", THIS_FILE, __LINE__, method);
+        return KAFKATOOLS_EARG;
+    }
+
+    part = (kt_partitioner) mem_alloc_zero(1, sizeof(*part));
+
+    part->method = method;
+    part->x4 = keyhash_x4_supported();
+
+    pthread_mutex_init(&part->sticky_lock, NULL);
+
+    kafkatools_partitioner_set_sticky(part, KAFKATOOLS_PARTITIONER_STICKY_BYTES,
+        KAFKATOOLS_PARTITIONER_STICKY_MSGS, KAFKATOOLS_PARTITIONER_STICKY_LINGER_MS);
+
+    *outpart = part;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_partitioner_destroy (kt_partitioner part)
+{
+    if (part) {
+        pthread_mutex_destroy(&part->sticky_lock);
+        mem_free(part);
+    }
+}
+
+
+void kafkatools_partitioner_set_sticky (kt_partitioner part, size_t batch_bytes, int batch_msgs, double linger_ms)
+{
+    pthread_mutex_lock(&part->sticky_lock);
+
+    part->sticky_max_bytes = (batch_bytes > 0)? batch_bytes : KAFKATOOLS_PARTITIONER_STICKY_BYTES;
+    part->sticky_max_msgs = (batch_msgs > 0)? batch_msgs : KAFKATOOLS_PARTITIONER_STICKY_MSGS;
+    part->sticky_linger_us = (sb8) ((linger_ms > 0? linger_ms : KAFKATOOLS_PARTITIONER_STICKY_LINGER_MS) * 1000);
+
+    pthread_mutex_unlock(&part->sticky_lock);
+}
+
+
+int32_t kafkatools_partitioner_partition (kt_partitioner part, const kafkatools_msg_site_t *site, const kafkatools_msg_data_t *ktmsg)
+{
+    uint32_t hash;
+
+    if (part->method == KAFKATOOLS_PARTITIONER_ROUNDROBIN) {
+        return kt_partition_rotate(part, site);
+    }
+
+    if (! ktmsg->key || part->method == KAFKATOOLS_PARTITIONER_STICKY) {
+        return kt_partition_sticky(part, site, (size_t) ktmsg->msglen, monotonic_usec());
+    }
+
+    hash = kt_partition_hash(part->method, ktmsg->key, (size_t) ktmsg->keylen);
+
+    return kt_partition_of_hash(part, hash, site, NULL);
+}
+
+
+void kafkatools_partitioner_partition_batch (kt_partitioner part, const kafkatools_msg_site_t *site, const kafkatools_msg_data_t *ktmsgs, int count, int32_t *partitions)
+{
+    int i, j, lanes = 0;
+
+    /* keyed messages waiting for 4 lanes */
+    int lanemsg[4];
+    const unsigned char *lanekeys[4];
+    size_t lanelens[4];
+    uint32_t hashes[4];
+
+    kt_partition_divisor_t div;
+
+    /* linger of sticky is checked once per batch */
+    sb8 nowus;
+
+    if (part->method == KAFKATOOLS_PARTITIONER_ROUNDROBIN) {
+        for (i = 0; i < count; i++) {
+            partitions[i] = kt_partition_rotate(part, site);
+        }
+        return;
+    }
+
+    nowus = monotonic_usec();
+
+    if (part->method == KAFKATOOLS_PARTITIONER_STICKY) {
+        for (i = 0; i < count; i++) {
+            partitions[i] = kt_partition_sticky(part, site, (size_t) ktmsgs[i].msglen, nowus);
+        }
+        return;
+    }
+
+    kt_partition_divisor_init(&div, site);
+
+    for (i = 0; i < count; i++) {
+        if (! ktmsgs[i].key) {
+            partitions[i] = kt_partition_sticky(part, site, (size_t) ktmsgs[i].msglen, nowus);
+            continue;
+        }
+
+        if (! part->x4 || part->method != KAFKATOOLS_PARTITIONER_MURMUR2) {
+            /* only murmur2 gains from lanes, see common/keyhash.h */
+            hashes[0] = kt_partition_hash(part->method, ktmsgs[i].key, (size_t) ktmsgs[i].keylen);
+            partitions[i] = kt_partition_of_hash(part, hashes[0], site, &div);
+            continue;
+        }
+
+        lanemsg[lanes] = i;
+        lanekeys[lanes] = (const unsigned char *) ktmsgs[i].key;
+        lanelens[lanes] = (size_t) ktmsgs[i].keylen;
+
+        if (++lanes == 4) {
+            keyhash_murmur2_x4(lanekeys, lanelens, hashes);
+
+            for (j = 0; j < 4; j++) {
+                partitions[lanemsg[j]] = kt_partition_of_hash(part, hashes[j], site, &div);
+            }
+
+            lanes = 0;
+        }
+    }
+
+    for (j = 0; j < lanes; j++) {
+        hashes[j] = kt_partition_hash(part->method, lanekeys[j], lanelens[j]);
+        partitions[lanemsg[j]] = kt_partition_of_hash(part, hashes[j], site, &div);
+    }
+}
@@ -0,0 +1,211 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_pool.c
+ *  sharded pool of kafka producers.
+ *
+ *  Each shard is a separate librdkafka instance created from the same
+ *   properties by kafkatools_producer_state_init() and owns a contiguous
+ *   slice of the partitionid scope. Messages are routed to the shard which
+ *   owns their partition, so one process may scale produce throughput
+ *   across cores without contention on librdkafka's partition queues.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.3
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/uatomic.h>
+
+static const char THIS_FILE[] = "kafkatools_pool.c";
+
+
+typedef struct kafkatools_producer_pool_t
+{
+    /* partitionid scope of all shards: [min, max] */
+    int32_t partitionid_min;
+    int32_t partitionid_max;
+
+    /* round-robin counter for messages without key */
+    uatomic_int rrcounter;
+
+    /* shard index of partition: shardof[partition - partitionid_min] */
+    int16_t shardof[KAFKATOOLS_PARTITIONID_MAX + 1];
+
+    int numshards;
+    ktproducer_state_t shards[0];
+} kafkatools_producer_pool_t;
+
+
+int kafkatools_producer_pool_create (const char *propertiesfile, const char *topicpartitions, int shards, kafkatools_msg_cb statecb, void *argp, kt_producer_pool *outpool)
+{
+    int i, ret, partitions;
+    int32_t partid;
+
+    kt_producer_pool pool;
+
+    if (shards < 1) {
+        printf("(%s:%d) ERROR - invalid shards: %d\n", THIS_FILE, __LINE__, shards);
+        return KAFKATOOLS_EARG;
+    }
+
+    pool = (kt_producer_pool) mem_alloc_zero(1, sizeof(*pool) + sizeof(ktproducer_state_t) * shards);
+
+    for (i = 0; i < shards; i++) {
+        ret = kafkatools_producer_state_init(propertiesfile, topicpartitions, statecb, argp, &pool->shards[i]);
+
+        if (ret != KAFKATOOLS_SUCCESS) {
+            printf("(%s:%d) ERROR - kafkatools_producer_state_init failed on shard: %d\n", THIS_FILE, __LINE__, i);
+
+            /* state of failed shard may own a producer */
+            pool->numshards = pool->shards[i].producer? i + 1 : i;
+            kafkatools_producer_pool_destroy(pool, 0);
+            return ret;
+        }
+
+        pool->numshards = i + 1;
+
+        if (shards > 1 && kafkatools_producer_get_spool(pool->shards[i].producer)) {
+            /* spool dir is owned by one producer: shards would replay the same segments */
+            printf("(%s:%d) ERROR - kafkatools.spool.dir not supported by pool of %d shards\n", THIS_FILE, __LINE__, shards);
+            kafkatools_producer_pool_destroy(pool, 0);
+            return KAFKATOOLS_EARG;
+        }
+    }
+
+    pool->partitionid_min = pool->shards[0].site.partitionid_min;
+    pool->partitionid_max = pool->shards[0].site.partitionid_max;
+
+    partitions = pool->partitionid_max - pool->partitionid_min + 1;
+
+    if (shards > partitions) {
+        /* a shard without partition is useless */
+        for (i = partitions; i < shards; i++) {
+            kafkatools_producer_state_uninit(&pool->shards[i], 0);
+        }
+        pool->numshards = partitions;
+    }
+
+    /* slice partitionid scope: shard i owns [min + i*P/N, min + (i+1)*P/N - 1] */
+    for (i = 0; i < pool->numshards; i++) {
+        ktproducer_state_t *state = &pool->shards[i];
+
+        state->site.partitionid_min = pool->partitionid_min + (int32_t) ((int64_t) partitions * i / pool->numshards);
+        state->site.partitionid_max = pool->partitionid_min + (int32_t) ((int64_t) partitions * (i + 1) / pool->numshards) - 1;
+        state->site.partition = state->site.partitionid_min;
+
+        for (partid = state->site.partitionid_min; partid <= state->site.partitionid_max; partid++) {
+            pool->shardof[partid - pool->partitionid_min] = (int16_t) i;
+        }
+    }
+
+    *outpool = pool;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_producer_pool_destroy (kt_producer_pool pool, int wait_ms)
+{
+    if (pool) {
+        int i;
+
+        for (i = 0; i < pool->numshards; i++) {
+            kafkatools_producer_state_uninit(&pool->shards[i], wait_ms);
+        }
+
+        mem_free(pool);
+    }
+}
+
+
+int kafkatools_producer_pool_shards (kt_producer_pool pool)
+{
+    return pool->numshards;
+}
+
+
+ktproducer_state_t * kafkatools_producer_pool_get_shard (kt_producer_pool pool, int shard)
+{
+    if (shard < 0 || shard >= pool->numshards) {
+        return NULL;
+    }
+
+    return &pool->shards[shard];
+}
+
+
+int32_t kafkatools_producer_pool_partition (kt_producer_pool pool, const char *key, ssize_t keylen)
+{
+    int32_t partitions = pool->partitionid_max - pool->partitionid_min + 1;
+
+    if (key) {
+        /* the topic arg is not used by murmur2 partitioner */
+        return pool->partitionid_min + rd_kafka_msg_partitioner_murmur2(pool->shards[0].site.topic,
+            (const void *) key, (size_t) keylen, partitions, NULL, NULL);
+    }
+
+    return pool->partitionid_min + (int32_t) ((unsigned int) uatomic_int_add(&pool->rrcounter, 1) % (unsigned int) partitions);
+}
+
+
+int kafkatools_producer_pool_shard_of (kt_producer_pool pool, int32_t partition)
+{
+    if (partition < pool->partitionid_min || partition > pool->partitionid_max) {
+        return (-1);
+    }
+
+    return pool->shardof[partition - pool->partitionid_min];
+}
+
+
+int kafkatools_producer_pool_produce (kt_producer_pool pool, int32_t partition, kafkatools_msg_data_t *ktmsg, int timout_ms, int retry_count)
+{
+    int shard, ret;
+
+    kt_producer producer;
+    kafkatools_msg_site_t site;
+
+    if (partition == RD_KAFKA_PARTITION_UA) {
+        partition = kafkatools_producer_pool_partition(pool, ktmsg->key, ktmsg->keylen);
+    }
+
+    shard = kafkatools_producer_pool_shard_of(pool, partition);
+    if (shard == -1) {
+        return KAFKATOOLS_EARG;
+    }
+
+    /* shard may be watched and reloaded: kafkatools_producer_state_watch() */
+    producer = kafkatools_producer_state_acquire(&pool->shards[shard], 0, &site);
+    site.partition = partition;
+
+    ret = kafkatools_produce_timedwait(producer, &site, ktmsg, timout_ms, retry_count);
+
+    kafkatools_producer_state_release(&pool->shards[shard]);
+    return ret;
+}
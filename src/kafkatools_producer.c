@@ -32,20 +32,50 @@
  *    https://github.com/edenhill/librdkafka/blob/master/examples/rdkafka_simple_producer.c
  *
  * @author     Liang Zhang <350137278@qq.com>
- * @version    0.0.11
+ * @version    0.0.36
  * @create     2018-10-08
- * @update     2019-11-22 12:11:42
+ * @update     2026-10-18 10:12:33
  */
 #include "kafkatools.h"
 
-#include <common/red_black_tree.h>
 #include <common/readconf.h>
 #include <common/memapi.h>
 #include <common/misc.h>
 #include <common/cstrbuf.h>
+#include <common/uatomic.h>
+#include <common/thread_affinity.h>
+#include <common/thread_rwlock.h>
+#include <common/strhashmap.h>
+
+#if ! defined(__WINDOWS__)
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+# include <sys/inotify.h>
+# include <sys/eventfd.h>
+# include <poll.h>
+#endif
 
 static const char THIS_FILE[] = "kafkatools_producer.c";
 
+#define KT_POLLER_BATCH_DEFAULT   1024
+
+#define KT_SPOOL_DEADLINE_MS      1000
+#define KT_SPOOL_REPLAY_BATCH     1024
+#define KT_SPOOL_PROBE_MS         1000
+#define KT_SPOOL_IDLE_WAIT_MS     10
+
+#define KT_FILE_REGION_BYTES      (16 * 1024 * 1024)
+#define KT_FILE_REGIONS_MAX       8
+#define KT_FILE_BATCH             1024
+
+#define KT_WATCH_POLL_MS          500
+#define KT_WATCH_SETTLE_MS        100
+
+#define KT_REAP_CHUNK             256
+
 
 typedef struct kafkatools_producer_t
 {
@@ -54,19 +84,101 @@ typedef struct kafkatools_producer_t
     /* Producer instance handle */
     rd_kafka_t *rkProducer;
 
+    /* Delivery report callback of application */
+    kafkatools_msg_cb msg_cb;
+
     void * opaque;
 
-    red_black_tree_t  rktopic_tree;
+    /* read-mostly cache of topic handles by name */
+    ThreadRWLock_t rktopic_lock;
+    strhashmap_t rktopic_map;
+
+    /* Delivery report poller thread: kafkatools.poller.* */
+    int poller_interval_ms;
+    int poller_batch;
+    int poller_numcpus;
+    int poller_cpus[THREAD_AFFINITY_CPUS_MAX];
+
+    int poller_started;
+    uatomic_int poller_stopping;
+    pthread_t poller_thread;
+
+    /* main queue served by poller thread or kafkatools_producer_reap */
+    rd_kafka_queue_t *mainq;
+
+    /* signaled by poller after each batch of delivery reports */
+    pthread_mutex_t drlock;
+    pthread_cond_t drcond;
+
+    /* Disk spool: kafkatools.spool.* */
+    cstrbuf spool_dir;
+    size_t spool_segment_bytes;
+    int spool_deadline_ms;
+
+    kt_spool spool;
+    int spool_started;
+    uatomic_int spool_stopping;
+    uatomic_int spool_healthy;
+    pthread_t spool_thread;
+
+    /* file regions mapped by kafkatools_produce_file and not yet delivered */
+    uatomic_int file_regions;
+
+    /* kafkatools.metrics = true */
+    kt_metrics metrics;
+
+    /* kafkatools.partitioner: for site with partition of RD_KAFKA_PARTITION_UA */
+    kt_partitioner partitioner;
+
+    /* kafkatools.slab = true: payload copied into slab, see kt_msgenv_slabcopy */
+    int slab;
+
+    /* Completion queue: kafkatools.completion = true */
+    int completion;
+    int completion_started;
+    int completion_fd;
+    uatomic_int64 completion_ticket;
+
+    /* delivery report event partly reaped */
+    rd_kafka_event_t *completion_event;
+
+    /* kafkatools.affinity.*: cpus of librdkafka threads */
+    kt_affinity affinity;
 
     int errcode;
     char errstr[KAFKATOOLS_ERRSTR_SIZE];
 } kafkatools_producer_t;
 
 
-static int rktopic_name_cmp(void *newObject, void *nodeObject)
+/**
+ * Properties watcher of ktproducer_state_t
+ *
+ * On change of the props in state's section, a new producer is created and
+ *  published together with its site under write lock of state, then the old
+ *  one is flushed and destroyed on the watcher thread.
+ */
+typedef struct kafkatools_state_watch_t
 {
-    return strcmp(rd_kafka_topic_name((rd_kafka_topic_t *) newObject), rd_kafka_topic_name((rd_kafka_topic_t *) nodeObject));
-}
+    ktproducer_state_t *state;
+
+    cstrbuf propsfile;
+
+    /* section of props: topic name of state */
+    char *section;
+
+    /* props which current producer is created from */
+    char *propsbuf;
+    size_t bufsize;
+    int numprops;
+
+    int drain_ms;
+
+    /* inotify fd or -1 for polling */
+    int notifyfd;
+
+    uatomic_int stopping;
+    pthread_t thread;
+} kafkatools_state_watch_t;
 
 
 /*! Callback function prototype for traverse objects */
@@ -77,350 +189,1496 @@ static void rktopic_object_release(void *object, void *param)
 
 
 /**
- * Message delivery report callback.
- *
- * This callback is called exactly once per message, indicating if the message
- *  was succesfully delivered (rkmessage->err == RD_KAFKA_RESP_ERR_NO_ERROR) or
- *  permanently failed delivery (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR).
+ * Message envelope
  *
- * The callback is triggered from rd_kafka_poll() and executes on the
- *  application's thread.
+ * Messages produced by kafkatools which need extra work on delivery (such as
+ *  releasing a zero-copy payload) carry an envelope as msg_opaque instead of
+ *  the application's _private. The envelope pointer is tagged with the lowest
+ *  bit so that kt_dr_msg_cb() can tell it from a plain application pointer.
  *
- * The rkmessage is destroyed automatically by librdkafka.
+ * NOTE: messages produced to a kafkatools producer by rd_kafka_produce*()
+ *   directly must not use msg_opaque with the lowest bit set.
  */
-static void kt_msg_cb_default (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque) {
-    if (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
-        printf("[error] Message delivery failed: %s\n", rd_kafka_err2str(rkmessage->err));
-    } else {
-        // printf("success: Message delivered (%zd bytes, partition %"PRId32")\n", rkmessage->len, rkmessage->partition);
-    }
-}
+typedef struct kafkatools_msgenv_t  kt_msgenv_t;
 
+typedef void (*kt_msgenv_done_cb) (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage);
 
-static cstrbuf kt_get_producer_properties_pathfile (const char *propspathfile)
+struct kafkatools_msgenv_t
 {
-    cstrbuf propsfile = NULL;
-    cstrbuf bindir = get_proc_abspath();
-    cstrbuf pathfile = cstrbufCat(0, "%.*s", cstr_length(propspathfile, KAFKATOOLS_PROPSFILE_LEN_MAX), propspathfile);
-    int pathlen = cstrbufGetLen(pathfile);
+    /* called after application's delivery report callback */
+    kt_msgenv_done_cb donecb;
 
-    if (pathlen < 2) {
-        // using default file
-        propsfile = cstrbufCat(0, "%.*s%c%s", cstrbufGetLen(bindir), cstrbufGetStr(bindir), PATH_SEPARATOR_CHAR, KAFKA_PRODUCER_PROPERTIES_FILE);
+    /* application message opaque */
+    void * _private;
+};
 
-        cstrbufFree(&pathfile);
-        cstrbufFree(&bindir);
-        return propsfile;
-    }
+#define KT_MSGENV_TAG            ((uintptr_t) 1)
 
-    if (*cstrbufCharAt(pathfile, pathlen - 1) == PATH_SEPARATOR_CHAR || *cstrbufCharAt(pathfile, pathlen - 1) == '/') {
-        // only dir withnot filename
-        *cstrbufCharAt(pathfile, pathlen - 1) = PATH_SEPARATOR_CHAR;
-        pathfile = cstrbufCat(pathfile, KAFKA_PRODUCER_PROPERTIES_FILE);
-        pathlen = cstrbufGetLen(pathfile);
-    }
+#define kt_msgenv_tagged(p)      (((uintptr_t)(p)) & KT_MSGENV_TAG)
+#define kt_msgenv_wrap(env)      ((void *)(((uintptr_t)(env)) | KT_MSGENV_TAG))
+#define kt_msgenv_unwrap(p)      ((kt_msgenv_t *)(((uintptr_t)(p)) & ~KT_MSGENV_TAG))
 
-    if (*cstrbufCharAt(pathfile, 0) == '.' && (*cstrbufCharAt(pathfile, 1) == PATH_SEPARATOR_CHAR || *cstrbufCharAt(pathfile, 1) == '/')) {
-        // current app dir:
-        //   "./config/kafka-producer.properties"
-        propsfile = cstrbufCat(0, "%.*s%c%s", cstrbufGetLen(bindir), cstrbufGetStr(bindir), PATH_SEPARATOR_CHAR, cstrbufCharAt(pathfile, 2));
 
-        cstrbufFree(&pathfile);
-        cstrbufFree(&bindir);
-        return propsfile;
-    }
+static void kt_msgenv_boxed_done (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage)
+{
+    kafkatools_slab_free(env);
+}
 
-    if (*cstrbufCharAt(pathfile, 0) == '.' && *cstrbufCharAt(pathfile, 1) == '.' &&
-        (*cstrbufCharAt(pathfile, 2) == PATH_SEPARATOR_CHAR || *cstrbufCharAt(pathfile, 2) =='/')) {
-        // parent dir:
-        //   "../config/kafka-producer.properties"
-        propsfile = cstrbufCat(0, "%.*s%c%s", cstrbufGetLen(bindir), cstrbufGetStr(bindir), PATH_SEPARATOR_CHAR, cstrbufGetStr(pathfile));
 
-        cstrbufFree(&pathfile);
-        cstrbufFree(&bindir);
-        return propsfile;
+/**
+ * Application _private with the tag bit set (such as an odd integer) is
+ *  boxed into an envelope so that it reaches msg_cb unchanged.
+ */
+static void * kt_msgenv_box (void *_private)
+{
+    if (kt_msgenv_tagged(_private)) {
+        kt_msgenv_t *env = (kt_msgenv_t *) kafkatools_slab_alloc(sizeof(*env));
+
+        env->donecb = kt_msgenv_boxed_done;
+        env->_private = _private;
+
+        return kt_msgenv_wrap(env);
     }
 
-    // absolute path
-    cstrbufFree(&propsfile);
-    cstrbufFree(&bindir);
-    return pathfile;
+    return _private;
 }
 
 
-/**********************************************************
- * public api
- **********************************************************/
+/* release box or slab copy of message which never got enqueued */
+static void kt_msgenv_unbox (void *msg_opaque, void *_private)
+{
+    if (msg_opaque != _private) {
+        kafkatools_slab_free(kt_msgenv_unwrap(msg_opaque));
+    }
+}
+
 
 /**
- * high level api for kafka producer
+ * Slab copy of message (kafkatools.slab = true): one slab block holds the
+ *  envelope followed by a copy of payload, which is produced without copy
+ *  by librdkafka and freed back to slab by the delivery report.
  */
-int kafkatools_producer_state_init (const char *propertiesfile, const char *topicpartitions, kafkatools_msg_cb statecb, void *argp, ktproducer_state_t *state)
+static void kt_msgenv_slabcopy_done (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage)
 {
-    int ret;
+    kafkatools_slab_free(env);
+}
 
-    char *propsbuf = 0;
-    size_t bufsize = 0;
 
-    char *propnames[KAFKATOOLS_CONF_PROPS_MAX] = {0};
-    char *propvalues[KAFKATOOLS_CONF_PROPS_MAX] = {0};
-    char *topicptsplit[2] = {0};
+static void * kt_msgenv_slabcopy (const kafkatools_msg_data_t *ktmsg, void **payload)
+{
+    kt_msgenv_t *env = (kt_msgenv_t *) kafkatools_slab_alloc(sizeof(*env) + ktmsg->msglen);
 
-    cstrbuf propsfile = kt_get_producer_properties_pathfile(propertiesfile);
-    cstrbuf topicpt = cstrbufNew(0, topicpartitions, -1);
+    env->donecb = kt_msgenv_slabcopy_done;
+    env->_private = ktmsg->_private;
 
-    if (!topicpt) {
-        printf("(%s:%d) ERROR -  invalid topic partitions: '%s'\n",  THIS_FILE, __LINE__, topicpartitions);
-        cstrbufFree(&propsfile);
-        return KAFKATOOLS_EARG;
+    /* NULL payload is kept: tombstone of compacted topic */
+    *payload = ktmsg->msgbuf? (void *) (env + 1) : NULL;
+    if (ktmsg->msglen) {
+        memcpy(*payload, ktmsg->msgbuf, ktmsg->msglen);
     }
 
-    cstr_split_substr(topicpt->str, ":", 1, topicptsplit, 2);
-    if (! topicptsplit[0]) {
-        printf("(%s:%d) ERROR - bad topic partitions: '%s'\n", THIS_FILE, __LINE__, topicpartitions);
-        cstrbufFree(&propsfile);
-        cstrbufFree(&topicpt);
-        return KAFKATOOLS_EFATAL;
-    }
+    return kt_msgenv_wrap(env);
+}
 
-    if (! pathfile_exists(cstrbufGetStr(propsfile))) {
-        printf("(%s:%d) ERROR -  properties file not found: '%.*s'\n",  THIS_FILE, __LINE__,
-            cstrbufGetLen(propsfile), cstrbufGetStr(propsfile));
 
-        cstrbufFree(&propsfile);
-        cstrbufFree(&topicpt);
-        return KAFKATOOLS_EFILE;
-    }
+/**
+ * Ticket of message produced by kafkatools_produce_nowait(). In slab mode
+ *  the payload copy follows the envelope in the same slab block.
+ */
+typedef struct
+{
+    kt_msgenv_t env;
+    uint64_t ticket;
+} kt_ticket_env_t;
 
-    ret = kafkatools_props_readconf(cstrbufGetStr(propsfile), topicptsplit[0], &propsbuf, &bufsize);
-    cstrbufFree(&propsfile);
 
-    if (kafkatools_props_retrieve(propsbuf, bufsize, propnames, propvalues, ret) != KAFKATOOLS_SUCCESS) {
-        printf("(%s:%d) ERROR - kafkatools_props_retrieve failed.\n", THIS_FILE, __LINE__);
-        cstrbufFree(&topicpt);
-        kafkatools_propsbuf_free(propsbuf);
-        return KAFKATOOLS_EPROPS;
-    }
+static void kt_msgenv_ticket_done (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage)
+{
+    kafkatools_slab_free(env);
+}
 
-    // create producer for kafka
-    state->statearg = argp;
-    ret = kafkatools_producer_create(propnames, propvalues, statecb, (void *)state, &state->producer);
-    if (ret != KAFKATOOLS_SUCCESS) {
-        printf("(%s:%d) ERROR - kafkatools_producer_create failed.\n", THIS_FILE, __LINE__);
-        cstrbufFree(&topicpt);
-        kafkatools_propsbuf_free(propsbuf);
-        return KAFKATOOLS_ERROR;
-    }
-    kafkatools_propsbuf_free(propsbuf);
 
-    // set topic and partitions scope
-    if (topicptsplit[1]) {
-        state->site.topic = kafkatools_producer_get_topic(state->producer, topicptsplit[0]);
+static void * kt_msgenv_ticket (const kafkatools_msg_data_t *ktmsg, uint64_t ticket, void **payload)
+{
+    kt_ticket_env_t *tenv = (kt_ticket_env_t *) kafkatools_slab_alloc(sizeof(*tenv) + (payload? ktmsg->msglen : 0));
 
-        if (strchr(topicptsplit[1], '-')) {
-            char *maxpartid = strchr(topicptsplit[1], '-');
-            *maxpartid++ = 0;
-            state->site.partitionid_min = atoi(topicptsplit[1]);
-            state->site.partitionid_max = atoi(maxpartid);
-        } else {
-            // only one partition
-            state->site.partition = state->site.partitionid_min = state->site.partitionid_max = atoi(topicptsplit[1]);
-        }
-    } else {
-        // only topic without partition
-        state->site.topic = kafkatools_producer_get_topic(state->producer, topicpt->str);
+    tenv->env.donecb = kt_msgenv_ticket_done;
+    tenv->env._private = ktmsg->_private;
+    tenv->ticket = ticket;
 
-        state->site.partition = state->site.partitionid_min = state->site.partitionid_max = 0;
+    if (payload) {
+        *payload = (void *) (tenv + 1);
+        if (ktmsg->msglen) {
+            memcpy(*payload, ktmsg->msgbuf, ktmsg->msglen);
+        }
     }
 
-    // validate state topic partitions
-    if (! state->site.topic ||
-        state->site.partitionid_max < state->site.partitionid_min ||
-        state->site.partitionid_min < 0 ||
-        state->site.partitionid_max > KAFKATOOLS_PARTITIONID_MAX) {
-        printf("(%s:%d) ERROR - bad topic partitions: '%.*s'\n", THIS_FILE, __LINE__,
-            cstrbufGetLen(topicpt), cstrbufGetStr(topicpt));
+    return kt_msgenv_wrap(&tenv->env);
+}
 
-        cstrbufFree(&topicpt);
-        return KAFKATOOLS_EARG;
-    }
 
-    cstrbufFree(&topicpt);
-    return KAFKATOOLS_SUCCESS;
-}
+/**
+ * Zero-copy batch: one allocation holds envelopes for all messages of a
+ *  kafkatools_produce_batch() call. The last delivery report frees it.
+ */
+typedef struct kafkatools_msgbatch_t  kt_msgbatch_t;
 
+typedef struct
+{
+    kt_msgenv_t env;
+    kt_msgbatch_t *batch;
+} kt_msgbatch_env_t;
 
-void kafkatools_producer_state_uninit (ktproducer_state_t *state, int wait_ms)
+struct kafkatools_msgbatch_t
 {
-    kafkatools_producer_destroy(state->producer, wait_ms);
-}
+    uatomic_int refcnt;
 
+    kt_msgfree_cb freecb;
 
-/**
- * public helper api
- */
-const char * kafkatools_get_rdkafka_version (void)
-{
-    return rd_kafka_version_str();
-}
+    kt_msgbatch_env_t envs[0];
+};
 
 
-int kafkatools_mutex_lock (pthread_mutex_t * mutex, int is_try)
+static void kt_msgbatch_release (kt_msgbatch_t *batch)
 {
-    return (is_try? pthread_mutex_trylock(mutex) : pthread_mutex_lock(mutex));
+    if (uatomic_int_sub(&batch->refcnt, 1) == 0) {
+        kafkatools_slab_free(batch);
+    }
 }
 
 
-void kafkatools_mutex_unlock (pthread_mutex_t * mutex)
+static void kt_msgbatch_done (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage)
 {
-    pthread_mutex_unlock(mutex);
+    kt_msgbatch_t *batch = ((kt_msgbatch_env_t *) env)->batch;
+
+    /* payload is the original msgbuf since it was produced without copy */
+    batch->freecb(rkmessage->payload, (ssize_t) rkmessage->len, rkmessage->_private);
+
+    kt_msgbatch_release(batch);
 }
 
 
-int kafkatools_props_readconf (const char *conf_file, const char *section, char **propsbuf, size_t *bufsz)
+/**
+ * Replayed spool record: payload is produced without copy from the mapped
+ *  segment, which is released on delivery.
+ */
+typedef struct
 {
-    char *sec, *key, *val, *outbuf;
+    kt_msgenv_t env;
 
-    int props = 0;
-    size_t cb, outsz = 0;
+    kt_producer producer;
+    size_t segid;
     size_t offset;
+} kt_spool_env_t;
 
-    CONF_position cpos = ConfOpenFile(conf_file);
-    if (! cpos) {
-        return KAFKATOOLS_EFILE;
-    }
-
-    // calc size for props in section
-    sec = ConfGetFirstPair(cpos, &key, &val);
-    while (sec) {
-        if (! section || ! strcmp(ConfGetSection(cpos), section)) {
-            props++;
-            outsz += strlen(key) + 1 + strlen(val) + 1;
-        }
-        if (props >= KAFKATOOLS_CONF_PROPS_MAX) {
-            ConfCloseFile(cpos);
-            return KAFKATOOLS_EPROPS;
-        }
-        sec = ConfGetNextPair(cpos, &key, &val);
-    }
 
-    if (! outsz) {
-        ConfCloseFile(cpos);
+/**
+ * errors after which a message may be delivered if produced again. others
+ *  (too large, unknown topic, invalid message ...) fail again every time.
+ */
+static int kt_err_retriable (rd_kafka_resp_err_t err)
+{
+    switch (err) {
+    case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+    case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+    case RD_KAFKA_RESP_ERR__TIMED_OUT:
+    case RD_KAFKA_RESP_ERR__TIMED_OUT_QUEUE:
+    case RD_KAFKA_RESP_ERR__TRANSPORT:
+    case RD_KAFKA_RESP_ERR__RESOLVE:
+    case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+    case RD_KAFKA_RESP_ERR__DESTROY:
+    case RD_KAFKA_RESP_ERR__PURGE_QUEUE:
+    case RD_KAFKA_RESP_ERR__PURGE_INFLIGHT:
+    case RD_KAFKA_RESP_ERR_REQUEST_TIMED_OUT:
+    case RD_KAFKA_RESP_ERR_NETWORK_EXCEPTION:
+    case RD_KAFKA_RESP_ERR_BROKER_NOT_AVAILABLE:
+    case RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE:
+    case RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION:
+    case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS:
+    case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS_AFTER_APPEND:
+    case RD_KAFKA_RESP_ERR_KAFKA_STORAGE_ERROR:
+        return 1;
+
+    default:
         return 0;
     }
+}
 
-    outbuf = mem_alloc_unset(outsz + 1);
-    if (! outbuf) {
-        ConfCloseFile(cpos);
-        return KAFKATOOLS_ENOMEM;
-    }
-    outbuf[outsz] = 0;
 
-    // copy all props in section
-    offset = 0;
-    sec = ConfGetFirstPair(cpos, &key, &val);
-    while (sec) {
-        if (! section || ! strcmp(ConfGetSection(cpos), section)) {
-            cb = strlen(key) + 1;
-            if (offset + cb > outsz) {
-                mem_free(outbuf);
-                ConfCloseFile(cpos);
-                return KAFKATOOLS_EBREAK;
-            }
-            bcopy(key, outbuf + offset, cb);
-            offset += cb;
-
-            cb = strlen(val) + 1;
-            if (offset + cb > outsz) {
-                mem_free(outbuf);
-                ConfCloseFile(cpos);
-                return KAFKATOOLS_EBREAK;
-            }
-            bcopy(val, outbuf + offset, cb);
-            offset += cb;
-        }
-        sec = ConfGetNextPair(cpos, &key, &val);
-    }
+/**
+ * A replayed message failed with retriable error is replayed again from its
+ *  spool position (records behind it are replayed again too). It stays
+ *  ahead of newer messages of its partition, since they are spilled behind
+ *  it until all spooled records are released (kafkatools_spool_pending).
+ *  A message failed with permanent error is dropped, it was reported to
+ *  msg_cb and counted as KT_COUNTER_FAILED by the dispatcher.
+ */
+static void kt_spool_replay_done (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage)
+{
+    kt_spool_env_t *senv = (kt_spool_env_t *) env;
+    kt_producer producer = senv->producer;
 
-    ConfCloseFile(cpos);
+    if (rkmessage->err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+        uatomic_int_set(&producer->spool_healthy, 1);
+    } else if (kt_err_retriable(rkmessage->err)) {
+        uatomic_int_set(&producer->spool_healthy, 0);
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_RETRIES, 1);
 
-    if (offset != outsz) {
-        mem_free(outbuf);
-        return KAFKATOOLS_EBREAK;
+        /* before release, so the segment is still there */
+        kafkatools_spool_rewind(producer->spool, senv->segid, senv->offset);
+    } else {
+        printf("(%s:%d) ERROR - spooled message dropped {%s:%d}: %s\n", THIS_FILE, __LINE__,
+            rd_kafka_topic_name(rkmessage->rkt), rkmessage->partition, rd_kafka_err2str(rkmessage->err));
     }
 
-    *propsbuf = outbuf;
-    *bufsz = outsz;
-    return props;
+    kafkatools_spool_release(producer->spool, senv->segid);
+
+    mem_free(senv);
 }
 
 
-int kafkatools_props_retrieve (const char *propsbuf, size_t bufsz, char **propnames, char **propvalues, int numprops)
+#if ! defined(__WINDOWS__)
+
+/**
+ * Mapped region of file produced by kafkatools_produce_file. All messages
+ *  of region share one envelope, region is unmapped on the last delivery.
+ */
+typedef struct
 {
-    int i;
-    size_t cb;
+    kt_msgenv_t env;
+
+    kt_producer producer;
 
-    size_t offset = 0;
-    char *p = (char *) propsbuf;
+    uatomic_int refcnt;
 
-    for (i = 0; i < numprops; i++) {
-        propnames[i] = p;
+    char *map;
+    size_t maplen;
+} kt_file_region_t;
 
-        cb = strlen(p) + 1;
-        offset += cb;
-        p += cb;
 
-        propvalues[i] = p;
+static void kt_file_region_release (kt_file_region_t *region)
+{
+    if (uatomic_int_sub(&region->refcnt, 1) == 0) {
+        munmap(region->map, region->maplen);
+        uatomic_int_sub(&region->producer->file_regions, 1);
+        mem_free(region);
+    }
+}
 
-        cb = strlen(p) + 1;
-        offset += cb;
-        p += cb;
 
-        if (offset > bufsz) {
-            return KAFKATOOLS_ERROR;
-        }
+static void kt_file_region_done (kt_msgenv_t *env, const rd_kafka_message_t *rkmessage)
+{
+    kt_file_region_release((kt_file_region_t *) env);
+}
+
+#endif
+
+
+/**
+ * Message delivery report callback.
+ *
+ * This callback is called exactly once per message, indicating if the message
+ *  was succesfully delivered (rkmessage->err == RD_KAFKA_RESP_ERR_NO_ERROR) or
+ *  permanently failed delivery (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR).
+ *
+ * The callback is triggered from rd_kafka_poll() and executes on the
+ *  application's thread.
+ *
+ * The rkmessage is destroyed automatically by librdkafka.
+ */
+static void kt_msg_cb_default (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque) {
+    if (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        printf("[error] Message delivery failed: %s\n", rd_kafka_err2str(rkmessage->err));
+    } else {
+        // printf("success: Message delivered (%zd bytes, partition %"PRId32")\n", rkmessage->len, rkmessage->partition);
     }
+}
 
-    propnames[i] = 0;
-    propvalues[i] = 0;
 
-    return KAFKATOOLS_SUCCESS;
+static void kt_dr_metrics (kt_producer producer, const rd_kafka_message_t *rkmessage)
+{
+    int64_t latency_us = rd_kafka_message_latency(rkmessage);
+
+    kafkatools_metrics_count(producer->metrics, (rkmessage->err? KT_COUNTER_FAILED : KT_COUNTER_DELIVERED), 1);
+
+    if (latency_us >= 0) {
+        kafkatools_metrics_record(producer->metrics, KT_HISTOGRAM_DELIVERY_US, latency_us);
+    }
 }
 
 
-void kafkatools_propsbuf_free (char *propsbuf)
+/**
+ * Delivery report dispatcher registered to librdkafka for all producers.
+ *
+ * It unwraps kafkatools envelopes so that the application callback always
+ *  sees its own _private, and then completes the envelope.
+ */
+static void kt_dr_msg_cb (rd_kafka_t *rk, const rd_kafka_message_t *rkmessage, void *opaque)
 {
-    mem_free(propsbuf);
+    kt_producer producer = (kt_producer) opaque;
+
+    if (producer->metrics) {
+        kt_dr_metrics(producer, rkmessage);
+    }
+
+    if (kt_msgenv_tagged(rkmessage->_private)) {
+        kt_msgenv_t *env = kt_msgenv_unwrap(rkmessage->_private);
+
+        rd_kafka_message_t msg = *rkmessage;
+        msg._private = env->_private;
+
+        if (producer->msg_cb) {
+            producer->msg_cb(rk, &msg, producer->opaque);
+        }
+
+        env->donecb(env, &msg);
+    } else if (producer->msg_cb) {
+        producer->msg_cb(rk, rkmessage, producer->opaque);
+    }
 }
 
 
-int kafkatools_producer_create (char **propnames, char **propvalues, kafkatools_msg_cb msg_cb, void *msg_opaque, kt_producer *outproducer)
+/**
+ * Delivery report of completion queue producer: like kt_dr_msg_cb but the
+ *  result is stored into completion instead of calling msg_cb.
+ */
+static void kt_dr_complete (kt_producer producer, const rd_kafka_message_t *rkmessage, kt_completion_t *completion)
 {
-    int i;
+    if (producer->metrics) {
+        kt_dr_metrics(producer, rkmessage);
+    }
 
-    int result;
+    completion->ticket = 0;
+    completion->err = rkmessage->err;
+    completion->topic = rkmessage->rkt;
+    completion->partition = rkmessage->partition;
+    completion->offset = rkmessage->offset;
+    completion->_private = rkmessage->_private;
 
-    rd_kafka_conf_res_t res;
+    if (kt_msgenv_tagged(rkmessage->_private)) {
+        kt_msgenv_t *env = kt_msgenv_unwrap(rkmessage->_private);
 
-    rd_kafka_conf_t * conf = 0;
-    kafkatools_producer_t * producer = 0;
+        rd_kafka_message_t msg = *rkmessage;
+        msg._private = env->_private;
 
-    result = KAFKATOOLS_ENOMEM;
+        if (env->donecb == kt_msgenv_ticket_done) {
+            completion->ticket = ((kt_ticket_env_t *) env)->ticket;
+        }
+        completion->_private = env->_private;
 
-    producer = (kt_producer) mem_alloc_unset(sizeof(*producer));
-    if (! producer) {
-        goto on_error_result;
+        env->donecb(env, &msg);
     }
-    bzero(producer, sizeof(*producer));
+}
 
-    rbtree_init(&producer->rktopic_tree, (rbtreenode_cmp_func *) rktopic_name_cmp);
 
-    /*
-     * Create Kafka client configuration place-holder
-     */
-    conf = rd_kafka_conf_new();
-    if (! conf) {
-        goto on_error_result;
+/**
+ * sticky partitioner rotates as librdkafka closes a MessageSet:
+ *   batch.size, batch.num.messages or linger.ms
+ */
+static void kt_producer_set_sticky (kt_producer producer, rd_kafka_conf_t *conf)
+{
+    char value[64];
+    size_t valsz;
+
+    size_t batch_bytes = 0;
+    int batch_msgs = 0;
+    double linger_ms = 0;
+
+    valsz = sizeof(value);
+    if (rd_kafka_conf_get(conf, "batch.size", value, &valsz) == RD_KAFKA_CONF_OK) {
+        batch_bytes = (size_t) atoll(value);
+    }
+
+    valsz = sizeof(value);
+    if (rd_kafka_conf_get(conf, "batch.num.messages", value, &valsz) == RD_KAFKA_CONF_OK) {
+        batch_msgs = atoi(value);
+    }
+
+    valsz = sizeof(value);
+    if (rd_kafka_conf_get(conf, "linger.ms", value, &valsz) == RD_KAFKA_CONF_OK) {
+        linger_ms = atof(value);
+    }
+
+    kafkatools_partitioner_set_sticky(producer->partitioner, batch_bytes, batch_msgs, linger_ms);
+}
+
+
+/**
+ * Properties prefixed with "kafkatools." are options of kafkatools itself
+ *  and are not passed to librdkafka:
+ *
+ *   kafkatools.poller.interval.ms - start delivery report poller thread which
+ *                                   polls with this interval (default: 0, no
+ *                                   poller)
+ *   kafkatools.poller.batch       - max delivery reports dispatched per batch
+ *   kafkatools.poller.cpus        - cpu list poller thread bound to: "0,2-3"
+ *
+ *   kafkatools.spool.dir          - spill messages to disk spool in this dir
+ *                                   when queue is full past deadline, and
+ *                                   replay them in order on a thread.
+ *                                   dir is locked by one producer only
+ *   kafkatools.spool.segment.bytes - size of spool segment file (default: 64 MB)
+ *   kafkatools.spool.deadline.ms  - max wait on queue full before spilling
+ *                                   (default: 1000)
+ *
+ *   kafkatools.metrics            - record metrics if "true" (default: false),
+ *                                   see kafkatools_producer_get_metrics
+ *
+ *   kafkatools.partitioner        - partitioner within site's partitionid scope:
+ *                                   murmur2, fnv1a, xxhash, roundrobin or sticky
+ *                                   (default: none, librdkafka partitioner).
+ *                                   keyless messages stick to a partition for
+ *                                   batch.size, batch.num.messages or linger.ms
+ *
+ *   kafkatools.slab               - copy payloads into slab blocks instead of
+ *                                   malloc by librdkafka if "true" (default:
+ *                                   false). blocks are freed to slab by the
+ *                                   delivery report, see kafkatools_slab_alloc
+ *
+ *   kafkatools.completion         - queue delivery reports for
+ *                                   kafkatools_producer_reap() and signal them
+ *                                   on kafkatools_producer_completion_fd()
+ *                                   instead of calling msg_cb if "true"
+ *                                   (default: false). Linux only, not with
+ *                                   poller or spool, and can not be reloaded
+ *                                   by kafkatools_producer_state_watch
+ *
+ *   kafkatools.affinity.main.cpus       - cpus librdkafka main, broker or
+ *   kafkatools.affinity.broker.cpus       background threads bound to:
+ *   kafkatools.affinity.background.cpus   "0,2-3" or NUMA nodes "node:1"
+ */
+static int kt_producer_set_option (kt_producer producer, const char *name, const char *value)
+{
+    if (! strcmp(name, "kafkatools.poller.interval.ms")) {
+        producer->poller_interval_ms = atoi(value);
+        if (producer->poller_interval_ms < 0) {
+            goto bad_value;
+        }
+    } else if (! strcmp(name, "kafkatools.poller.batch")) {
+        producer->poller_batch = atoi(value);
+        if (producer->poller_batch < 1) {
+            goto bad_value;
+        }
+    } else if (! strcmp(name, "kafkatools.poller.cpus")) {
+        producer->poller_numcpus = cpulist_parse(value, producer->poller_cpus, THREAD_AFFINITY_CPUS_MAX);
+        if (producer->poller_numcpus < 0) {
+            goto bad_value;
+        }
+    } else if (! strcmp(name, "kafkatools.spool.dir")) {
+        cstrbufFree(&producer->spool_dir);
+        producer->spool_dir = cstrbufNew(0, value, -1);
+    } else if (! strcmp(name, "kafkatools.spool.segment.bytes")) {
+        producer->spool_segment_bytes = (size_t) atoll(value);
+    } else if (! strcmp(name, "kafkatools.spool.deadline.ms")) {
+        producer->spool_deadline_ms = atoi(value);
+        if (producer->spool_deadline_ms < 0) {
+            goto bad_value;
+        }
+    } else if (! strcmp(name, "kafkatools.metrics")) {
+        if (! strcmp(value, "true")) {
+            if (! producer->metrics) {
+                kafkatools_metrics_create(&producer->metrics);
+            }
+        } else if (strcmp(value, "false")) {
+            goto bad_value;
+        }
+    } else if (! strcmp(name, "kafkatools.partitioner")) {
+        int method = kafkatools_partitioner_method(value);
+        if (method == -1) {
+            goto bad_value;
+        }
+        kafkatools_partitioner_destroy(producer->partitioner);
+        kafkatools_partitioner_create(method, &producer->partitioner);
+    } else if (! strcmp(name, "kafkatools.slab")) {
+        if (! strcmp(value, "true")) {
+            producer->slab = 1;
+        } else if (! strcmp(value, "false")) {
+            producer->slab = 0;
+        } else {
+            goto bad_value;
+        }
+    } else if (! strncmp(name, "kafkatools.affinity.", 20)) {
+        if (! producer->affinity) {
+            kafkatools_affinity_create(&producer->affinity);
+        }
+        if (kafkatools_affinity_set(producer->affinity, name, value) != KAFKATOOLS_SUCCESS) {
+            goto bad_value;
+        }
+    } else if (! strcmp(name, "kafkatools.completion")) {
+        if (! strcmp(value, "true")) {
+            producer->completion = 1;
+        } else if (! strcmp(value, "false")) {
+            producer->completion = 0;
+        } else {
+            goto bad_value;
+        }
+    } else {
+        snprintf(producer->errstr, sizeof(producer->errstr), "No such configuration property: \"%s\"", name);
+        return KAFKATOOLS_ECONF;
+    }
+
+    return KAFKATOOLS_SUCCESS;
+
+bad_value:
+    snprintf(producer->errstr, sizeof(producer->errstr), "Invalid value for configuration property \"%s\": %s", name, value);
+    return KAFKATOOLS_ECONF;
+}
+
+
+/**
+ * Delivery report poller thread
+ *
+ * Serves the main queue of producer as events, so that delivery reports
+ *  are dispatched in batches on this thread instead of producing threads.
+ */
+static void * kt_producer_poller_thread (void *arg)
+{
+    kt_producer producer = (kt_producer) arg;
+
+    rd_kafka_t *rk = producer->rkProducer;
+
+    const rd_kafka_message_t **rkmessages = (const rd_kafka_message_t **) mem_alloc_unset(sizeof(void *) * producer->poller_batch);
+
+    if (producer->poller_numcpus > 0) {
+        thread_set_affinity(producer->poller_cpus, producer->poller_numcpus);
+    }
+
+    while (! uatomic_int_get(&producer->poller_stopping)) {
+        size_t i, cnt;
+
+        rd_kafka_event_t *rkev = rd_kafka_queue_poll(producer->mainq, producer->poller_interval_ms);
+
+        if (! rkev) {
+            continue;
+        }
+
+        switch (rd_kafka_event_type(rkev)) {
+        case RD_KAFKA_EVENT_DR:
+            while ((cnt = rd_kafka_event_message_array(rkev, rkmessages, (size_t) producer->poller_batch)) > 0) {
+                for (i = 0; i < cnt; i++) {
+                    kt_dr_msg_cb(rk, rkmessages[i], (void *) producer);
+                }
+            }
+
+            pthread_mutex_lock(&producer->drlock);
+            pthread_cond_broadcast(&producer->drcond);
+            pthread_mutex_unlock(&producer->drlock);
+            break;
+
+        case RD_KAFKA_EVENT_ERROR:
+            printf("[error] Producer error: %s\n", rd_kafka_event_error_string(rkev));
+            break;
+
+        default:
+            break;
+        }
+
+        rd_kafka_event_destroy(rkev);
+    }
+
+    mem_free((void *) rkmessages);
+    return NULL;
+}
+
+
+static int kt_producer_poller_start (kt_producer producer)
+{
+    if (! producer->poller_batch) {
+        producer->poller_batch = KT_POLLER_BATCH_DEFAULT;
+    }
+
+    producer->mainq = rd_kafka_queue_get_main(producer->rkProducer);
+    if (! producer->mainq) {
+        return KAFKATOOLS_ERROR;
+    }
+
+    if (pthread_mutex_init(&producer->drlock, NULL) != 0) {
+        rd_kafka_queue_destroy(producer->mainq);
+        producer->mainq = NULL;
+        return KAFKATOOLS_EFATAL;
+    }
+
+    if (pthread_cond_init(&producer->drcond, NULL) != 0) {
+        pthread_mutex_destroy(&producer->drlock);
+        rd_kafka_queue_destroy(producer->mainq);
+        producer->mainq = NULL;
+        return KAFKATOOLS_EFATAL;
+    }
+
+    if (pthread_create(&producer->poller_thread, NULL, kt_producer_poller_thread, (void *) producer) != 0) {
+        pthread_cond_destroy(&producer->drcond);
+        pthread_mutex_destroy(&producer->drlock);
+        rd_kafka_queue_destroy(producer->mainq);
+        producer->mainq = NULL;
+        return KAFKATOOLS_EFATAL;
+    }
+
+    producer->poller_started = 1;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static void kt_producer_poller_stop (kt_producer producer)
+{
+    if (producer->poller_started) {
+        producer->poller_started = 0;
+
+        uatomic_int_set(&producer->poller_stopping, 1);
+        pthread_join(producer->poller_thread, NULL);
+
+        rd_kafka_queue_destroy(producer->mainq);
+        producer->mainq = NULL;
+
+        pthread_cond_destroy(&producer->drcond);
+        pthread_mutex_destroy(&producer->drlock);
+    }
+}
+
+
+/**
+ * Completion queue
+ *
+ * Delivery reports are kept on main queue as events. librdkafka writes to
+ *  the eventfd as reports are enqueued, so an application's epoll loop is
+ *  woken up to call kafkatools_producer_reap().
+ */
+static int kt_producer_completion_start (kt_producer producer)
+{
+#if defined(__linux__)
+    uint64_t one = 1;
+
+    producer->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (producer->completion_fd == -1) {
+        printf("(%s:%d) ERROR - eventfd failed(%d).\n", THIS_FILE, __LINE__, errno);
+        return KAFKATOOLS_EFATAL;
+    }
+
+    producer->mainq = rd_kafka_queue_get_main(producer->rkProducer);
+    if (! producer->mainq) {
+        close(producer->completion_fd);
+        return KAFKATOOLS_ERROR;
+    }
+
+    /* eventfd only accepts writes of 8 bytes counter */
+    rd_kafka_queue_io_event_enable(producer->mainq, producer->completion_fd, &one, sizeof(one));
+
+    producer->completion_started = 1;
+    return KAFKATOOLS_SUCCESS;
+#else
+    printf("(%s:%d) ERROR - kafkatools.completion not supported.\n", THIS_FILE, __LINE__);
+    return KAFKATOOLS_ECONF;
+#endif
+}
+
+
+/* nobody reaps while producer is destroyed: drop completions */
+static void kt_producer_completion_discard (kt_producer producer)
+{
+    kt_completion_t completions[KT_REAP_CHUNK];
+
+    while (kafkatools_producer_reap(producer, completions, KT_REAP_CHUNK) > 0) {
+        ;
+    }
+}
+
+
+static void kt_producer_completion_stop (kt_producer producer)
+{
+    if (producer->completion_started) {
+        kt_producer_completion_discard(producer);
+
+        producer->completion_started = 0;
+
+        rd_kafka_queue_io_event_enable(producer->mainq, -1, NULL, 0);
+        rd_kafka_queue_destroy(producer->mainq);
+        producer->mainq = NULL;
+
+        close(producer->completion_fd);
+        producer->completion_fd = -1;
+    }
+}
+
+
+/**
+ * Spool replayer thread
+ *
+ * Feeds spooled records back to librdkafka in order. After a replayed
+ *  message failed delivery, only one record is replayed per KT_SPOOL_PROBE_MS
+ *  until a delivery succeeds again.
+ */
+static int kt_spool_replay_record (size_t segid, void *record, size_t reclen, void *arg)
+{
+    kt_producer producer = (kt_producer) arg;
+    kt_spool_record_t *rec = (kt_spool_record_t *) record;
+
+    kt_spool_env_t *senv;
+
+    kt_topic rkt = kafkatools_producer_get_topic(producer, rec->topic);
+    if (! rkt) {
+        return KAFKATOOLS_ERROR;
+    }
+
+    senv = (kt_spool_env_t *) mem_alloc_unset(sizeof(*senv));
+
+    senv->env.donecb = kt_spool_replay_done;
+    senv->env._private = NULL;
+    senv->producer = producer;
+    senv->segid = segid;
+    senv->offset = rec->offset;
+
+    /* no copy: record stays mapped until released in delivery report */
+    if (rd_kafka_produce(rkt, rec->partition, 0, rec->msg.msgbuf, (size_t) rec->msg.msglen,
+            rec->msg.key, (size_t) rec->msg.keylen, kt_msgenv_wrap(senv)) == -1) {
+        rd_kafka_resp_err_t err = rd_kafka_last_error();
+
+        mem_free(senv);
+
+        if (kt_err_retriable(err)) {
+            return KAFKATOOLS_EAGAIN;
+        }
+
+        /* permanent error: drop the record */
+        printf("(%s:%d) ERROR - spooled message dropped {%s:%d}: %s\n", THIS_FILE, __LINE__, rec->topic, rec->partition, rd_kafka_err2str(err));
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_FAILED, 1);
+        kafkatools_spool_release(producer->spool, segid);
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static void * kt_spool_replayer_thread (void *arg)
+{
+    kt_producer producer = (kt_producer) arg;
+
+    while (! uatomic_int_get(&producer->spool_stopping)) {
+        if (! uatomic_int_get(&producer->spool_healthy)) {
+            /* probe cluster with one record */
+            sleep_msec(KT_SPOOL_PROBE_MS);
+
+            kafkatools_spool_replay(producer->spool, 1, kt_spool_replay_record, (void *) producer);
+            kafkatools_producer_poll(producer, 0);
+        } else if (kafkatools_spool_replay(producer->spool, KT_SPOOL_REPLAY_BATCH, kt_spool_replay_record, (void *) producer) < KT_SPOOL_REPLAY_BATCH) {
+            /* nothing to replay or queue is full */
+            kafkatools_producer_poll(producer, KT_SPOOL_IDLE_WAIT_MS);
+
+            if (! kafkatools_spool_unread(producer->spool)) {
+                sleep_msec(KT_SPOOL_IDLE_WAIT_MS);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static int kt_producer_spool_start (kt_producer producer)
+{
+    int ret = kafkatools_spool_open(cstrbufGetStr(producer->spool_dir), producer->spool_segment_bytes, &producer->spool);
+    if (ret != KAFKATOOLS_SUCCESS) {
+        snprintf(producer->errstr, sizeof(producer->errstr), "kafkatools_spool_open(%s) failed(%d)", cstrbufGetStr(producer->spool_dir), ret);
+        return ret;
+    }
+
+    if (! producer->spool_deadline_ms) {
+        producer->spool_deadline_ms = KT_SPOOL_DEADLINE_MS;
+    }
+
+    producer->spool_healthy = 1;
+
+    if (pthread_create(&producer->spool_thread, NULL, kt_spool_replayer_thread, (void *) producer) != 0) {
+        kafkatools_spool_close(producer->spool);
+        producer->spool = NULL;
+        return KAFKATOOLS_EFATAL;
+    }
+
+    producer->spool_started = 1;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static void kt_producer_spool_stop (kt_producer producer)
+{
+    if (producer->spool_started) {
+        producer->spool_started = 0;
+
+        uatomic_int_set(&producer->spool_stopping, 1);
+        pthread_join(producer->spool_thread, NULL);
+    }
+}
+
+
+/**
+ * append message to spool instead of librdkafka queue. partition is the one
+ *  chosen by partitioner of producer, so replay does not partition again.
+ */
+static int kt_producer_spill (kt_producer producer, const kafkatools_msg_site_t *ktsite, int32_t partition, const kafkatools_msg_data_t *ktmsg)
+{
+    int ret = kafkatools_spool_append(producer->spool, kafkatools_topic_name(ktsite->topic), partition, ktmsg);
+
+    if (ret != KAFKATOOLS_SUCCESS) {
+        producer->errcode = RD_KAFKA_RESP_ERR__FS;
+        snprintf(producer->errstr, sizeof(producer->errstr), "kafkatools_spool_append {%s:%d} failed(%d)",
+            kafkatools_topic_name(ktsite->topic), partition, ret);
+        return KAFKATOOLS_ERROR;
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static cstrbuf kt_get_producer_properties_pathfile (const char *propspathfile)
+{
+    cstrbuf propsfile = NULL;
+    cstrbuf bindir = get_proc_abspath();
+    cstrbuf pathfile = cstrbufCat(0, "%.*s", cstr_length(propspathfile, KAFKATOOLS_PROPSFILE_LEN_MAX), propspathfile);
+    int pathlen = cstrbufGetLen(pathfile);
+
+    if (pathlen < 2) {
+        // using default file
+        propsfile = cstrbufCat(0, "%.*s%c%s", cstrbufGetLen(bindir), cstrbufGetStr(bindir), PATH_SEPARATOR_CHAR, KAFKA_PRODUCER_PROPERTIES_FILE);
+
+        cstrbufFree(&pathfile);
+        cstrbufFree(&bindir);
+        return propsfile;
+    }
+
+    if (*cstrbufCharAt(pathfile, pathlen - 1) == PATH_SEPARATOR_CHAR || *cstrbufCharAt(pathfile, pathlen - 1) == '/') {
+        // only dir withnot filename
+        *cstrbufCharAt(pathfile, pathlen - 1) = PATH_SEPARATOR_CHAR;
+        pathfile = cstrbufCat(pathfile, KAFKA_PRODUCER_PROPERTIES_FILE);
+        pathlen = cstrbufGetLen(pathfile);
+    }
+
+    if (*cstrbufCharAt(pathfile, 0) == '.' && (*cstrbufCharAt(pathfile, 1) == PATH_SEPARATOR_CHAR || *cstrbufCharAt(pathfile, 1) == '/')) {
+        // current app dir:
+        //   "./config/kafka-producer.properties"
+        propsfile = cstrbufCat(0, "%.*s%c%s", cstrbufGetLen(bindir), cstrbufGetStr(bindir), PATH_SEPARATOR_CHAR, cstrbufCharAt(pathfile, 2));
+
+        cstrbufFree(&pathfile);
+        cstrbufFree(&bindir);
+        return propsfile;
+    }
+
+    if (*cstrbufCharAt(pathfile, 0) == '.' && *cstrbufCharAt(pathfile, 1) == '.' &&
+        (*cstrbufCharAt(pathfile, 2) == PATH_SEPARATOR_CHAR || *cstrbufCharAt(pathfile, 2) =='/')) {
+        // parent dir:
+        //   "../config/kafka-producer.properties"
+        propsfile = cstrbufCat(0, "%.*s%c%s", cstrbufGetLen(bindir), cstrbufGetStr(bindir), PATH_SEPARATOR_CHAR, cstrbufGetStr(pathfile));
+
+        cstrbufFree(&pathfile);
+        cstrbufFree(&bindir);
+        return propsfile;
+    }
+
+    // absolute path
+    cstrbufFree(&propsfile);
+    cstrbufFree(&bindir);
+    return pathfile;
+}
+
+
+/**
+ * Sites of ktproducer_state_t
+ *
+ * sites[0] is kept in state->site, which may be changed by caller (such as
+ *  the producer pool), so kt_state_site() is the only way to get a site.
+ */
+typedef struct kafkatools_state_sites_t
+{
+    /* section of properties */
+    char *section;
+
+    /* topic name => siteid + 1 */
+    strhashmap_t topicmap;
+
+    char **topics;
+
+    int count;
+    kafkatools_msg_site_t sites[0];
+} kafkatools_state_sites_t;
+
+
+#define kt_state_site(state, siteid)  \
+    ((siteid) == 0? &(state)->site : &(state)->sites->sites[(siteid)])
+
+
+static void kt_state_sites_free (kt_state_sites sites)
+{
+    if (sites) {
+        int i;
+
+        strhashmap_uninit(&sites->topicmap, NULL, NULL);
+
+        for (i = 0; i < sites->count; i++) {
+            mem_free(sites->topics[i]);
+        }
+
+        mem_free(sites->topics);
+        mem_free(sites->section);
+        mem_free(sites);
+    }
+}
+
+
+/**
+ * parse "$topic:$partitionidMin-$partitionidMax", "$topic:$partitionid"
+ *  or "$topic" (partition 0) into topic name and site without topic object.
+ */
+static int kt_state_parse_site (const char *topicpartitions, char **topic, kafkatools_msg_site_t *site)
+{
+    char *endp;
+    const char *scope = strchr(topicpartitions, ':');
+    size_t namelen = scope? (size_t) (scope - topicpartitions) : strlen(topicpartitions);
+
+    if (namelen == 0 || namelen > KAFKATOOLS_TOPIC_NAMELEN) {
+        return KAFKATOOLS_EARG;
+    }
+
+    *topic = (char *) mem_alloc_unset(namelen + 1);
+    memcpy(*topic, topicpartitions, namelen);
+    (*topic)[namelen] = 0;
+
+    bzero(site, sizeof(*site));
+
+    if (scope) {
+        site->partitionid_min = (int32_t) strtol(scope + 1, &endp, 10);
+        site->partitionid_max = site->partitionid_min;
+
+        if (*endp == '-') {
+            site->partitionid_max = (int32_t) strtol(endp + 1, &endp, 10);
+        }
+
+        if (*endp) {
+            return KAFKATOOLS_EARG;
+        }
+    }
+
+    site->partition = site->partitionid_min;
+
+    if (site->partitionid_max < site->partitionid_min ||
+        site->partitionid_min < 0 ||
+        site->partitionid_max > KAFKATOOLS_PARTITIONID_MAX) {
+        return KAFKATOOLS_EARG;
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static void kt_state_watch_free (kt_state_watch watch)
+{
+#if defined(__linux__)
+    if (watch->notifyfd != -1) {
+        close(watch->notifyfd);
+    }
+#endif
+
+    kafkatools_propsbuf_free(watch->propsbuf);
+    mem_free(watch->section);
+    cstrbufFree(&watch->propsfile);
+    mem_free(watch);
+}
+
+
+/**
+ * rebuild producer of state if props in section changed.
+ *   called on watcher thread only, so state is not changed by others.
+ */
+static void kt_state_watch_reload (kt_state_watch watch)
+{
+    int ret;
+    size_t bufsize = 0;
+    char *propsbuf = 0;
+
+    char *propnames[KAFKATOOLS_CONF_PROPS_MAX] = {0};
+    char *propvalues[KAFKATOOLS_CONF_PROPS_MAX] = {0};
+
+    int i;
+
+    kt_producer oldproducer, newproducer;
+    kafkatools_msg_site_t *newsites;
+
+    ktproducer_state_t *state = watch->state;
+
+    ret = kafkatools_props_readconf(cstrbufGetStr(watch->propsfile), watch->section, &propsbuf, &bufsize);
+    if (ret < 0) {
+        /* file may be in the middle of replacing */
+        return;
+    }
+
+    if (ret == watch->numprops && bufsize == watch->bufsize &&
+        (! ret || ! memcmp(propsbuf, watch->propsbuf, bufsize))) {
+        /* section not changed */
+        if (ret) {
+            kafkatools_propsbuf_free(propsbuf);
+        }
+        return;
+    }
+
+    if (kafkatools_props_retrieve(propsbuf, bufsize, propnames, propvalues, ret) != KAFKATOOLS_SUCCESS) {
+        printf("(%s:%d) ERROR - reload producer failed: '%s'. keep current.\n", THIS_FILE, __LINE__, cstrbufGetStr(watch->propsfile));
+        goto keep_props;
+    }
+
+    /* checked before create: a new producer would open and replay the spool of current one */
+    for (i = 0; i < ret; i++) {
+        if (! strcmp(propnames[i], "kafkatools.spool.dir")) {
+            break;
+        }
+    }
+
+    if (state->producer->spool_dir || i < ret) {
+        printf("(%s:%d) ERROR - producer with spool can not be reloaded. keep current.\n", THIS_FILE, __LINE__);
+        goto keep_props;
+    }
+
+    /* eventfd added to application's epoll set and queued completions belong to current one */
+    for (i = 0; i < ret; i++) {
+        if (! strcmp(propnames[i], "kafkatools.completion") && ! strcmp(propvalues[i], "true")) {
+            break;
+        }
+    }
+
+    if (state->producer->completion || i < ret) {
+        printf("(%s:%d) ERROR - producer with completion can not be reloaded. keep current.\n", THIS_FILE, __LINE__);
+        goto keep_props;
+    }
+
+    if (kafkatools_producer_create(propnames, propvalues, state->producer->msg_cb, (void *) state, &newproducer) != KAFKATOOLS_SUCCESS) {
+        printf("(%s:%d) ERROR - reload producer failed: '%s'. keep current.\n", THIS_FILE, __LINE__, cstrbufGetStr(watch->propsfile));
+        goto keep_props;
+    }
+
+    newsites = (kafkatools_msg_site_t *) mem_alloc_unset(sizeof(kafkatools_msg_site_t) * state->sites->count);
+
+    for (i = 0; i < state->sites->count; i++) {
+        newsites[i] = *kt_state_site(state, i);
+        newsites[i].topic = kafkatools_producer_get_topic(newproducer, state->sites->topics[i]);
+
+        if (! newsites[i].topic) {
+            printf("(%s:%d) ERROR - reload topic failed: '%s'. keep current.\n", THIS_FILE, __LINE__, state->sites->topics[i]);
+            mem_free(newsites);
+            kafkatools_producer_destroy(newproducer, 0);
+            goto keep_props;
+        }
+    }
+
+    /* no one holds old producer after write lock acquired */
+    RWLockAcquire(&state->lock, RWLOCK_STATE_WRITE, 0);
+    oldproducer = state->producer;
+    state->producer = newproducer;
+    for (i = 0; i < state->sites->count; i++) {
+        *kt_state_site(state, i) = newsites[i];
+    }
+    RWLockRelease(&state->lock, RWLOCK_STATE_WRITE);
+
+    mem_free(newsites);
+
+    /* in-flight messages of old producer are delivered to statecb */
+    kafkatools_producer_destroy(oldproducer, watch->drain_ms);
+
+keep_props:
+    /* failed props are kept too so that they are not retried until changed again */
+    kafkatools_propsbuf_free(watch->propsbuf);
+    watch->propsbuf = ret? propsbuf : NULL;
+    watch->bufsize = bufsize;
+    watch->numprops = ret;
+}
+
+
+#if defined(__linux__)
+/**
+ * read out pending inotify events.
+ *   returns 1 if any event is on properties file.
+ */
+static int kt_state_watch_events (kt_state_watch watch)
+{
+    ssize_t len;
+    char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    int changed = 0;
+    const char *name = strrchr(watch->propsfile->str, '/');
+
+    name = name? name + 1 : watch->propsfile->str;
+
+    while ((len = read(watch->notifyfd, evbuf, sizeof(evbuf))) > 0) {
+        char *p = evbuf;
+
+        while (p < evbuf + len) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            if (ev->len && ! strcmp(ev->name, name)) {
+                changed = 1;
+            }
+
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    return changed;
+}
+#endif
+
+
+static void * kt_state_watch_thread (void *arg)
+{
+    kt_state_watch watch = (kt_state_watch) arg;
+
+    while (! uatomic_int_get(&watch->stopping)) {
+#if defined(__linux__)
+        if (watch->notifyfd != -1) {
+            struct pollfd pfd;
+
+            pfd.fd = watch->notifyfd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            if (poll(&pfd, 1, KT_WATCH_POLL_MS) <= 0 || ! kt_state_watch_events(watch)) {
+                continue;
+            }
+
+            /* let writer finish and coalesce bursts of events */
+            sleep_msec(KT_WATCH_SETTLE_MS);
+            kt_state_watch_events(watch);
+        } else {
+            sleep_msec(KT_WATCH_POLL_MS);
+        }
+#else
+        sleep_msec(KT_WATCH_POLL_MS);
+#endif
+
+        if (! uatomic_int_get(&watch->stopping)) {
+            kt_state_watch_reload(watch);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void kt_state_watch_stop (ktproducer_state_t *state)
+{
+    kt_state_watch watch = state->watch;
+
+    if (watch) {
+        uatomic_int_set(&watch->stopping, 1);
+        pthread_join(watch->thread, NULL);
+
+        state->watch = NULL;
+
+        kt_state_watch_free(watch);
+    }
+}
+
+
+/**********************************************************
+ * public api
+ **********************************************************/
+
+/**
+ * high level api for kafka producer
+ */
+int kafkatools_producer_state_init (const char *propertiesfile, const char *topicpartitions, kafkatools_msg_cb statecb, void *argp, ktproducer_state_t *state)
+{
+    const char *specs[2];
+
+    specs[0] = topicpartitions;
+    specs[1] = NULL;
+
+    return kafkatools_producer_state_init_sites(propertiesfile, NULL, specs, statecb, argp, state);
+}
+
+
+int kafkatools_producer_state_init_sites (const char *propertiesfile, const char *section, const char *topicpartitions[], kafkatools_msg_cb statecb, void *argp, ktproducer_state_t *state)
+{
+    int i, ret, numsites = 0;
+
+    char *propsbuf = 0;
+    size_t bufsize = 0;
+
+    char *propnames[KAFKATOOLS_CONF_PROPS_MAX] = {0};
+    char *propvalues[KAFKATOOLS_CONF_PROPS_MAX] = {0};
+
+    cstrbuf propsfile = NULL;
+    kt_state_sites sites = NULL;
+
+    state->producer = NULL;
+    state->statearg = argp;
+    state->watch = NULL;
+    state->sites = NULL;
+
+    RWLockInit(&state->lock);
+
+    while (topicpartitions && topicpartitions[numsites]) {
+        numsites++;
+    }
+
+    if (numsites < 1 || numsites > KAFKATOOLS_TOPICS_MAX) {
+        printf("(%s:%d) ERROR - invalid count of topic partitions: %d\n", THIS_FILE, __LINE__, numsites);
+        RWLockUninit(&state->lock);
+        return KAFKATOOLS_EARG;
+    }
+
+    sites = (kt_state_sites) mem_alloc_zero(1, sizeof(*sites) + sizeof(kafkatools_msg_site_t) * numsites);
+    sites->topics = (char **) mem_alloc_zero(numsites, sizeof(char *));
+    strhashmap_init(&sites->topicmap, (uint32_t) numsites * 2);
+
+    for (i = 0; i < numsites; i++) {
+        ret = kt_state_parse_site(topicpartitions[i], &sites->topics[i], &sites->sites[i]);
+        sites->count = i + 1;
+
+        if (ret != KAFKATOOLS_SUCCESS) {
+            printf("(%s:%d) ERROR - bad topic partitions: '%s'\n", THIS_FILE, __LINE__, topicpartitions[i]);
+            goto on_error_result;
+        }
+
+        if (! strhashmap_insert(&sites->topicmap, sites->topics[i], strhashmap_hash(sites->topics[i]), (void *) (intptr_t) (i + 1))) {
+            printf("(%s:%d) ERROR - duplicated topic: '%s'\n", THIS_FILE, __LINE__, sites->topics[i]);
+            ret = KAFKATOOLS_EARG;
+            goto on_error_result;
+        }
+    }
+
+    // properties of all sites are in one section: name of first topic by default
+    sites->section = mem_strdup(section? section : sites->topics[0]);
+
+    propsfile = kt_get_producer_properties_pathfile(propertiesfile);
+
+    if (! pathfile_exists(cstrbufGetStr(propsfile))) {
+        printf("(%s:%d) ERROR -  properties file not found: '%s'\n",  THIS_FILE, __LINE__, cstrbufGetStr(propsfile));
+        ret = KAFKATOOLS_EFILE;
+        goto on_error_result;
+    }
+
+    ret = kafkatools_props_readconf(cstrbufGetStr(propsfile), sites->section, &propsbuf, &bufsize);
+    cstrbufFree(&propsfile);
+
+    if (ret < 0 || kafkatools_props_retrieve(propsbuf, bufsize, propnames, propvalues, ret) != KAFKATOOLS_SUCCESS) {
+        printf("(%s:%d) ERROR - kafkatools_props_retrieve failed.\n", THIS_FILE, __LINE__);
+        kafkatools_propsbuf_free(propsbuf);
+        ret = KAFKATOOLS_EPROPS;
+        goto on_error_result;
+    }
+
+    // create one producer for all sites
+    ret = kafkatools_producer_create(propnames, propvalues, statecb, (void *)state, &state->producer);
+    kafkatools_propsbuf_free(propsbuf);
+
+    if (ret != KAFKATOOLS_SUCCESS) {
+        printf("(%s:%d) ERROR - kafkatools_producer_create failed.\n", THIS_FILE, __LINE__);
+        ret = KAFKATOOLS_ERROR;
+        goto on_error_result;
+    }
+
+    for (i = 0; i < numsites; i++) {
+        sites->sites[i].topic = kafkatools_producer_get_topic(state->producer, sites->topics[i]);
+
+        if (! sites->sites[i].topic) {
+            printf("(%s:%d) ERROR - bad topic: '%s'\n", THIS_FILE, __LINE__, sites->topics[i]);
+            ret = KAFKATOOLS_EARG;
+            goto on_error_result;
+        }
+    }
+
+    state->site = sites->sites[0];
+    state->sites = sites;
+    return KAFKATOOLS_SUCCESS;
+
+on_error_result:
+    kafkatools_producer_destroy(state->producer, 0);
+    state->producer = NULL;
+
+    cstrbufFree(&propsfile);
+    kt_state_sites_free(sites);
+
+    RWLockUninit(&state->lock);
+    return ret;
+}
+
+
+void kafkatools_producer_state_uninit (ktproducer_state_t *state, int wait_ms)
+{
+    kt_state_watch_stop(state);
+
+    kafkatools_producer_destroy(state->producer, wait_ms);
+
+    kt_state_sites_free(state->sites);
+    state->sites = NULL;
+
+    RWLockUninit(&state->lock);
+}
+
+
+int kafkatools_producer_state_sites (ktproducer_state_t *state)
+{
+    return state->sites->count;
+}
+
+
+int kafkatools_producer_state_site_id (ktproducer_state_t *state, const char *topic)
+{
+    void *value = strhashmap_find(&state->sites->topicmap, topic, strhashmap_hash(topic));
+
+    return value? (int) (intptr_t) value - 1 : (-1);
+}
+
+
+kafkatools_msg_site_t * kafkatools_producer_state_get_site (ktproducer_state_t *state, int siteid)
+{
+    if (siteid < 0 || siteid >= state->sites->count) {
+        return NULL;
+    }
+
+    return kt_state_site(state, siteid);
+}
+
+
+int kafkatools_producer_state_watch (ktproducer_state_t *state, const char *propertiesfile, int drain_ms)
+{
+    int ret;
+    kt_state_watch watch;
+
+    if (state->watch) {
+        return KAFKATOOLS_SUCCESS;
+    }
+
+    if (state->producer->spool_dir) {
+        printf("(%s:%d) ERROR - producer with spool can not be reloaded.\n", THIS_FILE, __LINE__);
+        return KAFKATOOLS_EARG;
+    }
+
+    if (state->producer->completion) {
+        printf("(%s:%d) ERROR - producer with completion can not be reloaded.\n", THIS_FILE, __LINE__);
+        return KAFKATOOLS_EARG;
+    }
+
+    watch = (kt_state_watch) mem_alloc_zero(1, sizeof(*watch));
+
+    watch->state = state;
+    watch->drain_ms = drain_ms;
+    watch->notifyfd = -1;
+    watch->propsfile = kt_get_producer_properties_pathfile(propertiesfile);
+    watch->section = mem_strdup(state->sites->section);
+
+    if (! watch->propsfile) {
+        ret = KAFKATOOLS_EFILE;
+        goto on_error_result;
+    }
+
+    ret = kafkatools_props_readconf(cstrbufGetStr(watch->propsfile), watch->section, &watch->propsbuf, &watch->bufsize);
+    if (ret < 0) {
+        printf("(%s:%d) ERROR - kafkatools_props_readconf failed(%d): '%s'\n", THIS_FILE, __LINE__, ret, cstrbufGetStr(watch->propsfile));
+        goto on_error_result;
+    }
+    watch->numprops = ret;
+
+#if defined(__linux__)
+    do {
+        /* watch the dir since editors replace file by rename */
+        char *dir = mem_strdup(watch->propsfile->str);
+        char *sep = strrchr(dir, '/');
+
+        if (sep) {
+            *(sep == dir? sep + 1 : sep) = 0;
+        }
+
+        watch->notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (watch->notifyfd != -1 &&
+            inotify_add_watch(watch->notifyfd, sep? dir : ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+            printf("(%s:%d) WARN - inotify_add_watch failed(%d): '%s'. polling instead.\n", THIS_FILE, __LINE__, errno, dir);
+            close(watch->notifyfd);
+            watch->notifyfd = -1;
+        }
+
+        mem_free(dir);
+    } while (0);
+#endif
+
+    if (pthread_create(&watch->thread, NULL, kt_state_watch_thread, (void *) watch) != 0) {
+        printf("(%s:%d) ERROR - pthread_create failed.\n", THIS_FILE, __LINE__);
+        ret = KAFKATOOLS_ERROR;
+        goto on_error_result;
+    }
+
+    state->watch = watch;
+    return KAFKATOOLS_SUCCESS;
+
+on_error_result:
+    kt_state_watch_free(watch);
+    return ret;
+}
+
+
+kt_producer kafkatools_producer_state_acquire (ktproducer_state_t *state, int siteid, kafkatools_msg_site_t *site)
+{
+    /* always locked: watcher may be started while held by other threads */
+    RWLockAcquire(&state->lock, RWLOCK_STATE_READ, 0);
+
+    if (site) {
+        *site = *kt_state_site(state, siteid);
+    }
+
+    return state->producer;
+}
+
+
+void kafkatools_producer_state_release (ktproducer_state_t *state)
+{
+    RWLockRelease(&state->lock, RWLOCK_STATE_READ);
+}
+
+
+/**
+ * public helper api
+ */
+const char * kafkatools_get_rdkafka_version (void)
+{
+    return rd_kafka_version_str();
+}
+
+
+int kafkatools_mutex_lock (pthread_mutex_t * mutex, int is_try)
+{
+    return (is_try? pthread_mutex_trylock(mutex) : pthread_mutex_lock(mutex));
+}
+
+
+void kafkatools_mutex_unlock (pthread_mutex_t * mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+
+int kafkatools_producer_create (char **propnames, char **propvalues, kafkatools_msg_cb msg_cb, void *msg_opaque, kt_producer *outproducer)
+{
+    int i;
+
+    int result;
+
+    rd_kafka_conf_res_t res;
+
+    rd_kafka_conf_t * conf = 0;
+    kafkatools_producer_t * producer = 0;
+
+    result = KAFKATOOLS_ENOMEM;
+
+    producer = (kt_producer) mem_alloc_unset(sizeof(*producer));
+    if (! producer) {
+        goto on_error_result;
+    }
+    bzero(producer, sizeof(*producer));
+
+    RWLockInit(&producer->rktopic_lock);
+    strhashmap_init(&producer->rktopic_map, 0);
+
+    /*
+     * Create Kafka client configuration place-holder
+     */
+    conf = rd_kafka_conf_new();
+    if (! conf) {
+        goto on_error_result;
     }
 
     if (propnames) {
@@ -442,7 +1700,11 @@ int kafkatools_producer_create (char **propnames, char **propvalues, kafkatools_
          */
         i = 0;
         while (i < KAFKATOOLS_CONF_PROPS_MAX && propnames[i]) {
-            res = rd_kafka_conf_set(conf, propnames[i], propvalues[i], producer->errstr, sizeof(producer->errstr));
+            if (! strncmp(propnames[i], "kafkatools.", 11)) {
+                res = (kt_producer_set_option(producer, propnames[i], propvalues[i]) == KAFKATOOLS_SUCCESS)? RD_KAFKA_CONF_OK : RD_KAFKA_CONF_INVALID;
+            } else {
+                res = rd_kafka_conf_set(conf, propnames[i], propvalues[i], producer->errstr, sizeof(producer->errstr));
+            }
 
             if (res != RD_KAFKA_CONF_OK) {
                 perror(producer->errstr);
@@ -454,18 +1716,46 @@ int kafkatools_producer_create (char **propnames, char **propvalues, kafkatools_
         }
     }
 
+    if (producer->partitioner) {
+        kt_producer_set_sticky(producer, conf);
+    }
+
+    if (producer->completion && (producer->poller_interval_ms > 0 || producer->spool_dir)) {
+        printf("(%s:%d) ERROR - kafkatools.completion can not be used with poller or spool.\n", THIS_FILE, __LINE__);
+        result = KAFKATOOLS_ECONF;
+        goto on_error_result;
+    }
+
     /* Set the delivery report callback.
      * This callback will be called once per message to inform the application
      *  if delivery succeeded or failed. See dr_msg_cb() above.
+     *
+     * kt_dr_msg_cb() dispatches to the application's msg_cb with msg_opaque.
+     *
+     * Completion queue producer gets delivery reports as events instead,
+     *  which are served by kafkatools_producer_reap().
      */
     if (msg_cb == KAFKATOOLS_MSG_CB_DEFAULT) {
-        rd_kafka_conf_set_dr_msg_cb(conf, kt_msg_cb_default);
+        producer->msg_cb = kt_msg_cb_default;
+    } else {
+        producer->msg_cb = msg_cb;
+    }
+
+    if (producer->completion) {
+        rd_kafka_conf_set_events(conf, RD_KAFKA_EVENT_DR);
     } else {
-        rd_kafka_conf_set_dr_msg_cb(conf, msg_cb);
+        rd_kafka_conf_set_dr_msg_cb(conf, kt_dr_msg_cb);
     }
 
-    /* Sets the application's opaque pointer that will be passed to callbacks */
-    rd_kafka_conf_set_opaque(conf, msg_opaque);
+    /* Sets the producer as opaque pointer that will be passed to callbacks */
+    rd_kafka_conf_set_opaque(conf, (void *) producer);
+
+    if (producer->affinity) {
+        result = kafkatools_affinity_conf(producer->affinity, conf);
+        if (result != KAFKATOOLS_SUCCESS) {
+            goto on_error_result;
+        }
+    }
 
     /*
      * Create producer instance.
@@ -481,6 +1771,9 @@ int kafkatools_producer_create (char **propnames, char **propvalues, kafkatools_
         goto on_error_result;
     }
 
+    /* conf object is freed by rd_kafka_new() on success */
+    conf = 0;
+
     /*
      * https://linux.die.net/man/3/pthread_mutex_init
      */
@@ -489,6 +1782,27 @@ int kafkatools_producer_create (char **propnames, char **propvalues, kafkatools_
         goto on_error_result;
     }
 
+    if (producer->poller_interval_ms > 0) {
+        result = kt_producer_poller_start(producer);
+        if (result != KAFKATOOLS_SUCCESS) {
+            goto on_error_result;
+        }
+    }
+
+    if (producer->spool_dir) {
+        result = kt_producer_spool_start(producer);
+        if (result != KAFKATOOLS_SUCCESS) {
+            goto on_error_result;
+        }
+    }
+
+    if (producer->completion) {
+        result = kt_producer_completion_start(producer);
+        if (result != KAFKATOOLS_SUCCESS) {
+            goto on_error_result;
+        }
+    }
+
     producer->opaque = msg_opaque;
     *outproducer = producer;
     return KAFKATOOLS_SUCCESS;
@@ -511,12 +1825,26 @@ void kafkatools_producer_destroy (kt_producer producer, int flush_wait_ms)
 
         pthread_mutex_lock(&producer->lock);
 
+        /* stop replaying before flush, spooled records are kept on disk */
+        kt_producer_spool_stop(producer);
+
         if (producer->rkProducer) {
             rkProducer = producer->rkProducer;
             producer->rkProducer = NULL;
 
             /*  Wait until all outstanding produce requests, et.al, are completed. */
             while (flush_wait_ms-- != 0) {
+                if (producer->completion_started) {
+                    /* rd_kafka_flush() waits for reports to be reaped without timeout */
+                    kt_producer_completion_discard(producer);
+
+                    if (rd_kafka_outq_len(rkProducer) > 0) {
+                        kafkatools_producer_poll(producer, 1);
+                        continue;
+                    }
+                    break;
+                }
+
                 if (rd_kafka_flush(rkProducer, 1) == RD_KAFKA_RESP_ERR__TIMED_OUT) {
                     continue;
                 }
@@ -524,15 +1852,29 @@ void kafkatools_producer_destroy (kt_producer producer, int flush_wait_ms)
             }
         }
 
-        /* Must clean topic tree before destroy rkProducer */
-        rbtree_traverse(&producer->rktopic_tree, rktopic_object_release, 0);
-        rbtree_clean(&producer->rktopic_tree);
+        /* no more delivery reports after flush */
+        kt_producer_poller_stop(producer);
+        kt_producer_completion_stop(producer);
+
+        /* Must clean topic cache before destroy rkProducer */
+        strhashmap_uninit(&producer->rktopic_map, rktopic_object_release, 0);
+        RWLockUninit(&producer->rktopic_lock);
 
         if (rkProducer) {
             /* Destroy the producer instance */
             rd_kafka_destroy(rkProducer);
         }
 
+        /* all threads of librdkafka have exited */
+        kafkatools_affinity_destroy(producer->affinity);
+
+        /* spool is released by delivery reports until producer destroyed */
+        kafkatools_spool_close(producer->spool);
+        cstrbufFree(&producer->spool_dir);
+
+        kafkatools_metrics_destroy(producer->metrics);
+        kafkatools_partitioner_destroy(producer->partitioner);
+
         pthread_mutex_destroy(&producer->lock);
         mem_free(producer);
     }
@@ -563,51 +1905,183 @@ void * kafkatools_producer_get_opaque (kt_producer producer)
 }
 
 
-pthread_mutex_t * kafkatools_producer_get_mutex (kt_producer producer)
-{
-    return &(producer->lock);
+kt_metrics kafkatools_producer_get_metrics (kt_producer producer)
+{
+    return producer->metrics;
+}
+
+
+kt_spool kafkatools_producer_get_spool (kt_producer producer)
+{
+    return producer->spool;
+}
+
+
+int kafkatools_producer_get_threads (kt_producer producer, kt_thread_cpu_t *threads, int maxthreads)
+{
+    return (producer->affinity? kafkatools_affinity_threads(producer->affinity, threads, maxthreads) : 0);
+}
+
+
+pthread_mutex_t * kafkatools_producer_get_mutex (kt_producer producer)
+{
+    return &(producer->lock);
+}
+
+
+void kafkatools_producer_poll (kt_producer producer, int timeout_ms)
+{
+    if (producer->poller_started) {
+        /* delivery reports are served by poller thread: wait for next batch */
+        pthread_mutex_lock(&producer->drlock);
+
+        if (timeout_ms == KAFKATOOLS_WAIT_INFINITE) {
+            pthread_cond_wait(&producer->drcond, &producer->drlock);
+        } else if (timeout_ms > 0) {
+            struct timespec abstime;
+
+            getfuturetimeofday(&abstime, timeout_ms);
+            pthread_cond_timedwait(&producer->drcond, &producer->drlock, &abstime);
+        }
+
+        pthread_mutex_unlock(&producer->drlock);
+    } else if (producer->completion_started) {
+#if defined(__linux__)
+        /* delivery reports are left to kafkatools_producer_reap: wait for any */
+        struct pollfd pfd;
+
+        pfd.fd = producer->completion_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        poll(&pfd, 1, timeout_ms);
+#endif
+    } else {
+        rd_kafka_poll(producer->rkProducer, timeout_ms);
+    }
+}
+
+
+int kafkatools_producer_completion_fd (kt_producer producer)
+{
+    return (producer->completion_started? producer->completion_fd : -1);
+}
+
+
+int kafkatools_producer_reap (kt_producer producer, kt_completion_t *completions, int maxcount)
+{
+    int num = 0;
+
+    const rd_kafka_message_t *rkmessages[KT_REAP_CHUNK];
+
+    if (! producer->completion_started) {
+        return KAFKATOOLS_EARG;
+    }
+
+#if defined(__linux__)
+    do {
+        /* clear eventfd before draining, so later reports signal it again */
+        uint64_t cnt;
+        if (read(producer->completion_fd, &cnt, sizeof(cnt)) == -1) {
+            ;
+        }
+    } while (0);
+#endif
+
+    while (num < maxcount) {
+        size_t i, cnt;
+
+        if (! producer->completion_event) {
+            rd_kafka_event_t *rkev = rd_kafka_queue_poll(producer->mainq, 0);
+
+            if (! rkev) {
+                break;
+            }
+
+            if (rd_kafka_event_type(rkev) != RD_KAFKA_EVENT_DR) {
+                if (rd_kafka_event_type(rkev) == RD_KAFKA_EVENT_ERROR) {
+                    printf("[error] Producer error: %s\n", rd_kafka_event_error_string(rkev));
+                }
+
+                rd_kafka_event_destroy(rkev);
+                continue;
+            }
+
+            producer->completion_event = rkev;
+        }
+
+        cnt = rd_kafka_event_message_array(producer->completion_event, rkmessages,
+                (size_t) (maxcount - num < KT_REAP_CHUNK? maxcount - num : KT_REAP_CHUNK));
+
+        if (! cnt) {
+            /* messages of event are destroyed with it */
+            rd_kafka_event_destroy(producer->completion_event);
+            producer->completion_event = NULL;
+            continue;
+        }
+
+        for (i = 0; i < cnt; i++) {
+            kt_dr_complete(producer, rkmessages[i], &completions[num++]);
+        }
+    }
+
+#if defined(__linux__)
+    if (producer->completion_event || rd_kafka_queue_length(producer->mainq)) {
+        /* completions left for next reap: keep eventfd readable */
+        uint64_t one = 1;
+        if (write(producer->completion_fd, &one, sizeof(one)) == -1) {
+            ;
+        }
+    }
+#endif
+
+    return num;
 }
 
 
 kt_topic kafkatools_producer_get_topic (kt_producer producer, const char *topic_name)
 {
-    red_black_node_t *node;
-
-    /* Topic handles are refcounted internally and calling rd_kafka_topic_new()
-     *  again with the same topic name will return the previous topic handle
-     *  without updating the original handle's configuration.
-     *
-     * Applications must eventually call rd_kafka_topic_destroy() for each
-     *  succesfull call to rd_kafka_topic_new() to clear up resources.
-     *
-     * returns the new topic handle or NULL on error.
-     */
     rd_kafka_topic_t *rktopic;
 
-    rktopic = rd_kafka_topic_new(producer->rkProducer, topic_name, NULL);
+    uint32_t hash = strhashmap_hash(topic_name);
 
-    if (! rktopic) {
-        snprintf_chkd_V1(producer->errstr, KAFKATOOLS_ERRSTR_SIZE, "rd_kafka_topic_new(topic=%s) fail: %s",
-            topic_name, rd_kafka_err2str(rd_kafka_last_error()));
-        return NULL;
+    /* lookup first: cached topic handle costs one hash probe */
+    RWLockAcquire(&producer->rktopic_lock, RWLOCK_STATE_READ, 0);
+    rktopic = (rd_kafka_topic_t *) strhashmap_find(&producer->rktopic_map, topic_name, hash);
+    RWLockRelease(&producer->rktopic_lock, RWLOCK_STATE_READ);
+
+    if (rktopic) {
+        return (kt_topic) rktopic;
     }
 
-    node = rbtree_find(&producer->rktopic_tree, (void*) rktopic);
-    if (! node) {
-        // 如果 tree 没有 topic, 插入新 topic
-        int is_new_node;
+    RWLockAcquire(&producer->rktopic_lock, RWLOCK_STATE_WRITE, 0);
+
+    /* another thread may have inserted it */
+    rktopic = (rd_kafka_topic_t *) strhashmap_find(&producer->rktopic_map, topic_name, hash);
+
+    if (! rktopic) {
+        /* Topic handles are refcounted internally and calling rd_kafka_topic_new()
+         *  again with the same topic name will return the previous topic handle
+         *  without updating the original handle's configuration.
+         *
+         * Applications must eventually call rd_kafka_topic_destroy() for each
+         *  succesfull call to rd_kafka_topic_new() to clear up resources.
+         *
+         * returns the new topic handle or NULL on error.
+         */
+        rktopic = rd_kafka_topic_new(producer->rkProducer, topic_name, NULL);
 
-        node = rbtree_insert_unique(&producer->rktopic_tree, (void *)rktopic, &is_new_node);
-        if (! node || ! is_new_node) {
-            // 必须成功
-            printf("application error: should never run to this!\n");
-            exit(-1);
+        if (! rktopic) {
+            snprintf_chkd_V1(producer->errstr, KAFKATOOLS_ERRSTR_SIZE, "rd_kafka_topic_new(topic=%s) fail: %s",
+                topic_name, rd_kafka_err2str(rd_kafka_last_error()));
+        } else {
+            /* name of topic handle lives as long as the handle in cache */
+            strhashmap_insert(&producer->rktopic_map, rd_kafka_topic_name(rktopic), hash, (void *) rktopic);
         }
-    } else {
-        // 如果 tree 中已经存在 topic, 释放 topic 引用计数
-        rd_kafka_topic_destroy(rktopic);
     }
 
+    RWLockRelease(&producer->rktopic_lock, RWLOCK_STATE_WRITE);
+
     // do not call rd_kafka_topic_destroy() for below object!
     return (kt_topic) rktopic;
 }
@@ -623,13 +2097,44 @@ int kafkatools_produce_timedwait (kt_producer producer, kafkatools_msg_site_t *k
 {
     int ret = 0;
 
+    sb8 fullsince = 0;
+    sb8 startus = (producer->metrics? monotonic_usec() : 0);
+
+    void *msg_opaque;
+    void *payload = (void *) ktmsg->msgbuf;
+    int rkflags = RD_KAFKA_MSG_F_COPY;
+    int32_t partition;
+
+    if (retry_count == 0) {
+        /* at least one attempt, so that envelope is always sent or freed */
+        retry_count = 1;
+    }
+
+    partition = ktsite->partition;
+    if (partition == RD_KAFKA_PARTITION_UA && producer->partitioner) {
+        partition = kafkatools_partitioner_partition(producer->partitioner, ktsite, ktmsg);
+    }
+
+    if (producer->spool && kafkatools_spool_pending(producer->spool)) {
+        /* keep order behind spooled messages, also those in flight */
+        return kt_producer_spill(producer, ktsite, partition, ktmsg);
+    }
+
+    if (producer->slab) {
+        /* payload copied into slab and owned by envelope */
+        msg_opaque = kt_msgenv_slabcopy(ktmsg, &payload);
+        rkflags = 0;
+    } else {
+        msg_opaque = kt_msgenv_box(ktmsg->_private);
+    }
+
     while (retry_count-- != 0) {
         ret = rd_kafka_produce((rd_kafka_topic_t *) ktsite->topic,
-                ktsite->partition,
-                RD_KAFKA_MSG_F_COPY,         /* Make a copy of the payload. */
-                (void* ) ktmsg->msgbuf, ktmsg->msglen,        /* Message payload (value) and length */
+                partition,
+                rkflags,                     /* Make a copy of the payload unless in slab. */
+                payload, ktmsg->msglen,      /* Message payload (value) and length */
                 ktmsg->key, ktmsg->keylen,   /* Optional key and its length for partition */
-                ktmsg->_private);            /* msg_opaque is an optional application-provided per-message opaque
+                msg_opaque);                 /* msg_opaque is an optional application-provided per-message opaque
                                               *  pointer that will provided in the delivery report callback (`dr_cb`) for
                                               *  referencing this message. */
         if (ret == -1) {
@@ -655,8 +2160,34 @@ int kafkatools_produce_timedwait (kt_producer producer, kafkatools_msg_site_t *k
                  * The internal queue is limited by the configuration property:
                  *      queue.buffering.max.messages
                  */
-                rd_kafka_poll(producer->rkProducer, timout_ms);
+                kafkatools_metrics_count(producer->metrics, KT_COUNTER_QUEUE_FULL, 1);
+
+                if (producer->completion_started) {
+                    /* only kafkatools_producer_reap frees the queue: never wait for it */
+                    kt_msgenv_unbox(msg_opaque, ktmsg->_private);
+
+                    producer->errcode = RD_KAFKA_RESP_ERR__QUEUE_FULL;
+                    snprintf(producer->errstr, sizeof(producer->errstr), "rd_kafka_produce {%s:%d}: %s",
+                        kafkatools_topic_name(ktsite->topic), ktsite->partition, rd_kafka_err2str(producer->errcode));
+                    return KAFKATOOLS_EAGAIN;
+                }
 
+                if (producer->spool) {
+                    sb8 now = difftime_msec(NULL, NULL);
+
+                    if (! fullsince) {
+                        fullsince = now;
+                    }
+
+                    if (retry_count == 0 || now - fullsince >= producer->spool_deadline_ms) {
+                        kt_msgenv_unbox(msg_opaque, ktmsg->_private);
+                        return kt_producer_spill(producer, ktsite, partition, ktmsg);
+                    }
+                }
+
+                kafkatools_producer_poll(producer, timout_ms);
+
+                kafkatools_metrics_count(producer->metrics, KT_COUNTER_RETRIES, 1);
                 continue;
             }
         }
@@ -665,6 +2196,10 @@ int kafkatools_produce_timedwait (kt_producer producer, kafkatools_msg_site_t *k
     }
 
     if (ret == -1) {
+        kt_msgenv_unbox(msg_opaque, ktmsg->_private);
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_FAILED, 1);
+
         /* unexpect error */
         producer->errcode = rd_kafka_last_error();
         snprintf(producer->errstr, sizeof(producer->errstr), "rd_kafka_produce {%s:%d} failed(%d): %s",
@@ -672,6 +2207,511 @@ int kafkatools_produce_timedwait (kt_producer producer, kafkatools_msg_site_t *k
         return KAFKATOOLS_ERROR;
     }
 
+    if (producer->metrics) {
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_ENQUEUED, 1);
+        kafkatools_metrics_record(producer->metrics, KT_HISTOGRAM_ENQUEUE_US, monotonic_usec() - startus);
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_produce_nowait (kt_producer producer, kafkatools_msg_site_t *ktsite, kafkatools_msg_data_t *ktmsg, uint64_t *ticket)
+{
+    int ret;
+
+    void *msg_opaque;
+    void *payload = (void *) ktmsg->msgbuf;
+    int rkflags = RD_KAFKA_MSG_F_COPY;
+    int32_t partition;
+
+    uint64_t tid = (uint64_t) uatomic_int64_add(&producer->completion_ticket, 1);
+
+    partition = ktsite->partition;
+    if (partition == RD_KAFKA_PARTITION_UA && producer->partitioner) {
+        partition = kafkatools_partitioner_partition(producer->partitioner, ktsite, ktmsg);
+    }
+
+    if (producer->slab) {
+        /* payload copied into slab after ticket */
+        msg_opaque = kt_msgenv_ticket(ktmsg, tid, &payload);
+        rkflags = 0;
+    } else {
+        msg_opaque = kt_msgenv_ticket(ktmsg, tid, NULL);
+    }
+
+    ret = rd_kafka_produce((rd_kafka_topic_t *) ktsite->topic, partition, rkflags,
+            payload, ktmsg->msglen, ktmsg->key, ktmsg->keylen, msg_opaque);
+
+    if (ret == -1) {
+        kafkatools_slab_free(kt_msgenv_unwrap(msg_opaque));
+
+        if (rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            /* caller reaps completions and tries again */
+            kafkatools_metrics_count(producer->metrics, KT_COUNTER_QUEUE_FULL, 1);
+            return KAFKATOOLS_EAGAIN;
+        }
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_FAILED, 1);
+
+        producer->errcode = rd_kafka_last_error();
+        snprintf(producer->errstr, sizeof(producer->errstr), "rd_kafka_produce {%s:%d} failed(%d): %s",
+            kafkatools_topic_name(ktsite->topic), ktsite->partition, producer->errcode, rd_kafka_err2str(producer->errcode));
+        return KAFKATOOLS_ERROR;
+    }
+
+    kafkatools_metrics_count(producer->metrics, KT_COUNTER_ENQUEUED, 1);
+
+    *ticket = tid;
     return KAFKATOOLS_SUCCESS;
 }
 
+
+
+/**
+ * spill messages [offset, count) of batch not enqueued into spool, each to
+ *  its partition in partitions (NULL for partition of site).
+ *  returns count of messages spilled.
+ */
+static int kt_producer_spill_batch (kt_producer producer, kafkatools_msg_site_t *ktsite, const int32_t *partitions, kafkatools_msg_data_t *ktmsgs, rd_kafka_message_t *rkmsgs, int offset, int count, kt_msgbatch_t *batch)
+{
+    int i, spilled = 0;
+
+    for (i = offset; i < count; i++) {
+        if (kt_producer_spill(producer, ktsite, (partitions? partitions[i] : ktsite->partition), &ktmsgs[i]) != KAFKATOOLS_SUCCESS) {
+            rkmsgs[i].err = RD_KAFKA_RESP_ERR__FS;
+            continue;
+        }
+
+        rkmsgs[i].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+        spilled++;
+
+        /* payload is copied into spool: no delivery report with this envelope */
+        if (batch) {
+            batch->freecb(ktmsgs[i].msgbuf, ktmsgs[i].msglen, ktmsgs[i]._private);
+            kt_msgbatch_release(batch);
+        } else {
+            kt_msgenv_unbox(rkmsgs[i]._private, ktmsgs[i]._private);
+        }
+    }
+
+    return spilled;
+}
+
+
+int kafkatools_produce_batch (kt_producer producer, kafkatools_msg_site_t *ktsite, kafkatools_msg_data_t *ktmsgs, int count, int msgflags, kt_msgfree_cb freecb, rd_kafka_resp_err_t *errs, int timout_ms, int retry_count)
+{
+    int i, ret, offset, failed;
+
+    sb8 fullsince = 0;
+    sb8 startus = (producer->metrics? monotonic_usec() : 0);
+
+    int enqueued = 0;
+
+    rd_kafka_message_t *rkmsgs;
+    kt_msgbatch_t *batch = NULL;
+    int32_t *partitions = NULL;
+    int slabcopy = 0;
+
+    int rkflags = (msgflags & KAFKATOOLS_MSGF_NOCOPY)? 0 : RD_KAFKA_MSG_F_COPY;
+
+    if (count <= 0) {
+        return (count == 0? 0 : KAFKATOOLS_EARG);
+    }
+
+    if (retry_count == 0) {
+        /* at least one attempt, so that every message is sent or failed */
+        retry_count = 1;
+    }
+
+    rkmsgs = (rd_kafka_message_t *) mem_alloc_unset(sizeof(rd_kafka_message_t) * count);
+
+    if (freecb && ! rkflags) {
+        /* one more reference held by this call until all messages are sent */
+        batch = (kt_msgbatch_t *) kafkatools_slab_alloc(sizeof(kt_msgbatch_t) + sizeof(kt_msgbatch_env_t) * count);
+        batch->refcnt = count + 1;
+        batch->freecb = freecb;
+    } else if (producer->slab && rkflags) {
+        /* payloads copied into slab: kt_msgenv_slabcopy */
+        slabcopy = 1;
+        rkflags = 0;
+    }
+
+    if (ktsite->partition == RD_KAFKA_PARTITION_UA && producer->partitioner) {
+        /* partitions of all messages at once, then honored by produce_batch */
+        partitions = (int32_t *) mem_alloc_unset(sizeof(int32_t) * count);
+        kafkatools_partitioner_partition_batch(producer->partitioner, ktsite, ktmsgs, count, partitions);
+        rkflags |= RD_KAFKA_MSG_F_PARTITION;
+    }
+
+    for (i = 0; i < count; i++) {
+        rd_kafka_message_t *rkmsg = &rkmsgs[i];
+
+        rkmsg->payload = (void *) ktmsgs[i].msgbuf;
+        rkmsg->len = (size_t) ktmsgs[i].msglen;
+        rkmsg->key = (void *) ktmsgs[i].key;
+        rkmsg->key_len = (size_t) ktmsgs[i].keylen;
+        rkmsg->err = RD_KAFKA_RESP_ERR_NO_ERROR;
+
+        if (partitions) {
+            rkmsg->partition = partitions[i];
+        }
+
+        if (batch) {
+            kt_msgbatch_env_t *benv = &batch->envs[i];
+
+            benv->env.donecb = kt_msgbatch_done;
+            benv->env._private = ktmsgs[i]._private;
+            benv->batch = batch;
+
+            rkmsg->_private = kt_msgenv_wrap(benv);
+        } else if (slabcopy) {
+            rkmsg->_private = kt_msgenv_slabcopy(&ktmsgs[i], &rkmsg->payload);
+        } else {
+            rkmsg->_private = kt_msgenv_box(ktmsgs[i]._private);
+        }
+    }
+
+    offset = 0;
+
+    if (producer->spool && kafkatools_spool_pending(producer->spool)) {
+        /* keep order behind spooled messages, also those in flight */
+        enqueued += kt_producer_spill_batch(producer, ktsite, partitions, ktmsgs, rkmsgs, 0, count, batch);
+        offset = count;
+    }
+
+    while (offset < count && retry_count-- != 0) {
+        ret = rd_kafka_produce_batch((rd_kafka_topic_t *) ktsite->topic, ktsite->partition, rkflags, rkmsgs + offset, count - offset);
+        enqueued += ret;
+
+        if (offset + ret == count) {
+            break;
+        }
+
+        /* Once the queue is full, all the following messages fail with QUEUE_FULL.
+         *  Other errors are permanent for the message and are not retried.
+         */
+        for (i = offset; i < count; i++) {
+            if (rkmsgs[i].err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+                break;
+            }
+        }
+
+        if (i == count) {
+            break;
+        }
+
+        offset = i;
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_QUEUE_FULL, 1);
+
+        if (producer->completion_started) {
+            /* only kafkatools_producer_reap frees the queue: rest fail with QUEUE_FULL */
+            break;
+        }
+
+        if (producer->spool) {
+            sb8 now = difftime_msec(NULL, NULL);
+
+            if (! fullsince) {
+                fullsince = now;
+            }
+
+            if (retry_count == 0 || now - fullsince >= producer->spool_deadline_ms) {
+                enqueued += kt_producer_spill_batch(producer, ktsite, partitions, ktmsgs, rkmsgs, offset, count, batch);
+                break;
+            }
+        }
+
+        kafkatools_producer_poll(producer, timout_ms);
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_RETRIES, 1);
+    }
+
+    failed = 0;
+
+    for (i = 0; i < count; i++) {
+        if (errs) {
+            errs[i] = rkmsgs[i].err;
+        }
+
+        if (rkmsgs[i].err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            if (! failed++) {
+                producer->errcode = rkmsgs[i].err;
+            }
+
+            /* no delivery report for failed message: caller still owns the payload */
+            if (batch) {
+                kt_msgbatch_release(batch);
+            } else {
+                kt_msgenv_unbox(rkmsgs[i]._private, ktmsgs[i]._private);
+            }
+        }
+    }
+
+    if (batch) {
+        kt_msgbatch_release(batch);
+    }
+
+    mem_free(partitions);
+    mem_free(rkmsgs);
+
+    if (producer->metrics) {
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_ENQUEUED, enqueued);
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_FAILED, failed);
+        kafkatools_metrics_record(producer->metrics, KT_HISTOGRAM_ENQUEUE_US, monotonic_usec() - startus);
+    }
+
+    if (failed) {
+        snprintf(producer->errstr, sizeof(producer->errstr), "rd_kafka_produce_batch {%s:%d} failed %d/%d messages(%d): %s",
+            kafkatools_topic_name(ktsite->topic), ktsite->partition, failed, count, producer->errcode, rd_kafka_err2str(producer->errcode));
+    }
+
+    return enqueued;
+}
+
+
+#if ! defined(__WINDOWS__)
+
+/**
+ * enqueue records of region without copy. returns index of first record
+ *  failed with permanent error, or count if all are enqueued.
+ */
+static int kt_file_produce_records (kt_producer producer, kafkatools_msg_site_t *ktsite, kt_file_region_t *region, rd_kafka_message_t *rkmsgs, int count, int timout_ms, int retry_count)
+{
+    int i, ret, offset = 0;
+
+    uatomic_int_add(&region->refcnt, count);
+
+    while (offset < count) {
+        ret = rd_kafka_produce_batch((rd_kafka_topic_t *) ktsite->topic, ktsite->partition, 0, rkmsgs + offset, count - offset);
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_ENQUEUED, ret);
+
+        if (offset + ret == count) {
+            return count;
+        }
+
+        for (i = offset; i < count; i++) {
+            if (rkmsgs[i].err != RD_KAFKA_RESP_ERR_NO_ERROR && rkmsgs[i].err != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+                break;
+            }
+        }
+
+        if (i < count || retry_count-- == 0) {
+            /* stop at first record not enqueued, messages behind it are dropped */
+            for (i = offset; i < count && rkmsgs[i].err == RD_KAFKA_RESP_ERR_NO_ERROR; i++) {
+                /* enqueued */
+            }
+            producer->errcode = rkmsgs[i].err;
+            snprintf(producer->errstr, sizeof(producer->errstr), "rd_kafka_produce_batch {%s:%d} failed(%d): %s",
+                kafkatools_topic_name(ktsite->topic), ktsite->partition, producer->errcode, rd_kafka_err2str(producer->errcode));
+
+            for (offset = i; offset < count; offset++) {
+                if (rkmsgs[offset].err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                    kt_file_region_release(region);
+                }
+            }
+
+            return i;
+        }
+
+        /* messages after first QUEUE_FULL are all failed with QUEUE_FULL */
+        for (i = offset; rkmsgs[i].err != RD_KAFKA_RESP_ERR__QUEUE_FULL; i++) {
+            /* enqueued */
+        }
+        offset = i;
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_QUEUE_FULL, 1);
+
+        kafkatools_producer_poll(producer, timout_ms);
+
+        kafkatools_metrics_count(producer->metrics, KT_COUNTER_RETRIES, 1);
+    }
+
+    return count;
+}
+
+#endif
+
+
+int kafkatools_produce_file (kt_producer producer, kafkatools_msg_site_t *ktsite, const char *pathfile, int delim, kt_msgfile_cb recordcb, void *arg, int timout_ms, int retry_count, sb8 *stopoffset)
+{
+#if defined(__WINDOWS__)
+    snprintf(producer->errstr, sizeof(producer->errstr), "kafkatools_produce_file not supported");
+    return KAFKATOOLS_ERROR;
+#else
+    int i, ret, count;
+
+    struct stat st;
+    size_t pagesize, filesize, pos, mapoff, maplen;
+
+    kt_file_region_t *region;
+    rd_kafka_message_t *rkmsgs;
+
+    int result = KAFKATOOLS_SUCCESS;
+
+    filehandle_t hf;
+
+    if (producer->completion_started) {
+        /* waits for delivery of regions which only kafkatools_producer_reap serves */
+        snprintf(producer->errstr, sizeof(producer->errstr), "kafkatools_produce_file not supported with kafkatools.completion");
+        return KAFKATOOLS_EARG;
+    }
+
+    hf = file_open_read(pathfile);
+    if (hf == filehandle_invalid) {
+        snprintf(producer->errstr, sizeof(producer->errstr), "open file failed(%d): %s", errno, pathfile);
+        return KAFKATOOLS_ERROR;
+    }
+
+    if (fstat(hf, &st) != 0) {
+        snprintf(producer->errstr, sizeof(producer->errstr), "fstat failed(%d): %s", errno, pathfile);
+        file_close(&hf);
+        return KAFKATOOLS_ERROR;
+    }
+
+    pagesize = (size_t) sysconf(_SC_PAGESIZE);
+    filesize = (size_t) st.st_size;
+
+    rkmsgs = (rd_kafka_message_t *) mem_alloc_zero(KT_FILE_BATCH, sizeof(rd_kafka_message_t));
+
+    pos = 0;
+
+    while (pos < filesize && result == KAFKATOOLS_SUCCESS) {
+        const char *p, *end, *rec;
+        size_t reclen, start = pos;
+
+        /* bound mapped memory: wait for delivery of older regions */
+        while (uatomic_int_get(&producer->file_regions) >= KT_FILE_REGIONS_MAX) {
+            kafkatools_producer_poll(producer, timout_ms);
+        }
+
+        mapoff = pos & ~(pagesize - 1);
+        maplen = KT_FILE_REGION_BYTES;
+
+    remap_region:
+        if (maplen > filesize - mapoff) {
+            maplen = filesize - mapoff;
+        }
+
+        region = (kt_file_region_t *) mem_alloc_unset(sizeof(*region));
+
+        region->map = (char *) mmap(NULL, maplen, PROT_READ, MAP_SHARED, hf, (off_t) mapoff);
+        if (region->map == MAP_FAILED) {
+            snprintf(producer->errstr, sizeof(producer->errstr), "mmap failed(%d): %s", errno, pathfile);
+            mem_free(region);
+            result = KAFKATOOLS_ERROR;
+            break;
+        }
+        madvise(region->map, maplen, MADV_SEQUENTIAL);
+
+        region->env.donecb = kt_file_region_done;
+        region->env._private = NULL;
+        region->producer = producer;
+        region->refcnt = 1;
+        region->maplen = maplen;
+
+        uatomic_int_add(&producer->file_regions, 1);
+
+        p = region->map + (pos - mapoff);
+        end = region->map + maplen;
+
+        count = 0;
+
+        for (;;) {
+            if (delim == KAFKATOOLS_FILE_LENPREFIX) {
+                const ub1 *hdr = (const ub1 *) p;
+
+                if (end - p < 4) {
+                    break;
+                }
+                reclen = ((size_t) hdr[0] << 24) | ((size_t) hdr[1] << 16) | ((size_t) hdr[2] << 8) | (size_t) hdr[3];
+                if ((size_t) (end - p) - 4 < reclen) {
+                    break;
+                }
+                rec = p + 4;
+                p = rec + reclen;
+            } else {
+                /* memchr of libc scans with simd */
+                const char *q = (const char *) memchr(p, delim, (size_t) (end - p));
+
+                if (! q) {
+                    if (mapoff + maplen < filesize || p == end) {
+                        break;
+                    }
+
+                    /* last record without delimiter */
+                    q = end;
+                }
+                rec = p;
+                reclen = (size_t) (q - p);
+                p = (q == end? end : q + 1);
+
+                if (! reclen) {
+                    pos = mapoff + (size_t) (p - region->map);
+                    continue;
+                }
+            }
+
+            if (recordcb) {
+                ret = recordcb(pos, (void *) rec, reclen, arg);
+                if (ret != KAFKATOOLS_SUCCESS) {
+                    result = ret;
+                    break;
+                }
+            }
+
+            rkmsgs[count].payload = (void *) rec;
+            rkmsgs[count].len = reclen;
+            rkmsgs[count].key = NULL;
+            rkmsgs[count].key_len = 0;
+            rkmsgs[count].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+            rkmsgs[count]._private = kt_msgenv_wrap(region);
+
+            if (++count == KT_FILE_BATCH) {
+                i = kt_file_produce_records(producer, ktsite, region, rkmsgs, count, timout_ms, retry_count);
+                count = 0;
+                if (i < KT_FILE_BATCH) {
+                    pos = mapoff + (size_t) ((const char *) rkmsgs[i].payload - region->map) - (delim == KAFKATOOLS_FILE_LENPREFIX? 4 : 0);
+                    result = KAFKATOOLS_ERROR;
+                    break;
+                }
+            }
+
+            pos = mapoff + (size_t) (p - region->map);
+        }
+
+        if (count) {
+            i = kt_file_produce_records(producer, ktsite, region, rkmsgs, count, timout_ms, retry_count);
+            if (i < count) {
+                pos = mapoff + (size_t) ((const char *) rkmsgs[i].payload - region->map) - (delim == KAFKATOOLS_FILE_LENPREFIX? 4 : 0);
+                result = KAFKATOOLS_ERROR;
+            }
+        }
+
+        if (result == KAFKATOOLS_SUCCESS && pos == start && mapoff + maplen < filesize) {
+            /* record is larger than region: map twice as large */
+            kt_file_region_release(region);
+            maplen *= 2;
+            goto remap_region;
+        }
+
+        kt_file_region_release(region);
+
+        if (result == KAFKATOOLS_SUCCESS && pos < filesize && mapoff + maplen == filesize) {
+            snprintf(producer->errstr, sizeof(producer->errstr), "truncated record at offset %" PRIu64 ": %s", (ub8) pos, pathfile);
+            result = KAFKATOOLS_ERROR;
+        }
+    }
+
+    mem_free(rkmsgs);
+    file_close(&hf);
+
+    if (stopoffset) {
+        *stopoffset = (sb8) pos;
+    }
+
+    return result;
+#endif
+}
@@ -0,0 +1,358 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_props.c
+ *  pre-parsed kafka properties cache.
+ *
+ *  A properties file is parsed in a single pass and the props of each
+ *   section are packed into the same "key\0value\0..." layout returned by
+ *   kafkatools_props_readconf(), so kafkatools_props_retrieve() can serve
+ *   arrays straight from the cache. kafkatools_props_readconf() goes
+ *   through a process wide cache keyed by path file, which is reloaded
+ *   only when mtime (in nanoseconds), size or inode of the file changes.
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.2
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/readconf.h>
+#include <common/memapi.h>
+#include <common/strhashmap.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static const char THIS_FILE[] = "kafkatools_props.c";
+
+#define KT_PROPS_BUFSIZE_MIN   256
+
+
+/* an edit of same size in the same second still changes nsec or inode */
+typedef struct
+{
+    time_t mtime;
+    long mtime_nsec;
+    off_t size;
+    ino_t ino;
+} kt_props_stamp_t;
+
+
+typedef struct
+{
+    /* section name: "" for props before any section */
+    char *name;
+
+    int props;
+
+    size_t bufsz;
+    size_t bufcap;
+
+    /* packed props: "key\0value\0..." */
+    char *buf;
+} kt_props_section_t;
+
+
+typedef struct kafkatools_props_cache_t
+{
+    char *conffile;
+
+    /* file stamp when loaded */
+    kt_props_stamp_t stamp;
+
+    /* props of all sections in file order */
+    kt_props_section_t allprops;
+
+    /* section name => kt_props_section_t */
+    strhashmap_t sections;
+} kafkatools_props_cache_t;
+
+
+/* process wide cache: path file => kt_props_cache */
+static pthread_mutex_t kt_props_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static strhashmap_t kt_props_registry;
+
+
+static void kt_props_section_append (kt_props_section_t *sec, const char *key, const char *val)
+{
+    size_t keysz = strlen(key) + 1;
+    size_t valsz = strlen(val) + 1;
+
+    if (sec->bufsz + keysz + valsz > sec->bufcap) {
+        size_t cap = sec->bufcap? sec->bufcap : KT_PROPS_BUFSIZE_MIN;
+
+        while (cap < sec->bufsz + keysz + valsz) {
+            cap *= 2;
+        }
+
+        sec->buf = (char *) mem_realloc(sec->buf, cap);
+        sec->bufcap = cap;
+    }
+
+    memcpy(sec->buf + sec->bufsz, key, keysz);
+    sec->bufsz += keysz;
+
+    memcpy(sec->buf + sec->bufsz, val, valsz);
+    sec->bufsz += valsz;
+
+    sec->props++;
+}
+
+
+static void kt_props_section_free (void *value, void *arg)
+{
+    kt_props_section_t *sec = (kt_props_section_t *) value;
+
+    (void) arg;
+
+    mem_free(sec->name);
+    mem_free(sec->buf);
+    mem_free(sec);
+}
+
+
+static int kt_props_file_stamp (const char *conf_file, kt_props_stamp_t *stamp)
+{
+    struct stat st;
+
+    if (stat(conf_file, &st) != 0) {
+        return KAFKATOOLS_EFILE;
+    }
+
+    stamp->mtime = st.st_mtime;
+#if defined(__WINDOWS__)
+    stamp->mtime_nsec = 0;
+#else
+    stamp->mtime_nsec = (long) st.st_mtim.tv_nsec;
+#endif
+    stamp->size = st.st_size;
+    stamp->ino = st.st_ino;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+static int kt_props_stamp_changed (const kt_props_stamp_t *a, const kt_props_stamp_t *b)
+{
+    return (a->mtime != b->mtime || a->mtime_nsec != b->mtime_nsec || a->size != b->size || a->ino != b->ino);
+}
+
+
+int kafkatools_props_cache_load (const char *conf_file, kt_props_cache *outcache)
+{
+    char *pair, *key, *val;
+    const char *secname;
+
+    kt_props_cache cache;
+    kt_props_section_t *sec = NULL;
+
+    CONF_position cpos;
+
+    cache = (kt_props_cache) mem_alloc_zero(1, sizeof(*cache));
+
+    if (kt_props_file_stamp(conf_file, &cache->stamp) != KAFKATOOLS_SUCCESS) {
+        mem_free(cache);
+        return KAFKATOOLS_EFILE;
+    }
+
+    cpos = ConfOpenFile(conf_file);
+    if (! cpos) {
+        mem_free(cache);
+        return KAFKATOOLS_EFILE;
+    }
+
+    cache->conffile = mem_strdup(conf_file);
+    strhashmap_init(&cache->sections, STRHASHMAP_CAPACITY_MIN);
+
+    // single pass: pairs of a section are adjacent unless the section is reopened
+    pair = ConfGetFirstPair(cpos, &key, &val);
+    while (pair) {
+        secname = ConfGetSection(cpos);
+
+        if (! sec || strcmp(sec->name, secname)) {
+            uint32_t hash = strhashmap_hash(secname);
+
+            sec = (kt_props_section_t *) strhashmap_find(&cache->sections, secname, hash);
+            if (! sec) {
+                sec = (kt_props_section_t *) mem_alloc_zero(1, sizeof(*sec));
+                sec->name = mem_strdup(secname);
+                strhashmap_insert(&cache->sections, sec->name, hash, (void *) sec);
+            }
+        }
+
+        // a key without '=' has no value
+        kt_props_section_append(sec, key, val? val : "");
+        kt_props_section_append(&cache->allprops, key, val? val : "");
+
+        pair = ConfGetNextPair(cpos, &key, &val);
+    }
+
+    ConfCloseFile(cpos);
+
+    *outcache = cache;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_props_cache_free (kt_props_cache cache)
+{
+    if (cache) {
+        strhashmap_uninit(&cache->sections, kt_props_section_free, NULL);
+        mem_free(cache->allprops.buf);
+        mem_free(cache->conffile);
+        mem_free(cache);
+    }
+}
+
+
+int kafkatools_props_cache_section (kt_props_cache cache, const char *section, const char **propsbuf, size_t *bufsz)
+{
+    const kt_props_section_t *sec = &cache->allprops;
+
+    if (section) {
+        sec = (const kt_props_section_t *) strhashmap_find(&cache->sections, section, strhashmap_hash(section));
+        if (! sec) {
+            return 0;
+        }
+    }
+
+    if (sec->props >= KAFKATOOLS_CONF_PROPS_MAX) {
+        printf("(%s:%d) ERROR - too many props in section: '%s'\n", THIS_FILE, __LINE__, section? section : "*");
+        return KAFKATOOLS_EPROPS;
+    }
+
+    *propsbuf = sec->buf;
+    *bufsz = sec->bufsz;
+    return sec->props;
+}
+
+
+int kafkatools_props_readconf (const char *conf_file, const char *section, char **propsbuf, size_t *bufsz)
+{
+    int props;
+    kt_props_stamp_t stamp;
+    uint32_t hash;
+
+    const char *secbuf;
+    size_t secsz;
+
+    kt_props_cache cache;
+
+    if (kt_props_file_stamp(conf_file, &stamp) != KAFKATOOLS_SUCCESS) {
+        return KAFKATOOLS_EFILE;
+    }
+
+    hash = strhashmap_hash(conf_file);
+
+    pthread_mutex_lock(&kt_props_registry_lock);
+
+    if (! kt_props_registry.entries) {
+        strhashmap_init(&kt_props_registry, STRHASHMAP_CAPACITY_MIN);
+    }
+
+    cache = (kt_props_cache) strhashmap_find(&kt_props_registry, conf_file, hash);
+
+    if (cache && kt_props_stamp_changed(&cache->stamp, &stamp)) {
+        // file changed since loaded: parse it again in place
+        kt_props_cache newcache;
+
+        props = kafkatools_props_cache_load(conf_file, &newcache);
+        if (props != KAFKATOOLS_SUCCESS) {
+            pthread_mutex_unlock(&kt_props_registry_lock);
+            return props;
+        }
+
+        // swap contents so the key owned by registry stays valid
+        strhashmap_uninit(&cache->sections, kt_props_section_free, NULL);
+        mem_free(cache->allprops.buf);
+        mem_free(newcache->conffile);
+
+        newcache->conffile = cache->conffile;
+        *cache = *newcache;
+        mem_free(newcache);
+    } else if (! cache) {
+        props = kafkatools_props_cache_load(conf_file, &cache);
+        if (props != KAFKATOOLS_SUCCESS) {
+            pthread_mutex_unlock(&kt_props_registry_lock);
+            return props;
+        }
+
+        strhashmap_insert(&kt_props_registry, cache->conffile, hash, (void *) cache);
+    }
+
+    props = kafkatools_props_cache_section(cache, section, &secbuf, &secsz);
+
+    if (props > 0) {
+        *propsbuf = (char *) mem_alloc_unset(secsz + 1);
+        memcpy(*propsbuf, secbuf, secsz);
+        (*propsbuf)[secsz] = 0;
+        *bufsz = secsz;
+    }
+
+    pthread_mutex_unlock(&kt_props_registry_lock);
+
+    return props;
+}
+
+
+int kafkatools_props_retrieve (const char *propsbuf, size_t bufsz, char **propnames, char **propvalues, int numprops)
+{
+    int i;
+    size_t cb;
+
+    size_t offset = 0;
+    char *p = (char *) propsbuf;
+
+    for (i = 0; i < numprops; i++) {
+        propnames[i] = p;
+
+        cb = strlen(p) + 1;
+        offset += cb;
+        p += cb;
+
+        propvalues[i] = p;
+
+        cb = strlen(p) + 1;
+        offset += cb;
+        p += cb;
+
+        if (offset > bufsz) {
+            return KAFKATOOLS_ERROR;
+        }
+    }
+
+    propnames[i] = 0;
+    propvalues[i] = 0;
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_propsbuf_free (char *propsbuf)
+{
+    mem_free(propsbuf);
+}
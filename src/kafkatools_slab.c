@@ -0,0 +1,358 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_slab.c
+ *  process wide slab allocator for messages in produce path.
+ *
+ *  Blocks are served from size classes of power of 2 (64 bytes .. 64 KB).
+ *   Each thread caches two magazines of free blocks per class, so alloc and
+ *   free take no lock in the common case. Blocks are mostly freed on the
+ *   delivery report thread: its magazines fill up and are handed to the
+ *   depot of class, from which producing threads reload when they run dry.
+ *   Memory of blocks is carved from chunks which are never returned to the
+ *   system, so the footprint is the peak of blocks in flight.
+ *
+ * @refer
+ *    Bonwick, Adams: Magazines and Vmem (USENIX 2001)
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.2
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+
+static const char THIS_FILE[] = "kafkatools_slab.c";
+
+#define KT_SLAB_CLASS_SHIFT_MIN    6
+#define KT_SLAB_CLASSES            11     /* 64 bytes .. 64 KB */
+#define KT_SLAB_MAGAZINE_SIZE      64
+#define KT_SLAB_CHUNK_BYTES        (256 * 1024)
+
+#define KT_SLAB_MAGIC              0x51AB51ABU
+
+/* class of blocks from malloc */
+#define KT_SLAB_CLASS_MALLOC       (-1)
+
+
+/* header before each block, keeps block 16 bytes aligned */
+typedef struct
+{
+    uint32_t magic;
+    int32_t cls;
+    uint64_t _pad;
+} kt_slab_header_t;
+
+
+typedef struct kt_slab_magazine_t
+{
+    struct kt_slab_magazine_t *next;
+
+    int count;
+    void *blocks[KT_SLAB_MAGAZINE_SIZE];
+} kt_slab_magazine_t;
+
+
+typedef struct
+{
+    pthread_mutex_t lock;
+
+    kt_slab_magazine_t *full;
+    kt_slab_magazine_t *empty;
+} kt_slab_depot_t;
+
+
+typedef struct
+{
+    kt_slab_magazine_t *loaded;
+    kt_slab_magazine_t *previous;
+} kt_slab_cache_t;
+
+
+typedef struct
+{
+    kt_slab_cache_t classes[KT_SLAB_CLASSES];
+} kt_slab_thread_t;
+
+
+static kt_slab_depot_t kt_slab_depots[KT_SLAB_CLASSES];
+
+static pthread_once_t kt_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t kt_slab_key;
+
+#if defined(__GNUC__)
+static __thread kt_slab_thread_t *kt_slab_self = NULL;
+#endif
+
+
+#define kt_slab_block_size(cls)  ((size_t) 1 << ((cls) + KT_SLAB_CLASS_SHIFT_MIN))
+
+
+static kt_slab_magazine_t * kt_slab_magazine_new (void)
+{
+    kt_slab_magazine_t *mag = (kt_slab_magazine_t *) mem_alloc_unset(sizeof(*mag));
+
+    mag->next = NULL;
+    mag->count = 0;
+
+    return mag;
+}
+
+
+/* hand magazines of exiting thread over to depots */
+static void kt_slab_thread_exit (void *arg)
+{
+    int cls;
+    kt_slab_thread_t *self = (kt_slab_thread_t *) arg;
+
+#if defined(__GNUC__)
+    /* later destructors of this thread must not reach freed self */
+    kt_slab_self = NULL;
+#endif
+
+    for (cls = 0; cls < KT_SLAB_CLASSES; cls++) {
+        kt_slab_depot_t *depot = &kt_slab_depots[cls];
+        kt_slab_magazine_t *mags[2];
+        int i;
+
+        mags[0] = self->classes[cls].loaded;
+        mags[1] = self->classes[cls].previous;
+
+        pthread_mutex_lock(&depot->lock);
+
+        for (i = 0; i < 2; i++) {
+            if (mags[i]->count) {
+                mags[i]->next = depot->full;
+                depot->full = mags[i];
+            } else {
+                mags[i]->next = depot->empty;
+                depot->empty = mags[i];
+            }
+        }
+
+        pthread_mutex_unlock(&depot->lock);
+    }
+
+    mem_free(self);
+}
+
+
+static void kt_slab_init_once (void)
+{
+    int cls;
+
+    for (cls = 0; cls < KT_SLAB_CLASSES; cls++) {
+        pthread_mutex_init(&kt_slab_depots[cls].lock, NULL);
+    }
+
+    pthread_key_create(&kt_slab_key, kt_slab_thread_exit);
+}
+
+
+static kt_slab_thread_t * kt_slab_thread (void)
+{
+    kt_slab_thread_t *self;
+
+#if defined(__GNUC__)
+    if (kt_slab_self) {
+        return kt_slab_self;
+    }
+#endif
+
+    pthread_once(&kt_slab_once, kt_slab_init_once);
+
+    self = (kt_slab_thread_t *) pthread_getspecific(kt_slab_key);
+
+    if (! self) {
+        int cls;
+
+        self = (kt_slab_thread_t *) mem_alloc_zero(1, sizeof(*self));
+
+        for (cls = 0; cls < KT_SLAB_CLASSES; cls++) {
+            self->classes[cls].loaded = kt_slab_magazine_new();
+            self->classes[cls].previous = kt_slab_magazine_new();
+        }
+
+        pthread_setspecific(kt_slab_key, self);
+    }
+
+#if defined(__GNUC__)
+    kt_slab_self = self;
+#endif
+
+    return self;
+}
+
+
+/* fill empty magazine with new blocks carved from a chunk */
+static void kt_slab_carve (int cls, kt_slab_magazine_t *mag)
+{
+    size_t blksz = kt_slab_block_size(cls);
+    size_t i, num = KT_SLAB_CHUNK_BYTES / blksz;
+    char *chunk;
+
+    if (num < 1) {
+        num = 1;
+    } else if (num > KT_SLAB_MAGAZINE_SIZE) {
+        num = KT_SLAB_MAGAZINE_SIZE;
+    }
+
+    chunk = (char *) mem_alloc_unset(blksz * num);
+
+    for (i = 0; i < num; i++) {
+        kt_slab_header_t *hdr = (kt_slab_header_t *) (chunk + blksz * i);
+
+        hdr->magic = KT_SLAB_MAGIC;
+        hdr->cls = cls;
+
+        mag->blocks[mag->count++] = (void *) hdr;
+    }
+}
+
+
+static int kt_slab_class_of (size_t size)
+{
+    int cls = 0;
+
+    size += sizeof(kt_slab_header_t);
+
+    while (cls < KT_SLAB_CLASSES && kt_slab_block_size(cls) < size) {
+        cls++;
+    }
+
+    return (cls < KT_SLAB_CLASSES? cls : KT_SLAB_CLASS_MALLOC);
+}
+
+
+void * kafkatools_slab_alloc (size_t size)
+{
+    kt_slab_header_t *hdr;
+    kt_slab_cache_t *cache;
+
+    int cls = kt_slab_class_of(size);
+
+    if (cls == KT_SLAB_CLASS_MALLOC) {
+        hdr = (kt_slab_header_t *) mem_alloc_unset(sizeof(*hdr) + size);
+
+        hdr->magic = KT_SLAB_MAGIC;
+        hdr->cls = KT_SLAB_CLASS_MALLOC;
+
+        return (void *) (hdr + 1);
+    }
+
+    cache = &kt_slab_thread()->classes[cls];
+
+    if (! cache->loaded->count) {
+        kt_slab_magazine_t *mag = cache->previous;
+
+        if (mag->count) {
+            cache->previous = cache->loaded;
+            cache->loaded = mag;
+        } else {
+            kt_slab_depot_t *depot = &kt_slab_depots[cls];
+
+            pthread_mutex_lock(&depot->lock);
+            mag = depot->full;
+            if (mag) {
+                depot->full = mag->next;
+
+                /* previous is empty here */
+                cache->previous->next = depot->empty;
+                depot->empty = cache->previous;
+            }
+            pthread_mutex_unlock(&depot->lock);
+
+            if (mag) {
+                cache->previous = cache->loaded;
+                cache->loaded = mag;
+            } else {
+                kt_slab_carve(cls, cache->loaded);
+            }
+        }
+    }
+
+    hdr = (kt_slab_header_t *) cache->loaded->blocks[--cache->loaded->count];
+
+    return (void *) (hdr + 1);
+}
+
+
+void kafkatools_slab_free (void *ptr)
+{
+    kt_slab_header_t *hdr;
+    kt_slab_cache_t *cache;
+
+    if (! ptr) {
+        return;
+    }
+
+    hdr = ((kt_slab_header_t *) ptr) - 1;
+
+    if (hdr->magic != KT_SLAB_MAGIC) {
+        printf("(%s:%d) FATAL - not a slab block: %p\n", THIS_FILE, __LINE__, ptr);
+        abort();
+    }
+
+    if (hdr->cls == KT_SLAB_CLASS_MALLOC) {
+        mem_free(hdr);
+        return;
+    }
+
+    cache = &kt_slab_thread()->classes[hdr->cls];
+
+    if (cache->loaded->count == KT_SLAB_MAGAZINE_SIZE) {
+        kt_slab_magazine_t *mag = cache->previous;
+
+        if (mag->count < KT_SLAB_MAGAZINE_SIZE) {
+            cache->previous = cache->loaded;
+            cache->loaded = mag;
+        } else {
+            /* both full: give previous to depot and load an empty one */
+            kt_slab_depot_t *depot = &kt_slab_depots[hdr->cls];
+
+            pthread_mutex_lock(&depot->lock);
+            mag->next = depot->full;
+            depot->full = mag;
+
+            mag = depot->empty;
+            if (mag) {
+                depot->empty = mag->next;
+            }
+            pthread_mutex_unlock(&depot->lock);
+
+            if (! mag) {
+                mag = kt_slab_magazine_new();
+            }
+
+            cache->previous = cache->loaded;
+            cache->loaded = mag;
+        }
+    }
+
+    cache->loaded->blocks[cache->loaded->count++] = (void *) hdr;
+}
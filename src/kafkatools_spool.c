@@ -0,0 +1,774 @@
+/***********************************************************************
+ * Copyright (c) 2008-2080 pepstack.com, 350137278@qq.com
+ *
+ * ALL RIGHTS RESERVED.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ **********************************************************************/
+
+/**
+ * @filename   kafkatools_spool.c
+ *  disk spool of messages for kafka producer during broker outages.
+ *
+ *  Messages are appended as CRC framed records to memory-mapped segment
+ *   files in spool dir: "kt-spool-$seqno.seg". Records are replayed in
+ *   order and a segment file is removed when all of its records have been
+ *   replayed and released. Segments left by a previous process are
+ *   recovered on open, up to the first torn or corrupted record.
+ *
+ *  Spool dir is owned by one spool at a time: open holds an exclusive flock
+ *   on "kt-spool.lock" in the dir until close.
+ *
+ *  segment: | KT_SPOOL_SEG_MAGIC (8) | seqno (8) | record | record | ...
+ *  record:  | kt_spool_rechdr_t | topic + '\0' | key | msg | pad to 8 |
+ *
+ * @author     Liang Zhang <350137278@qq.com>
+ * @version    0.0.4
+ * @create     2026-10-18 10:12:33
+ * @update     2026-10-18 10:12:33
+ */
+#include "kafkatools.h"
+
+#include <common/memapi.h>
+#include <common/misc.h>
+#include <common/cstrbuf.h>
+#include <common/crc32.h>
+
+#if ! defined(__WINDOWS__)
+# include <sys/mman.h>
+# include <sys/file.h>
+# include <dirent.h>
+#endif
+
+static const char THIS_FILE[] = "kafkatools_spool.c";
+
+#define KT_SPOOL_SEG_MAGIC       0x314C4F4F5053544BULL    /* "KTSPOOL1" */
+#define KT_SPOOL_REC_MAGIC       0x4B545352U              /* "RSTK" */
+#define KT_SPOOL_SEG_HDRSIZE     16
+#define KT_SPOOL_SEGBYTES_MIN    (1024 * 1024)
+#define KT_SPOOL_SEGBYTES_DEF    (64 * 1024 * 1024)
+
+#define KT_SPOOL_F_KEY           0x1
+
+#define KT_SPOOL_LOCKFILE        "kt-spool.lock"
+
+#define kt_spool_align8(n)       (((n) + 7) & ~((size_t) 7))
+
+
+typedef struct
+{
+    /* written last, so that a torn record is never valid */
+    uint32_t magic;
+
+    /* crc32 of header after crc and record data */
+    uint32_t crc;
+
+    int32_t partition;
+    uint32_t flags;
+
+    /* topic length including '\0' */
+    uint32_t topiclen;
+    uint32_t keylen;
+    uint32_t msglen;
+    uint32_t _reserved;
+} kt_spool_rechdr_t;
+
+
+typedef struct kt_spool_segment_t
+{
+    struct kt_spool_segment_t *next;
+
+    uint64_t seqno;
+    cstrbuf pathfile;
+
+    filehandle_t hf;
+    char *map;
+    size_t size;
+
+    /* end of records */
+    size_t writepos;
+
+    /* next record to replay */
+    size_t readpos;
+
+    /* no more records appended */
+    int sealed;
+
+    /* records replayed but not released */
+    int64_t unreleased;
+} kt_spool_segment_t;
+
+
+typedef struct kafkatools_spool_t
+{
+    pthread_mutex_t lock;
+
+    cstrbuf spooldir;
+    size_t segment_bytes;
+
+    /* flock held on KT_SPOOL_LOCKFILE */
+    int lockfd;
+
+    uint64_t nextseqno;
+
+    /* oldest first, tail is the one appended to */
+    kt_spool_segment_t *head;
+    kt_spool_segment_t *tail;
+
+    int64_t unread;
+
+    /* records replayed but not released in all segments */
+    int64_t unreleased;
+} kafkatools_spool_t;
+
+
+#if ! defined(__WINDOWS__)
+
+static uint32_t kt_spool_record_crc (const kt_spool_rechdr_t *hdr)
+{
+    size_t datalen = (size_t) hdr->topiclen + hdr->keylen + hdr->msglen;
+
+    uint32_t crc = crc32_update(0, (const char *) hdr + offsetof(kt_spool_rechdr_t, partition),
+                        sizeof(*hdr) - offsetof(kt_spool_rechdr_t, partition));
+
+    return crc32_update(crc, (const char *) (hdr + 1), datalen);
+}
+
+
+static void kt_spool_segment_free (kt_spool_segment_t *seg, int remove)
+{
+    if (seg->map) {
+        munmap(seg->map, seg->size);
+    }
+
+    file_close(&seg->hf);
+
+    if (remove) {
+        pathfile_remove(cstrbufGetStr(seg->pathfile));
+    }
+
+    cstrbufFree(&seg->pathfile);
+    mem_free(seg);
+}
+
+
+/**
+ * remove segments from head which are sealed and fully replayed and
+ *  released. called with lock held.
+ */
+static void kt_spool_segments_purge (kafkatools_spool_t *spool)
+{
+    while (spool->head && spool->head->sealed &&
+        spool->head->readpos == spool->head->writepos && ! spool->head->unreleased) {
+        kt_spool_segment_t *seg = spool->head;
+
+        spool->head = seg->next;
+        if (! spool->head) {
+            spool->tail = NULL;
+        }
+
+        kt_spool_segment_free(seg, 1);
+    }
+}
+
+
+static void kt_spool_segment_seal (kt_spool_segment_t *seg)
+{
+    if (! seg->sealed) {
+        seg->sealed = 1;
+        msync(seg->map, seg->writepos, MS_ASYNC);
+    }
+}
+
+
+/**
+ * open segment file left by previous process and find end of valid records.
+ *  returns NULL if segment is invalid or empty.
+ */
+static kt_spool_segment_t * kt_spool_segment_recover (kafkatools_spool_t *spool, uint64_t seqno, int64_t *records)
+{
+    struct stat st;
+    size_t pos;
+
+    kt_spool_segment_t *seg = (kt_spool_segment_t *) mem_alloc_zero(1, sizeof(*seg));
+
+    seg->seqno = seqno;
+    seg->sealed = 1;
+    seg->pathfile = cstrbufCat(0, "%.*s/kt-spool-%016llu.seg", cstrbufGetLen(spool->spooldir), cstrbufGetStr(spool->spooldir), (unsigned long long) seqno);
+
+    seg->hf = file_open_read(cstrbufGetStr(seg->pathfile));
+    if (seg->hf == filehandle_invalid) {
+        printf("(%s:%d) ERROR - open spool segment failed: %s\n", THIS_FILE, __LINE__, cstrbufGetStr(seg->pathfile));
+        cstrbufFree(&seg->pathfile);
+        mem_free(seg);
+        return NULL;
+    }
+
+    if (fstat(seg->hf, &st) == -1 || st.st_size < KT_SPOOL_SEG_HDRSIZE) {
+        kt_spool_segment_free(seg, 1);
+        return NULL;
+    }
+
+    seg->size = (size_t) st.st_size;
+    seg->map = (char *) mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->hf, 0);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        printf("(%s:%d) ERROR - mmap spool segment failed: %s\n", THIS_FILE, __LINE__, cstrbufGetStr(seg->pathfile));
+        kt_spool_segment_free(seg, 0);
+        return NULL;
+    }
+
+    if (*(uint64_t *) seg->map != KT_SPOOL_SEG_MAGIC) {
+        printf("(%s:%d) WARN - bad spool segment removed: %s\n", THIS_FILE, __LINE__, cstrbufGetStr(seg->pathfile));
+        kt_spool_segment_free(seg, 1);
+        return NULL;
+    }
+
+    *records = 0;
+    pos = KT_SPOOL_SEG_HDRSIZE;
+
+    while (pos + sizeof(kt_spool_rechdr_t) <= seg->size) {
+        const kt_spool_rechdr_t *hdr = (const kt_spool_rechdr_t *) (seg->map + pos);
+
+        size_t reclen = kt_spool_align8(sizeof(*hdr) + (size_t) hdr->topiclen + hdr->keylen + hdr->msglen);
+
+        if (hdr->magic != KT_SPOOL_REC_MAGIC || pos + reclen > seg->size || ! hdr->topiclen ||
+            kt_spool_record_crc(hdr) != hdr->crc) {
+            /* end of records or torn write */
+            break;
+        }
+
+        pos += reclen;
+        (*records)++;
+    }
+
+    seg->writepos = pos;
+    seg->readpos = KT_SPOOL_SEG_HDRSIZE;
+
+    if (! *records) {
+        kt_spool_segment_free(seg, 1);
+        return NULL;
+    }
+
+    return seg;
+}
+
+
+static kt_spool_segment_t * kt_spool_segment_create (kafkatools_spool_t *spool, size_t size)
+{
+    uint64_t hdr[2];
+
+    kt_spool_segment_t *seg = (kt_spool_segment_t *) mem_alloc_zero(1, sizeof(*seg));
+
+    seg->seqno = spool->nextseqno++;
+    seg->pathfile = cstrbufCat(0, "%.*s/kt-spool-%016llu.seg", cstrbufGetLen(spool->spooldir), cstrbufGetStr(spool->spooldir), (unsigned long long) seg->seqno);
+
+    seg->hf = file_create(cstrbufGetStr(seg->pathfile), O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (seg->hf == filehandle_invalid) {
+        printf("(%s:%d) ERROR - create spool segment failed: %s (%s)\n", THIS_FILE, __LINE__, cstrbufGetStr(seg->pathfile), strerror(errno));
+        cstrbufFree(&seg->pathfile);
+        mem_free(seg);
+        return NULL;
+    }
+
+    hdr[0] = KT_SPOOL_SEG_MAGIC;
+    hdr[1] = seg->seqno;
+
+    if (file_writebytes(seg->hf, (const char *) hdr, sizeof(hdr)) != 0 || ftruncate(seg->hf, (off_t) size) == -1) {
+        printf("(%s:%d) ERROR - write spool segment failed: %s (%s)\n", THIS_FILE, __LINE__, cstrbufGetStr(seg->pathfile), strerror(errno));
+        kt_spool_segment_free(seg, 1);
+        return NULL;
+    }
+
+    seg->size = size;
+    seg->map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->hf, 0);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        printf("(%s:%d) ERROR - mmap spool segment failed: %s (%s)\n", THIS_FILE, __LINE__, cstrbufGetStr(seg->pathfile), strerror(errno));
+        kt_spool_segment_free(seg, 1);
+        return NULL;
+    }
+
+    seg->writepos = KT_SPOOL_SEG_HDRSIZE;
+    seg->readpos = KT_SPOOL_SEG_HDRSIZE;
+
+    return seg;
+}
+
+
+static int kt_spool_seqno_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x < y)? -1 : (x > y? 1 : 0);
+}
+
+
+/**
+ * take exclusive use of spool dir, so that segments are never recovered
+ *  and appended by two spools (or producers of a pool) at once.
+ */
+static int kt_spool_lock (kafkatools_spool_t *spool)
+{
+    cstrbuf lockfile = cstrbufCat(0, "%.*s/%s", cstrbufGetLen(spool->spooldir), cstrbufGetStr(spool->spooldir), KT_SPOOL_LOCKFILE);
+
+    spool->lockfd = open(lockfile->str, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (spool->lockfd == -1) {
+        printf("(%s:%d) ERROR - open spool lock failed: %s (%s)\n", THIS_FILE, __LINE__, lockfile->str, strerror(errno));
+        cstrbufFree(&lockfile);
+        return KAFKATOOLS_EFILE;
+    }
+
+    if (flock(spool->lockfd, LOCK_EX | LOCK_NB) == -1) {
+        printf("(%s:%d) ERROR - spool dir in use by another spool: %s (%s)\n", THIS_FILE, __LINE__, cstrbufGetStr(spool->spooldir), strerror(errno));
+        close(spool->lockfd);
+        spool->lockfd = -1;
+        cstrbufFree(&lockfile);
+        return KAFKATOOLS_EFILE;
+    }
+
+    cstrbufFree(&lockfile);
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+/* recover segments in spool dir in order of seqno */
+static int kt_spool_recover (kafkatools_spool_t *spool)
+{
+    struct dirent *ent;
+
+    int i, num = 0, cap = 16;
+    uint64_t *seqnos;
+
+    DIR *dir = opendir(spool->spooldir->str);
+    if (! dir) {
+        return KAFKATOOLS_EFILE;
+    }
+
+    seqnos = (uint64_t *) mem_alloc_unset(sizeof(uint64_t) * cap);
+
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned long long seqno;
+        char tail;
+
+        if (sscanf(ent->d_name, "kt-spool-%llu.se%c", &seqno, &tail) == 2 && tail == 'g') {
+            if (num == cap) {
+                cap *= 2;
+                seqnos = (uint64_t *) mem_realloc(seqnos, sizeof(uint64_t) * cap);
+            }
+            seqnos[num++] = (uint64_t) seqno;
+        }
+    }
+
+    closedir(dir);
+
+    qsort(seqnos, num, sizeof(uint64_t), kt_spool_seqno_cmp);
+
+    for (i = 0; i < num; i++) {
+        int64_t records;
+
+        kt_spool_segment_t *seg = kt_spool_segment_recover(spool, seqnos[i], &records);
+
+        if (seg) {
+            if (spool->tail) {
+                spool->tail->next = seg;
+            } else {
+                spool->head = seg;
+            }
+            spool->tail = seg;
+
+            spool->unread += records;
+        }
+
+        spool->nextseqno = seqnos[i] + 1;
+    }
+
+    mem_free(seqnos);
+
+    if (spool->unread) {
+        printf("(%s:%d) INFO - %lld records recovered from spool: %s\n", THIS_FILE, __LINE__,
+            (long long) spool->unread, cstrbufGetStr(spool->spooldir));
+    }
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_spool_open (const char *spooldir, size_t segment_bytes, kt_spool *outspool)
+{
+    int ret;
+
+    kafkatools_spool_t *spool;
+
+    if (! spooldir || ! *spooldir) {
+        return KAFKATOOLS_EARG;
+    }
+
+    if (! pathfile_exists(spooldir) && mkdir(spooldir, S_IRWXU | S_IRGRP | S_IXGRP) == -1) {
+        printf("(%s:%d) ERROR - mkdir spool dir failed: %s (%s)\n", THIS_FILE, __LINE__, spooldir, strerror(errno));
+        return KAFKATOOLS_EFILE;
+    }
+
+    spool = (kafkatools_spool_t *) mem_alloc_zero(1, sizeof(*spool));
+
+    if (pthread_mutex_init(&spool->lock, NULL) != 0) {
+        mem_free(spool);
+        return KAFKATOOLS_EFATAL;
+    }
+
+    spool->lockfd = -1;
+
+    spool->spooldir = cstrbufNew(0, spooldir, -1);
+    spool->segment_bytes = segment_bytes? kt_spool_align8(segment_bytes) : KT_SPOOL_SEGBYTES_DEF;
+    if (spool->segment_bytes < KT_SPOOL_SEGBYTES_MIN) {
+        spool->segment_bytes = KT_SPOOL_SEGBYTES_MIN;
+    }
+
+    ret = kt_spool_lock(spool);
+    if (ret == KAFKATOOLS_SUCCESS) {
+        ret = kt_spool_recover(spool);
+    }
+
+    if (ret != KAFKATOOLS_SUCCESS) {
+        kafkatools_spool_close(spool);
+        return ret;
+    }
+
+    *outspool = spool;
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+void kafkatools_spool_close (kt_spool spool)
+{
+    if (spool) {
+        kt_spool_segment_t *seg = spool->head;
+
+        while (seg) {
+            kt_spool_segment_t *next = seg->next;
+
+            if (! seg->sealed) {
+                msync(seg->map, seg->writepos, MS_SYNC);
+            }
+
+            /* keep segments with records not yet delivered for next open */
+            kt_spool_segment_free(seg, (seg->readpos == seg->writepos && ! seg->unreleased));
+
+            seg = next;
+        }
+
+        if (spool->lockfd != -1) {
+            /* flock is released on close */
+            close(spool->lockfd);
+        }
+
+        cstrbufFree(&spool->spooldir);
+        pthread_mutex_destroy(&spool->lock);
+        mem_free(spool);
+    }
+}
+
+
+int kafkatools_spool_append (kt_spool spool, const char *topic, int32_t partition, const kafkatools_msg_data_t *ktmsg)
+{
+    char *p;
+
+    kt_spool_segment_t *seg;
+    kt_spool_rechdr_t hdr;
+
+    size_t keylen = ktmsg->key? (size_t) ktmsg->keylen : 0;
+    size_t reclen = kt_spool_align8(sizeof(hdr) + strlen(topic) + 1 + keylen + (size_t) ktmsg->msglen);
+
+    hdr.partition = partition;
+    hdr.flags = ktmsg->key? KT_SPOOL_F_KEY : 0;
+    hdr.topiclen = (uint32_t) strlen(topic) + 1;
+    hdr.keylen = (uint32_t) keylen;
+    hdr.msglen = (uint32_t) ktmsg->msglen;
+    hdr._reserved = 0;
+
+    pthread_mutex_lock(&spool->lock);
+
+    seg = spool->tail;
+
+    if (! seg || seg->sealed || seg->writepos + reclen > seg->size) {
+        size_t segsize = spool->segment_bytes;
+
+        if (KT_SPOOL_SEG_HDRSIZE + reclen > segsize) {
+            /* segment for one large record */
+            segsize = KT_SPOOL_SEG_HDRSIZE + reclen;
+        }
+
+        seg = kt_spool_segment_create(spool, segsize);
+        if (! seg) {
+            pthread_mutex_unlock(&spool->lock);
+            return KAFKATOOLS_EFILE;
+        }
+
+        if (spool->tail) {
+            kt_spool_segment_seal(spool->tail);
+            spool->tail->next = seg;
+        } else {
+            spool->head = seg;
+        }
+        spool->tail = seg;
+    }
+
+    p = seg->map + seg->writepos + sizeof(hdr);
+
+    memcpy(p, topic, hdr.topiclen);
+    p += hdr.topiclen;
+
+    if (keylen) {
+        memcpy(p, ktmsg->key, keylen);
+        p += keylen;
+    }
+
+    memcpy(p, ktmsg->msgbuf, hdr.msglen);
+
+    hdr.magic = 0;
+    memcpy(seg->map + seg->writepos, &hdr, sizeof(hdr));
+
+    ((kt_spool_rechdr_t *) (seg->map + seg->writepos))->crc = kt_spool_record_crc((kt_spool_rechdr_t *) (seg->map + seg->writepos));
+    ((kt_spool_rechdr_t *) (seg->map + seg->writepos))->magic = KT_SPOOL_REC_MAGIC;
+
+    seg->writepos += reclen;
+    spool->unread++;
+
+    pthread_mutex_unlock(&spool->lock);
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int kafkatools_spool_replay (kt_spool spool, int maxrecords, kt_msgfile_cb recordcb, void *arg)
+{
+    int records = 0;
+
+    while (records < maxrecords) {
+        int ret;
+
+        kt_spool_record_t record;
+        kt_spool_segment_t *seg;
+
+        const kt_spool_rechdr_t *hdr;
+        size_t offset, reclen;
+
+        pthread_mutex_lock(&spool->lock);
+
+        seg = spool->head;
+        while (seg && seg->readpos == seg->writepos) {
+            seg = seg->next;
+        }
+
+        if (! seg) {
+            pthread_mutex_unlock(&spool->lock);
+            break;
+        }
+
+        offset = seg->readpos;
+
+        hdr = (const kt_spool_rechdr_t *) (seg->map + offset);
+        reclen = kt_spool_align8(sizeof(*hdr) + (size_t) hdr->topiclen + hdr->keylen + hdr->msglen);
+
+        /* consumed before callback so that a rewind from its delivery report
+         *  is never undone. segment is kept mapped until released.
+         */
+        seg->readpos += reclen;
+        seg->unreleased++;
+        spool->unreleased++;
+        spool->unread--;
+
+        pthread_mutex_unlock(&spool->lock);
+
+        record.offset = offset;
+        record.topic = (const char *) (hdr + 1);
+        record.partition = hdr->partition;
+        record.msg.key = (hdr->flags & KT_SPOOL_F_KEY)? (char *) record.topic + hdr->topiclen : NULL;
+        record.msg.keylen = (ssize_t) hdr->keylen;
+        record.msg.msgbuf = (char *) record.topic + hdr->topiclen + hdr->keylen;
+        record.msg.msglen = (ssize_t) hdr->msglen;
+        record.msg._private = NULL;
+
+        ret = recordcb((size_t) seg->seqno, (void *) &record, reclen, arg);
+
+        pthread_mutex_lock(&spool->lock);
+
+        if (ret == KAFKATOOLS_SUCCESS) {
+            /* released by kafkatools_spool_release() */
+            records++;
+        } else {
+            seg->unreleased--;
+            spool->unreleased--;
+
+            /* not consumed: put back unless rewound before it meanwhile */
+            if (seg->readpos == offset + reclen) {
+                seg->readpos = offset;
+                spool->unread++;
+            }
+        }
+
+        kt_spool_segments_purge(spool);
+
+        pthread_mutex_unlock(&spool->lock);
+
+        if (ret != KAFKATOOLS_SUCCESS) {
+            break;
+        }
+    }
+
+    return records;
+}
+
+
+void kafkatools_spool_release (kt_spool spool, size_t segid)
+{
+    kt_spool_segment_t *seg;
+
+    pthread_mutex_lock(&spool->lock);
+
+    for (seg = spool->head; seg; seg = seg->next) {
+        if (seg->seqno == (uint64_t) segid) {
+            seg->unreleased--;
+            spool->unreleased--;
+            break;
+        }
+    }
+
+    kt_spool_segments_purge(spool);
+
+    pthread_mutex_unlock(&spool->lock);
+}
+
+
+/* count of records in [from, to) of segment */
+static int64_t kt_spool_segment_records (const kt_spool_segment_t *seg, size_t from, size_t to)
+{
+    int64_t records = 0;
+
+    while (from < to) {
+        const kt_spool_rechdr_t *hdr = (const kt_spool_rechdr_t *) (seg->map + from);
+
+        from += kt_spool_align8(sizeof(*hdr) + (size_t) hdr->topiclen + hdr->keylen + hdr->msglen);
+        records++;
+    }
+
+    return records;
+}
+
+
+int kafkatools_spool_rewind (kt_spool spool, size_t segid, size_t offset)
+{
+    kt_spool_segment_t *seg;
+
+    pthread_mutex_lock(&spool->lock);
+
+    for (seg = spool->head; seg; seg = seg->next) {
+        if (seg->seqno == (uint64_t) segid) {
+            break;
+        }
+    }
+
+    if (! seg || offset < KT_SPOOL_SEG_HDRSIZE || offset > seg->writepos) {
+        pthread_mutex_unlock(&spool->lock);
+        return KAFKATOOLS_EARG;
+    }
+
+    if (offset < seg->readpos) {
+        spool->unread += kt_spool_segment_records(seg, offset, seg->readpos);
+        seg->readpos = offset;
+
+        /* all records of later segments are replayed again */
+        for (seg = seg->next; seg; seg = seg->next) {
+            spool->unread += kt_spool_segment_records(seg, KT_SPOOL_SEG_HDRSIZE, seg->readpos);
+            seg->readpos = KT_SPOOL_SEG_HDRSIZE;
+        }
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+
+    return KAFKATOOLS_SUCCESS;
+}
+
+
+int64_t kafkatools_spool_unread (kt_spool spool)
+{
+    int64_t unread;
+
+    pthread_mutex_lock(&spool->lock);
+    unread = spool->unread;
+    pthread_mutex_unlock(&spool->lock);
+
+    return unread;
+}
+
+
+int64_t kafkatools_spool_pending (kt_spool spool)
+{
+    int64_t pending;
+
+    pthread_mutex_lock(&spool->lock);
+    pending = spool->unread + spool->unreleased;
+    pthread_mutex_unlock(&spool->lock);
+
+    return pending;
+}
+
+#else /* __WINDOWS__ */
+
+int kafkatools_spool_open (const char *spooldir, size_t segment_bytes, kt_spool *outspool)
+{
+    printf("(%s:%d) ERROR - spool not supported on Windows\n", THIS_FILE, __LINE__);
+    return KAFKATOOLS_EFATAL;
+}
+
+void kafkatools_spool_close (kt_spool spool)
+{
+}
+
+int kafkatools_spool_append (kt_spool spool, const char *topic, int32_t partition, const kafkatools_msg_data_t *ktmsg)
+{
+    return KAFKATOOLS_EFATAL;
+}
+
+int kafkatools_spool_replay (kt_spool spool, int maxrecords, kt_msgfile_cb recordcb, void *arg)
+{
+    return 0;
+}
+
+void kafkatools_spool_release (kt_spool spool, size_t segid)
+{
+}
+
+int kafkatools_spool_rewind (kt_spool spool, size_t segid, size_t offset)
+{
+    return KAFKATOOLS_EFATAL;
+}
+
+int64_t kafkatools_spool_unread (kt_spool spool)
+{
+    return 0;
+}
+
+int64_t kafkatools_spool_pending (kt_spool spool)
+{
+    return 0;
+}
+
+#endif